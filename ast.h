@@ -40,7 +40,9 @@ typedef enum expression_type_t {
     CHAR_CLASS,
     INFIX_EXPRESSION,
     POSTFIX_EXPRESSION,
-    PREFIX_EXPRESSION
+    PREFIX_EXPRESSION,
+    UTF8_CLASS,
+    ASSERTION
 } expression_type_t;
 
 static const char *expression_type_strings[] = {
@@ -48,7 +50,9 @@ static const char *expression_type_strings[] = {
     "CHAR_CLASS",
     "INFIX_EXPRESSION",
     "POSTFIX_EXPRESSION",
-    "PREFIX_EXPRESSION"
+    "PREFIX_EXPRESSION",
+    "UTF8_CLASS",
+    "ASSERTION"
 };
 
 #define expression_type_to_string(exp_type) expression_type_strings[exp_type]
@@ -70,9 +74,16 @@ static const char *operator_strings[] = {
 };
 
 #define operator_to_string(op) operator_strings[op]
+
+/* Zero width assertions, 0 is kept for states which are not one */
+typedef enum assertion_kind_t {
+    ASSERT_TEXT_START = 1, // ^
+    ASSERT_TEXT_END, // $
+    ASSERT_WORD_BOUNDARY, // \b
+    ASSERT_NOT_WORD_BOUNDARY // \B
+} assertion_kind_t;
 #define END_STATE 0
-#define NULL_STATE 255
-#define MATCH_ALL 254
+#define NULL_STATE 255 // the value of the null literal which `x?` is parsed into
 
 
 typedef struct expression_node_t {
@@ -90,6 +101,22 @@ typedef struct char_class_t {
     uint8_t allowed_values[256];
 } char_class_t;
 
+/*
+ * A class of code points in UTF-8 mode, as sorted, disjoint and
+ * non-adjacent ranges: range i is [ranges[2 * i], ranges[2 * i + 1]].
+ */
+typedef struct utf8_class_t {
+    expression_node_t expression;
+    uint32_t *ranges;
+    size_t nranges;
+    int reversed; // match the encodings backwards, for the reversed pattern
+} utf8_class_t;
+
+typedef struct assertion_t {
+    expression_node_t expression;
+    assertion_kind_t kind;
+} assertion_t;
+
 typedef struct infix_expression_t {
     expression_node_t expression;
     expression_node_t *left;
@@ -27,55 +27,635 @@
  * SUCH DAMAGE.
  */
 
+/*
+ * Benchmark suite. Every workload is a pattern, a locally generated input
+ * and a match mode, and is run through each engine: the NFA simulation,
+ * the lazy DFA, the minimized table DFA, the JIT and the planned engine.
+ * Compile and match times are measured separately with CLOCK_MONOTONIC
+ * over a number of trials, after some warmup runs which are not recorded.
+ * The allocations of compiling and of one match are counted in a run of
+ * their own with the counting allocator. The results are printed as CSV
+ * or JSON.
+ *
+ * The results can also be recorded as a named baseline in a file, and a
+ * later run compared against it. A workload has regressed if the 95%
+ * confidence interval of the change in its mean match time lies entirely
+ * above the threshold, or if a match allocates more than it did.
+ */
+
 #include <err.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "dense_dfa.h"
+#include "dfa.h"
+#include "dfa_jit.h"
 #include "nfa_compiler.h"
 #include "nfa_executor.h"
+#include "re_meta.h"
+#include "re_utils.h"
+
+#define CORPUS_SIZE (1024 * 1024)
+#define LONG_CORPUS_SIZE (16 * 1024 * 1024)
+#define DEFAULT_TRIALS 10
+#define DEFAULT_WARMUP 2
+#define DEFAULT_BASELINE_FILE "benchmark.baseline"
+#define DEFAULT_THRESHOLD 5.0 // percent
+#define BASELINE_LINE_SIZE 512
+
+typedef enum engine_t {
+    ENGINE_NFA,
+    ENGINE_DFA,
+    ENGINE_DENSE_DFA,
+    ENGINE_JIT,
+    ENGINE_META
+} engine_t;
+
+static const char *engine_names[] = {"nfa", "dfa", "dense_dfa", "jit", "meta"};
+
+typedef struct workload {
+    char *name;
+    const char *type; // pathological, literal, class, alternation or long_input
+    char *pattern;
+    char *input;
+    size_t len;
+    match_mode_t mode;
+} workload;
+
+typedef struct engine_instance {
+    engine_t engine;
+    nfa_machine_t *machine;
+    dfa_t *dfa;
+    dense_dfa_t *dense;
+    dfa_jit_t *jit;
+    re_meta_t *meta;
+} engine_instance;
+
+typedef struct result {
+    const char *workload;
+    const char *type;
+    engine_t engine;
+    size_t input_bytes;
+    uint64_t compile_median_ns;
+    uint64_t match_median_ns;
+    uint64_t match_p99_ns;
+    double match_mean_ns;
+    double match_stddev_ns;
+    size_t trials;
+    double mb_per_s;
+    size_t compile_allocs;
+    size_t match_allocs;
+    int matched;
+} result;
+
+/* The recorded result of a workload on an engine */
+typedef struct baseline_entry {
+    char workload[128];
+    char engine[16];
+    size_t trials;
+    uint64_t match_median_ns;
+    double match_mean_ns;
+    double match_stddev_ns;
+    double mb_per_s;
+    size_t compile_allocs;
+    size_t match_allocs;
+} baseline_entry;
+
+static re_alloc_counter_t counter;
+
+#define nallocs atomic_load_explicit(&counter.nallocs, memory_order_relaxed)
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y? -1: x > y;
+}
+
+static uint64_t
+percentile(uint64_t *samples, size_t n, double p)
+{
+    qsort(samples, n, sizeof(uint64_t), compare_u64);
+    size_t idx = (size_t) (p * n);
+    return samples[idx < n? idx: n - 1];
+}
+
+/*
+ * Compiles the pattern for the engine. Returns 0 if the engine can't run
+ * it, e.g. because its DFA does not fit in the cache.
+ */
+static int
+engine_compile(engine_instance *e, engine_t engine, const char *pattern)
+{
+    memset(e, 0, sizeof(*e));
+    e->engine = engine;
+    e->machine = compile_regex(pattern);
+    if (engine == ENGINE_NFA)
+        return 1;
+    if (engine == ENGINE_META) {
+        e->meta = re_meta_init(e->machine);
+        return 1;
+    }
+    e->dfa = dfa_init(e->machine, 0);
+    if (engine == ENGINE_DFA)
+        return 1;
+    e->dense = dfa_minimize(e->dfa);
+    if (e->dense == NULL)
+        return 0;
+    if (engine == ENGINE_DENSE_DFA)
+        return 1;
+    e->jit = dfa_jit_compile(e->dense);
+    return e->jit->code != NULL;
+}
 
 static void
-execute(size_t n)
-{
-    char *pattern, *string;
-    clock_t start, end;
-    double time_used;
-    size_t pattern_size = 2 * n + n + 1;
-    size_t string_size = n + 1;
-    pattern = malloc(pattern_size);
-    if (pattern == NULL)
+engine_free(engine_instance *e)
+{
+    if (e->meta)
+        re_meta_free(e->meta);
+    if (e->jit)
+        dfa_jit_free(e->jit);
+    if (e->dense)
+        dense_dfa_free(e->dense);
+    if (e->dfa)
+        dfa_free(e->dfa);
+    free_nfa(e->machine);
+}
+
+static int
+engine_match(engine_instance *e, workload *w)
+{
+    switch (e->engine) {
+    case ENGINE_NFA:
+        return nfa_match(e->machine, w->input, w->len, w->mode, NULL);
+    case ENGINE_DFA:
+        return dfa_match(e->dfa, w->input, w->len, w->mode, NULL);
+    case ENGINE_DENSE_DFA:
+        return dense_dfa_match(e->dense, w->input, w->len, w->mode, NULL);
+    case ENGINE_JIT:
+        return dfa_jit_match(e->jit, w->input, w->len, w->mode, NULL);
+    case ENGINE_META:
+        return re_meta_match(e->meta, w->input, w->len, w->mode, NULL);
+    }
+    return 0;
+}
+
+static void
+mean_stddev(const uint64_t *samples, size_t n, double *mean, double *stddev)
+{
+    double sum = 0, squares = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += samples[i];
+    *mean = sum / n;
+    for (size_t i = 0; i < n; i++)
+        squares += (samples[i] - *mean) * (samples[i] - *mean);
+    *stddev = n > 1? sqrt(squares / (n - 1)): 0;
+}
+
+/*
+ * Counts the allocations of compiling and of a match after a first one,
+ * which may still be filling in a DFA. Memory from the counting allocator
+ * can't be freed by the plain one, so this is a run of its own.
+ */
+static void
+count_allocations(workload *w, engine_t engine, result *r)
+{
+    engine_instance e;
+    re_allocator_t allocator;
+    re_counting_allocator(&allocator, &counter);
+    re_set_allocator(&allocator);
+    engine_compile(&e, engine, w->pattern);
+    r->compile_allocs = nallocs;
+    engine_match(&e, w);
+    size_t before = nallocs;
+    engine_match(&e, w);
+    r->match_allocs = nallocs - before;
+    engine_free(&e);
+    re_set_allocator(NULL);
+}
+
+static int
+run_workload(workload *w, engine_t engine, size_t trials, size_t warmup, result *r)
+{
+    engine_instance e;
+    uint64_t *samples = malloc(trials * sizeof(uint64_t));
+    if (samples == NULL)
         err(EXIT_FAILURE, "malloc failed");
-    string = malloc(string_size);
-    if (string == NULL)
+
+    for (size_t i = 0; i < warmup + trials; i++) {
+        uint64_t start = now_ns();
+        int ok = engine_compile(&e, engine, w->pattern);
+        uint64_t end = now_ns();
+        engine_free(&e);
+        if (!ok) {
+            free(samples);
+            return 0;
+        }
+        if (i >= warmup)
+            samples[i - warmup] = end - start;
+    }
+    r->compile_median_ns = percentile(samples, trials, 0.5);
+
+    engine_compile(&e, engine, w->pattern);
+    for (size_t i = 0; i < warmup + trials; i++) {
+        uint64_t start = now_ns();
+        r->matched = engine_match(&e, w);
+        uint64_t end = now_ns();
+        if (i >= warmup)
+            samples[i - warmup] = end - start;
+    }
+    engine_free(&e);
+    mean_stddev(samples, trials, &r->match_mean_ns, &r->match_stddev_ns);
+    r->trials = trials;
+    r->match_median_ns = percentile(samples, trials, 0.5);
+    r->match_p99_ns = percentile(samples, trials, 0.99);
+    r->workload = w->name;
+    r->type = w->type;
+    r->engine = engine;
+    r->input_bytes = w->len;
+    r->mb_per_s = r->match_median_ns? (w->len / (1024.0 * 1024.0)) / (r->match_median_ns / 1e9): 0;
+    count_allocations(w, engine, r);
+    free(samples);
+    return 1;
+}
+
+static char *
+random_text(size_t len, const char *alphabet, unsigned int seed)
+{
+    size_t n = strlen(alphabet);
+    char *text = malloc(len + 1);
+    if (text == NULL)
         err(EXIT_FAILURE, "malloc failed");
-    memset(pattern, 'a', pattern_size - 1);
-    for (size_t i = 0; i < 2 * n; i++) {
-        if (i % 2 == 0)
-            pattern[i] = 'a';
-        else
-            pattern[i] = '?';
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        text[i] = alphabet[(seed >> 16) % n];
     }
-    pattern[pattern_size - 1] = 0;
-    memset(string, 'a', n);
-    string[n] = 0;
-    start = clock();
-    nfa_machine_t * machine = compile_regex(pattern);
-    nfa_execute(machine, string);
-    free_nfa(machine);
-    end = clock();
-    free(pattern);
-    free(string);
-    time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-    printf("%zu,%f\n", n, time_used);
+    text[len] = 0;
+    return text;
+}
+
+static char *
+repeat_char(char c, size_t n, char last)
+{
+    char *s = malloc(n + 2);
+    if (s == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    memset(s, c, n);
+    s[n] = last;
+    s[n + 1] = 0;
+    return s;
+}
+
+static void
+add_workload(workload **workloads, size_t *n, const char *type, char *name, char *pattern,
+    char *input, size_t len, match_mode_t mode)
+{
+    *workloads = reallocarray(*workloads, *n + 1, sizeof(workload));
+    if (*workloads == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    workload *w = &(*workloads)[(*n)++];
+    w->type = type;
+    w->name = name;
+    w->pattern = pattern;
+    w->input = input;
+    w->len = len;
+    w->mode = mode;
+}
+
+static char *
+xstrdup(const char *s)
+{
+    char *copy = strdup(s);
+    if (copy == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    return copy;
+}
+
+/*
+ * The workloads. The text corpora never contain a match unless noted, so
+ * that the engines have to scan all of the input.
+ */
+static workload *
+create_workloads(size_t *n)
+{
+    workload *workloads = NULL;
+    char *name;
+    *n = 0;
+
+    // a?^n a^n against a^n, from Russ Cox's article
+    size_t sizes[] = {10, 25, 50, 100};
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        size_t k = sizes[i];
+        char *pattern = malloc(3 * k + 1);
+        if (pattern == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+        for (size_t j = 0; j < k; j++) {
+            pattern[2 * j] = 'a';
+            pattern[2 * j + 1] = '?';
+        }
+        memset(pattern + 2 * k, 'a', k);
+        pattern[3 * k] = 0;
+        if (asprintf(&name, "a?^%zua^%zu", k, k) == -1)
+            err(EXIT_FAILURE, "malloc failed");
+        add_workload(&workloads, n, "pathological", name, pattern, repeat_char('a', k - 1, 'a'), k, MATCH_FULL);
+    }
+    // (a|aa)*b against a...a!, exponential for backtracking engines
+    size_t lengths[] = {30, 10000};
+    for (size_t i = 0; i < sizeof(lengths)/sizeof(lengths[0]); i++) {
+        if (asprintf(&name, "(a|aa)*b/%zu", lengths[i]) == -1)
+            err(EXIT_FAILURE, "malloc failed");
+        add_workload(&workloads, n, "pathological", name, xstrdup("(a|aa)*b"),
+            repeat_char('a', lengths[i], '!'), lengths[i] + 1, MATCH_ANY);
+    }
+
+    char *text = random_text(CORPUS_SIZE, "abcdefghijklmnopqrstuvwxyz      \n", 1);
+    char *alnum = random_text(CORPUS_SIZE, "abcdefghijklmnopqrstuvwxyz0123456789 .,;=", 2);
+    add_workload(&workloads, n, "literal", xstrdup("literal"), xstrdup("needle"),
+        text, CORPUS_SIZE, MATCH_ANY);
+    add_workload(&workloads, n, "literal", xstrdup("long_literal"), xstrdup("session_identifier_token"),
+        text, CORPUS_SIZE, MATCH_ANY);
+    add_workload(&workloads, n, "class", xstrdup("email"), xstrdup("[a-z0-9]+@[a-z]+[.][a-z][a-z]+"),
+        alnum, CORPUS_SIZE, MATCH_ANY);
+    add_workload(&workloads, n, "class", xstrdup("key_value"), xstrdup("[a-z]+=[0-9][0-9][0-9][0-9][0-9]+;"),
+        alnum, CORPUS_SIZE, MATCH_ANY);
+    add_workload(&workloads, n, "alternation", xstrdup("words"),
+        xstrdup("(alpha|bravo|charlie|delta|echo|foxtrot|golf|hotel)[0-9]"), text, CORPUS_SIZE, MATCH_ANY);
+    add_workload(&workloads, n, "alternation", xstrdup("methods"),
+        xstrdup("(GET|HEAD|POST|PUT|DELETE|OPTIONS|PATCH) /"), text, CORPUS_SIZE, MATCH_ANY);
+
+    char *long_text = random_text(LONG_CORPUS_SIZE, "abcdefghijklmnopqrstuvwxyz      \n", 3);
+    add_workload(&workloads, n, "long_input", xstrdup("prefix_scan"), xstrdup(".*x[0-9]"),
+        long_text, LONG_CORPUS_SIZE, MATCH_PREFIX);
+    add_workload(&workloads, n, "long_input", xstrdup("full_match"), xstrdup("[a-z \n]*"),
+        long_text, LONG_CORPUS_SIZE, MATCH_FULL);
+    char *field = random_text(LONG_CORPUS_SIZE, "abcdefghijklmnopqrstuvwxyz      \n", 4);
+    field[0] = field[LONG_CORPUS_SIZE - 1] = '"';
+    add_workload(&workloads, n, "long_input", xstrdup("quoted_field"), xstrdup("\"[^\"]*\""),
+        field, LONG_CORPUS_SIZE, MATCH_PREFIX);
+    return workloads;
+}
+
+static void
+free_workloads(workload *workloads, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        free(workloads[i].name);
+        free(workloads[i].pattern);
+        // the corpora are shared between workloads
+        int shared = 0;
+        for (size_t j = i + 1; j < n; j++)
+            shared |= workloads[j].input == workloads[i].input;
+        if (!shared)
+            free(workloads[i].input);
+    }
+    free(workloads);
+}
+
+static void
+print_result(result *r, int json, int first)
+{
+    if (json) {
+        printf("%s  {\"workload\": \"%s\", \"type\": \"%s\", \"engine\": \"%s\", \"input_bytes\": %zu, "
+            "\"compile_median_ns\": %" PRIu64 ", \"match_median_ns\": %" PRIu64 ", \"match_p99_ns\": %" PRIu64 ", "
+            "\"mb_per_s\": %.2f, \"compile_allocs\": %zu, \"match_allocs\": %zu, \"matched\": %d}",
+            first? "": ",\n", r->workload, r->type, engine_names[r->engine], r->input_bytes,
+            r->compile_median_ns, r->match_median_ns, r->match_p99_ns, r->mb_per_s, r->compile_allocs,
+            r->match_allocs, r->matched);
+        return;
+    }
+    printf("%s,%s,%s,%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.2f,%zu,%zu,%d\n", r->workload, r->type,
+        engine_names[r->engine], r->input_bytes, r->compile_median_ns, r->match_median_ns, r->match_p99_ns,
+        r->mb_per_s, r->compile_allocs, r->match_allocs, r->matched);
+}
+
+/*
+ * Rewrites the baseline file with the results under name, replacing the
+ * ones recorded under it before. Every line is one workload on one engine:
+ * name workload engine trials median_ns mean_ns stddev_ns mb_per_s
+ * compile_allocs match_allocs.
+ */
+static void
+save_baseline(const char *file, const char *name, result *results, size_t n)
+{
+    char tmp[PATH_MAX], line[BASELINE_LINE_SIZE], first[BASELINE_LINE_SIZE];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int) sizeof(tmp))
+        errx(EXIT_FAILURE, "%s: name too long", file);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL)
+        err(EXIT_FAILURE, "%s", tmp);
+    FILE *in = fopen(file, "r");
+    if (in) {
+        while (fgets(line, sizeof(line), in)) {
+            if (sscanf(line, "%s", first) != 1 || strcmp(first, name) != 0)
+                fputs(line, out);
+        }
+        fclose(in);
+    }
+    for (size_t i = 0; i < n; i++) {
+        result *r = &results[i];
+        fprintf(out, "%s %s %s %zu %" PRIu64 " %.1f %.1f %.2f %zu %zu\n", name, r->workload,
+            engine_names[r->engine], r->trials, r->match_median_ns, r->match_mean_ns, r->match_stddev_ns,
+            r->mb_per_s, r->compile_allocs, r->match_allocs);
+    }
+    if (fclose(out) != 0 || rename(tmp, file) != 0)
+        err(EXIT_FAILURE, "%s", file);
+}
+
+static baseline_entry *
+load_baseline(const char *file, const char *name, size_t *n)
+{
+    char line[BASELINE_LINE_SIZE], first[BASELINE_LINE_SIZE];
+    baseline_entry *entries = NULL;
+    *n = 0;
+    FILE *in = fopen(file, "r");
+    if (in == NULL)
+        err(EXIT_FAILURE, "%s", file);
+    while (fgets(line, sizeof(line), in)) {
+        baseline_entry b;
+        if (sscanf(line, "%s %127s %15s %zu %" SCNu64 " %lf %lf %lf %zu %zu", first, b.workload, b.engine,
+            &b.trials, &b.match_median_ns, &b.match_mean_ns, &b.match_stddev_ns, &b.mb_per_s,
+            &b.compile_allocs, &b.match_allocs) != 10 || strcmp(first, name) != 0)
+            continue;
+        entries = reallocarray(entries, *n + 1, sizeof(baseline_entry));
+        if (entries == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+        entries[(*n)++] = b;
+    }
+    fclose(in);
+    if (*n == 0)
+        errx(EXIT_FAILURE, "%s: no baseline named %s", file, name);
+    return entries;
+}
+
+/* The two sided 95% quantile of Student's t distribution */
+static double
+t_quantile(double df)
+{
+    static const double table[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+        2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    if (df < 1)
+        return table[0];
+    if (df <= 30)
+        return table[(size_t) df - 1];
+    return df <= 40? 2.021: df <= 60? 2.000: df <= 120? 1.980: 1.960;
+}
+
+/*
+ * Compares the result with its baseline, with Welch's confidence interval
+ * for the difference of the mean match times, as percentages of the
+ * baseline mean. Returns 1 for a regression.
+ */
+static int
+compare_result(result *r, baseline_entry *b, double threshold, int json, int first)
+{
+    double v1 = b->match_stddev_ns * b->match_stddev_ns / b->trials;
+    double v2 = r->match_stddev_ns * r->match_stddev_ns / r->trials;
+    double se = sqrt(v1 + v2);
+    double df = se > 0? (v1 + v2) * (v1 + v2) /
+        ((b->trials > 1? v1 * v1 / (b->trials - 1): 0) + (r->trials > 1? v2 * v2 / (r->trials - 1): 0)): 0;
+    double diff = r->match_mean_ns - b->match_mean_ns;
+    double margin = se > 0? t_quantile(df) * se: 0;
+    double base = b->match_mean_ns > 0? b->match_mean_ns: 1;
+    double change = 100 * diff / base, low = 100 * (diff - margin) / base, high = 100 * (diff + margin) / base;
+    const char *verdict = "same";
+    int regressed = low > threshold || r->match_allocs > b->match_allocs;
+    if (regressed)
+        verdict = "regression";
+    else if (high < -threshold)
+        verdict = "improvement";
+    if (json)
+        printf("%s  {\"workload\": \"%s\", \"engine\": \"%s\", \"baseline_mean_ns\": %.1f, \"mean_ns\": %.1f, "
+            "\"change_pct\": %.2f, \"ci_low_pct\": %.2f, \"ci_high_pct\": %.2f, \"baseline_match_allocs\": %zu, "
+            "\"match_allocs\": %zu, \"verdict\": \"%s\"}", first? "": ",\n", r->workload, engine_names[r->engine],
+            b->match_mean_ns, r->match_mean_ns, change, low, high, b->match_allocs, r->match_allocs, verdict);
+    else
+        printf("%s,%s,%.1f,%.1f,%.2f,%.2f,%.2f,%zu,%zu,%s\n", r->workload, engine_names[r->engine],
+            b->match_mean_ns, r->match_mean_ns, change, low, high, b->match_allocs, r->match_allocs, verdict);
+    return regressed;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: benchmark [-j] [-n trials] [-w warmup] [-t type] [-b name | -c name] "
+        "[-f baseline_file] [-r threshold]\n");
+    exit(EXIT_FAILURE);
 }
 
 int
 main(int argc, char **argv)
 {
-    for (size_t i = 1; i < 100; i++)
-        execute(i);
-    return 0;
+    size_t trials = DEFAULT_TRIALS;
+    size_t warmup = DEFAULT_WARMUP;
+    const char *type = NULL;
+    const char *record = NULL, *compare = NULL;
+    const char *file = DEFAULT_BASELINE_FILE;
+    double threshold = DEFAULT_THRESHOLD;
+    int json = 0, first = 1, regressions = 0, ch;
+    size_t nworkloads, nresults = 0, nbaseline = 0;
+    result *results = NULL;
+    baseline_entry *baseline = NULL;
 
+    while ((ch = getopt(argc, argv, "b:c:f:jn:r:t:w:")) != -1) {
+        switch (ch) {
+        case 'b':
+            record = optarg;
+            break;
+        case 'c':
+            compare = optarg;
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'n':
+            trials = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            threshold = strtod(optarg, NULL);
+            break;
+        case 't':
+            type = optarg;
+            break;
+        case 'w':
+            warmup = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (trials == 0 || (record && compare))
+        usage();
+    if (compare)
+        baseline = load_baseline(file, compare, &nbaseline);
+
+    workload *workloads = create_workloads(&nworkloads);
+    if (json)
+        printf("[\n");
+    else if (compare)
+        printf("workload,engine,baseline_mean_ns,mean_ns,change_pct,ci_low_pct,ci_high_pct,baseline_match_allocs,"
+            "match_allocs,verdict\n");
+    else
+        printf("workload,type,engine,input_bytes,compile_median_ns,match_median_ns,match_p99_ns,mb_per_s,"
+            "compile_allocs,match_allocs,matched\n");
+    for (size_t i = 0; i < nworkloads; i++) {
+        if (type && strcmp(type, workloads[i].type) != 0)
+            continue;
+        for (engine_t engine = ENGINE_NFA; engine <= ENGINE_META; engine++) {
+            result r;
+            if (!run_workload(&workloads[i], engine, trials, warmup, &r))
+                continue;
+            if (compare) {
+                baseline_entry *b = NULL;
+                for (size_t j = 0; j < nbaseline && b == NULL; j++) {
+                    if (strcmp(baseline[j].workload, r.workload) == 0 &&
+                        strcmp(baseline[j].engine, engine_names[engine]) == 0)
+                        b = &baseline[j];
+                }
+                // a workload new since the baseline can't regress
+                if (b == NULL)
+                    continue;
+                regressions += compare_result(&r, b, threshold, json, first);
+            } else {
+                print_result(&r, json, first);
+            }
+            first = 0;
+            fflush(stdout);
+            if (record) {
+                results = reallocarray(results, nresults + 1, sizeof(result));
+                if (results == NULL)
+                    err(EXIT_FAILURE, "malloc failed");
+                results[nresults++] = r;
+            }
+        }
+    }
+    if (json)
+        printf("\n]\n");
+    if (record)
+        save_baseline(file, record, results, nresults);
+    if (compare && !json)
+        fprintf(stderr, "%d regressions against %s\n", regressions, compare);
+    free(results);
+    free(baseline);
+    free_workloads(workloads, nworkloads);
+    return regressions != 0;
 }
@@ -0,0 +1,90 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "test_utils.h"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+/*
+ * The matchers are generated by recodegen from the patterns in the Makefile
+ * rules for ident_re.c, http_method_re.c, digits_re.c and whole_word_re.c.
+ */
+int ident(const char *, size_t);
+int http_method(const char *, size_t);
+int digits(const char *, size_t);
+int whole_word(const char *, size_t);
+
+static void
+test_generated_matchers(void)
+{
+    typedef struct test_input {
+        int (*fn) (const char *, size_t);
+        const char *regex;
+        match_mode_t mode;
+    } test_input;
+
+    test_input tests[] = {
+        {ident, "[a-zA-Z_][a-zA-Z0-9_]*", MATCH_FULL},
+        {http_method, "GET|HEAD|POST|PUT|DELETE|OPTIONS", MATCH_PREFIX},
+        {digits, "[0-9][0-9]+", MATCH_ANY},
+        {whole_word, "\\bGET\\b|[0-9]+$", MATCH_ANY}
+    };
+    const char *inputs[] = {
+        "", "a", "_x9", "9x", "foo_bar", "foo-bar", "GET", "GET /", "HEAD",
+        "HEA", "POS", "POST", "OPTIONS", "put", "x1", "x12", "order 42",
+        "\xff\xfe", "GETS", "a GET", "x12 y"
+    };
+
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        test_input t = tests[i];
+        printf("Testing generated matcher for %s---", t.regex);
+        nfa_machine_t *machine = compile_regex(t.regex);
+        for (size_t j = 0; j < sizeof(inputs)/sizeof(inputs[0]); j++) {
+            size_t len = strlen(inputs[j]);
+            int expected = nfa_match(machine, inputs[j], len, t.mode, NULL);
+            test(t.fn(inputs[j], len) == expected,
+                ANSI_COLOR_RED "failed for input %s: %s\n" ANSI_COLOR_RESET, t.regex, inputs[j]);
+        }
+        free_nfa(machine);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    test_generated_matchers();
+}
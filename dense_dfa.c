@@ -0,0 +1,391 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dense_dfa.h"
+#include "dfa.h"
+#include "re_utils.h"
+
+typedef struct signature {
+    uint32_t *values;
+    size_t len;
+} signature;
+
+static size_t
+signature_hash(void *key)
+{
+    signature *sig = (signature *) key;
+    size_t hash = 14695981039346656037UL;
+    for (size_t i = 0; i < sig->len; i++) {
+        hash ^= sig->values[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static _Bool
+signature_equals(void *key1, void *key2)
+{
+    signature *s1 = (signature *) key1;
+    signature *s2 = (signature *) key2;
+    return memcmp(s1->values, s2->values, s1->len * sizeof(uint32_t)) == 0;
+}
+
+/*
+ * Fills in the accel table of dfa. States with conditional acceptance are
+ * left out, as whether they accept depends on the byte after them.
+ */
+static uint8_t *
+find_accelerated_states(dense_dfa_t *dfa)
+{
+    uint8_t *accel = re_calloc(dfa->nstates, DENSE_DFA_ACCEL_MAX + 1);
+    if (accel == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    for (uint32_t s = 0; s < dfa->nstates; s++) {
+        if (s == DFA_DEAD_STATE || (dfa->flags[s] & DFA_CONDITIONAL))
+            continue;
+        uint8_t *a = accel + (size_t) s * (DENSE_DFA_ACCEL_MAX + 1);
+        size_t n = 0;
+        for (int c = 0; c < 256 && n <= DENSE_DFA_ACCEL_MAX; c++) {
+            if (dense_dfa_next(dfa, s, c) != s && n++ < DENSE_DFA_ACCEL_MAX)
+                a[n] = c;
+        }
+        a[0] = n <= DENSE_DFA_ACCEL_MAX? n: 0;
+    }
+    return accel;
+}
+
+/*
+ * Returns the position of the first byte from i on leading out of the
+ * accelerated state with the given accel entry, or len.
+ */
+static inline size_t
+accel_skip(const uint8_t *accel, const char *string, size_t i, size_t len)
+{
+    const void *p;
+    if (accel[0] == 1)
+        p = memchr(string + i, accel[1], len - i);
+    else if (accel[0] == 2)
+        p = re_memchr2(string + i, accel[1], accel[2], len - i);
+    else
+        p = re_memchr3(string + i, accel[1], accel[2], accel[3], len - i);
+    return p? (size_t) ((const char *) p - string): len;
+}
+
+/*
+ * Builds all the states of the lazy DFA and merges the equivalent ones
+ * using Moore's partition refinement: states start out partitioned by
+ * when they accept, and every round splits the blocks whose states move
+ * into different blocks on some byte class, until no block splits any more.
+ * The block of the dead state becomes state DFA_DEAD_STATE. Returns NULL if
+ * the DFA does not fit into its cache.
+ */
+dense_dfa_t *
+dfa_minimize(dfa_t *dfa)
+{
+    if (!dfa_build_all(dfa))
+        return NULL;
+
+    size_t n = dfa->nstates;
+    size_t k = dfa->nclasses;
+    uint32_t *block = re_malloc(n * sizeof(uint32_t));
+    uint32_t *new_block = re_malloc(n * sizeof(uint32_t));
+    uint32_t *values = re_malloc(n * (k + 1) * sizeof(uint32_t));
+    signature *sigs = re_malloc(n * sizeof(signature));
+    if (block == NULL || new_block == NULL || values == NULL || sigs == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+
+    size_t nblocks = 0;
+    for (size_t s = 0; s < n; s++)
+        block[s] = dfa->flags[s] & DFA_ACCEPT_MASK;
+    for (;;) {
+        cm_hash_table *table = cm_hash_table_init(signature_hash, signature_equals, NULL, NULL);
+        size_t count = 0;
+        for (size_t s = 0; s < n; s++) {
+            signature *sig = &sigs[s];
+            sig->values = values + s * (k + 1);
+            sig->len = k + 1;
+            sig->values[0] = block[s];
+            for (size_t c = 0; c < k; c++)
+                sig->values[c + 1] = block[dfa->trans[s * k + c]];
+            void *id = cm_hash_table_get(table, sig);
+            if (id == NULL) {
+                id = (void *) (uintptr_t) ++count;
+                cm_hash_table_put(table, sig, id);
+            }
+            new_block[s] = (uint32_t) (uintptr_t) id - 1;
+        }
+        cm_hash_table_free(table);
+        uint32_t *temp = block;
+        block = new_block;
+        new_block = temp;
+        if (count == nblocks)
+            break;
+        nblocks = count;
+    }
+
+    // renumber the blocks so that the dead state's block comes first
+    uint32_t *renumber = new_block;
+    uint32_t dead_block = block[DFA_DEAD_STATE];
+    for (size_t b = 0; b < nblocks; b++)
+        renumber[b] = b == dead_block? 0: (b < dead_block? b + 1: b);
+
+    dense_dfa_t *dense = re_malloc(sizeof(*dense));
+    uint32_t *trans = re_malloc(nblocks * k * sizeof(uint32_t));
+    uint8_t *flags = re_malloc(nblocks);
+    if (dense == NULL || trans == NULL || flags == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    for (size_t s = 0; s < n; s++) {
+        uint32_t b = renumber[block[s]];
+        flags[b] = dfa->flags[s] & DFA_ACCEPT_MASK;
+        for (size_t c = 0; c < k; c++)
+            trans[b * k + c] = renumber[block[dfa->trans[s * k + c]]];
+    }
+    dense->trans = trans;
+    dense->flags = flags;
+    dense->nstates = nblocks;
+    dense->nclasses = k;
+    for (size_t i = 0; i < 4; i++)
+        dense->start[i] = renumber[block[dfa->start[i]]];
+    memcpy(dense->byte_classes, dfa->byte_classes, 256);
+    dense->accel = find_accelerated_states(dense);
+    copy_analysis(&dense->analysis, &dfa->machine->analysis);
+    dense->owned = 1;
+    RE_STATS_DO(dense->stats = &dfa->machine->stats);
+
+    re_free(block);
+    re_free(new_block);
+    re_free(values);
+    re_free(sigs);
+    return dense;
+}
+
+/*
+ * Attempts of an unanchored search, kept in the order of the offset they
+ * started at like the thread lists of the NFA executor. Two attempts in
+ * the same state have the same future, so only the one which started first
+ * is kept and a list never has more than nstates of them.
+ */
+typedef struct search_list {
+    uint32_t *states;
+    size_t *starts;
+    size_t n;
+} search_list;
+
+static void
+add_attempt(search_list *list, size_t *marks, size_t gen, uint32_t state, size_t start)
+{
+    if (state == DFA_DEAD_STATE || marks[state] == gen)
+        return;
+    marks[state] = gen;
+    list->states[list->n] = state;
+    list->starts[list->n++] = start;
+}
+
+/*
+ * Returns the first offset from i on, but not after end, whose attempt
+ * doesn't die on its first byte.
+ */
+static size_t
+skip_dead_starts(dense_dfa_t *dfa, const char *string, size_t len, size_t i, size_t end)
+{
+    for (; i < end; i++) {
+        uint32_t state = dfa->start[is_word_byte((uint8_t) string[i - 1])? 3: 2];
+        if (dfa_accepts(dfa->flags[state], string, i, len) || dense_dfa_next(dfa, state, string[i]) != DFA_DEAD_STATE)
+            break;
+    }
+    return i;
+}
+
+/*
+ * Finds the leftmost longest match by running the attempts from every
+ * offset up to end, where the earliest match ends, side by side in a
+ * single pass. Once an attempt accepts the ones which started after it
+ * can't be leftmost and are dropped, the ones which started before it may
+ * still accept and replace it. Each position costs at most nstates steps,
+ * offsets whose attempt dies on its first byte are skipped while no
+ * attempt is alive. There has to be a match ending at end, and as no
+ * match ends before it none starts more than max_len bytes before it.
+ */
+void
+dense_dfa_leftmost_longest(dense_dfa_t *dfa, const char *string, size_t len, size_t end, match_t *match)
+{
+    search_list lists[2];
+    for (size_t l = 0; l < 2; l++) {
+        lists[l].states = re_malloc(dfa->nstates * sizeof(uint32_t));
+        lists[l].starts = re_malloc(dfa->nstates * sizeof(size_t));
+        if (lists[l].states == NULL || lists[l].starts == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+        lists[l].n = 0;
+    }
+    // the list for position i has the generation i + 1
+    size_t *marks = re_calloc(dfa->nstates, sizeof(size_t));
+    if (marks == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    search_list *cur = &lists[0], *next = &lists[1];
+    size_t max_len = dfa->analysis.max_len;
+    int found = 0;
+
+    for (size_t i = max_len != RE_UNBOUNDED && end > max_len? end - max_len: 0; ; i++) {
+        if (i > 0 && !found && cur->n == 0)
+            i = skip_dead_starts(dfa, string, len, i, end);
+        if (!found && i <= end)
+            add_attempt(cur, marks, i + 1, dfa->start[i == 0? 0: is_word_byte((uint8_t) string[i - 1])? 3: 2], i);
+        for (size_t t = 0; t < cur->n; t++) {
+            uint32_t state = cur->states[t];
+            if (dfa_accepts(dfa->flags[state], string, i, len)) {
+                found = 1;
+                match->start = cur->starts[t];
+                match->end = i;
+                cur->n = t + 1;
+            }
+            if (i < len)
+                add_attempt(next, marks, i + 2, dense_dfa_next(dfa, state, string[i]), cur->starts[t]);
+        }
+        if (i == len || (next->n == 0 && (found || i >= end)))
+            break;
+        search_list *temp = cur;
+        cur = next;
+        next = temp;
+        next->n = 0;
+    }
+    for (size_t l = 0; l < 2; l++) {
+        re_free(lists[l].states);
+        re_free(lists[l].starts);
+    }
+    re_free(marks);
+}
+
+#ifdef RE_STATS
+static int
+record_match(dense_dfa_t *dfa, size_t steps, int ret)
+{
+    re_match_stats_t m = {0};
+    m.bytes_scanned = steps;
+    m.steps = steps;
+    m.prefilter_candidates = dfa->analysis.required.len != 0;
+    if (dfa->stats)
+        re_stats_add(dfa->stats, RE_ENGINE_DENSE_DFA, &m);
+    return ret;
+}
+#define match_return(ret) return record_match(dfa, i, ret)
+#else
+#define match_return(ret) return ret
+#endif
+
+/*
+ * For MATCH_SEARCH the leftmost match can't start after the end of the
+ * earliest match, so the unanchored pass only finds where that is and
+ * dense_dfa_leftmost_longest the offsets.
+ */
+static int
+dense_dfa_run(dense_dfa_t *dfa, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    int anchored = mode == MATCH_FULL || mode == MATCH_PREFIX;
+    uint32_t state = dfa->start[anchored? 0: 1];
+    size_t i;
+
+    if (mode == MATCH_FULL) {
+        for (i = 0; i < len && state != DFA_DEAD_STATE; i++) {
+            const uint8_t *accel = dense_dfa_accel(dfa, state);
+            if (accel[0] && (i = accel_skip(accel, string, i, len)) == len)
+                break;
+            state = dense_dfa_next(dfa, state, string[i]);
+        }
+        if (!dfa_accepts_next(dfa->flags[state], 1, 0))
+            match_return(0);
+        if (match) {
+            match->start = 0;
+            match->end = len;
+        }
+        match_return(1);
+    }
+
+    for (i = 0; !dfa_accepts(dfa->flags[state], string, i, len); i++) {
+        if (i == len || state == DFA_DEAD_STATE)
+            match_return(0);
+        const uint8_t *accel = dense_dfa_accel(dfa, state);
+        if (accel[0] && (i = accel_skip(accel, string, i, len)) == len)
+            match_return(0);
+        state = dense_dfa_next(dfa, state, string[i]);
+    }
+    if (mode == MATCH_SEARCH && match)
+        dense_dfa_leftmost_longest(dfa, string, len, i, match);
+    if (mode == MATCH_PREFIX && match) {
+        match->start = 0;
+        match->end = i;
+    }
+    match_return(1);
+}
+
+/*
+ * Same semantics as nfa_match, including answering from the analysis of
+ * the pattern without running the DFA where possible.
+ */
+int
+dense_dfa_match(dense_dfa_t *dfa, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    const re_analysis_t *a = &dfa->analysis;
+    int ret = match_precheck(a, string, len, mode, match);
+    if (ret != -1) {
+        RE_STATS_DO(if (dfa->stats) re_stats_add_prefiltered(dfa->stats, RE_ENGINE_DENSE_DFA, len));
+        return ret;
+    }
+    return extend_match(a, dense_dfa_run(dfa, string, len, core_mode(a, mode), match), len, mode, match);
+}
+
+/*
+ * The bytes of the DFA, and of its tables if it owns them.
+ */
+size_t
+dense_dfa_size(dense_dfa_t *dfa)
+{
+    size_t size = sizeof(*dfa);
+    if (dfa->owned) {
+        size += (size_t) dfa->nstates * (dfa->nclasses * sizeof(uint32_t) + 1 + DENSE_DFA_ACCEL_MAX + 1);
+        size += dfa->analysis.prefix.len + dfa->analysis.suffix.len + dfa->analysis.required.len;
+    }
+    return size;
+}
+
+void
+dense_dfa_free(dense_dfa_t *dfa)
+{
+    if (dfa->owned) {
+        re_free((void *) dfa->trans);
+        re_free((void *) dfa->flags);
+        re_free((void *) dfa->accel);
+        free_analysis(&dfa->analysis);
+    }
+    re_free(dfa);
+}
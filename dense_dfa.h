@@ -0,0 +1,79 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef DENSE_DFA_H
+#define DENSE_DFA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfa.h"
+#include "nfa_executor.h"
+#include "re_analysis.h"
+#include "re_stats.h"
+
+#define DENSE_DFA_ACCEL_MAX 3
+
+/*
+ * A DFA with all its states built, stored as a flat transition table of
+ * nstates rows of nclasses entries. State DFA_DEAD_STATE never accepts and
+ * never leaves itself. The tables and the strings of the analysis are
+ * either owned by the dense_dfa_t or point into a mapped image.
+ *
+ * A state that goes back to itself on all but up to DENSE_DFA_ACCEL_MAX
+ * bytes is accelerated: the run of bytes keeping it in place is skipped
+ * with a memchr for the bytes leading out of it. accel has
+ * DENSE_DFA_ACCEL_MAX + 1 bytes per state, the number of such bytes (0 if
+ * the state is not accelerated) followed by the bytes.
+ */
+typedef struct dense_dfa_t {
+    const uint32_t *trans;
+    const uint8_t *flags;
+    const uint8_t *accel;
+    uint32_t nstates;
+    uint32_t nclasses;
+    uint32_t start[4]; // the start states of the dfa_t it was built from
+    uint8_t byte_classes[256];
+    re_analysis_t analysis; // of the pattern of the machine it was built from
+    int owned;
+#ifdef RE_STATS
+    re_stats_t *stats; // the stats of the machine it was built from, NULL for an image
+#endif
+} dense_dfa_t;
+
+#define dense_dfa_next(dfa, state, c) \
+    ((dfa)->trans[(size_t) (state) * (dfa)->nclasses + (dfa)->byte_classes[(uint8_t) (c)]])
+#define dense_dfa_accel(dfa, state) ((dfa)->accel + (size_t) (state) * (DENSE_DFA_ACCEL_MAX + 1))
+
+dense_dfa_t *dfa_minimize(dfa_t *);
+int dense_dfa_match(dense_dfa_t *, const char *, size_t, match_mode_t, match_t *);
+void dense_dfa_leftmost_longest(dense_dfa_t *, const char *, size_t, size_t, match_t *);
+size_t dense_dfa_size(dense_dfa_t *);
+void dense_dfa_free(dense_dfa_t *);
+#endif
@@ -0,0 +1,762 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfa.h"
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "re_utils.h"
+
+#define INITIAL_DFA_STATES 16
+#define state_mem_size(dfa, nset) ((dfa)->nclasses * sizeof(uint32_t) + sizeof(dfa_state_t) \
+    + (nset) * sizeof(size_t) + 1 + 4 * sizeof(void *))
+
+static size_t
+dfa_state_hash(void *key)
+{
+    dfa_state_t *state = (dfa_state_t *) key;
+    size_t hash = 14695981039346656037UL ^ state->flags;
+    for (size_t i = 0; i < state->nset; i++) {
+        hash ^= state->set[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static _Bool
+dfa_state_equals(void *key1, void *key2)
+{
+    dfa_state_t *s1 = (dfa_state_t *) key1;
+    dfa_state_t *s2 = (dfa_state_t *) key2;
+    return s1->flags == s2->flags && s1->nset == s2->nset &&
+        memcmp(s1->set, s2->set, s1->nset * sizeof(size_t)) == 0;
+}
+
+static void
+free_dfa_state(void *data)
+{
+    dfa_state_t *state = (dfa_state_t *) data;
+    re_free(state->set);
+    re_free(state);
+}
+
+static int
+compare_idx(const void *a, const void *b)
+{
+    size_t i1 = *(const size_t *) a;
+    size_t i2 = *(const size_t *) b;
+    return i1 < i2? -1: i1 > i2;
+}
+
+static uint32_t
+add_state(dfa_t *dfa, size_t *set, size_t nset, uint8_t flags)
+{
+    dfa_state_t key = {set, nset, flags, 0};
+    dfa_state_t *state = cm_hash_table_get(dfa->state_table, &key);
+    if (state)
+        return state->idx;
+
+    if (dfa->nstates == dfa->states_size) {
+        dfa->states_size *= 2;
+        dfa->trans = re_reallocarray(dfa->trans, dfa->states_size, dfa->nclasses * sizeof(uint32_t));
+        dfa->flags = re_realloc(dfa->flags, dfa->states_size);
+        dfa->states = re_reallocarray(dfa->states, dfa->states_size, sizeof(*dfa->states));
+        if (dfa->trans == NULL || dfa->flags == NULL || dfa->states == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+    }
+    state = re_malloc(sizeof(*state));
+    if (state == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    state->set = re_malloc(nset * sizeof(size_t) + 1);
+    if (state->set == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    memcpy(state->set, set, nset * sizeof(size_t));
+    state->nset = nset;
+    state->flags = flags;
+    state->idx = dfa->nstates++;
+    dfa->states[state->idx] = state;
+    dfa->flags[state->idx] = flags;
+    uint32_t *row = dfa->trans + (size_t) state->idx * dfa->nclasses;
+    for (size_t i = 0; i < dfa->nclasses; i++)
+        row[i] = DFA_UNKNOWN;
+    dfa->mem_used += state_mem_size(dfa, nset);
+    cm_hash_table_put(dfa->state_table, state, state);
+    return state->idx;
+}
+
+static void
+add_dead_state(dfa_t *dfa)
+{
+    uint32_t dead = add_state(dfa, dfa->builder.set, 0, 0);
+    uint32_t *row = dfa->trans + (size_t) dead * dfa->nclasses;
+    for (size_t i = 0; i < dfa->nclasses; i++)
+        row[i] = DFA_DEAD_STATE;
+}
+
+/*
+ * Throws away all the cached states, the caller has to forget any state
+ * index it holds on to.
+ */
+static void
+dfa_flush(dfa_t *dfa)
+{
+    cm_hash_table_free(dfa->state_table);
+    dfa->state_table = cm_hash_table_init(dfa_state_hash, dfa_state_equals, NULL, free_dfa_state);
+    dfa->nstates = 0;
+    dfa->mem_used = 0;
+    for (size_t i = 0; i < 4; i++)
+        dfa->start[i] = DFA_UNKNOWN;
+    dfa->nflushes++;
+    add_dead_state(dfa);
+}
+
+/*
+ * Adds the char states reachable from state through epsilon transitions to
+ * out. With resolve set every assertion is checked against look, otherwise
+ * only `^` is and the other assertions are added to out as they are, to be
+ * resolved once the byte after the position is known.
+ */
+static uint8_t
+add_closure(dfa_builder_t *b, nfa_state_t *state, unsigned look, int resolve, size_t *out, size_t *nout)
+{
+    uint8_t flags = 0;
+    size_t top = 0;
+    b->stack[top++] = state;
+    while (top) {
+        nfa_state_t *s = b->stack[--top];
+        if (is_end_state(s)) {
+            flags |= DFA_ACCEPTING;
+            continue;
+        }
+        if (b->marks[s->state_idx] == b->gen)
+            continue;
+        b->marks[s->state_idx] = b->gen;
+        if (is_null_state(s)) {
+            if (s->assertion && !resolve && s->assertion != ASSERT_TEXT_START) {
+                out[(*nout)++] = s->state_idx;
+                continue;
+            }
+            if (!assertion_holds(s->assertion, look))
+                continue;
+            if (s->out1)
+                b->stack[top++] = s->out1;
+            b->stack[top++] = s->out;
+            continue;
+        }
+        out[(*nout)++] = s->state_idx;
+    }
+    return flags;
+}
+
+#define behind_look(flags) (((flags) & DFA_AT_TEXT_START? LOOK_TEXT_START: 0) | \
+    ((flags) & DFA_AFTER_WORD? LOOK_PREV_WORD: 0))
+
+/*
+ * Adds the look-behind and the conditional accepts to the flags of the
+ * scratch set if it holds pending assertions, look is what is known of the
+ * position the state is entered at.
+ */
+static uint8_t
+pending_flags(dfa_builder_t *b, uint8_t flags, unsigned look)
+{
+    static const unsigned ahead[3] = {LOOK_TEXT_END, LOOK_NEXT_WORD, 0};
+    static const uint8_t accepts[3] = {DFA_ACCEPT_AT_END, DFA_ACCEPT_BEFORE_WORD, DFA_ACCEPT_BEFORE_NONWORD};
+    int pending = 0;
+    for (size_t i = 0; i < b->nset; i++) {
+        if (is_null_state(&b->machine->states[b->set[i]]))
+            pending = 1;
+    }
+    if (!pending)
+        return flags;
+    flags |= (look & LOOK_TEXT_START? DFA_AT_TEXT_START: 0) | (look & LOOK_PREV_WORD? DFA_AFTER_WORD: 0);
+    if (flags & DFA_ACCEPTING)
+        return flags;
+    for (size_t k = 0; k < 3; k++) {
+        size_t nstep = 0;
+        b->gen++;
+        for (size_t i = 0; i < b->nset && !(flags & accepts[k]); i++) {
+            nfa_state_t *s = &b->machine->states[b->set[i]];
+            if (is_null_state(s) && assertion_holds(s->assertion, look | ahead[k]) &&
+                add_closure(b, s->out, look | ahead[k], 1, b->step, &nstep))
+                flags |= accepts[k];
+        }
+    }
+    return flags;
+}
+
+/*
+ * Builds start state which, as indexed in dfa_t.start, into the set of the
+ * builder and returns its flags.
+ */
+uint8_t
+dfa_builder_start(dfa_builder_t *b, int which)
+{
+    static const unsigned looks[4] = {LOOK_TEXT_START, LOOK_TEXT_START, 0, LOOK_PREV_WORD};
+    b->gen++;
+    b->nset = 0;
+    uint8_t flags = add_closure(b, b->machine->start, looks[which], 0, b->set, &b->nset);
+    // without its leading `.*` the machine is unanchored from every start
+    if (which == 1 || b->machine->analysis.leading_any)
+        flags |= DFA_UNANCHORED;
+    flags = pending_flags(b, flags, looks[which]);
+    qsort(b->set, b->nset, sizeof(size_t), compare_idx);
+    return flags;
+}
+
+/*
+ * Builds the state entered from the state with the given set and flags over
+ * the bytes of the given class into the set of the builder and returns its
+ * flags. The pending assertions of the state are resolved first, now that
+ * the byte after their position is known, and the char states they lead to
+ * are stepped over together with the char states of the state.
+ */
+uint8_t
+dfa_builder_step(dfa_builder_t *b, const size_t *set, size_t nset, uint8_t from_flags, uint8_t class)
+{
+    uint8_t c = b->class_bytes[class];
+    uint8_t flags = from_flags & DFA_UNANCHORED;
+    unsigned look = behind_look(from_flags) | (is_word_byte(c)? LOOK_NEXT_WORD: 0);
+    size_t nstep = 0;
+
+    b->gen++;
+    for (size_t i = 0; i < nset; i++) {
+        nfa_state_t *s = &b->machine->states[set[i]];
+        if (!is_null_state(s)) {
+            b->marks[s->state_idx] = b->gen;
+            b->step[nstep++] = s->state_idx;
+        }
+    }
+    for (size_t i = 0; i < nset; i++) {
+        nfa_state_t *s = &b->machine->states[set[i]];
+        if (is_null_state(s) && assertion_holds(s->assertion, look))
+            add_closure(b, s->out, look, 1, b->step, &nstep);
+    }
+
+    look = is_word_byte(c)? LOOK_PREV_WORD: 0;
+    b->gen++;
+    b->nset = 0;
+    for (size_t i = 0; i < nstep; i++) {
+        nfa_state_t *s = &b->machine->states[b->step[i]];
+        if (!is_matching_state(s, c))
+            continue;
+        flags |= add_closure(b, s->out, look, 0, b->set, &b->nset);
+        if (s->out1)
+            flags |= add_closure(b, s->out1, look, 0, b->set, &b->nset);
+    }
+    if (flags & DFA_UNANCHORED)
+        flags |= add_closure(b, b->machine->start, look, 0, b->set, &b->nset);
+    flags = pending_flags(b, flags, look);
+    qsort(b->set, b->nset, sizeof(size_t), compare_idx);
+    return flags;
+}
+
+/*
+ * Adds the state in the set of the builder to the cache, flushing it first
+ * if there is no room left.
+ */
+static uint32_t
+add_built_state(dfa_t *dfa, uint8_t flags, int *flushed)
+{
+    dfa_builder_t *b = &dfa->builder;
+    *flushed = 0;
+    if (dfa->mem_used + state_mem_size(dfa, b->nset) > dfa->cache_size) {
+        dfa_state_t key = {b->set, b->nset, flags, 0};
+        if (cm_hash_table_get(dfa->state_table, &key) == NULL) {
+            dfa_flush(dfa);
+            *flushed = 1;
+        }
+    }
+    return add_state(dfa, b->set, b->nset, flags);
+}
+
+/*
+ * Returns start state which of dfa_t.start, building it if needed.
+ */
+static uint32_t
+start_state(dfa_t *dfa, int which)
+{
+    int flushed;
+    // a search for a pattern anchored at the start has nothing to retry
+    if (which == 1 && dfa->machine->anchored_start)
+        return dfa->start[1] = start_state(dfa, 0);
+    if (dfa->start[which] != DFA_UNKNOWN)
+        return dfa->start[which];
+    uint8_t flags = dfa_builder_start(&dfa->builder, which);
+    uint32_t idx = add_built_state(dfa, flags, &flushed);
+    dfa->start[which] = idx;
+    return idx;
+}
+
+/*
+ * Computes the state entered from state from over the bytes of the given
+ * class.
+ */
+static uint32_t
+compute_transition(dfa_t *dfa, uint32_t from, uint8_t class)
+{
+    dfa_state_t *state = dfa->states[from];
+    int flushed;
+    uint8_t flags = dfa_builder_step(&dfa->builder, state->set, state->nset, state->flags, class);
+    uint32_t to = add_built_state(dfa, flags, &flushed);
+    RE_STATS_DO(dfa->ncomputed++);
+    // the state we came from is gone if the cache got flushed
+    if (!flushed)
+        dfa->trans[(size_t) from * dfa->nclasses + class] = to;
+    return to;
+}
+
+#define next_state(dfa, state, c) do { \
+    uint8_t class = dfa->byte_classes[(uint8_t) (c)]; \
+    uint32_t next = dfa->trans[(size_t) state * dfa->nclasses + class]; \
+    state = next == DFA_UNKNOWN? compute_transition(dfa, state, class): next; \
+    } while (0)
+
+/*
+ * class_bytes is a representative byte for every byte class, it is only
+ * referred to.
+ */
+void
+dfa_builder_init(dfa_builder_t *b, nfa_machine_t *machine, const uint8_t *class_bytes)
+{
+    b->machine = machine;
+    b->class_bytes = class_bytes;
+    b->set = re_malloc((machine->nstates + 1) * sizeof(size_t));
+    b->nset = 0;
+    b->step = re_malloc((machine->nstates + 1) * sizeof(size_t));
+    b->stack = re_malloc((2 * machine->nstates + 1) * sizeof(nfa_state_t *));
+    b->marks = re_calloc(machine->nstates + 1, sizeof(size_t));
+    b->gen = 0;
+    if (b->set == NULL || b->step == NULL || b->stack == NULL || b->marks == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+}
+
+/*
+ * The bytes dfa_builder_init allocates for an NFA of nstates states.
+ */
+size_t
+dfa_builder_size(size_t nstates)
+{
+    return 3 * (nstates + 1) * sizeof(size_t) + (2 * nstates + 1) * sizeof(nfa_state_t *);
+}
+
+void
+dfa_builder_free(dfa_builder_t *b)
+{
+    re_free(b->set);
+    re_free(b->step);
+    re_free(b->stack);
+    re_free(b->marks);
+}
+
+/*
+ * A cache_size of 0 takes the max_dfa_memory the machine was compiled
+ * with, or DFA_DEFAULT_CACHE_SIZE if it has none.
+ */
+dfa_t *
+dfa_init(nfa_machine_t *machine, size_t cache_size)
+{
+    dfa_t *dfa;
+    dfa = re_calloc(1, sizeof(*dfa));
+    if (dfa == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    dfa->machine = machine;
+    memcpy(dfa->byte_classes, machine->byte_classes, 256);
+    dfa->nclasses = machine->nclasses;
+    for (int c = 255; c >= 0; c--)
+        dfa->class_bytes[dfa->byte_classes[c]] = c;
+    if (cache_size == 0)
+        cache_size = machine->max_dfa_memory? machine->max_dfa_memory: DFA_DEFAULT_CACHE_SIZE;
+    dfa->cache_size = cache_size;
+    dfa->states_size = INITIAL_DFA_STATES;
+    dfa->trans = re_reallocarray(NULL, dfa->states_size, dfa->nclasses * sizeof(uint32_t));
+    dfa->flags = re_malloc(dfa->states_size);
+    dfa->states = re_reallocarray(NULL, dfa->states_size, sizeof(*dfa->states));
+    if (dfa->trans == NULL || dfa->flags == NULL || dfa->states == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    dfa_builder_init(&dfa->builder, machine, dfa->class_bytes);
+    dfa->state_table = cm_hash_table_init(dfa_state_hash, dfa_state_equals, NULL, free_dfa_state);
+    for (size_t i = 0; i < 4; i++)
+        dfa->start[i] = DFA_UNKNOWN;
+    add_dead_state(dfa);
+    if (machine->reverse)
+        dfa->reverse = dfa_init(machine->reverse, cache_size);
+    return dfa;
+}
+
+#ifdef RE_STATS
+/*
+ * Adds the counters of a match which took the given number of steps to
+ * the stats of machine, the forward one even when dfa is the reverse DFA.
+ * ncomputed and nflushes are the values the DFA had before the match.
+ */
+static int
+record_match(dfa_t *dfa, nfa_machine_t *machine, size_t steps, size_t ncomputed, size_t nflushes, int ret)
+{
+    re_match_stats_t m = {0};
+    m.bytes_scanned = steps;
+    m.steps = steps;
+    m.dfa_cache_misses = dfa->ncomputed - ncomputed;
+    m.dfa_cache_hits = steps > m.dfa_cache_misses? steps - m.dfa_cache_misses: 0;
+    m.dfa_cache_flushes = dfa->nflushes - nflushes;
+    m.prefilter_candidates = machine->analysis.required.len != 0;
+    re_stats_add(&machine->stats, RE_ENGINE_DFA, &m);
+    return ret;
+}
+#define match_return(ret) return record_match(dfa, machine, i, ncomputed, nflushes, ret)
+#else
+#define match_return(ret) return ret
+#endif
+
+static void
+search_room(dfa_search_t *s, size_t size)
+{
+    for (size_t l = 0; l < 2; l++) {
+        s->states[l] = re_reallocarray(s->states[l], size, sizeof(uint32_t));
+        s->starts[l] = re_reallocarray(s->starts[l], size, sizeof(size_t));
+        if (s->states[l] == NULL || s->starts[l] == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+    }
+    s->marks = re_reallocarray(s->marks, size, sizeof(size_t));
+    if (s->marks == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    memset(s->marks + s->size, 0, (size - s->size) * sizeof(size_t));
+    s->size = size;
+}
+
+static void
+add_attempt(dfa_t *dfa, size_t l, size_t gen, uint32_t state, size_t start)
+{
+    dfa_search_t *s = &dfa->search;
+    if (state >= s->size)
+        search_room(s, dfa->states_size);
+    if (state == DFA_DEAD_STATE || s->marks[state] == gen)
+        return;
+    s->marks[state] = gen;
+    s->states[l][s->n[l]] = state;
+    s->starts[l][s->n[l]++] = start;
+}
+
+/*
+ * Returns the first offset from i on, but not after end, whose attempt
+ * doesn't die on its first byte as far as the cached transitions tell.
+ */
+static size_t
+skip_dead_starts(dfa_t *dfa, const char *string, size_t len, size_t i, size_t end)
+{
+    uint32_t starts[2] = {dfa->start[2], dfa->start[3]};
+    if (starts[0] == DFA_UNKNOWN || starts[1] == DFA_UNKNOWN)
+        return i;
+    for (; i < end; i++) {
+        uint32_t state = starts[is_word_byte((uint8_t) string[i - 1])];
+        if (dfa_accepts(dfa->flags[state], string, i, len) ||
+            dfa->trans[(size_t) state * dfa->nclasses + dfa->byte_classes[(uint8_t) string[i]]] != DFA_DEAD_STATE)
+            break;
+    }
+    return i;
+}
+
+/*
+ * Finds the leftmost longest match the way dense_dfa.c does, running the
+ * attempts from every offset up to end, where the earliest match ends, side
+ * by side. For a pattern of bounded length they start at most max_len
+ * bytes before end. Returns 0 if the cache got flushed on the way, which leaves the
+ * states of the attempts unknown.
+ */
+static int
+leftmost_longest(dfa_t *dfa, const char *string, size_t len, size_t end, match_t *match)
+{
+    dfa_search_t *s = &dfa->search;
+    size_t nflushes = dfa->nflushes;
+    size_t base = s->gen;
+    size_t cur = 0, next = 1;
+    // the attempt from 0 is ahead of the others if it is the only one
+    int once = dfa->machine->analysis.leading_any || dfa->machine->anchored_start;
+    size_t max_len = dfa->machine->analysis.max_len;
+    int found = 0;
+
+    s->n[cur] = 0;
+    s->n[next] = 0;
+    for (size_t i = max_len != RE_UNBOUNDED && end > max_len? end - max_len: 0; ; i++) {
+        if (i > 0 && !found && !once && s->n[cur] == 0)
+            i = skip_dead_starts(dfa, string, len, i, end);
+        size_t gen = base + i + 1;
+        s->gen = gen + 1;
+        if (!found && i <= end && (i == 0 || !once)) {
+            uint32_t state = start_state(dfa, i == 0? 0: is_word_byte((uint8_t) string[i - 1])? 3: 2);
+            if (dfa->nflushes != nflushes)
+                return 0;
+            add_attempt(dfa, cur, gen, state, i);
+        }
+        for (size_t t = 0; t < s->n[cur]; t++) {
+            uint32_t state = s->states[cur][t];
+            if (dfa_accepts(dfa->flags[state], string, i, len)) {
+                found = 1;
+                match->start = s->starts[cur][t];
+                match->end = i;
+                s->n[cur] = t + 1;
+            }
+            if (i < len) {
+                next_state(dfa, state, string[i]);
+                if (dfa->nflushes != nflushes)
+                    return 0;
+                add_attempt(dfa, next, gen + 1, state, s->starts[cur][t]);
+            }
+        }
+        if (i == len || (s->n[next] == 0 && (found || i >= end)))
+            return 1;
+        cur ^= 1;
+        next ^= 1;
+        s->n[next] = 0;
+    }
+}
+
+/*
+ * Scans the input backwards with the DFA of the reversed pattern, which is
+ * anchored at the end of the input. Every match ends there, so the leftmost
+ * one starts at the last position the reverse DFA accepts at.
+ */
+static int
+reverse_match(dfa_t *forward, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    dfa_t *dfa = forward->reverse;
+#ifdef RE_STATS
+    nfa_machine_t *machine = forward->machine;
+    size_t ncomputed = dfa->ncomputed;
+    size_t nflushes = dfa->nflushes;
+#endif
+    uint32_t state = start_state(dfa, 0);
+    int found = 0;
+    size_t i, start = 0;
+
+    // i bytes have been read, the byte after the position is string[len - i - 1]
+    for (i = 0; ; i++) {
+        if (dfa_accepts_next(dfa->flags[state], i == len, is_word_byte((uint8_t) string[len - i - 1]))) {
+            found = 1;
+            start = len - i;
+            if (mode == MATCH_ANY)
+                break;
+        }
+        if (i == len || state == DFA_DEAD_STATE)
+            break;
+        next_state(dfa, state, string[len - i - 1]);
+    }
+    if (found && match && mode == MATCH_SEARCH) {
+        match->start = start;
+        match->end = len;
+    }
+    match_return(found);
+}
+
+static int
+dfa_run(dfa_t *dfa, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    int anchored = mode == MATCH_FULL || mode == MATCH_PREFIX;
+    if (dfa->reverse && !anchored)
+        return reverse_match(dfa, string, len, mode, match);
+#ifdef RE_STATS
+    nfa_machine_t *machine = dfa->machine;
+    size_t ncomputed = dfa->ncomputed;
+    size_t nflushes = dfa->nflushes;
+#endif
+    uint32_t state = start_state(dfa, anchored? 0: 1);
+    size_t i;
+
+    if (mode == MATCH_FULL) {
+        for (i = 0; i < len && state != DFA_DEAD_STATE; i++)
+            next_state(dfa, state, string[i]);
+        if (!dfa_accepts_next(dfa->flags[state], 1, 0))
+            match_return(0);
+        if (match) {
+            match->start = 0;
+            match->end = len;
+        }
+        match_return(1);
+    }
+
+    for (i = 0; !dfa_accepts(dfa->flags[state], string, i, len); i++) {
+        if (i == len || state == DFA_DEAD_STATE)
+            match_return(0);
+        next_state(dfa, state, string[i]);
+    }
+    if (mode == MATCH_SEARCH && match && !leftmost_longest(dfa, string, len, i, match))
+        match_return(nfa_match_scratch(dfa->machine, &dfa->nfa_scratch, string, len, mode, match));
+    if (mode == MATCH_PREFIX && match) {
+        match->start = 0;
+        match->end = i;
+    }
+    match_return(1);
+}
+
+/*
+ * Same semantics as nfa_match. For MATCH_SEARCH the unanchored pass finds
+ * where the earliest match ends and leftmost_longest the offsets, unless the
+ * pattern only matches at the end of the input and the reverse DFA can find
+ * them. Only a search which flushes the cache falls back to the NFA. Like
+ * nfa_match it first answers what the analysis of the pattern can.
+ */
+int
+dfa_match(dfa_t *dfa, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    const re_analysis_t *a = &dfa->machine->analysis;
+    int ret = match_precheck(a, string, len, mode, match);
+    if (ret != -1) {
+        RE_STATS_DO(re_stats_add_prefiltered(&dfa->machine->stats, RE_ENGINE_DFA, len));
+        return ret;
+    }
+    return extend_match(a, dfa_run(dfa, string, len, core_mode(a, mode), match), len, mode, match);
+}
+
+/*
+ * A stream starts out unanchored at the start of the text. The state
+ * index stays valid across dfa_stream_feed calls, the cache is only
+ * flushed while computing a transition, which returns the new index of the
+ * state it leads to.
+ */
+void
+dfa_stream_init(dfa_stream_t *stream, dfa_t *dfa)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->dfa = dfa;
+    stream->state = start_state(dfa, 1);
+}
+
+/*
+ * Feeds the next len bytes of the input. Whether the state accepts at a
+ * position is decided once the byte after it is fed, so a match ending at
+ * the end of one piece, with a `\b` or `$` after it, is found when the next
+ * piece or the end of the input comes. Returns 1 once there is a match.
+ */
+int
+dfa_stream_feed(dfa_stream_t *stream, const char *string, size_t len)
+{
+    dfa_t *dfa = stream->dfa;
+    uint32_t state = stream->state;
+    if (stream->done)
+        return stream->matched;
+    for (size_t i = 0; i < len; i++) {
+        if (dfa_accepts_next(dfa->flags[state], 0, is_word_byte((uint8_t) string[i]))) {
+            stream->matched = stream->done = 1;
+            stream->end = stream->offset + i;
+            return 1;
+        }
+        if (state == DFA_DEAD_STATE) {
+            stream->done = 1;
+            return 0;
+        }
+        next_state(dfa, state, string[i]);
+    }
+    stream->state = state;
+    stream->offset += len;
+    return 0;
+}
+
+/*
+ * Ends the input, returns 1 if it matched.
+ */
+int
+dfa_stream_end(dfa_stream_t *stream)
+{
+    if (!stream->done && dfa_accepts_next(stream->dfa->flags[stream->state], 1, 0)) {
+        stream->matched = 1;
+        stream->end = stream->offset;
+    }
+    stream->done = 1;
+    return stream->matched;
+}
+
+/*
+ * Computes every state reachable from the start states, after which the
+ * transition table has no DFA_UNKNOWN entries left. Returns 0 if the states
+ * did not fit into the cache, in which case the DFA is left partially built.
+ */
+int
+dfa_build_all(dfa_t *dfa)
+{
+    size_t nflushes = dfa->nflushes;
+    for (int which = 0; which < 4; which++)
+        start_state(dfa, which);
+    for (uint32_t state = 0; state < dfa->nstates; state++) {
+        for (size_t class = 0; class < dfa->nclasses; class++) {
+            if (dfa->trans[(size_t) state * dfa->nclasses + class] == DFA_UNKNOWN)
+                compute_transition(dfa, state, class);
+            if (dfa->nflushes != nflushes)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * The bytes held by the cached states, their transitions and the state
+ * table. The reverse DFA is not included.
+ */
+size_t
+dfa_states_size(dfa_t *dfa)
+{
+    size_t size = dfa->states_size * (dfa->nclasses * sizeof(uint32_t) + 1 + sizeof(dfa_state_t *));
+    for (size_t i = 0; i < dfa->nstates; i++)
+        size += sizeof(dfa_state_t) + dfa->states[i]->nset * sizeof(size_t) + 1;
+    return size + cm_hash_table_memory(dfa->state_table);
+}
+
+/*
+ * The bytes of the dfa_t itself and of the space it computes states and
+ * finds the offsets of searches in. The reverse DFA is not included.
+ */
+size_t
+dfa_scratch_size(dfa_t *dfa)
+{
+    size_t size = sizeof(*dfa) + dfa_builder_size(dfa->machine->nstates);
+    size += dfa->search.size * (2 * (sizeof(uint32_t) + sizeof(size_t)) + sizeof(size_t));
+    if (dfa->nfa_scratch.nstates)
+        size += nfa_scratch_size(dfa->machine);
+    return size;
+}
+
+void
+dfa_free(dfa_t *dfa)
+{
+    if (dfa->reverse)
+        dfa_free(dfa->reverse);
+    cm_hash_table_free(dfa->state_table);
+    re_free(dfa->trans);
+    re_free(dfa->flags);
+    re_free(dfa->states);
+    dfa_builder_free(&dfa->builder);
+    for (size_t l = 0; l < 2; l++) {
+        re_free(dfa->search.states[l]);
+        re_free(dfa->search.starts[l]);
+    }
+    re_free(dfa->search.marks);
+    nfa_scratch_free(&dfa->nfa_scratch);
+    re_free(dfa);
+}
@@ -0,0 +1,164 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef DFA_H
+#define DFA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "re_utils.h"
+
+#define DFA_UNKNOWN UINT32_MAX // transition not computed yet
+#define DFA_DEAD_STATE 0
+#define DFA_DEFAULT_CACHE_SIZE (2 * 1024 * 1024)
+
+#define DFA_ACCEPTING 0x1 // a match ends at the position where this state is entered
+#define DFA_UNANCHORED 0x2 // the NFA start state is added back after every step
+/*
+ * `$`, `\b` and `\B` look at the byte after the position, so a state still
+ * holding them only accepts depending on that byte. The look-behind they
+ * need is kept in the state itself.
+ */
+#define DFA_ACCEPT_AT_END 0x4
+#define DFA_ACCEPT_BEFORE_WORD 0x8
+#define DFA_ACCEPT_BEFORE_NONWORD 0x10
+#define DFA_AFTER_WORD 0x20
+#define DFA_AT_TEXT_START 0x40
+#define DFA_CONDITIONAL (DFA_ACCEPT_AT_END | DFA_ACCEPT_BEFORE_WORD | DFA_ACCEPT_BEFORE_NONWORD)
+#define DFA_ACCEPT_MASK (DFA_ACCEPTING | DFA_CONDITIONAL)
+
+#define dfa_accepts_next(flags, at_end, next_word) (((flags) & DFA_ACCEPTING) || \
+    (((flags) & DFA_CONDITIONAL) && ((flags) & ((at_end)? DFA_ACCEPT_AT_END: \
+    (next_word)? DFA_ACCEPT_BEFORE_WORD: DFA_ACCEPT_BEFORE_NONWORD))))
+/* Whether a state with the given flags accepts at position i of the input */
+#define dfa_accepts(flags, string, i, len) \
+    dfa_accepts_next(flags, (i) == (len), is_word_byte((uint8_t) (string)[i]))
+
+typedef struct dfa_state_t {
+    size_t *set; // sorted state_idx of the NFA char states and pending assertions making up this state
+    size_t nset;
+    uint8_t flags;
+    uint32_t idx;
+} dfa_state_t;
+
+/*
+ * The subset construction: the NFA it works on and its scratch space. Every
+ * thread building DFA states needs its own.
+ */
+typedef struct dfa_builder_t {
+    nfa_machine_t *machine;
+    const uint8_t *class_bytes; // a representative byte for every class
+    size_t *set; // the state built, sorted
+    size_t nset;
+    size_t *step; // the char states stepped over once the pending assertions are resolved
+    nfa_state_t **stack;
+    size_t *marks;
+    size_t gen;
+} dfa_builder_t;
+
+/*
+ * The attempts of a MATCH_SEARCH, one list for the current position and one
+ * for the next, with room for a state index below size in each. marks
+ * tells which states a list has already, gen is where the next search
+ * starts numbering its positions.
+ */
+typedef struct dfa_search_t {
+    uint32_t *states[2];
+    size_t *starts[2];
+    size_t n[2];
+    size_t *marks;
+    size_t size;
+    size_t gen;
+} dfa_search_t;
+
+/*
+ * A DFA over the byte classes of an NFA machine which is built lazily: a
+ * state is created by subset construction the first time a transition into
+ * it is taken. The states are kept in a cache bounded by cache_size bytes,
+ * once that fills up the cache is flushed and rebuilt from the current state
+ * on. The transition table has one row of nclasses entries per state.
+ * A dfa_t is not safe for concurrent use.
+ */
+typedef struct dfa_t {
+    nfa_machine_t *machine;
+    struct dfa_t *reverse; // DFA of machine->reverse, scanned from the end of the input
+    uint8_t byte_classes[256];
+    uint8_t class_bytes[256]; // a representative byte for every class
+    size_t nclasses;
+    uint32_t *trans;
+    uint8_t *flags;
+    dfa_state_t **states;
+    size_t nstates;
+    size_t states_size;
+    cm_hash_table *state_table;
+    uint32_t start[4]; // anchored, unanchored, anchored after a non-word and after a word byte
+    size_t cache_size;
+    size_t mem_used;
+    size_t nflushes;
+#ifdef RE_STATS
+    size_t ncomputed; // transitions computed, i.e. cache misses
+#endif
+    dfa_builder_t builder;
+    dfa_search_t search;
+    nfa_scratch_t nfa_scratch; // for a search the cache is too small for
+} dfa_t;
+
+/*
+ * A MATCH_ANY scan of an input fed to the DFA in pieces. end is the offset
+ * where the first match ends, once matched is set. done is set once the
+ * outcome is known, a match or the dead state, after which the rest of
+ * the input is ignored.
+ */
+typedef struct dfa_stream_t {
+    dfa_t *dfa;
+    uint32_t state;
+    size_t offset; // the bytes fed so far
+    int matched;
+    int done;
+    size_t end;
+} dfa_stream_t;
+
+dfa_t *dfa_init(nfa_machine_t *, size_t);
+int dfa_match(dfa_t *, const char *, size_t, match_mode_t, match_t *);
+int dfa_build_all(dfa_t *);
+size_t dfa_states_size(dfa_t *);
+size_t dfa_scratch_size(dfa_t *);
+void dfa_free(dfa_t *);
+void dfa_stream_init(dfa_stream_t *, dfa_t *);
+int dfa_stream_feed(dfa_stream_t *, const char *, size_t);
+int dfa_stream_end(dfa_stream_t *);
+void dfa_builder_init(dfa_builder_t *, nfa_machine_t *, const uint8_t *);
+uint8_t dfa_builder_start(dfa_builder_t *, int);
+uint8_t dfa_builder_step(dfa_builder_t *, const size_t *, size_t, uint8_t, uint8_t);
+size_t dfa_builder_size(size_t);
+void dfa_builder_free(dfa_builder_t *);
+#endif
@@ -0,0 +1,252 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dense_dfa.h"
+#include "dfa.h"
+#include "dfa_image.h"
+
+#define align8(n) (((n) + 7) & ~(size_t) 7)
+
+static uint64_t
+image_checksum(const uint8_t *data, size_t len)
+{
+    uint64_t hash = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/*
+ * Builds all the states of the DFA, minimizes it and writes it out as an
+ * image to path. Returns 0 on success, -1 if the DFA does not fit into its
+ * cache or the file could not be written.
+ */
+int
+dfa_image_write(dfa_t *lazy_dfa, const char *pattern, const char *path)
+{
+    dfa_image_header header;
+    dense_dfa_t *dfa = dfa_minimize(lazy_dfa);
+    if (dfa == NULL)
+        return -1;
+
+    size_t trans_size = (size_t) dfa->nstates * dfa->nclasses * sizeof(uint32_t);
+    size_t accel_size = (size_t) dfa->nstates * (DENSE_DFA_ACCEL_MAX + 1);
+    size_t pattern_len = strlen(pattern);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DFA_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = DFA_IMAGE_VERSION;
+    header.byte_order = DFA_IMAGE_BYTE_ORDER;
+    header.nstates = dfa->nstates;
+    header.nclasses = dfa->nclasses;
+    for (size_t i = 0; i < 4; i++)
+        header.start[i] = dfa->start[i];
+    header.trans_offset = align8(sizeof(header));
+    header.flags_offset = header.trans_offset + trans_size;
+    header.accel_offset = header.flags_offset + dfa->nstates;
+    const re_analysis_t *a = &dfa->analysis;
+    header.analysis_flags = (a->nullable? DFA_IMAGE_NULLABLE: 0) | (a->leading_any? DFA_IMAGE_LEADING_ANY: 0) |
+        (a->trailing_any? DFA_IMAGE_TRAILING_ANY: 0);
+    header.min_len = a->min_len;
+    header.max_len = a->max_len;
+    header.literals_offset = header.accel_offset + accel_size;
+    header.prefix_len = a->prefix.len;
+    header.suffix_len = a->suffix.len;
+    header.required_len = a->required.len;
+    header.pattern_offset = header.literals_offset + a->prefix.len + a->suffix.len + a->required.len;
+    header.pattern_len = pattern_len;
+    header.size = header.pattern_offset + pattern_len + 1;
+    memcpy(header.byte_classes, dfa->byte_classes, 256);
+
+    uint8_t *buf = re_calloc(1, header.size);
+    if (buf == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    memcpy(buf + header.trans_offset, dfa->trans, trans_size);
+    memcpy(buf + header.flags_offset, dfa->flags, dfa->nstates);
+    memcpy(buf + header.accel_offset, dfa->accel, accel_size);
+    uint8_t *literals = buf + header.literals_offset;
+    if (a->prefix.len)
+        memcpy(literals, a->prefix.bytes, a->prefix.len);
+    if (a->suffix.len)
+        memcpy(literals + a->prefix.len, a->suffix.bytes, a->suffix.len);
+    if (a->required.len)
+        memcpy(literals + a->prefix.len + a->suffix.len, a->required.bytes, a->required.len);
+    memcpy(buf + header.pattern_offset, pattern, pattern_len + 1);
+    header.checksum = image_checksum(buf + sizeof(header), header.size - sizeof(header));
+    memcpy(buf, &header, sizeof(header));
+    dense_dfa_free(dfa);
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        re_free(buf);
+        return -1;
+    }
+    size_t written = fwrite(buf, 1, header.size, f);
+    re_free(buf);
+    if (fclose(f) != 0 || written != header.size)
+        return -1;
+    return 0;
+}
+
+static int
+validate_header(const dfa_image_header *header, size_t size)
+{
+    if (memcmp(header->magic, DFA_IMAGE_MAGIC, sizeof(header->magic)) != 0)
+        return 0;
+    if (header->version != DFA_IMAGE_VERSION || header->byte_order != DFA_IMAGE_BYTE_ORDER)
+        return 0;
+    if (header->size != size || header->nclasses == 0 || header->nclasses > 256 || header->nstates == 0)
+        return 0;
+    for (size_t i = 0; i < 4; i++) {
+        if (header->start[i] >= header->nstates)
+            return 0;
+    }
+    if (header->trans_offset < sizeof(*header) || header->trans_offset % sizeof(uint32_t) ||
+        header->flags_offset != header->trans_offset + (uint64_t) header->nstates * header->nclasses * sizeof(uint32_t) ||
+        header->accel_offset != header->flags_offset + header->nstates ||
+        header->literals_offset != header->accel_offset + (uint64_t) header->nstates * (DENSE_DFA_ACCEL_MAX + 1) ||
+        header->prefix_len > size || header->suffix_len > size || header->required_len > size ||
+        header->pattern_offset != header->literals_offset + header->prefix_len + header->suffix_len +
+        header->required_len ||
+        header->pattern_offset + header->pattern_len + 1 != size)
+        return 0;
+    for (size_t i = 0; i < 256; i++) {
+        if (header->byte_classes[i] >= header->nclasses)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * The checksum only catches accidental damage. Every state and class a
+ * match can index with has to be in range too, or a crafted image would
+ * make the DFA read outside the mapping.
+ */
+static int
+validate_tables(const dfa_image_header *header, const uint8_t *data)
+{
+    const uint32_t *trans = (const uint32_t *) (data + header->trans_offset);
+    const uint8_t *accel = data + header->accel_offset;
+    for (size_t i = 0; i < (size_t) header->nstates * header->nclasses; i++) {
+        if (trans[i] >= header->nstates)
+            return 0;
+    }
+    for (size_t i = 0; i < header->nstates; i++) {
+        if (accel[i * (DENSE_DFA_ACCEL_MAX + 1)] > DENSE_DFA_ACCEL_MAX)
+            return 0;
+    }
+    return data[header->pattern_offset + header->pattern_len] == '\0';
+}
+
+/*
+ * Maps the image at path read only. The mapping is shared, so processes
+ * loading the same file share its pages. Returns NULL if the file can't be
+ * read or is not a valid image, including one with a state, a byte class
+ * or an accel entry out of range.
+ */
+dfa_image_t *
+dfa_image_load(const char *path)
+{
+    struct stat sb;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &sb) == -1 || (size_t) sb.st_size < sizeof(dfa_image_header)) {
+        close(fd);
+        return NULL;
+    }
+    void *base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    const dfa_image_header *header = (const dfa_image_header *) base;
+    const uint8_t *data = (const uint8_t *) base;
+    if (!validate_header(header, sb.st_size) || !validate_tables(header, data) ||
+        image_checksum(data + sizeof(*header), sb.st_size - sizeof(*header)) != header->checksum) {
+        munmap(base, sb.st_size);
+        return NULL;
+    }
+
+    dfa_image_t *image = re_malloc(sizeof(*image));
+    if (image == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    image->base = base;
+    image->size = sb.st_size;
+    image->header = header;
+    image->pattern = (const char *) (data + header->pattern_offset);
+    image->dfa.trans = (const uint32_t *) (data + header->trans_offset);
+    image->dfa.flags = data + header->flags_offset;
+    image->dfa.accel = data + header->accel_offset;
+    image->dfa.nstates = header->nstates;
+    image->dfa.nclasses = header->nclasses;
+    for (size_t i = 0; i < 4; i++)
+        image->dfa.start[i] = header->start[i];
+    memcpy(image->dfa.byte_classes, header->byte_classes, 256);
+    re_analysis_t *a = &image->dfa.analysis;
+    uint8_t *literals = (uint8_t *) (data + header->literals_offset);
+    a->min_len = header->min_len;
+    a->max_len = header->max_len;
+    a->nullable = (header->analysis_flags & DFA_IMAGE_NULLABLE) != 0;
+    a->leading_any = (header->analysis_flags & DFA_IMAGE_LEADING_ANY) != 0;
+    a->trailing_any = (header->analysis_flags & DFA_IMAGE_TRAILING_ANY) != 0;
+    a->prefix.bytes = header->prefix_len? literals: NULL;
+    a->prefix.len = header->prefix_len;
+    a->suffix.bytes = header->suffix_len? literals + header->prefix_len: NULL;
+    a->suffix.len = header->suffix_len;
+    a->required.bytes = header->required_len? literals + header->prefix_len + header->suffix_len: NULL;
+    a->required.len = header->required_len;
+    image->dfa.owned = 0;
+    RE_STATS_DO(image->dfa.stats = NULL);
+    return image;
+}
+
+int
+dfa_image_match(dfa_image_t *image, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    return dense_dfa_match(&image->dfa, string, len, mode, match);
+}
+
+void
+dfa_image_free(dfa_image_t *image)
+{
+    munmap(image->base, image->size);
+    re_free(image);
+}
@@ -0,0 +1,96 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef DFA_IMAGE_H
+#define DFA_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dense_dfa.h"
+#include "dfa.h"
+#include "nfa_executor.h"
+
+#define DFA_IMAGE_MAGIC "REDFA\0\0\0"
+#define DFA_IMAGE_VERSION 5
+#define DFA_IMAGE_BYTE_ORDER 0x01020304
+
+/* dfa_image_header.analysis_flags */
+#define DFA_IMAGE_NULLABLE 0x1
+#define DFA_IMAGE_LEADING_ANY 0x2
+#define DFA_IMAGE_TRAILING_ANY 0x4
+
+/*
+ * On disk layout of a minimized DFA. The header is followed by the
+ * transition table (nstates * nclasses uint32_t), the state flags (nstates
+ * bytes), the accel table (nstates * (DENSE_DFA_ACCEL_MAX + 1) bytes), the
+ * prefix, suffix and required string of the analysis of the pattern, back to
+ * back, and the pattern the DFA was built from. All the sections are
+ * referred to by their offset from the start of the file, so the image can
+ * be used from wherever it is mapped without any fix-ups. The checksum
+ * covers everything after the header.
+ */
+typedef struct dfa_image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;
+    uint64_t checksum;
+    uint32_t nstates;
+    uint32_t nclasses;
+    uint32_t start[4]; // as in dense_dfa_t
+    uint32_t analysis_flags;
+    uint32_t reserved;
+    uint64_t min_len;
+    uint64_t max_len;
+    uint64_t trans_offset;
+    uint64_t flags_offset;
+    uint64_t accel_offset;
+    uint64_t literals_offset;
+    uint64_t prefix_len;
+    uint64_t suffix_len;
+    uint64_t required_len;
+    uint64_t pattern_offset;
+    uint64_t pattern_len;
+    uint8_t byte_classes[256];
+} dfa_image_header;
+
+typedef struct dfa_image_t {
+    void *base;
+    size_t size;
+    const dfa_image_header *header;
+    const char *pattern;
+    dense_dfa_t dfa; // tables point into the mapping
+} dfa_image_t;
+
+int dfa_image_write(dfa_t *, const char *, const char *);
+dfa_image_t *dfa_image_load(const char *);
+int dfa_image_match(dfa_image_t *, const char *, size_t, match_mode_t, match_t *);
+void dfa_image_free(dfa_image_t *);
+#endif
@@ -0,0 +1,412 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/mman.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dense_dfa.h"
+#include "dfa.h"
+#include "dfa_jit.h"
+
+/*
+ * The DFA is compiled into two copies of straight line x86-64 code, one
+ * basic block per state. The first copy returns as soon as an accepting
+ * state is entered (MATCH_PREFIX and MATCH_ANY), the second one only checks
+ * for acceptance at the end of the input (MATCH_FULL). Every block checks
+ * for the end of the input, loads the next byte and dispatches on it with
+ * compares and jumps over the byte ranges going to the same state, so there
+ * is no table lookup left. Transitions to the dead state jump to a shared
+ * block returning NULL. The generated functions follow the System V ABI,
+ * p in rdi and end in rsi, and use no stack.
+ */
+
+#define JIT_VARIANTS 2
+#define JIT_MAX_EXCEPTIONS 6
+#define EARLY_ACCEPT 0
+#define FULL_MATCH 1
+
+typedef struct code_buf {
+    uint8_t *code;
+    size_t len;
+    size_t size;
+} code_buf;
+
+typedef struct jit_patch {
+    size_t at; // offset of a rel32 operand
+    size_t label;
+} jit_patch;
+
+typedef struct jit_compiler {
+    code_buf buf;
+    jit_patch *patches;
+    size_t npatches;
+    size_t patches_size;
+    size_t *labels;
+    dense_dfa_t *dfa;
+} jit_compiler;
+
+typedef struct byte_range {
+    uint8_t hi;
+    uint32_t target;
+} byte_range;
+
+#define state_label(jc, variant, state) ((variant) * (jc)->dfa->nstates + (state))
+#define fail_label(jc) (JIT_VARIANTS * (jc)->dfa->nstates)
+
+static void
+emit(jit_compiler *jc, const uint8_t *bytes, size_t n)
+{
+    code_buf *buf = &jc->buf;
+    if (buf->len + n > buf->size) {
+        buf->size = (buf->len + n) * 2;
+        buf->code = re_realloc(buf->code, buf->size);
+        if (buf->code == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+    }
+    memcpy(buf->code + buf->len, bytes, n);
+    buf->len += n;
+}
+
+#define EMIT(jc, ...) do { \
+    const uint8_t bytes[] = {__VA_ARGS__}; \
+    emit(jc, bytes, sizeof(bytes)); \
+    } while (0)
+
+static void
+emit_rel32(jit_compiler *jc, uint32_t value)
+{
+    emit(jc, (const uint8_t *) &value, sizeof(value));
+}
+
+/*
+ * Emits the rel32 operand of a jump to label, resolved once all the labels
+ * are known.
+ */
+static void
+emit_label_ref(jit_compiler *jc, size_t label)
+{
+    if (jc->npatches == jc->patches_size) {
+        jc->patches_size = jc->patches_size? jc->patches_size * 2: 256;
+        jc->patches = re_reallocarray(jc->patches, jc->patches_size, sizeof(*jc->patches));
+        if (jc->patches == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+    }
+    jc->patches[jc->npatches].at = jc->buf.len;
+    jc->patches[jc->npatches++].label = label;
+    emit_rel32(jc, 0);
+}
+
+static void
+patch_rel32(jit_compiler *jc, size_t at, size_t target)
+{
+    int32_t rel = (int32_t) (target - (at + 4));
+    memcpy(jc->buf.code + at, &rel, sizeof(rel));
+}
+
+static size_t
+target_label(jit_compiler *jc, size_t variant, uint32_t state)
+{
+    return state == DFA_DEAD_STATE? fail_label(jc): state_label(jc, variant, state);
+}
+
+static void
+emit_dispatch(jit_compiler *jc, size_t variant, byte_range *ranges, size_t lo, size_t hi)
+{
+    if (hi - lo < 3) {
+        for (size_t i = lo; i < hi; i++) {
+            EMIT(jc, 0x3c, ranges[i].hi); // cmp al, hi
+            EMIT(jc, 0x0f, 0x86); // jbe target
+            emit_label_ref(jc, target_label(jc, variant, ranges[i].target));
+        }
+        EMIT(jc, 0xe9); // jmp target
+        emit_label_ref(jc, target_label(jc, variant, ranges[hi].target));
+        return;
+    }
+    size_t mid = (lo + hi) / 2;
+    EMIT(jc, 0x3c, ranges[mid].hi); // cmp al, hi
+    EMIT(jc, 0x0f, 0x87); // ja upper half
+    size_t at = jc->buf.len;
+    emit_rel32(jc, 0);
+    emit_dispatch(jc, variant, ranges, lo, mid);
+    patch_rel32(jc, at, jc->buf.len);
+    emit_dispatch(jc, variant, ranges, mid + 1, hi);
+}
+
+/*
+ * Most states send nearly every byte to the same state, such as back to
+ * the start of the pattern. When only a few ranges go elsewhere they are
+ * tested one by one and the common target is the fall through, so that on
+ * typical input every branch is predicted as not taken.
+ */
+static int
+emit_exceptions(jit_compiler *jc, size_t variant, byte_range *ranges, size_t nranges)
+{
+    size_t counts[256] = {0};
+    uint32_t targets[256];
+    size_t ntargets = 0, best = 0, lo = 0, nexceptions = 0;
+
+    for (size_t i = 0; i < nranges; i++) {
+        size_t t;
+        for (t = 0; t < ntargets && targets[t] != ranges[i].target; t++)
+            ;
+        if (t == ntargets)
+            targets[ntargets++] = ranges[i].target;
+        counts[t] += ranges[i].hi - lo + 1;
+        if (counts[t] > counts[best])
+            best = t;
+        lo = ranges[i].hi + 1;
+    }
+    for (size_t i = 0; i < nranges; i++) {
+        if (ranges[i].target != targets[best])
+            nexceptions++;
+    }
+    if (nexceptions > JIT_MAX_EXCEPTIONS)
+        return 0;
+
+    lo = 0;
+    for (size_t i = 0; i < nranges; i++) {
+        if (ranges[i].target != targets[best]) {
+            if (lo == ranges[i].hi) {
+                EMIT(jc, 0x3c, lo); // cmp al, lo
+                EMIT(jc, 0x0f, 0x84); // je target
+            } else {
+                EMIT(jc, 0x8d, 0x88); // lea ecx, [rax - lo]
+                emit_rel32(jc, (uint32_t) -lo);
+                EMIT(jc, 0x81, 0xf9); // cmp ecx, hi - lo
+                emit_rel32(jc, ranges[i].hi - lo);
+                EMIT(jc, 0x0f, 0x86); // jbe target
+            }
+            emit_label_ref(jc, target_label(jc, variant, ranges[i].target));
+        }
+        lo = ranges[i].hi + 1;
+    }
+    EMIT(jc, 0xe9); // jmp common target
+    emit_label_ref(jc, target_label(jc, variant, targets[best]));
+    return 1;
+}
+
+static void
+emit_state(jit_compiler *jc, size_t variant, uint32_t state)
+{
+    dense_dfa_t *dfa = jc->dfa;
+    int accepting = dfa->flags[state] & DFA_ACCEPTING;
+    byte_range ranges[256];
+    size_t nranges = 0;
+
+    jc->labels[state_label(jc, variant, state)] = jc->buf.len;
+    if (state == DFA_DEAD_STATE) {
+        EMIT(jc, 0xe9); // jmp fail
+        emit_label_ref(jc, fail_label(jc));
+        return;
+    }
+    if (variant == EARLY_ACCEPT && accepting) {
+        EMIT(jc, 0x48, 0x89, 0xf8); // mov rax, rdi
+        EMIT(jc, 0xc3); // ret
+        return;
+    }
+    EMIT(jc, 0x48, 0x39, 0xf7); // cmp rdi, rsi
+    if (variant == FULL_MATCH && accepting) {
+        EMIT(jc, 0x72, 0x04); // jb over the end of input case
+        EMIT(jc, 0x48, 0x89, 0xf8); // mov rax, rdi
+        EMIT(jc, 0xc3); // ret
+    } else {
+        EMIT(jc, 0x72, 0x03); // jb over the end of input case
+        EMIT(jc, 0x31, 0xc0); // xor eax, eax
+        EMIT(jc, 0xc3); // ret
+    }
+    EMIT(jc, 0x0f, 0xb6, 0x07); // movzx eax, byte [rdi]
+    EMIT(jc, 0x48, 0xff, 0xc7); // inc rdi
+
+    for (size_t c = 0; c < 256; c++) {
+        uint32_t target = dense_dfa_next(dfa, state, c);
+        if (nranges && ranges[nranges - 1].target == target)
+            ranges[nranges - 1].hi = c;
+        else {
+            ranges[nranges].hi = c;
+            ranges[nranges++].target = target;
+        }
+    }
+    if (!emit_exceptions(jc, variant, ranges, nranges))
+        emit_dispatch(jc, variant, ranges, 0, nranges - 1);
+}
+
+static void *
+map_code(code_buf *buf)
+{
+#if defined(__x86_64__)
+    void *code = mmap(NULL, buf->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return NULL;
+    memcpy(code, buf->code, buf->len);
+    if (mprotect(code, buf->len, PROT_READ | PROT_EXEC) == -1) {
+        munmap(code, buf->len);
+        return NULL;
+    }
+    return code;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * Compiles the DFA to native code. If it has too many states, has states
+ * which accept depending on the byte after them (from `$`, `\b` or `\B`) or
+ * the code can't be mapped executable, the returned dfa_jit_t has no code
+ * and dfa_jit_match falls back to the table executor. The DFA has to
+ * outlive the dfa_jit_t.
+ */
+dfa_jit_t *
+dfa_jit_compile(dense_dfa_t *dfa)
+{
+    dfa_jit_t *jit;
+    jit = re_calloc(1, sizeof(*jit));
+    if (jit == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    jit->dfa = dfa;
+    if (dfa->nstates > DFA_JIT_MAX_STATES)
+        return jit;
+    for (uint32_t state = 0; state < dfa->nstates; state++) {
+        if (dfa->flags[state] & DFA_CONDITIONAL)
+            return jit;
+    }
+
+    jit_compiler jc;
+    memset(&jc, 0, sizeof(jc));
+    jc.dfa = dfa;
+    jc.labels = re_malloc((JIT_VARIANTS * dfa->nstates + 1) * sizeof(size_t));
+    if (jc.labels == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    for (size_t variant = 0; variant < JIT_VARIANTS; variant++) {
+        for (uint32_t state = 0; state < dfa->nstates; state++)
+            emit_state(&jc, variant, state);
+    }
+    jc.labels[fail_label(&jc)] = jc.buf.len;
+    EMIT(&jc, 0x31, 0xc0); // xor eax, eax
+    EMIT(&jc, 0xc3); // ret
+    for (size_t i = 0; i < jc.npatches; i++)
+        patch_rel32(&jc, jc.patches[i].at, jc.labels[jc.patches[i].label]);
+
+    jit->code = map_code(&jc.buf);
+    if (jit->code) {
+        uint8_t *code = (uint8_t *) jit->code;
+        jit->code_size = jc.buf.len;
+        jit->full = (dfa_jit_fn) (code + jc.labels[state_label(&jc, FULL_MATCH, dfa->start[0])]);
+        jit->prefix = (dfa_jit_fn) (code + jc.labels[state_label(&jc, EARLY_ACCEPT, dfa->start[0])]);
+        jit->any = (dfa_jit_fn) (code + jc.labels[state_label(&jc, EARLY_ACCEPT, dfa->start[1])]);
+    }
+    re_free(jc.buf.code);
+    re_free(jc.patches);
+    re_free(jc.labels);
+    return jit;
+}
+
+#ifdef RE_STATS
+/*
+ * The generated code does not say where it gave up, so a failed match is
+ * counted as having scanned all of the input.
+ */
+static void
+record_match(dfa_jit_t *jit, size_t steps)
+{
+    re_match_stats_t m = {0};
+    m.bytes_scanned = steps;
+    m.steps = steps;
+    m.prefilter_candidates = jit->dfa->analysis.required.len != 0;
+    if (jit->dfa->stats)
+        re_stats_add(jit->dfa->stats, RE_ENGINE_JIT, &m);
+}
+#endif
+
+/*
+ * Same semantics as nfa_match. MATCH_SEARCH uses the generated code to find
+ * where the earliest match ends and the table executor for the offsets of
+ * the leftmost longest one, which starts before that. What the analysis of
+ * the pattern can answer is answered without running it.
+ */
+int
+dfa_jit_match(dfa_jit_t *jit, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    const uint8_t *p = (const uint8_t *) string;
+    const uint8_t *end;
+    if (jit->code == NULL)
+        return dense_dfa_match(jit->dfa, string, len, mode, match);
+    const re_analysis_t *a = &jit->dfa->analysis;
+    int ret = match_precheck(a, string, len, mode, match);
+    if (ret != -1) {
+        RE_STATS_DO(if (jit->dfa->stats) re_stats_add_prefiltered(jit->dfa->stats, RE_ENGINE_JIT, len));
+        return ret;
+    }
+
+    switch (core_mode(a, mode)) {
+    case MATCH_FULL:
+        end = jit->full(p, p + len);
+        RE_STATS_DO(record_match(jit, end? (size_t) (end - p): len));
+        if (end == NULL)
+            return 0;
+        if (match) {
+            match->start = 0;
+            match->end = len;
+        }
+        return 1;
+    case MATCH_PREFIX:
+        end = jit->prefix(p, p + len);
+        RE_STATS_DO(record_match(jit, end? (size_t) (end - p): len));
+        if (end == NULL)
+            return 0;
+        if (match) {
+            match->start = 0;
+            match->end = end - p;
+        }
+        return extend_match(a, 1, len, mode, match);
+    case MATCH_ANY:
+        end = jit->any(p, p + len);
+        RE_STATS_DO(record_match(jit, end? (size_t) (end - p): len));
+        return end != NULL;
+    case MATCH_SEARCH:
+        end = jit->any(p, p + len);
+        RE_STATS_DO(record_match(jit, end? (size_t) (end - p): len));
+        if (end == NULL)
+            return 0;
+        if (match)
+            dense_dfa_leftmost_longest(jit->dfa, string, len, end - p, match);
+        return extend_match(a, 1, len, mode, match);
+    }
+    return 0;
+}
+
+void
+dfa_jit_free(dfa_jit_t *jit)
+{
+    if (jit->code)
+        munmap(jit->code, jit->code_size);
+    re_free(jit);
+}
@@ -0,0 +1,60 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef DFA_JIT_H
+#define DFA_JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dense_dfa.h"
+#include "nfa_executor.h"
+
+// DFAs with more states than this are run by the table executor
+#define DFA_JIT_MAX_STATES 1024
+
+/*
+ * Generated code for a DFA run from p to end. Returns the position where the
+ * match ended, or NULL if there is no match.
+ */
+typedef const uint8_t * (*dfa_jit_fn) (const uint8_t *, const uint8_t *);
+
+typedef struct dfa_jit_t {
+    dense_dfa_t *dfa;
+    void *code; // NULL if the DFA could not be compiled to native code
+    size_t code_size;
+    dfa_jit_fn full; // anchored, runs to the end of the input
+    dfa_jit_fn prefix; // anchored, returns at the first accepting state
+    dfa_jit_fn any; // unanchored, returns at the first accepting state
+} dfa_jit_t;
+
+dfa_jit_t *dfa_jit_compile(dense_dfa_t *);
+int dfa_jit_match(dfa_jit_t *, const char *, size_t, match_mode_t, match_t *);
+void dfa_jit_free(dfa_jit_t *);
+#endif
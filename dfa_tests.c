@@ -0,0 +1,961 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dense_dfa.h"
+#include "dfa.h"
+#include "dfa_image.h"
+#include "dfa_jit.h"
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "re_memory.h"
+#include "re_meta.h"
+#include "re_utils.h"
+#include "shared_dfa.h"
+#include "test_utils.h"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+#define NTHREADS 8
+#define NSHARED_MATCHES 2000
+
+static void
+test_byte_classes(void)
+{
+    typedef struct test_input {
+        const char *regex;
+        size_t nclasses;
+        const char *same; // bytes expected to share one class
+        const char *different; // bytes expected to be in different classes
+    } test_input;
+
+    test_input tests[] = {
+        {"a", 2, "bcz", "ab"},
+        {".*", 1, "ab\x01\xfe", ""},
+        {"[a-z]+x", 3, "abw", "ax!"},
+        {"[a-e]?[1-4]+[ab]", 4, "cde", "ac1!"},
+        {"[0-9]+[0-9]", 2, "0189", "0a"}
+    };
+
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        test_input t = tests[i];
+        printf("Testing byte classes of %s---", t.regex);
+        nfa_machine_t *machine = compile_regex(t.regex);
+        test(machine->nclasses == t.nclasses, ANSI_COLOR_RED "expected %zu classes, got %zu\n" ANSI_COLOR_RESET,
+            t.nclasses, machine->nclasses);
+        for (size_t j = 1; t.same[j]; j++)
+            test(machine->byte_classes[(uint8_t) t.same[j]] == machine->byte_classes[(uint8_t) t.same[0]],
+                ANSI_COLOR_RED "expected %c and %c in the same class\n" ANSI_COLOR_RESET, t.same[0], t.same[j]);
+        for (size_t j = 0; t.different[j]; j++) {
+            for (size_t k = j + 1; t.different[k]; k++)
+                test(machine->byte_classes[(uint8_t) t.different[j]] != machine->byte_classes[(uint8_t) t.different[k]],
+                    ANSI_COLOR_RED "expected %c and %c in different classes\n" ANSI_COLOR_RESET,
+                    t.different[j], t.different[k]);
+        }
+        free_nfa(machine);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+}
+
+/*
+ * Runs every pattern against every input in all the match modes through
+ * both the NFA and the DFA and checks that they agree. A small cache size
+ * forces the DFA to flush its states in the middle of a scan.
+ */
+static void
+test_dfa_matches_nfa(size_t cache_size)
+{
+    const char *patterns[] = {
+        "a*", "a+", "a?a?aa", "(ab|c)+", "((ab|cd)+)12", "ab|cd",
+        "(a|b|c|d|e)?(1|2|3|4)+(a|b)", "a+b+c+de", ".+a.b", ".*a.*",
+        ".*[0-9]?[0-9]?[a-z]+", "[]abc]", "(a*)*b", "a?b", "[a-c]+x?[0-9]"
+    };
+    const char *inputs[] = {
+        "", "a", "aa", "ab", "ba", "b", "aba", "abc12", "cd12", "ab12",
+        "a1a", "e2a", "1b", "aabcde", "123aabcde", "1a2b", "aaab",
+        "+91ab", "+91", "]", "xxaab", "cab7", "zzzz9ab3"
+    };
+    static const char *mode_names[] = {"full", "prefix", "search", "any"};
+
+    printf("Testing DFA against NFA with cache size %zu---", cache_size);
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+        nfa_machine_t *machine = compile_regex(patterns[i]);
+        dfa_t *dfa = dfa_init(machine, cache_size);
+        for (size_t j = 0; j < sizeof(inputs)/sizeof(inputs[0]); j++) {
+            for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+                match_t nfa_m = {0, 0}, dfa_m = {0, 0};
+                size_t len = strlen(inputs[j]);
+                int expected = nfa_match(machine, inputs[j], len, mode, &nfa_m);
+                int actual = dfa_match(dfa, inputs[j], len, mode, &dfa_m);
+                test(expected == actual && nfa_m.start == dfa_m.start && nfa_m.end == dfa_m.end,
+                    ANSI_COLOR_RED "failed for input %s: %s in %s mode\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode_names[mode]);
+            }
+        }
+        dfa_free(dfa);
+        free_nfa(machine);
+    }
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+/*
+ * Rewrites the image at path with the byte at offset set to c and the
+ * checksum fixed up, as a crafted image would have it.
+ */
+static void
+craft_image(const char *path, size_t offset, uint8_t c)
+{
+    FILE *f = fopen(path, "r+b");
+    test(f != NULL, ANSI_COLOR_RED "failed to open image\n" ANSI_COLOR_RESET);
+    fseek(f, 0, SEEK_END);
+    size_t size = ftell(f);
+    uint8_t *buf = malloc(size);
+    rewind(f);
+    test(buf != NULL && fread(buf, 1, size, f) == size, ANSI_COLOR_RED "failed to read image\n" ANSI_COLOR_RESET);
+    buf[offset] = c;
+    uint64_t hash = 14695981039346656037UL;
+    for (size_t i = sizeof(dfa_image_header); i < size; i++) {
+        hash ^= buf[i];
+        hash *= 1099511628211UL;
+    }
+    memcpy(buf + offsetof(dfa_image_header, checksum), &hash, sizeof(hash));
+    rewind(f);
+    fwrite(buf, 1, size, f);
+    fclose(f);
+    free(buf);
+}
+
+/*
+ * Writes the DFA of every pattern out as an image, loads it back and checks
+ * it against the NFA. Also checks that a corrupted image is rejected.
+ */
+static void
+test_dfa_image(void)
+{
+    const char *patterns[] = {
+        "a*", "a+", "(ab|c)+", "((ab|cd)+)12", "(a|b|c|d|e)?(1|2|3|4)+(a|b)",
+        ".+a.b", ".*[0-9]?[0-9]?[a-z]+", "b|abc", "[0-9]+", "[a-z]+@corp\\.example\\.com"
+    };
+    const char *inputs[] = {
+        "", "a", "aa", "ab", "ba", "abc12", "cd12", "xcd12", "a1a", "e2a",
+        "1a2b", "+91ab", "+91", "id=1234;", "xabc", "to: bob@corp.example.com", "@corp.example.com"
+    };
+    char path[] = "/tmp/dfa_image_testXXXXXX";
+    int fd = mkstemp(path);
+    test(fd != -1, ANSI_COLOR_RED "mkstemp failed\n" ANSI_COLOR_RESET);
+    close(fd);
+
+    printf("Testing DFA images---");
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+        nfa_machine_t *machine = compile_regex(patterns[i]);
+        dfa_t *dfa = dfa_init(machine, 0);
+        test(dfa_image_write(dfa, patterns[i], path) == 0,
+            ANSI_COLOR_RED "failed to write image for %s\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_image_t *image = dfa_image_load(path);
+        test(image != NULL, ANSI_COLOR_RED "failed to load image for %s\n" ANSI_COLOR_RESET, patterns[i]);
+        test(strcmp(image->pattern, patterns[i]) == 0, ANSI_COLOR_RED "wrong pattern in image\n" ANSI_COLOR_RESET);
+        for (size_t j = 0; j < sizeof(inputs)/sizeof(inputs[0]); j++) {
+            for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+                match_t nfa_m = {0, 0}, image_m = {0, 0};
+                size_t len = strlen(inputs[j]);
+                int expected = nfa_match(machine, inputs[j], len, mode, &nfa_m);
+                int actual = dfa_image_match(image, inputs[j], len, mode, &image_m);
+                test(expected == actual && nfa_m.start == image_m.start && nfa_m.end == image_m.end,
+                    ANSI_COLOR_RED "image failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+            }
+        }
+        dfa_image_free(image);
+        dfa_free(dfa);
+        free_nfa(machine);
+    }
+
+    FILE *f = fopen(path, "r+b");
+    test(f != NULL, ANSI_COLOR_RED "failed to open image\n" ANSI_COLOR_RESET);
+    fseek(f, -2, SEEK_END);
+    fputc('!', f);
+    fclose(f);
+    test(dfa_image_load(path) == NULL, ANSI_COLOR_RED "corrupted image was loaded\n" ANSI_COLOR_RESET);
+
+    // images with a valid checksum but a table out of range
+    nfa_machine_t *machine = compile_regex("(ab|c)+");
+    dfa_t *dfa = dfa_init(machine, 0);
+    test(dfa_image_write(dfa, "(ab|c)+", path) == 0, ANSI_COLOR_RED "failed to write image\n" ANSI_COLOR_RESET);
+    dfa_image_t *image = dfa_image_load(path);
+    test(image != NULL, ANSI_COLOR_RED "failed to load image\n" ANSI_COLOR_RESET);
+    dfa_image_header header = *image->header;
+    dfa_image_free(image);
+    struct {
+        const char *what;
+        size_t offset;
+        uint8_t c;
+    } crafted[] = {
+        {"a transition", header.trans_offset + sizeof(uint32_t) * (header.nclasses + 1), header.nstates},
+        {"a transition", header.trans_offset + sizeof(uint32_t) * (header.nclasses * header.nstates - 1), 0xff},
+        {"a byte class", offsetof(dfa_image_header, byte_classes) + 'a', header.nclasses},
+        {"an accel entry", header.accel_offset + DENSE_DFA_ACCEL_MAX + 1, DENSE_DFA_ACCEL_MAX + 1},
+        {"the pattern", header.size - 1, 'x'},
+        {"a start state", offsetof(dfa_image_header, start) + sizeof(uint32_t), header.nstates},
+    };
+    for (size_t i = 0; i < sizeof(crafted)/sizeof(crafted[0]); i++) {
+        test(dfa_image_write(dfa, "(ab|c)+", path) == 0, ANSI_COLOR_RED "failed to write image\n" ANSI_COLOR_RESET);
+        craft_image(path, crafted[i].offset, crafted[i].c);
+        test(dfa_image_load(path) == NULL, ANSI_COLOR_RED "image with %s out of range was loaded\n" ANSI_COLOR_RESET,
+            crafted[i].what);
+    }
+    dfa_free(dfa);
+    free_nfa(machine);
+    unlink(path);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+/*
+ * Checks the minimized DFA and the code generated from it against the NFA.
+ */
+static void
+test_minimized_dfa_and_jit(void)
+{
+    const char *patterns[] = {
+        "a*", "a+", "(ab|c)+", "((ab|cd)+)12", "(a|b|c|d|e)?(1|2|3|4)+(a|b)",
+        ".+a.b", ".*[0-9]?[0-9]?[a-z]+", "b|abc", "[0-9]+", "(a|b)*abb",
+        "[a-z]+ing", "a+b+c+de", ".*", "[^a-z]+", "\\d+\\.\\d*", "\\W\\w", "[[:alpha:]]+[^[:alnum:]]"
+    };
+    const char *inputs[] = {
+        "", "a", "aa", "ab", "ba", "abc12", "cd12", "xcd12", "a1a", "e2a",
+        "1a2b", "+91ab", "+91", "id=1234;", "xabc", "ababb", "babba",
+        "singing", "ing", "aabcde", "\xff\x80z", "12.5", "3.", "a.b", "\xfe" "ab", "x+y", "ab\xfe"
+    };
+
+    printf("Testing minimized DFA and JIT---");
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+        nfa_machine_t *machine = compile_regex(patterns[i]);
+        dfa_t *dfa = dfa_init(machine, 0);
+        dense_dfa_t *dense = dfa_minimize(dfa);
+        test(dense != NULL, ANSI_COLOR_RED "failed to minimize %s\n" ANSI_COLOR_RESET, patterns[i]);
+        test(dense->nstates <= dfa->nstates, ANSI_COLOR_RED "minimized DFA of %s is bigger\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_jit_t *jit = dfa_jit_compile(dense);
+#if defined(__x86_64__)
+        test(jit->code != NULL, ANSI_COLOR_RED "failed to generate code for %s\n" ANSI_COLOR_RESET, patterns[i]);
+#endif
+        for (size_t j = 0; j < sizeof(inputs)/sizeof(inputs[0]); j++) {
+            for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+                match_t nfa_m = {0, 0}, dense_m = {0, 0}, jit_m = {0, 0};
+                size_t len = strlen(inputs[j]);
+                int expected = nfa_match(machine, inputs[j], len, mode, &nfa_m);
+                int dense_result = dense_dfa_match(dense, inputs[j], len, mode, &dense_m);
+                int jit_result = dfa_jit_match(jit, inputs[j], len, mode, &jit_m);
+                test(expected == dense_result && nfa_m.start == dense_m.start && nfa_m.end == dense_m.end,
+                    ANSI_COLOR_RED "minimized DFA failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+                test(expected == jit_result && nfa_m.start == jit_m.start && nfa_m.end == jit_m.end,
+                    ANSI_COLOR_RED "JIT failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+            }
+        }
+        dfa_jit_free(jit);
+        dense_dfa_free(dense);
+        dfa_free(dfa);
+        free_nfa(machine);
+    }
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+/*
+ * Runs UTF-8 patterns on every engine, including invalid and truncated
+ * sequences, and checks them against the NFA.
+ */
+static void
+test_utf8_engines(void)
+{
+    const char *patterns[] = {
+        ".", ".+", "x.*y", "[α-ω]+", "[a-zα-ωά-ώ]+s", "é+|€", "[😀-🙏]+.", "[^€]", "a.?b", "[α-ω]+$", "[^α-ω]+", "\\W+\\d"
+    };
+    const char *inputs[] = {
+        "", "a", "é", "É", "€", "😀", "xé€y", "XÉ€Y", "λόγος", "ΛΌΓΟΣ", "abγδe", "ééé€", "🙂🙂x", "x\x80y",
+        "\xff", "\xce", "\xed\xa0\x80", "\xf4\x90\x80\x80", "a\xc3" "b", "aéb", "[^€]"
+    };
+    re_compile_options_t options = {.flags = RE_UTF8};
+
+    printf("Testing UTF-8 patterns on all engines---");
+    for (size_t k = 0; k < 2 * sizeof(patterns)/sizeof(patterns[0]); k++) {
+        size_t i = k % (sizeof(patterns)/sizeof(patterns[0]));
+        // all of them once more with case folding
+        options.flags = k == i? RE_UTF8: RE_UTF8 | RE_ICASE;
+        nfa_machine_t *machine = compile_regex_with_options(patterns[i], &options, NULL);
+        test(machine != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_t *dfa = dfa_init(machine, 0);
+        dfa_t *lazy = dfa_init(machine, 0);
+        dense_dfa_t *dense = dfa_minimize(dfa);
+        test(dense != NULL, ANSI_COLOR_RED "failed to minimize %s\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_jit_t *jit = dfa_jit_compile(dense);
+        for (size_t j = 0; j < sizeof(inputs)/sizeof(inputs[0]); j++) {
+            for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+                match_t nfa_m = {0, 0}, lazy_m = {0, 0}, dense_m = {0, 0}, jit_m = {0, 0};
+                size_t len = strlen(inputs[j]);
+                int expected = nfa_match(machine, inputs[j], len, mode, &nfa_m);
+                int lazy_result = dfa_match(lazy, inputs[j], len, mode, &lazy_m);
+                int dense_result = dense_dfa_match(dense, inputs[j], len, mode, &dense_m);
+                int jit_result = dfa_jit_match(jit, inputs[j], len, mode, &jit_m);
+                test(expected == lazy_result && nfa_m.start == lazy_m.start && nfa_m.end == lazy_m.end,
+                    ANSI_COLOR_RED "lazy DFA failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+                test(expected == dense_result && nfa_m.start == dense_m.start && nfa_m.end == dense_m.end,
+                    ANSI_COLOR_RED "minimized DFA failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+                test(expected == jit_result && nfa_m.start == jit_m.start && nfa_m.end == jit_m.end,
+                    ANSI_COLOR_RED "JIT failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+            }
+        }
+        dfa_jit_free(jit);
+        dense_dfa_free(dense);
+        dfa_free(lazy);
+        dfa_free(dfa);
+        free_nfa(machine);
+    }
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+/*
+ * Assertions are resolved by the DFAs one byte late, the end anchored
+ * patterns also go through the reverse scan of the lazy DFA.
+ */
+static void
+test_assertion_engines(void)
+{
+    const char *patterns[] = {
+        "^ab", "ab$", "^$", "x$|y", "\\bfoo\\b", "a\\B", "\\B", "(^|,)b+", "[a-z]+\\b", "o*$",
+        "\\b(a|b)*\\b", "^a*$|b"
+    };
+    const char *inputs[] = {
+        "", "a", "ab", "abab", "xab", "y", "yx", "foo", "a foo", "foo.bar", "foobar", "aa b", "a,bb",
+        "bb,", "oo", "foo o", "ab ba", "_a"
+    };
+
+    printf("Testing assertions on all engines---");
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+        nfa_machine_t *machine = compile_regex(patterns[i]);
+        dfa_t *dfa = dfa_init(machine, 0);
+        dfa_t *lazy = dfa_init(machine, 0);
+        dense_dfa_t *dense = dfa_minimize(dfa);
+        test(dense != NULL, ANSI_COLOR_RED "failed to minimize %s\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_jit_t *jit = dfa_jit_compile(dense);
+        for (size_t j = 0; j < sizeof(inputs)/sizeof(inputs[0]); j++) {
+            for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+                match_t nfa_m = {0, 0}, lazy_m = {0, 0}, dense_m = {0, 0}, jit_m = {0, 0};
+                size_t len = strlen(inputs[j]);
+                int expected = nfa_match(machine, inputs[j], len, mode, &nfa_m);
+                int lazy_result = dfa_match(lazy, inputs[j], len, mode, &lazy_m);
+                int dense_result = dense_dfa_match(dense, inputs[j], len, mode, &dense_m);
+                int jit_result = dfa_jit_match(jit, inputs[j], len, mode, &jit_m);
+                test(expected == lazy_result && nfa_m.start == lazy_m.start && nfa_m.end == lazy_m.end,
+                    ANSI_COLOR_RED "lazy DFA failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+                test(expected == dense_result && nfa_m.start == dense_m.start && nfa_m.end == dense_m.end,
+                    ANSI_COLOR_RED "minimized DFA failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+                test(expected == jit_result && nfa_m.start == jit_m.start && nfa_m.end == jit_m.end,
+                    ANSI_COLOR_RED "JIT failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+            }
+        }
+        dfa_jit_free(jit);
+        dense_dfa_free(dense);
+        dfa_free(lazy);
+        dfa_free(dfa);
+        free_nfa(machine);
+    }
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+/*
+ * Checks that rejecting inputs without the required string of a pattern
+ * gives the same results on every engine as running the automaton.
+ */
+static void
+test_prefilter_engines(void)
+{
+    const char *patterns[] = {
+        "[a-z]+@corp\\.example\\.com", ".*session_id=[0-9]+", "(foobar|foobaz)+x", "a(bc)+d", "id\\b",
+        "x+yz$", "^GET /"
+    };
+    const char *inputs[] = {
+        "", "a", "bob@corp.example.com", "@corp.example.com", "bob@corp.example.co", "x session_id=42",
+        "session_id=", "foobarfoobazx", "foobax", "abcbcd", "ad", "id", "ids", "xxyz", "xyzz", "GET /",
+        "a GET /"
+    };
+
+    printf("Testing the required string prefilter on all engines---");
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+        nfa_machine_t *machine = compile_regex(patterns[i]);
+        test(machine->analysis.required.len > 0,
+            ANSI_COLOR_RED "no required string found for %s\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_t *dfa = dfa_init(machine, 0);
+        dense_dfa_t *dense = dfa_minimize(dfa);
+        test(dense != NULL, ANSI_COLOR_RED "failed to minimize %s\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_jit_t *jit = dfa_jit_compile(dense);
+        for (size_t j = 0; j < sizeof(inputs)/sizeof(inputs[0]); j++) {
+            for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+                match_t nfa_m = {0, 0}, lazy_m = {0, 0}, dense_m = {0, 0}, jit_m = {0, 0};
+                size_t len = strlen(inputs[j]);
+                int expected = nfa_match(machine, inputs[j], len, mode, &nfa_m);
+                int lazy_result = dfa_match(dfa, inputs[j], len, mode, &lazy_m);
+                int dense_result = dense_dfa_match(dense, inputs[j], len, mode, &dense_m);
+                int jit_result = dfa_jit_match(jit, inputs[j], len, mode, &jit_m);
+                test(expected == lazy_result && nfa_m.start == lazy_m.start && nfa_m.end == lazy_m.end,
+                    ANSI_COLOR_RED "lazy DFA failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+                test(expected == dense_result && nfa_m.start == dense_m.start && nfa_m.end == dense_m.end,
+                    ANSI_COLOR_RED "minimized DFA failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+                test(expected == jit_result && nfa_m.start == jit_m.start && nfa_m.end == jit_m.end,
+                    ANSI_COLOR_RED "JIT failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                    patterns[i], inputs[j], mode);
+            }
+        }
+        dfa_jit_free(jit);
+        dense_dfa_free(dense);
+        dfa_free(dfa);
+        free_nfa(machine);
+    }
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+/*
+ * Searches long inputs whose leftmost match starts long after the attempts
+ * from the earlier offsets die or only ends at the end, on every engine
+ * built from a dense DFA. Trying each start offset on its own takes
+ * minutes on these, a single pass a few milliseconds.
+ */
+static void
+test_long_search(void)
+{
+    const char *patterns[] = {"a*c|X", "(a|b)*abb", "a+$", "a*(b|X)", "\\ba+X", "\\Baa?X|aaab", "(aa|a)a(b|X)"};
+    const char tails[] = {'X', 'c', 'b', 'a'};
+    size_t n = 100000;
+    char *input = malloc(n + 2);
+    char path[] = "/tmp/dfa_long_testXXXXXX";
+    int fd = mkstemp(path);
+    test(input != NULL && fd != -1, ANSI_COLOR_RED "setup failed\n" ANSI_COLOR_RESET);
+    close(fd);
+
+    printf("Testing searches of long inputs---");
+    clock_t begin = clock();
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+        nfa_machine_t *machine = compile_regex(patterns[i]);
+        dfa_t *dfa = dfa_init(machine, 0);
+        dense_dfa_t *dense = dfa_minimize(dfa);
+        dfa_jit_t *jit = dfa_jit_compile(dense);
+        test(dfa_image_write(dfa, patterns[i], path) == 0,
+            ANSI_COLOR_RED "failed to write image for %s\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_image_t *image = dfa_image_load(path);
+        shared_dfa_t *shared = shared_dfa_init(machine, 0);
+        for (size_t j = 0; j < sizeof(tails); j++) {
+            memset(input, 'a', n);
+            input[n] = tails[j];
+            match_t nfa_m = {0, 0}, m[5];
+            memset(m, 0, sizeof(m));
+            int expected = nfa_match(machine, input, n + 1, MATCH_SEARCH, &nfa_m);
+            int results[5];
+            results[0] = dense_dfa_match(dense, input, n + 1, MATCH_SEARCH, &m[0]);
+            results[1] = dfa_jit_match(jit, input, n + 1, MATCH_SEARCH, &m[1]);
+            results[2] = dfa_image_match(image, input, n + 1, MATCH_SEARCH, &m[2]);
+            results[3] = dfa_match(dfa, input, n + 1, MATCH_SEARCH, &m[3]);
+            results[4] = shared_dfa_match(shared, input, n + 1, MATCH_SEARCH, &m[4]);
+            for (size_t k = 0; k < 5; k++) {
+                test(results[k] == expected && m[k].start == nfa_m.start && m[k].end == nfa_m.end,
+                    ANSI_COLOR_RED "engine %zu failed for %s with a long input ending in %c\n" ANSI_COLOR_RESET,
+                    k, patterns[i], tails[j]);
+            }
+        }
+        // the lazy DFA finds the offsets itself unless its cache overflows
+        test(dfa->nfa_scratch.nstates == 0, ANSI_COLOR_RED "the lazy DFA ran the NFA for %s\n" ANSI_COLOR_RESET,
+            patterns[i]);
+        shared_dfa_free(shared);
+        dfa_image_free(image);
+        dfa_jit_free(jit);
+        dense_dfa_free(dense);
+        dfa_free(dfa);
+        free_nfa(machine);
+    }
+    double seconds = (double) (clock() - begin) / CLOCKS_PER_SEC;
+    test(seconds < 10, ANSI_COLOR_RED "searching long inputs took %.2fs\n" ANSI_COLOR_RESET, seconds);
+    unlink(path);
+    free(input);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+/*
+ * Checks patterns whose leading or trailing `.*` is left out of the machine
+ * on every engine against the same pattern with a class of all the bytes
+ * for `.`, which is compiled as written.
+ */
+static void
+test_any_wrappers(void)
+{
+    const char *patterns[][2] = {
+        {".*ab", "[\\x00-\\xff]*ab"},
+        {"ab.*", "ab[\\x00-\\xff]*"},
+        {".*a(b|c)+.*", "[\\x00-\\xff]*a(b|c)+[\\x00-\\xff]*"},
+        {".*\\bfoo", "[\\x00-\\xff]*\\bfoo"},
+        {"^a.*", "^a[\\x00-\\xff]*"},
+        {".*b$", "[\\x00-\\xff]*b$"},
+        {".*.*", "[\\x00-\\xff]*[\\x00-\\xff]*"},
+        {".*a?x.*", "[\\x00-\\xff]*a?x[\\x00-\\xff]*"},
+    };
+    const char *inputs[] = {
+        "", "a", "ab", "xaby", "abab", "xabyab", "ac", "abcbx", "foo", "afoo foo", "afoo", "b", "ba", "x", "ax"
+    };
+    char path[] = "/tmp/dfa_any_testXXXXXX";
+    int fd = mkstemp(path);
+    test(fd != -1, ANSI_COLOR_RED "mkstemp failed\n" ANSI_COLOR_RESET);
+    close(fd);
+
+    printf("Testing leading and trailing .* on all engines---");
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+        nfa_machine_t *machine = compile_regex(patterns[i][0]);
+        nfa_machine_t *reference = compile_regex(patterns[i][1]);
+        test(machine != NULL && reference != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET,
+            patterns[i][0]);
+        dfa_t *dfa = dfa_init(machine, 0);
+        dense_dfa_t *dense = dfa_minimize(dfa);
+        dfa_jit_t *jit = dfa_jit_compile(dense);
+        test(dfa_image_write(dfa, patterns[i][0], path) == 0,
+            ANSI_COLOR_RED "failed to write image for %s\n" ANSI_COLOR_RESET, patterns[i][0]);
+        dfa_image_t *image = dfa_image_load(path);
+        test(image != NULL, ANSI_COLOR_RED "failed to load image for %s\n" ANSI_COLOR_RESET, patterns[i][0]);
+        for (size_t j = 0; j < sizeof(inputs)/sizeof(inputs[0]); j++) {
+            for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+                match_t expected_m = {0, 0}, m[5];
+                size_t len = strlen(inputs[j]);
+                int expected = nfa_match(reference, inputs[j], len, mode, &expected_m);
+                int results[5];
+                memset(m, 0, sizeof(m));
+                results[0] = nfa_match(machine, inputs[j], len, mode, &m[0]);
+                results[1] = dfa_match(dfa, inputs[j], len, mode, &m[1]);
+                results[2] = dense_dfa_match(dense, inputs[j], len, mode, &m[2]);
+                results[3] = dfa_jit_match(jit, inputs[j], len, mode, &m[3]);
+                results[4] = dfa_image_match(image, inputs[j], len, mode, &m[4]);
+                for (size_t k = 0; k < 5; k++) {
+                    test(results[k] == expected && (mode == MATCH_ANY ||
+                        (m[k].start == expected_m.start && m[k].end == expected_m.end)),
+                        ANSI_COLOR_RED "engine %zu failed for input %s: %s in mode %d\n" ANSI_COLOR_RESET,
+                        k, patterns[i][0], inputs[j], mode);
+                }
+            }
+        }
+        dfa_image_free(image);
+        dfa_jit_free(jit);
+        dense_dfa_free(dense);
+        dfa_free(dfa);
+        free_nfa(reference);
+        free_nfa(machine);
+    }
+    unlink(path);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+/*
+ * Checks the execution statistics. Without RE_STATS only checks that they
+ * read as zero.
+ */
+static void
+test_accelerated_states(void)
+{
+    const char *patterns[] = {"\"[^\"]*\"", ".*foo", "a[^,;\n]*;", "[^ab]*c", ".*\\bfoo", "(a|b)*o", "[a-z]+"};
+    int accelerated[] = {1, 1, 1, 1, -1, 1, 0}; // whether it has accelerated states, -1 if either
+    const char *alphabet = "\"a;,\nfoc b";
+    char input[64], buf[100];
+    unsigned int seed = 1;
+    char path[] = "/tmp/dfa_accel_testXXXXXX";
+    int fd = mkstemp(path);
+    test(fd != -1, ANSI_COLOR_RED "mkstemp failed\n" ANSI_COLOR_RESET);
+    close(fd);
+
+    printf("Testing re_memchr2 and re_memchr3---");
+    memset(buf, 'q', sizeof(buf));
+    for (size_t start = 0; start < 20; start++) {
+        for (size_t i = start; i < sizeof(buf); i++) {
+            buf[i] = i % 2? 'x': 'y';
+            test(re_memchr2(buf + start, 'x', 'y', sizeof(buf) - start) == buf + i &&
+                re_memchr3(buf + start, 'z', 'y', 'x', sizeof(buf) - start) == buf + i &&
+                re_memchr2(buf + start, 'x', 'y', i - start) == NULL &&
+                re_memchr3(buf + start, 'x', 'y', 'z', i - start) == NULL,
+                ANSI_COLOR_RED "wrong result from %zu for a byte at %zu\n" ANSI_COLOR_RESET, start, i);
+            buf[i] = 'q';
+        }
+    }
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+
+    printf("Testing accelerated DFA states---");
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+        nfa_machine_t *machine = compile_regex(patterns[i]);
+        test(machine != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_t *dfa = dfa_init(machine, 0);
+        dense_dfa_t *dense = dfa_minimize(dfa);
+        size_t count = 0;
+        for (uint32_t s = 0; s < dense->nstates; s++)
+            count += dense_dfa_accel(dense, s)[0] != 0;
+        test(accelerated[i] == -1 || (count != 0) == accelerated[i],
+            ANSI_COLOR_RED "%zu accelerated states for %s\n" ANSI_COLOR_RESET, count, patterns[i]);
+        test(dfa_image_write(dfa, patterns[i], path) == 0,
+            ANSI_COLOR_RED "failed to write image for %s\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_image_t *image = dfa_image_load(path);
+        test(image != NULL, ANSI_COLOR_RED "failed to load image for %s\n" ANSI_COLOR_RESET, patterns[i]);
+
+        // long runs of a byte most states loop on, so that the SSE2 loops run
+        for (size_t j = 0; j < 300; j++) {
+            seed = seed * 1103515245 + 12345;
+            size_t len = (seed >> 16) % sizeof(input);
+            for (size_t k = 0; k < len; k++) {
+                seed = seed * 1103515245 + 12345;
+                input[k] = (seed >> 16) % 8? 'q': alphabet[(seed >> 20) % strlen(alphabet)];
+            }
+            for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+                match_t expected_m = {0, 0}, m[2];
+                int expected = nfa_match(machine, input, len, mode, &expected_m);
+                int results[2];
+                memset(m, 0, sizeof(m));
+                results[0] = dense_dfa_match(dense, input, len, mode, &m[0]);
+                results[1] = dfa_image_match(image, input, len, mode, &m[1]);
+                for (size_t k = 0; k < 2; k++) {
+                    test(results[k] == expected && (mode == MATCH_ANY ||
+                        (m[k].start == expected_m.start && m[k].end == expected_m.end)),
+                        ANSI_COLOR_RED "engine %zu failed for %s: %.*s in mode %d\n" ANSI_COLOR_RESET,
+                        k, patterns[i], (int) len, input, mode);
+                }
+            }
+        }
+        dfa_image_free(image);
+        dense_dfa_free(dense);
+        dfa_free(dfa);
+        free_nfa(machine);
+    }
+    unlink(path);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+typedef struct shared_worker_arg {
+    shared_dfa_t *dfa;
+    nfa_machine_t *machine;
+    const char *pattern;
+    unsigned int seed;
+} shared_worker_arg;
+
+static void *
+shared_worker(void *arg)
+{
+    shared_worker_arg *w = (shared_worker_arg *) arg;
+    const char *alphabet = "abcx1 _-";
+    char input[24];
+    shared_dfa_scratch_t scratch = {0};
+    for (size_t i = 0; i < NSHARED_MATCHES; i++) {
+        size_t len = rand_r(&w->seed) % sizeof(input);
+        for (size_t k = 0; k < len; k++)
+            input[k] = alphabet[rand_r(&w->seed) % strlen(alphabet)];
+        for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+            match_t expected_m = {0, 0}, m = {0, 0};
+            int expected = nfa_match(w->machine, input, len, mode, &expected_m);
+            // every other match on scratch space kept across them
+            int ret = i % 2? shared_dfa_match_scratch(w->dfa, &scratch, input, len, mode, &m):
+                shared_dfa_match(w->dfa, input, len, mode, &m);
+            test(ret == expected && (mode == MATCH_ANY || (m.start == expected_m.start && m.end == expected_m.end)),
+                ANSI_COLOR_RED "shared DFA failed for %s: %.*s in mode %d\n" ANSI_COLOR_RESET,
+                w->pattern, (int) len, input, mode);
+        }
+    }
+    shared_dfa_scratch_free(&scratch);
+    return NULL;
+}
+
+static void
+test_shared_dfa(size_t cache_size)
+{
+    const char *patterns[] = {"(a|b)*abb", "[a-c]+x?1", "\\bab", "c\\B", ".*x1", "^(ab|ba)+$", "a(b|c)*c(a|b|c)(a|b|c)"};
+    pthread_t threads[NTHREADS];
+    shared_worker_arg args[NTHREADS];
+
+    printf("Testing a lazy DFA shared by %d threads with cache size %zu---", NTHREADS, cache_size);
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+        nfa_machine_t *machine = compile_regex(patterns[i]);
+        test(machine != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET, patterns[i]);
+        shared_dfa_t *dfa = shared_dfa_init(machine, cache_size);
+        for (size_t t = 0; t < NTHREADS; t++) {
+            args[t] = (shared_worker_arg) {dfa, machine, patterns[i], (unsigned int) (i * NTHREADS + t)};
+            pthread_create(&threads[t], NULL, shared_worker, &args[t]);
+        }
+        for (size_t t = 0; t < NTHREADS; t++)
+            pthread_join(threads[t], NULL);
+        // a cache too small for the states of the last pattern has to be flushed
+        if (cache_size && i == sizeof(patterns)/sizeof(patterns[0]) - 1)
+            test(atomic_load(&dfa->nflushes) != 0,
+                ANSI_COLOR_RED "expected the cache of %s to be flushed\n" ANSI_COLOR_RESET, patterns[i]);
+        shared_dfa_free(dfa);
+        free_nfa(machine);
+    }
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+typedef struct crowd_arg {
+    shared_dfa_t *dfa;
+    pthread_barrier_t *barrier;
+    const char *input;
+    size_t len;
+    int ok;
+} crowd_arg;
+
+static void *
+crowd_worker(void *arg)
+{
+    crowd_arg *c = (crowd_arg *) arg;
+    match_t m = {0, 0};
+    pthread_barrier_wait(c->barrier);
+    c->ok = shared_dfa_match(c->dfa, c->input, c->len, MATCH_SEARCH, &m) == 1 &&
+        m.start == c->len - 3 && m.end == c->len;
+    return NULL;
+}
+
+/*
+ * More threads than a block has slots match at once, the ones finding
+ * every slot taken get slots of a new block instead of waiting.
+ */
+static void
+test_shared_dfa_crowd(void)
+{
+    enum {NCROWD = 2 * SHARED_DFA_SLOTS + 8};
+    pthread_t threads[NCROWD];
+    crowd_arg args[NCROWD];
+    pthread_barrier_t barrier;
+    size_t len = 1 << 18;
+    char *input = malloc(len);
+    test(input != NULL, ANSI_COLOR_RED "malloc failed\n" ANSI_COLOR_RESET);
+    memset(input, 'a', len - 3);
+    memcpy(input + len - 3, "abb", 3);
+
+    printf("Testing a shared DFA with %d threads at once---", NCROWD);
+    nfa_machine_t *machine = compile_regex("(a|b)*abbb|abb");
+    shared_dfa_t *dfa = shared_dfa_init(machine, 0);
+    pthread_barrier_init(&barrier, NULL, NCROWD);
+    for (size_t t = 0; t < NCROWD; t++) {
+        args[t] = (crowd_arg) {dfa, &barrier, input, len, 0};
+        pthread_create(&threads[t], NULL, crowd_worker, &args[t]);
+    }
+    for (size_t t = 0; t < NCROWD; t++) {
+        pthread_join(threads[t], NULL);
+        test(args[t].ok, ANSI_COLOR_RED "thread %zu got the wrong match\n" ANSI_COLOR_RESET, t);
+    }
+    pthread_barrier_destroy(&barrier);
+    shared_dfa_free(dfa);
+    free_nfa(machine);
+    free(input);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+static void
+test_stats(void)
+{
+    re_stats_summary_t s;
+    nfa_machine_t *machine = compile_regex("(ab|a)*c");
+    const char *input = "abababac";
+    size_t len = strlen(input);
+
+    printf("Testing execution stats---");
+#ifdef RE_STATS
+    nfa_match(machine, input, len, MATCH_FULL, NULL);
+    test(nfa_machine_stats(machine, &s) == 1, ANSI_COLOR_RED "stats not enabled\n" ANSI_COLOR_RESET);
+    test(s.matches[RE_ENGINE_NFA] == 1 && s.last_engine == RE_ENGINE_NFA,
+        ANSI_COLOR_RED "NFA match not counted\n" ANSI_COLOR_RESET);
+    test(s.totals.bytes_scanned == len, ANSI_COLOR_RED "expected %zu bytes scanned, got %zu\n" ANSI_COLOR_RESET,
+        len, s.totals.bytes_scanned);
+    test(s.totals.steps >= len && s.totals.peak_threads >= 2 && s.totals.epsilon_edges > 0,
+        ANSI_COLOR_RED "NFA steps, threads or epsilon edges not counted\n" ANSI_COLOR_RESET);
+
+    dfa_t *dfa = dfa_init(machine, 0);
+    dfa_match(dfa, input, len, MATCH_FULL, NULL);
+    dfa_match(dfa, input, len, MATCH_FULL, NULL);
+    nfa_machine_stats(machine, &s);
+    test(s.matches[RE_ENGINE_DFA] == 2 && s.last_engine == RE_ENGINE_DFA,
+        ANSI_COLOR_RED "DFA matches not counted\n" ANSI_COLOR_RESET);
+    // the first match computes every transition, the second finds them all cached
+    test(s.totals.dfa_cache_hits + s.totals.dfa_cache_misses == 2 * len && s.totals.dfa_cache_hits >= len,
+        ANSI_COLOR_RED "wrong DFA cache hits %zu and misses %zu\n" ANSI_COLOR_RESET,
+        s.totals.dfa_cache_hits, s.totals.dfa_cache_misses);
+
+    dense_dfa_t *dense = dfa_minimize(dfa);
+    dense_dfa_match(dense, input, len, MATCH_PREFIX, NULL);
+    nfa_machine_stats(machine, &s);
+    test(s.matches[RE_ENGINE_DENSE_DFA] == 1, ANSI_COLOR_RED "dense DFA match not counted\n" ANSI_COLOR_RESET);
+    dense_dfa_free(dense);
+    dfa_free(dfa);
+
+    nfa_machine_reset_stats(machine);
+    nfa_machine_stats(machine, &s);
+    test(s.matches[RE_ENGINE_NFA] == 0 && s.totals.bytes_scanned == 0,
+        ANSI_COLOR_RED "stats not reset\n" ANSI_COLOR_RESET);
+
+    // "c" is required, an input without it is rejected without a scan
+    nfa_match(machine, "abab", 4, MATCH_SEARCH, NULL);
+    nfa_match(machine, input, len, MATCH_SEARCH, NULL);
+    nfa_machine_stats(machine, &s);
+    test(s.matches[RE_ENGINE_NFA] == 2 && s.totals.prefilter_skips == 4 && s.totals.prefilter_candidates == 1 &&
+        s.totals.bytes_scanned == len, ANSI_COLOR_RED "prefilter not counted\n" ANSI_COLOR_RESET);
+#else
+    nfa_match(machine, input, len, MATCH_FULL, NULL);
+    test(nfa_machine_stats(machine, &s) == 0 && s.matches[RE_ENGINE_NFA] == 0,
+        ANSI_COLOR_RED "stats collected without RE_STATS\n" ANSI_COLOR_RESET);
+#endif
+    free_nfa(machine);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+/*
+ * Checks that re_memory_usage accounts for every byte the library allocates
+ * for a machine and each engine built from it, using the counting allocator.
+ */
+static void
+test_memory_usage(void)
+{
+    const char *patterns[] = {"a*", "(ab|c)+", "((ab|cd)+)12", ".*[0-9]?[0-9]?[a-z]+", "b|abc"};
+    const char *inputs[] = {"", "ab", "abc12", "cd12", "+91ab", "xabc", "id=1234;"};
+    re_allocator_t allocator;
+    re_alloc_counter_t counter;
+    re_memory_usage_t usage;
+
+    printf("Testing memory accounting---");
+    re_counting_allocator(&allocator, &counter);
+    re_set_allocator(&allocator);
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+        nfa_machine_t *machine = compile_regex(patterns[i]);
+        re_memory_usage(machine, NULL, &usage);
+        size_t bytes = atomic_load(&counter.bytes);
+        test(usage.total == bytes, ANSI_COLOR_RED "%s: machine accounted as %zu bytes, allocated %zu\n"
+            ANSI_COLOR_RESET, patterns[i], usage.total, bytes);
+        test(usage.match_scratch > 0 && usage.char_sets == machine->nstates * 256,
+            ANSI_COLOR_RED "%s: wrong scratch or char set size\n" ANSI_COLOR_RESET, patterns[i]);
+
+        // the scratch is all that a match allocates and it is given back,
+        // the input has the required string of each pattern so it is run
+        size_t nallocs = atomic_load(&counter.nallocs);
+        size_t peak = atomic_load(&counter.peak);
+        atomic_store(&counter.peak, bytes);
+        nfa_match(machine, inputs[2], strlen(inputs[2]), MATCH_SEARCH, NULL);
+        test(atomic_load(&counter.peak) == bytes + usage.match_scratch && atomic_load(&counter.bytes) == bytes,
+            ANSI_COLOR_RED "%s: match scratch is not %zu bytes\n" ANSI_COLOR_RESET, patterns[i], usage.match_scratch);
+        test(atomic_load(&counter.nallocs) > nallocs, ANSI_COLOR_RED "match not counted\n" ANSI_COLOR_RESET);
+        atomic_store(&counter.peak, peak);
+
+        dfa_t *dfa = dfa_init(machine, 0);
+        for (size_t j = 0; j < sizeof(inputs)/sizeof(inputs[0]); j++) {
+            match_t m;
+            dfa_match(dfa, inputs[j], strlen(inputs[j]), MATCH_ANY, NULL);
+            dfa_match(dfa, inputs[j], strlen(inputs[j]), MATCH_SEARCH, &m);
+        }
+        re_memory_usage(machine, dfa, &usage);
+        bytes = atomic_load(&counter.bytes);
+        test(usage.total == bytes && usage.dfa_cache > 0, ANSI_COLOR_RED "%s: DFA accounted as %zu bytes, allocated %zu\n"
+            ANSI_COLOR_RESET, patterns[i], usage.total, bytes);
+        test(usage.parse > 0, ANSI_COLOR_RED "%s: parse not accounted\n" ANSI_COLOR_RESET, patterns[i]);
+
+        // the code of the JIT is mapped, the allocator only sees the rest
+        dense_dfa_t *dense = dfa_minimize(dfa);
+        test(dense != NULL, ANSI_COLOR_RED "%s: no dense DFA\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_jit_t *jit = dfa_jit_compile(dense);
+        re_memory_usage(machine, dfa, &usage);
+        re_memory_add_dense_dfa(&usage, dense);
+        if (jit)
+            re_memory_add_jit(&usage, jit);
+        bytes = atomic_load(&counter.bytes);
+        test(usage.total - usage.jit_code == bytes && usage.dense_dfa > 0, ANSI_COLOR_RED
+            "%s: dense DFA accounted as %zu bytes, allocated %zu\n" ANSI_COLOR_RESET, patterns[i],
+            usage.total - usage.jit_code, bytes);
+        if (jit)
+            dfa_jit_free(jit);
+        dense_dfa_free(dense);
+        dfa_free(dfa);
+
+        shared_dfa_t *shared = shared_dfa_init(machine, 0);
+        for (size_t j = 0; j < sizeof(inputs)/sizeof(inputs[0]); j++) {
+            match_t m;
+            shared_dfa_match(shared, inputs[j], strlen(inputs[j]), MATCH_SEARCH, &m);
+        }
+        re_memory_usage(machine, NULL, &usage);
+        re_memory_add_shared_dfa(&usage, shared);
+        bytes = atomic_load(&counter.bytes);
+        test(usage.total == bytes && usage.shared_dfa > 0, ANSI_COLOR_RED
+            "%s: shared DFA accounted as %zu bytes, allocated %zu\n" ANSI_COLOR_RESET, patterns[i], usage.total, bytes);
+        shared_dfa_free(shared);
+
+        // long enough an input for re_meta_t to build its DFA
+        char input[RE_PLAN_SHORT_INPUT * 2];
+        memset(input, 'x', sizeof(input));
+        memcpy(input + sizeof(input) - strlen(inputs[2]), inputs[2], strlen(inputs[2]));
+        re_meta_t *re = re_meta_init(machine);
+        re_meta_match(re, input, sizeof(input), MATCH_SEARCH, NULL);
+        re_memory_usage(machine, NULL, &usage);
+        re_memory_add_meta(&usage, re);
+        bytes = atomic_load(&counter.bytes);
+        test(usage.total == bytes && usage.meta > 0, ANSI_COLOR_RED
+            "%s: re_meta_t accounted as %zu bytes, allocated %zu\n" ANSI_COLOR_RESET, patterns[i], usage.total, bytes);
+        re_meta_free(re);
+        free_nfa(machine);
+        test(atomic_load(&counter.bytes) == 0, ANSI_COLOR_RED "%s: %zu bytes not freed\n" ANSI_COLOR_RESET,
+            patterns[i], atomic_load(&counter.bytes));
+    }
+    re_set_allocator(NULL);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    test_byte_classes();
+    test_dfa_matches_nfa(0);
+    test_dfa_matches_nfa(1);
+    test_dfa_image();
+    test_minimized_dfa_and_jit();
+    test_utf8_engines();
+    test_assertion_engines();
+    test_prefilter_engines();
+    test_any_wrappers();
+    test_long_search();
+    test_accelerated_states();
+    test_shared_dfa(0);
+    test_shared_dfa(2048);
+    test_shared_dfa_crowd();
+    test_stats();
+    test_memory_usage();
+}
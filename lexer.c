@@ -32,20 +32,23 @@
 #include <string.h>
 #include "lexer.h"
 #include "token.h"
+#include "re_utils.h"
+#include "utf8.h"
 
 lexer_t *
 lexer_init(const char *input)
 {
     lexer_t *l;
-    l = malloc(sizeof(*l));
+    l = re_malloc(sizeof(*l));
     if (l == NULL)
         err(EXIT_FAILURE, "malloc failed");
-    l->input = strdup(input);
+    l->input = re_strdup(input);
     if (l->input == NULL)
         err(EXIT_FAILURE, "malloc failed");
     l->cur_offset = 0;
     l->read_offset = 1;
     l->ch = input[0];
+    l->utf8 = 0;
     return l;
 }
 
@@ -59,11 +62,118 @@ read_char(lexer_t *l)
     }
 }
 
+/*
+ * Reads one character, several bytes of it in UTF-8 mode, into a token of
+ * the given type.
+ */
+static void
+read_literal(lexer_t *l, token_t *t, token_type type)
+{
+    size_t len = 1;
+    if (l->utf8 && (uint8_t) l->ch >= 0x80) {
+        uint32_t cp;
+        // decoding stops at the terminating NUL, it is not a continuation byte
+        len = utf8_decode((const uint8_t *) l->input + l->cur_offset, UTF8_MAX_BYTES, &cp);
+        if (len == 0) {
+            t->type = ILLEGAL;
+            t->literal = "(invalid UTF-8)";
+            read_char(l);
+            return;
+        }
+    }
+    t->type = type;
+    t->literal = re_malloc(len + 1);
+    if (t->literal == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    memcpy(t->literal, l->input + l->cur_offset, len);
+    t->literal[len] = 0;
+    while (len--)
+        read_char(l);
+}
+
+static int
+hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Reads what follows a backslash. Punctuation and non-ASCII characters
+ * stand for themselves, letters and digits have to make up one of the
+ * known escapes. `\xHH` is a byte, or the code point U+00HH in UTF-8 mode.
+ * The literal of `\x00` is the empty string, its value is still 0.
+ */
+static void
+read_escape(lexer_t *l, token_t *t)
+{
+    static const char controls[] = "n\nt\tr\rf\fv\v";
+    static const char *class_escapes[] = {"\\d", "\\D", "\\w", "\\W", "\\s", "\\S"};
+    const char *p;
+    int value;
+
+    if (l->ch == 0) {
+        t->type = ILLEGAL;
+        t->literal = "(trailing backslash)";
+        return;
+    }
+    if (l->ch == 'b' || l->ch == 'B') {
+        t->type = l->ch == 'b'? WORD_BOUNDARY: NOT_WORD_BOUNDARY;
+        t->literal = l->ch == 'b'? "\\b": "\\B";
+        read_char(l);
+        return;
+    }
+    if ((p = strchr("dDwWsS", l->ch)) != NULL) {
+        t->type = CLASS_ESCAPE;
+        t->literal = (char *) class_escapes[p - "dDwWsS"];
+        read_char(l);
+        return;
+    }
+    if (l->ch == 'x') {
+        int hi = hex_value(l->input[l->read_offset]);
+        int lo = hi < 0? -1: hex_value(l->input[l->read_offset + 1]);
+        if (lo < 0) {
+            t->type = ILLEGAL;
+            t->literal = "(bad \\x escape)";
+            read_char(l);
+            return;
+        }
+        value = 16 * hi + lo;
+        read_char(l);
+        read_char(l);
+    } else if ((p = strchr(controls, l->ch)) != NULL && (p - controls) % 2 == 0) {
+        value = (uint8_t) p[1];
+    } else if ((l->ch >= 'a' && l->ch <= 'z') || (l->ch >= 'A' && l->ch <= 'Z') ||
+        (l->ch >= '0' && l->ch <= '9')) {
+        t->type = ILLEGAL;
+        t->literal = "(unknown escape)";
+        read_char(l);
+        return;
+    } else {
+        read_literal(l, t, ESCAPED_CHAR);
+        return;
+    }
+    read_char(l);
+    t->type = ESCAPED_CHAR;
+    t->literal = re_calloc(1, UTF8_MAX_BYTES + 1);
+    if (t->literal == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    if (l->utf8)
+        utf8_encode(value, (uint8_t *) t->literal);
+    else
+        t->literal[0] = value;
+}
+
 token_t *
 next_token(lexer_t *l)
 {
     token_t *t;
-    t = malloc(sizeof(*t));
+    t = re_malloc(sizeof(*t));
     if (t == NULL)
         err(EXIT_FAILURE, "malloc failed");
     switch (l->ch) {
@@ -107,25 +217,45 @@ next_token(lexer_t *l)
         t->literal = "]";
         read_char(l);
         break;
+    case '^':
+        t->type = CARET;
+        t->literal = "^";
+        read_char(l);
+        break;
+    case '$':
+        t->type = DOLLAR;
+        t->literal = "$";
+        read_char(l);
+        break;
     case 0:
         t->type = END_OF_FILE;
         t->literal = "";
         break;
-    default:
-        t->type = CHAR;
-        t->literal = malloc(2);
-        t->literal[0] = l->ch;
-        t->literal[1] = 0;
+    case '\\':
         read_char(l);
+        read_escape(l, t);
+        break;
+    default:
+        read_literal(l, t, CHAR);
         break;
     }
     return t;
 }
 
+/*
+ * Returns the bytes allocated for the lexer, without the tokens it handed
+ * out.
+ */
+size_t
+lexer_size(lexer_t *l)
+{
+    return sizeof(*l) + strlen(l->input) + 1;
+}
+
 void
 lexer_free(lexer_t *l)
 {
-    free(l->input);
-    free(l);
+    re_free(l->input);
+    re_free(l);
 
 }
@@ -38,11 +38,13 @@ typedef struct lexer_t {
     size_t cur_offset;
     size_t read_offset;
     char ch;
+    int utf8; // read a multibyte character as one CHAR token
 } lexer_t;
 
 lexer_t *lexer_init(const char *);
 token_t *next_token(lexer_t *);
 token_t *peek_token(lexer_t *);
+size_t lexer_size(lexer_t *);
 void lexer_free(lexer_t *);
 
 #endif
\ No newline at end of file
@@ -114,6 +114,31 @@ main(int argc, char **argv)
                 {"+", PLUS},
                 {"", END_OF_FILE}
             }
+        },
+        {
+            "^a\\b\\B$",
+            {
+                {"^", CARET},
+                {"a", CHAR},
+                {"\\b", WORD_BOUNDARY},
+                {"\\B", NOT_WORD_BOUNDARY},
+                {"$", DOLLAR},
+                {"", END_OF_FILE}
+            }
+        },
+        {
+            "\\d\\.[^\\]]\\x41\\q",
+            {
+                {"\\d", CLASS_ESCAPE},
+                {".", ESCAPED_CHAR},
+                {"[", LBRACKET},
+                {"^", CARET},
+                {"]", ESCAPED_CHAR},
+                {"]", RBRACKET},
+                {"A", ESCAPED_CHAR},
+                {"(unknown escape)", ILLEGAL},
+                {"", END_OF_FILE}
+            }
         }
     };
 
@@ -28,6 +28,8 @@
  */
 
 #include <err.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -35,17 +37,40 @@
 #include "parser.h"
 #include "lexer.h"
 #include "nfa_compiler.h"
+#include "re_utils.h"
+#include "utf8.h"
 
 
-static nfa_state_t *compile_infix_node(nfa_machine_t *, expression_node_t *);
-static nfa_state_t *compile_postfix_node(nfa_machine_t *, expression_node_t *);
-static nfa_state_t *compile_char_class(nfa_machine_t *, expression_node_t *);
-static nfa_state_t *compile_char_literal(nfa_machine_t *, expression_node_t *);
+/*
+ * What compiling keeps on top of the machine: every state created so far
+ * and the end list of each, the states of its fragment which still have
+ * to be pointed at whatever follows it, indexed by state_idx. None of it
+ * is left once the machine is built.
+ */
+typedef struct end_state_list {
+    nfa_state_t *state;
+    struct end_state_list *next;
+    struct end_state_list *tail;
+} end_state_list;
+
+typedef struct nfa_builder_t {
+    nfa_machine_t *machine;
+    nfa_state_t **states;
+    end_state_list **end_lists;
+    size_t size;
+} nfa_builder_t;
+
+#define end_list(builder, s) ((builder)->end_lists[(s)->state_idx])
 
-// 32 stack size is enough to clean up machine with states upto 75k
-// beyond that the application crashes on a 16 GB machine. We can always
-// increase this limit or make it dynamic if required
-static nfa_state_t *stack[32];  
+typedef nfa_state_t * (*expression_compile_fn) (nfa_builder_t *, expression_node_t *);
+
+static nfa_state_t *compile_infix_node(nfa_builder_t *, expression_node_t *);
+static nfa_state_t *compile_postfix_node(nfa_builder_t *, expression_node_t *);
+static nfa_state_t *compile_char_class(nfa_builder_t *, expression_node_t *);
+static nfa_state_t *compile_char_literal(nfa_builder_t *, expression_node_t *);
+static nfa_state_t *compile_utf8_class(nfa_builder_t *, expression_node_t *);
+static nfa_state_t *compile_assertion(nfa_builder_t *, expression_node_t *);
+static void compute_byte_classes(nfa_machine_t *);
 
 
 static expression_compile_fn compile_fns[] = {
@@ -53,79 +78,143 @@ static expression_compile_fn compile_fns[] = {
     compile_char_class, // CHAR_CLASS
     compile_infix_node, // INFIX_EXP
     compile_postfix_node, // POSFIX_EXP
-    NULL
+    NULL, // PREFIX_EXP
+    compile_utf8_class, // UTF8_CLASS
+    compile_assertion // ASSERTION
 };
-#define compile_expression_node(machine, node) (compile_fns[node->type](machine, node))
+#define compile_expression_node(builder, node) (compile_fns[node->type](builder, node))
 
-const nfa_state_t ACCEPTING_STATE = {NULL, NULL, NULL, {0}, 0};
+const nfa_state_t ACCEPTING_STATE = {NULL, NULL, 0, 0, 0, 0, {0}};
 
 static nfa_state_t *
-create_state(nfa_machine_t *machine, u_int8_t c)
+create_state(nfa_builder_t *builder, u_int8_t c)
 {
+    nfa_machine_t *machine = builder->machine;
+    if (machine->nstates == builder->size) {
+        builder->size = builder->size? 2 * builder->size: 64;
+        builder->states = re_reallocarray(builder->states, builder->size, sizeof(*builder->states));
+        builder->end_lists = re_reallocarray(builder->end_lists, builder->size, sizeof(*builder->end_lists));
+        if (builder->states == NULL || builder->end_lists == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+    }
     nfa_state_t *state;
-    state = calloc(1, sizeof(*state));
+    state = re_calloc(1, sizeof(*state));
     if (state == NULL)
         err(EXIT_FAILURE, "malloc failed");
+    state->state_idx = machine->nstates++;
+    builder->states[state->state_idx] = state;
     if (c == '.')
-        state->c[MATCH_ALL] = 1;
+        state->any = 1;
+    else if (c == NULL_STATE)
+        state->null = 1;
     else
         state->c[c] = 1;
-    state->end_list = malloc(sizeof(end_state_list));
-    if (state->end_list == NULL)
+    end_list(builder, state) = re_malloc(sizeof(end_state_list));
+    if (end_list(builder, state) == NULL)
         err(EXIT_FAILURE, "malloc failed");
-    state->end_list->next = NULL;
-    state->end_list->tail = state->end_list;
-    state->state_idx = machine->nstates++;
+    end_list(builder, state)->next = NULL;
+    end_list(builder, state)->tail = end_list(builder, state);
     return state;
 }
 
-void
+static nfa_state_t *
+create_byte_set_state(nfa_builder_t *builder)
+{
+    nfa_state_t *state = create_state(builder, NULL_STATE);
+    state->null = 0;
+    return state;
+}
+
+/*
+ * Whether the node compiles into a single state matching a set of bytes.
+ */
+static int
+is_byte_set(expression_node_t *node)
+{
+    if (node->type == CHAR_CLASS)
+        return 1;
+    return node->type == CHAR_LITERAL && ((char_literal_t *) node)->value != NULL_STATE;
+}
+
+static void
+add_byte_set(nfa_state_t *state, expression_node_t *node)
+{
+    if (node->type == CHAR_CLASS) {
+        char_class_t *char_class = (char_class_t *) node;
+        for (size_t c = 0; c < 256; c++)
+            state->c[c] |= char_class->allowed_values[c];
+    } else {
+        uint8_t c = ((char_literal_t *) node)->value;
+        if (c == '.')
+            state->any = 1;
+        else
+            state->c[c] = 1;
+    }
+}
+
+static void
 free_end_list(end_state_list *list)
 {
     end_state_list *node = list;
     end_state_list *temp;
     while (node) {
         temp = node->next;
-        free(node);
+        re_free(node);
         node = temp;
     }
 }
 
 static nfa_state_t *
-compile_infix_node(nfa_machine_t *machine, expression_node_t *n)
+compile_infix_node(nfa_builder_t *builder, expression_node_t *n)
 {
     infix_expression_t *node = (infix_expression_t *) n;
     if (node->op == OR) {
         // We can optimize the alternation of two char matches, such as `a|b` by
         // combining the matches into a single node. Usually alternation results
         // three nodes, one epsilon transition to one of the two actual state nodes
-        // on matching one of the characters.
-        if (node->left->type == CHAR_LITERAL && node->right->type == CHAR_LITERAL) {
-            char c1 = ((char_literal_t *) node->left)->value;
-            char c2 = ((char_literal_t *) node->right)->value;
-            nfa_state_t *combined_node = create_state(machine, c1);
-            combined_node->c[(u_int8_t) c2] = 1;
+        // on matching one of the characters. The same goes for classes, which
+        // keeps case folded alternations, `[aA]|[bB]`, as small as `a|b`.
+        // The null literal of `a?` is an epsilon transition and can't be
+        // combined with a char match this way.
+        if (is_byte_set(node->left) && is_byte_set(node->right)) {
+            nfa_state_t *combined_node = create_byte_set_state(builder);
+            add_byte_set(combined_node, node->left);
+            add_byte_set(combined_node, node->right);
             combined_node->out = (nfa_state_t *) &ACCEPTING_STATE;
-            combined_node->end_list->state = combined_node;
+            end_list(builder, combined_node)->state = combined_node;
             return combined_node;
         }
 
-        nfa_state_t *state = create_state(machine, NULL_STATE);
-        nfa_state_t *left = compile_expression_node(machine, node->left);
-        nfa_state_t *right = compile_expression_node(machine, node->right);
+        // `x?` is parsed as the alternation of a null literal and x, a single
+        // split state which either enters x or skips over it is enough for it.
+        if (node->left->type == CHAR_LITERAL && ((char_literal_t *) node->left)->value == NULL_STATE) {
+            nfa_state_t *state = create_state(builder, NULL_STATE);
+            nfa_state_t *right = compile_expression_node(builder, node->right);
+            state->out = right;
+            state->out1 = (nfa_state_t *) &ACCEPTING_STATE;
+            end_list(builder, state)->state = state;
+            end_list(builder, state)->next = end_list(builder, right);
+            end_list(builder, state)->tail = end_list(builder, right)->tail;
+            end_list(builder, right) = NULL;
+            return state;
+        }
+
+        nfa_state_t *state = create_state(builder, NULL_STATE);
+        nfa_state_t *left = compile_expression_node(builder, node->left);
+        nfa_state_t *right = compile_expression_node(builder, node->right);
         state->out = left;
         state->out1 = right;
-        free_end_list(state->end_list);
-        state->end_list = left->end_list;
-        state->end_list->tail->next = right->end_list;
-        state->end_list->tail = right->end_list->tail;
-        left->end_list = NULL;
-        right->end_list = NULL;
+        free_end_list(end_list(builder, state));
+        end_list(builder, state) = end_list(builder, left);
+        end_list(builder, state)->tail->next = end_list(builder, right);
+        end_list(builder, state)->tail = end_list(builder, right)->tail;
+        end_list(builder, left) = NULL;
+        end_list(builder, right) = NULL;
         return state;
     } else if (node->op == CONCAT) {
-        nfa_state_t *left = compile_expression_node(machine, node->left);
-        nfa_state_t *right = compile_expression_node(machine, node->right);
-        end_state_list *temp = left->end_list;
+        nfa_state_t *left = compile_expression_node(builder, node->left);
+        nfa_state_t *right = compile_expression_node(builder, node->right);
+        end_state_list *temp = end_list(builder, left);
         while (temp) {
             if (is_end_state(temp->state->out)) {
                 temp->state->out = right;
@@ -135,9 +224,9 @@ compile_infix_node(nfa_machine_t *machine, expression_node_t *n)
             }
             temp = temp->next;
         }
-        free_end_list(left->end_list);
-        left->end_list = right->end_list;
-        right->end_list = NULL;
+        free_end_list(end_list(builder, left));
+        end_list(builder, left) = end_list(builder, right);
+        end_list(builder, right) = NULL;
         return left;
     }
     return NULL; // not expected to come here, only two infix operators supported
@@ -146,13 +235,13 @@ compile_infix_node(nfa_machine_t *machine, expression_node_t *n)
 
 
 static nfa_state_t *
-compile_postfix_node(nfa_machine_t *machine, expression_node_t *n)
+compile_postfix_node(nfa_builder_t *builder, expression_node_t *n)
 {
     postfix_expression_t *node = (postfix_expression_t *) n;
-    nfa_state_t *state = create_state(machine, NULL_STATE);
-    nfa_state_t *left = compile_expression_node(machine, node->left);
+    nfa_state_t *state = create_state(builder, NULL_STATE);
+    nfa_state_t *left = compile_expression_node(builder, node->left);
     state->out = left;
-    end_state_list *temp = left->end_list;
+    end_state_list *temp = end_list(builder, left);
     while (temp) {
         if (is_end_state(temp->state->out)) {
             temp->state->out = state;
@@ -162,83 +251,574 @@ compile_postfix_node(nfa_machine_t *machine, expression_node_t *n)
         }
         temp = temp->next;
     }
-    free_end_list(left->end_list);
-    left->end_list = NULL;
-    state->end_list->state = state;
+    free_end_list(end_list(builder, left));
+    end_list(builder, left) = NULL;
+    end_list(builder, state)->state = state;
     state->out1 = (nfa_state_t *) &ACCEPTING_STATE;
     return state;
 }
 
 static nfa_state_t *
-compile_char_literal(nfa_machine_t *machine, expression_node_t *node)
+compile_char_literal(nfa_builder_t *builder, expression_node_t *node)
 {
-        nfa_state_t *state = create_state(machine, ((char_literal_t *) node)->value);
+        nfa_state_t *state = create_state(builder, ((char_literal_t *) node)->value);
         state->out = (nfa_state_t *) &ACCEPTING_STATE;
-        if (state->c[NULL_STATE])
+        if (state->null)
             state->out1 = (nfa_state_t *) &ACCEPTING_STATE;
-        state->end_list->state = state;
+        end_list(builder, state)->state = state;
         return state;
 }
 
+/*
+ * An assertion is a null state which the executors only pass through if
+ * it holds at the current position of the input.
+ */
+static nfa_state_t *
+compile_assertion(nfa_builder_t *builder, expression_node_t *node)
+{
+    nfa_state_t *state = create_state(builder, NULL_STATE);
+    state->assertion = ((assertion_t *) node)->kind;
+    state->out = (nfa_state_t *) &ACCEPTING_STATE;
+    end_list(builder, state)->state = state;
+    return state;
+}
+
 static nfa_state_t *
-compile_char_class(nfa_machine_t *machine, expression_node_t *node)
+compile_char_class(nfa_builder_t *builder, expression_node_t *node)
 {
-    nfa_state_t *state = create_state(machine, NULL_STATE);
+    nfa_state_t *state = create_byte_set_state(builder);
     char_class_t *char_class = (char_class_t *) node;
     memcpy(state->c, char_class->allowed_values, 256);
     state->out = (nfa_state_t *) &ACCEPTING_STATE;
-    state->end_list->state = state;
+    end_list(builder, state)->state = state;
     return state;
 }
 
+/*
+ * The byte automaton of a UTF-8 class before it is turned into states.
+ * A node matches a range of continuation bytes and moves on to its next
+ * node, or to the end of the class if next is -1. Nodes are built from
+ * the last byte of each sequence backwards and interned, so sequences
+ * with the same tail share its nodes. Roots match the first byte and are
+ * grouped by the node they move on to, a set of lead bytes per group.
+ */
+typedef struct utf8_node {
+    uint8_t lo;
+    uint8_t hi;
+    int next;
+} utf8_node;
+
+typedef struct utf8_root {
+    int next;
+    uint8_t bytes[256];
+} utf8_root;
+
+typedef struct utf8_automaton {
+    utf8_node *nodes;
+    size_t nnodes;
+    utf8_root *roots;
+    size_t nroots;
+    cm_hash_table *interned; // (lo, hi, next) -> node index + 1
+    int reversed; // the byte sequences are read from the end
+} utf8_automaton;
+
+#define utf8_node_key(lo, hi, next) ((void *) (((uintptr_t) ((next) + 1) << 16) | ((lo) << 8) | (hi)))
+
+static int
+utf8_intern_node(utf8_automaton *a, uint8_t lo, uint8_t hi, int next)
+{
+    // a node never matches just NUL, so a key is never NULL
+    void *key = utf8_node_key(lo, hi, next);
+    uintptr_t idx = (uintptr_t) cm_hash_table_get(a->interned, key);
+    if (idx)
+        return idx - 1;
+    utf8_node *nodes = re_reallocarray(a->nodes, a->nnodes + 1, sizeof(*nodes));
+    if (nodes == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    nodes[a->nnodes].lo = lo;
+    nodes[a->nnodes].hi = hi;
+    nodes[a->nnodes].next = next;
+    a->nodes = nodes;
+    cm_hash_table_put(a->interned, key, (void *) (uintptr_t) ++a->nnodes);
+    return a->nnodes - 1;
+}
+
+static void
+utf8_add_sequence(const utf8_sequence *sequence, void *arg)
+{
+    utf8_automaton *a = arg;
+    utf8_sequence reversed;
+    const utf8_sequence *seq = sequence;
+    int next = -1;
+    if (a->reversed) {
+        reversed.len = sequence->len;
+        for (size_t i = 0; i < sequence->len; i++) {
+            reversed.lo[i] = sequence->lo[sequence->len - 1 - i];
+            reversed.hi[i] = sequence->hi[sequence->len - 1 - i];
+        }
+        seq = &reversed;
+    }
+    for (size_t i = seq->len - 1; i > 0; i--)
+        next = utf8_intern_node(a, seq->lo[i], seq->hi[i], next);
+
+    size_t r;
+    for (r = 0; r < a->nroots; r++) {
+        if (a->roots[r].next == next)
+            break;
+    }
+    if (r == a->nroots) {
+        utf8_root *roots = re_reallocarray(a->roots, a->nroots + 1, sizeof(*roots));
+        if (roots == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+        memset(&roots[r], 0, sizeof(roots[r]));
+        roots[r].next = next;
+        a->roots = roots;
+        a->nroots++;
+    }
+    for (int c = seq->lo[0]; c <= seq->hi[0]; c++)
+        a->roots[r].bytes[c] = 1;
+}
+
+static void
+utf8_build_automaton(utf8_class_t *node, utf8_automaton *a)
+{
+    memset(a, 0, sizeof(*a));
+    a->interned = cm_hash_table_init(pointer_hash_function, pointer_equals, NULL, NULL);
+    a->reversed = node->reversed;
+    for (size_t i = 0; i < node->nranges; i++)
+        utf8_range_sequences(node->ranges[2 * i], node->ranges[2 * i + 1], utf8_add_sequence, a);
+}
+
+static void
+utf8_free_automaton(utf8_automaton *a)
+{
+    cm_hash_table_free(a->interned);
+    re_free(a->nodes);
+    re_free(a->roots);
+}
+
+/*
+ * The number of states compile_utf8_class creates: one per node and root,
+ * and the split states which chain the roots.
+ */
+static size_t
+utf8_automaton_states(utf8_automaton *a)
+{
+    return a->nroots? a->nnodes + 2 * a->nroots - 1: 1;
+}
+
+/*
+ * Compiles a class of code points into states which match the UTF-8
+ * encodings of its members a byte at a time, so that the executors never
+ * decode the input. All the states which finish a character are on the
+ * end list of the start state.
+ */
+static nfa_state_t *
+compile_utf8_class(nfa_builder_t *builder, expression_node_t *n)
+{
+    utf8_automaton a;
+    utf8_build_automaton((utf8_class_t *) n, &a);
+    if (a.nroots == 0) {
+        // an empty class matches nothing
+        utf8_free_automaton(&a);
+        nfa_state_t *state = create_byte_set_state(builder);
+        state->out = (nfa_state_t *) &ACCEPTING_STATE;
+        end_list(builder, state)->state = state;
+        return state;
+    }
+
+    end_state_list *ends = NULL;
+    nfa_state_t **states = re_malloc((a.nnodes + a.nroots) * sizeof(*states));
+    if (states == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    // nodes only point to nodes created before them
+    for (size_t i = 0; i < a.nnodes + a.nroots; i++) {
+        nfa_state_t *state = create_byte_set_state(builder);
+        int next;
+        if (i < a.nnodes) {
+            memset(state->c + a.nodes[i].lo, 1, a.nodes[i].hi - a.nodes[i].lo + 1);
+            next = a.nodes[i].next;
+        } else {
+            memcpy(state->c, a.roots[i - a.nnodes].bytes, 256);
+            next = a.roots[i - a.nnodes].next;
+        }
+        if (next >= 0) {
+            state->out = states[next];
+            free_end_list(end_list(builder, state));
+        } else {
+            state->out = (nfa_state_t *) &ACCEPTING_STATE;
+            end_list(builder, state)->state = state;
+            if (ends) {
+                ends->tail->next = end_list(builder, state);
+                ends->tail = end_list(builder, state);
+            } else
+                ends = end_list(builder, state);
+        }
+        end_list(builder, state) = NULL;
+        states[i] = state;
+    }
+
+    nfa_state_t *start = states[a.nnodes + a.nroots - 1];
+    for (size_t r = a.nroots - 1; r > 0; r--) {
+        nfa_state_t *split = create_state(builder, NULL_STATE);
+        free_end_list(end_list(builder, split));
+        end_list(builder, split) = NULL;
+        split->out = states[a.nnodes + r - 1];
+        split->out1 = start;
+        start = split;
+    }
+    end_list(builder, start) = ends;
+    re_free(states);
+    utf8_free_automaton(&a);
+    return start;
+}
+
+/*
+ * Compiles the pattern without any limits. Returns NULL if it does not
+ * parse.
+ */
 nfa_machine_t *
 compile_regex(const char *regex_pattern)
 {
+    return compile_regex_with_options(regex_pattern, NULL, NULL);
+}
+
+static void
+set_error(re_compile_error_t *error, re_error_code_t code, const char *message)
+{
+    if (error) {
+        error->code = code;
+        snprintf(error->message, sizeof(error->message), "%s", message);
+    }
+}
+
+/*
+ * Counts the states compile_regex_ast would create for the tree, without
+ * creating them, and measures how deeply its operators nest. Chains of
+ * the same binary operator, such as a long concatenation, count as one
+ * level.
+ */
+static void
+measure_tree(expression_node_t *root, size_t *nstates, size_t *depth)
+{
+    cm_stack *stack = cm_stack_init(32);
+    cm_stack *depths = cm_stack_init(32);
+    *nstates = 0;
+    *depth = 0;
+    cm_stack_push(stack, root);
+    cm_stack_push(depths, (void *) (uintptr_t) 1);
+    while (stack->length > 0) {
+        expression_node_t *e = cm_stack_pop(stack);
+        size_t d = (uintptr_t) cm_stack_pop(depths);
+        if (d > *depth)
+            *depth = d;
+        expression_node_t *children[2] = {NULL, NULL};
+        if (e->type == CHAR_LITERAL || e->type == CHAR_CLASS || e->type == ASSERTION) {
+            (*nstates)++;
+        } else if (e->type == UTF8_CLASS) {
+            utf8_automaton a;
+            utf8_build_automaton((utf8_class_t *) e, &a);
+            *nstates += utf8_automaton_states(&a);
+            utf8_free_automaton(&a);
+        } else if (e->type == POSTFIX_EXPRESSION) {
+            (*nstates)++;
+            children[0] = ((postfix_expression_t *) e)->left;
+        } else if (e->type == INFIX_EXPRESSION) {
+            infix_expression_t *infix = (infix_expression_t *) e;
+            // mirrors the special cases of compile_infix_node
+            int left_null = infix->left->type == CHAR_LITERAL &&
+                ((char_literal_t *) infix->left)->value == NULL_STATE;
+            if (infix->op == OR && is_byte_set(infix->left) && is_byte_set(infix->right)) {
+                (*nstates)++;
+            } else if (infix->op == OR && left_null) {
+                (*nstates)++;
+                children[0] = infix->right;
+            } else {
+                if (infix->op == OR)
+                    (*nstates)++;
+                children[0] = infix->left;
+                children[1] = infix->right;
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            if (children[i] == NULL)
+                continue;
+            int same_chain = e->type == INFIX_EXPRESSION && children[i]->type == INFIX_EXPRESSION &&
+                ((infix_expression_t *) children[i])->op == ((infix_expression_t *) e)->op;
+            cm_stack_push(stack, children[i]);
+            cm_stack_push(depths, (void *) (uintptr_t) (same_chain? d: d + 1));
+        }
+    }
+    cm_stack_free(stack);
+    cm_stack_free(depths);
+}
+
+/*
+ * Compiles the pattern within the limits in options, which may be NULL.
+ * On failure returns NULL and fills in error, if it is not NULL, with the
+ * reason. Nothing is left allocated in that case.
+ */
+nfa_machine_t *
+compile_regex_with_options(const char *regex_pattern, const re_compile_options_t *options,
+    re_compile_error_t *error)
+{
+    static const re_compile_options_t no_limits = {0, 0, 0, 0, 0};
+    char message[RE_ERROR_MESSAGE_SIZE];
+    if (options == NULL)
+        options = &no_limits;
+    set_error(error, RE_OK, "");
+
     lexer_t *lexer = lexer_init(regex_pattern);
+    // the parser reads its first tokens as soon as it is created
+    lexer->utf8 = (options->flags & RE_UTF8) != 0;
     parser_t *parser = parser_init(lexer);
+    parser->max_depth = options->max_depth;
+    parser->max_repetition = options->max_repetition;
+    parser->icase = (options->flags & RE_ICASE) != 0;
     regex_t *regex = parse_regex(parser);
-    if (parser->error)
-        errx(EXIT_FAILURE, "%s\n", parser->error); //TODO: should gracefully return an error rather than exiting
-    nfa_machine_t *machine;
-    machine = malloc(sizeof(*machine));
-    if (machine == NULL)
-        err(EXIT_FAILURE, "malloc failed");
-    machine->nstates = 0;
-    expression_node_t *root = (expression_node_t *) regex->root;
-    nfa_state_t *compiled_regex =  compile_fns[root->type](machine, root);
+    size_t parse_size = sizeof(*parser) + lexer_size(lexer);
+    if (parser->error) {
+        set_error(error, parser->error_code == RE_OK? RE_ERROR_SYNTAX: parser->error_code, parser->error);
+        parser_free(parser);
+        regex_free(regex);
+        return NULL;
+    }
     parser_free(parser);
+
+    size_t nstates, depth;
+    measure_tree(regex->root, &nstates, &depth);
+    if (options->max_depth && depth > options->max_depth) {
+        snprintf(message, sizeof(message), "Operators nested %zu deep, the limit is %zu", depth, options->max_depth);
+        set_error(error, RE_ERROR_TOO_DEEP, message);
+        regex_free(regex);
+        return NULL;
+    }
+    if (options->max_states && nstates > options->max_states) {
+        snprintf(message, sizeof(message), "Pattern needs %zu states, the limit is %zu", nstates, options->max_states);
+        set_error(error, RE_ERROR_TOO_MANY_STATES, message);
+        regex_free(regex);
+        return NULL;
+    }
+    nfa_machine_t *machine = compile_regex_ast(regex);
+    machine->max_dfa_memory = options->max_dfa_memory;
+    machine->parse_size = parse_size + regex_size(regex);
+    if (machine->reverse)
+        machine->reverse->max_dfa_memory = options->max_dfa_memory;
     regex_free(regex);
-    machine->start = compiled_regex;
     return machine;
 }
 
-static void
-free_state(nfa_state_t *state, nfa_state_t **seen_states, size_t nsates)
+/*
+ * Whether every match has to start at the start of the input, that is if
+ * every path from the start state to a char state or to the accepting
+ * state passes a `^`.
+ */
+static int
+is_anchored_start(nfa_machine_t *machine)
 {
+    int anchored = 1;
+    uint8_t *seen = re_calloc(machine->nstates, 1);
+    nfa_state_t **stack = re_malloc((2 * machine->nstates + 1) * sizeof(*stack));
+    if (seen == NULL || stack == NULL)
+        err(EXIT_FAILURE, "malloc failed");
     size_t top = 0;
-    stack[top++] = state;
-    while (top) {
+    stack[top++] = machine->start;
+    while (top && anchored) {
         nfa_state_t *s = stack[--top];
-        if (s == &ACCEPTING_STATE || seen_states[s->state_idx])
+        if (is_end_state(s) || !is_null_state(s)) {
+            anchored = 0;
+            break;
+        }
+        if (seen[s->state_idx] || s->assertion == ASSERT_TEXT_START)
             continue;
-        seen_states[s->state_idx] = s;
+        seen[s->state_idx] = 1;
         stack[top++] = s->out;
         if (s->out1)
             stack[top++] = s->out1;
     }
+    re_free(stack);
+    re_free(seen);
+    return anchored;
 }
 
+/*
+ * Moves the states into a single array in breadth first order from the
+ * start state, so that the states an executor steps through together, the
+ * ones a state moves to and the ones they move to in turn, sit next to
+ * each other rather than wherever the recursion over the AST created
+ * them. state_idx becomes the index in the array. The end lists are done
+ * with and states no longer reachable from the start are dropped.
+ */
+static void
+renumber_states(nfa_builder_t *builder)
+{
+    nfa_machine_t *machine = builder->machine;
+    size_t n = machine->nstates;
+    nfa_state_t **queue = re_malloc(n * sizeof(*queue));
+    size_t *renumber = re_malloc(n * sizeof(*renumber));
+    uint8_t *seen = re_calloc(n, 1);
+    if (queue == NULL || renumber == NULL || seen == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    size_t head = 0, tail = 0;
+    queue[tail++] = machine->start;
+    seen[machine->start->state_idx] = 1;
+    while (head < tail) {
+        nfa_state_t *s = queue[head];
+        renumber[s->state_idx] = head++;
+        nfa_state_t *next[2] = {s->out, s->out1};
+        for (int i = 0; i < 2; i++) {
+            if (next[i] && !is_end_state(next[i]) && !seen[next[i]->state_idx]) {
+                seen[next[i]->state_idx] = 1;
+                queue[tail++] = next[i];
+            }
+        }
+    }
 
-void
-free_nfa(nfa_machine_t *machine)
+    nfa_state_t *states = re_malloc(tail * sizeof(*states));
+    if (states == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    for (size_t i = 0; i < tail; i++) {
+        nfa_state_t *s = &states[i];
+        *s = *queue[i];
+        s->state_idx = i;
+        if (s->out && !is_end_state(s->out))
+            s->out = &states[renumber[s->out->state_idx]];
+        if (s->out1 && !is_end_state(s->out1))
+            s->out1 = &states[renumber[s->out1->state_idx]];
+    }
+    for (size_t i = 0; i < n; i++) {
+        free_end_list(builder->end_lists[i]);
+        re_free(builder->states[i]);
+    }
+    re_free(builder->states);
+    re_free(builder->end_lists);
+    re_free(queue);
+    re_free(renumber);
+    re_free(seen);
+    machine->states = states;
+    machine->start = states;
+    machine->nstates = tail;
+}
+
+static nfa_machine_t *
+build_machine(expression_node_t *root, int *has_end_anchor)
+{
+    nfa_machine_t *machine;
+    machine = re_calloc(1, sizeof(*machine));
+    if (machine == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    nfa_builder_t builder = {machine, NULL, NULL, 0};
+    machine->start = compile_expression_node(&builder, root);
+    renumber_states(&builder);
+    compute_byte_classes(machine);
+    *has_end_anchor = 0;
+    for (size_t i = 0; i < machine->nstates; i++) {
+        if (machine->states[i].assertion == ASSERT_TEXT_END)
+            *has_end_anchor = 1;
+    }
+    machine->anchored_start = is_anchored_start(machine);
+    return machine;
+}
+
+/*
+ * Builds the NFA for an already parsed regex. The AST is left untouched
+ * and is still owned by the caller. A pattern which can only match at the
+ * end of the input also gets the machine of the reversed pattern, which
+ * is anchored at the start, for scanning the input backwards. The analysis
+ * of the pattern is kept with the machine for the executors' prefilters,
+ * and a leading or trailing `.*` is left out of the machine in its favour.
+ * The plan says which engine re_meta_match runs the machine on.
+ */
+nfa_machine_t *
+compile_regex_ast(regex_t *regex)
+{
+    int has_end_anchor;
+    re_analysis_t analysis;
+    analyze_pattern(regex->root, &analysis);
+    expression_node_t *core = strip_any_wrappers(regex->root, &analysis);
+    expression_node_t *root = core? core: regex->root;
+    nfa_machine_t *machine = build_machine(root, &has_end_anchor);
+    machine->analysis = analysis;
+    plan_pattern(regex->root, &machine->plan);
+    // the reverse DFA finds where a match starts, which a leading `.*` fixes at 0
+    if (has_end_anchor && !machine->anchored_start && !analysis.leading_any) {
+        expression_node_t *reversed = reverse_expression(root);
+        nfa_machine_t *reverse = build_machine(reversed, &has_end_anchor);
+        free_expression(reversed);
+        if (reverse->anchored_start)
+            machine->reverse = reverse;
+        else
+            free_nfa(reverse);
+    }
+    if (core)
+        free_expression(core);
+    return machine;
+}
+
+/*
+ * Partitions the 256 byte values into classes such that no state of the
+ * machine can tell apart two bytes of the same class. Starting with a single
+ * class, every char set of the machine splits the existing classes into the
+ * bytes inside and outside of it. Table driven engines index their rows by
+ * these classes instead of by the raw byte.
+ */
+static void
+compute_byte_classes(nfa_machine_t *machine)
 {
-    nfa_state_t **states = calloc(1, sizeof(size_t *) * machine->nstates);
-    nfa_state_t *start = machine->start;
-    free_state(start, states, machine->nstates);
+    int16_t remap[256][2];
+    size_t nclasses = 1;
+    memset(machine->byte_classes, 0, sizeof(machine->byte_classes));
     for (size_t i = 0; i < machine->nstates; i++) {
-        free_end_list(states[i]->end_list);
-        free(states[i]);
+        nfa_state_t *s = &machine->states[i];
+        // word boundaries tell apart word bytes from the others
+        int word = s->assertion == ASSERT_WORD_BOUNDARY || s->assertion == ASSERT_NOT_WORD_BOUNDARY;
+        if (is_null_state(s) && !word)
+            continue;
+        size_t n = 0;
+        memset(remap, -1, sizeof(remap));
+        for (size_t c = 0; c < 256; c++) {
+            uint8_t class = machine->byte_classes[c];
+            int in = (word? is_word_byte(c): is_matching_state(s, c))? 1: 0;
+            if (remap[class][in] == -1)
+                remap[class][in] = n++;
+            machine->byte_classes[c] = remap[class][in];
+        }
+        nclasses = n;
     }
-    free(states);
-    free(machine);
-}
\ No newline at end of file
+    machine->nclasses = nclasses;
+}
+
+void
+free_nfa(nfa_machine_t *machine)
+{
+    re_free(machine->states);
+    if (machine->reverse)
+        free_nfa(machine->reverse);
+    free_analysis(&machine->analysis);
+    free_plan(&machine->plan);
+    re_free(machine);
+}
+
+/*
+ * Copies the execution statistics of the machine into summary. Returns 0,
+ * with summary zeroed, if the library was built without RE_STATS.
+ */
+int
+nfa_machine_stats(nfa_machine_t *machine, re_stats_summary_t *summary)
+{
+    memset(summary, 0, sizeof(*summary));
+#ifdef RE_STATS
+    re_stats_read(&machine->stats, summary);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void
+nfa_machine_reset_stats(nfa_machine_t *machine)
+{
+#ifdef RE_STATS
+    re_stats_reset(&machine->stats);
+#endif
+}
@@ -31,37 +31,119 @@
 #define NFA_COMPILER_H
 
 #include "ast.h"
+#include "parser.h"
+#include "re_analysis.h"
+#include "re_stats.h"
 
+/*
+ * What an executor looks at to follow a state comes first, so that the
+ * char set only costs the cache line of the byte looked up in it.
+ */
 typedef struct nfa_state_t {
     struct nfa_state_t *out;
     struct nfa_state_t *out1;
-    struct end_state_list *end_list;
-    uint8_t c[256];
     size_t state_idx;
+    uint8_t assertion; // an assertion_kind_t for null states which only pass if it holds
+    uint8_t null; // moves on without consuming a byte
+    uint8_t any; // moves on every byte
+    uint8_t c[256]; // the bytes a char state moves on
 } nfa_state_t;
 
-typedef struct end_state_list {
-    nfa_state_t *state;
-    struct end_state_list *next;
-    struct end_state_list *tail;
-} end_state_list;
-
 typedef struct nfa_machine_t {
     nfa_state_t *start;
+    nfa_state_t *states; // in breadth first order from start, which is the first one
     size_t nstates;
+    uint8_t byte_classes[256]; // byte -> equivalence class
+    size_t nclasses;
+    size_t max_dfa_memory; // cache size for lazy DFAs built from it, 0 for the default
+    int anchored_start; // every match starts at the start of the input
+    struct nfa_machine_t *reverse; // the reversed pattern if every match ends at the end of the input
+    re_analysis_t analysis; // of the pattern, not filled in for the reversed one
+    re_plan_t plan; // as is the engine plan
+    size_t parse_size; // the lexer, parser and parse tree compiling took, all freed since
+#ifdef RE_STATS
+    re_stats_t stats; // aggregated over all the matches against this machine
+#endif
 } nfa_machine_t;
 
 
+/* Pattern and input are UTF-8, `.` and classes match code points */
+#define RE_UTF8 0x1
+/* Letters match their other cases, ASCII only unless with RE_UTF8 */
+#define RE_ICASE 0x2
+
+/*
+ * Limits for compiling untrusted patterns, 0 means no limit. max_depth
+ * applies both to the nesting of groups and to the nesting of operators in
+ * the parsed expression, max_repetition to the number of nodes copied to
+ * expand `x+`. flags is a combination of the RE_ flags above.
+ */
+typedef struct re_compile_options_t {
+    size_t max_states;
+    size_t max_depth;
+    size_t max_repetition;
+    size_t max_dfa_memory;
+    int flags;
+} re_compile_options_t;
+
+#define RE_ERROR_MESSAGE_SIZE 128
+
+typedef struct re_compile_error_t {
+    re_error_code_t code;
+    char message[RE_ERROR_MESSAGE_SIZE];
+} re_compile_error_t;
+
 extern const nfa_state_t ACCEPTING_STATE;
 
 #define is_end_state(s) (s == &ACCEPTING_STATE)
-#define is_matching_state(s, c) (s->c[MATCH_ALL]? 1: s->c[c])
-#define is_null_state(s) (s->c[NULL_STATE])
+#define is_matching_state(s, c) ((s)->any? 1: (s)->c[c])
+#define is_null_state(s) ((s)->null)
+#define is_word_byte(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+    ((c) >= '0' && (c) <= '9') || (c) == '_')
+
+/* What an assertion can see of the input around a position */
+#define LOOK_TEXT_START 0x1
+#define LOOK_TEXT_END 0x2
+#define LOOK_PREV_WORD 0x4 // the byte before is a word byte
+#define LOOK_NEXT_WORD 0x8 // the byte after is a word byte
 
-typedef nfa_state_t * (*expression_compile_fn) (nfa_machine_t *, expression_node_t *);
+static inline int
+assertion_holds(uint8_t assertion, unsigned look)
+{
+    switch (assertion) {
+    case ASSERT_TEXT_START:
+        return (look & LOOK_TEXT_START) != 0;
+    case ASSERT_TEXT_END:
+        return (look & LOOK_TEXT_END) != 0;
+    case ASSERT_WORD_BOUNDARY:
+        return !(look & LOOK_PREV_WORD) != !(look & LOOK_NEXT_WORD);
+    case ASSERT_NOT_WORD_BOUNDARY:
+        return !(look & LOOK_PREV_WORD) == !(look & LOOK_NEXT_WORD);
+    default:
+        return 1;
+    }
+}
 
+/* The look of the position i in the first len bytes of string */
+static inline unsigned
+look_at(const char *string, size_t len, size_t i)
+{
+    unsigned look = 0;
+    if (i == 0)
+        look |= LOOK_TEXT_START;
+    else if (is_word_byte((uint8_t) string[i - 1]))
+        look |= LOOK_PREV_WORD;
+    if (i == len)
+        look |= LOOK_TEXT_END;
+    else if (is_word_byte((uint8_t) string[i]))
+        look |= LOOK_NEXT_WORD;
+    return look;
+}
 
 void free_nfa(nfa_machine_t *);
 nfa_machine_t *compile_regex(const char *);
-void free_end_list(end_state_list *);
+nfa_machine_t *compile_regex_with_options(const char *, const re_compile_options_t *, re_compile_error_t *);
+nfa_machine_t *compile_regex_ast(regex_t *);
+int nfa_machine_stats(nfa_machine_t *, re_stats_summary_t *);
+void nfa_machine_reset_stats(nfa_machine_t *);
 #endif
\ No newline at end of file
@@ -34,114 +34,249 @@
 
 #include "nfa_compiler.h"
 #include "nfa_executor.h"
+#include "re_utils.h"
 
-#define LIST_SIZE 128
-static nfa_state_t ** clist;
-static nfa_state_t ** nlist;
-static uint8_t *idx_list;
-static size_t CLIST_INDEX;
-static size_t NLIST_INDEX;
-static size_t counter = 0;
-
-#define add_state_to_list(s) if (idx_list[s->state_idx] <= counter) { \
-    idx_list[s->state_idx]++; \
-    nlist[NLIST_INDEX++] = s; \
-    }
+/*
+ * List of threads (char states waiting for the next input byte) for one
+ * position in the input. starts[i] is the offset where the match attempt of
+ * states[i] began, it is only looked at in MATCH_SEARCH mode. The threads are
+ * kept in the order of their start offset, so that the first thread to reach
+ * the accepting state is also the leftmost one.
+ */
+typedef struct thread_list {
+    nfa_state_t **states;
+    size_t *starts;
+    size_t n;
+    int matched;
+    size_t match_start;
+} thread_list;
+
+typedef struct exec_state {
+    thread_list lists[2];
+    nfa_state_t **stack;
+    size_t *marks;
+#ifdef RE_STATS
+    re_match_stats_t stats;
+#endif
+} exec_state;
+
+/*
+ * The bytes of the scratch space for a match of machine: its thread lists
+ * and closure stack.
+ */
+size_t
+nfa_scratch_size(nfa_machine_t *machine)
+{
+    size_t n = machine->nstates + 1;
+    return 2 * n * (sizeof(nfa_state_t *) + sizeof(size_t)) + (2 * n + 1) * sizeof(nfa_state_t *) +
+        n * sizeof(size_t);
+}
 
+/*
+ * Points the exec state at the scratch space, making room in it for the
+ * states of machine first if they are more than it has seen. The marks
+ * are only cleared when the space is new, a match goes on from the
+ * generation the last one stopped at.
+ */
 static void
-find_match_state(nfa_state_t *s, u_int8_t c)
+exec_state_init(exec_state *e, nfa_scratch_t *scratch, nfa_machine_t *machine)
 {
-    if (is_end_state(s)) {
-        add_state_to_list(s);
-        return;
+    size_t n = machine->nstates + 1;
+    if (scratch->nstates < n) {
+        re_free(scratch->mem);
+        scratch->mem = re_calloc(1, nfa_scratch_size(machine));
+        if (scratch->mem == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+        scratch->nstates = n;
+        scratch->gen = 0;
     }
-
-    if (is_null_state(s)) {
-        find_match_state(s->out, c);
-        if (s->out1)
-            find_match_state(s->out1, c);
-        return;
+    // the size_t arrays go first, the pointers after them
+    size_t *sizes = scratch->mem;
+    nfa_state_t **states = (nfa_state_t **) (sizes + 3 * scratch->nstates);
+    e->marks = sizes;
+    e->stack = states;
+    for (size_t i = 0; i < 2; i++) {
+        e->lists[i].starts = sizes + (i + 1) * scratch->nstates;
+        // every null state pushes at most two states on the stack
+        e->lists[i].states = states + 2 * scratch->nstates + 1 + i * scratch->nstates;
+        e->lists[i].n = 0;
+        e->lists[i].matched = 0;
     }
+    RE_STATS_DO(memset(&e->stats, 0, sizeof(e->stats)));
+}
 
-    if (!is_matching_state(s, c))
-        return;
-    add_state_to_list(s);
+/*
+ * Follows the epsilon transitions from state and adds every char state
+ * reachable that way to the list. gen identifies the input position the
+ * list is for, marks[] remembers which states have been added already for
+ * that position so that no state is visited twice (this also keeps epsilon
+ * loops such as the one in `(a*)*` from spinning forever). Assertions are
+ * only passed if they hold for the look of that position.
+ */
+static void
+add_closure(exec_state *e, thread_list *l, nfa_state_t *state, size_t start, size_t gen, unsigned look)
+{
+    size_t top = 0;
+    e->stack[top++] = state;
+    while (top) {
+        nfa_state_t *s = e->stack[--top];
+        if (is_end_state(s)) {
+            if (!l->matched) {
+                l->matched = 1;
+                l->match_start = start;
+            }
+            continue;
+        }
+        if (e->marks[s->state_idx] == gen)
+            continue;
+        e->marks[s->state_idx] = gen;
+        if (is_null_state(s)) {
+            if (!assertion_holds(s->assertion, look))
+                continue;
+            RE_STATS_DO(e->stats.epsilon_edges += s->out1? 2: 1);
+            if (s->out1)
+                e->stack[top++] = s->out1;
+            e->stack[top++] = s->out;
+            continue;
+        }
+        l->states[l->n] = s;
+        l->starts[l->n++] = start;
+    }
 }
 
-static int
-check_end_state(nfa_state_t *s)
+/*
+ * Drops the threads which started after the given offset, used in MATCH_SEARCH
+ * mode once a match is known to start at that offset.
+ */
+static void
+prune_threads(thread_list *l, size_t start)
 {
-    if (is_end_state(s))
-        return 1;
-    if (is_end_state(s->out))
-        return 1;
-    if (s->out1 && is_end_state(s->out1))
-        return 1;
-
-    if (is_null_state(s->out)) {
-        if (is_end_state(s->out->out1) || is_end_state(s->out->out))
-            return 1;
+    size_t n = 0;
+    for (size_t i = 0; i < l->n; i++) {
+        if (l->starts[i] > start)
+            break;
+        n++;
     }
-    return 0;
+    l->n = n;
 }
 
-int
-nfa_execute(nfa_machine_t *machine, const char *string)
+/*
+ * Runs the machine in the given mode. Without a leading `.*` in the
+ * machine every offset is a start offset, but the matches of the pattern
+ * all start at 0.
+ */
+static int
+nfa_run(nfa_machine_t *machine, nfa_scratch_t *scratch, const char *string, size_t len, match_mode_t mode,
+    match_t *match)
 {
-    clist = calloc(LIST_SIZE, sizeof(nfa_state_t *));
-    nlist = calloc(LIST_SIZE, sizeof(nfa_state_t *));
-    size_t idx_len = machine->nstates;
-    idx_list = calloc(1, idx_len);
-    CLIST_INDEX = 0;
-    NLIST_INDEX = 0;
+    exec_state e;
+    thread_list *clist, *nlist, *temp_list;
+    match_t best = {0, 0};
+    int leading_any = machine->analysis.leading_any;
+    int anchored = (mode == MATCH_FULL || mode == MATCH_PREFIX || machine->anchored_start) && !leading_any;
+    int seeding = 1;
     int retval = 0;
-    counter = 0;
-    find_match_state(machine->start, *string++);
-    counter++;
-    CLIST_INDEX = NLIST_INDEX;
-    NLIST_INDEX = 0;
-    nfa_state_t **temp_list = nlist;
-    nlist = clist;
-    clist = temp_list;
-
-    while (*string) {
-        u_int8_t c = (u_int8_t) *string++;
-        for (size_t i = 0; i < CLIST_INDEX; i++) {
-            nfa_state_t *s = clist[i];
-            if (is_end_state(s)) {
-                add_state_to_list(s);
-                continue;
-            }
-            if (is_end_state(s->out)) {
-                add_state_to_list(s->out);
-            } else {
-                find_match_state(s->out, c);
+
+    exec_state_init(&e, scratch, machine);
+    size_t base = scratch->gen;
+    RE_STATS_DO(e.stats.prefilter_candidates = machine->analysis.required.len != 0);
+    clist = &e.lists[0];
+    nlist = &e.lists[1];
+    for (size_t i = 0; ; i++) {
+        size_t gen = base + i + 1;
+        scratch->gen = gen + 1;
+        if (seeding)
+            add_closure(&e, clist, machine->start, leading_any? 0: i, gen, look_at(string, len, i));
+        if (anchored)
+            seeding = 0;
+        RE_STATS_DO(if (clist->n > e.stats.peak_threads) e.stats.peak_threads = clist->n);
+
+        if (clist->matched) {
+            if (mode == MATCH_PREFIX || mode == MATCH_ANY || (mode == MATCH_FULL && i == len)) {
+                best.start = clist->match_start;
+                best.end = i;
+                retval = 1;
+                break;
             }
-            if (s->out1) {
-                if (is_end_state(s->out1)) {
-                    add_state_to_list(s->out1);
-                } else {
-                    find_match_state(s->out1, c);
-                }
+            if (mode == MATCH_SEARCH && (!retval || clist->match_start <= best.start)) {
+                best.start = clist->match_start;
+                best.end = i;
+                retval = 1;
+                seeding = leading_any;
+                prune_threads(clist, best.start);
             }
         }
-        counter++;
-        CLIST_INDEX = NLIST_INDEX;
-        NLIST_INDEX = 0;
-        temp_list = nlist;
-        nlist = clist;
-        clist = temp_list;
-        if (CLIST_INDEX == 0)
-            break;
-    }
-    for (size_t i = 0; i < CLIST_INDEX; i++) {
-        if (check_end_state(clist[i])) {
-            retval = 1;
+        if (i == len || (clist->n == 0 && !seeding))
             break;
+
+        uint8_t c = (uint8_t) string[i];
+        RE_STATS_DO(e.stats.bytes_scanned++; e.stats.steps += clist->n);
+        unsigned look = look_at(string, len, i + 1);
+        nlist->n = 0;
+        nlist->matched = 0;
+        for (size_t j = 0; j < clist->n; j++) {
+            nfa_state_t *s = clist->states[j];
+            if (!is_matching_state(s, c))
+                continue;
+            add_closure(&e, nlist, s->out, clist->starts[j], gen + 1, look);
+            if (s->out1)
+                add_closure(&e, nlist, s->out1, clist->starts[j], gen + 1, look);
         }
+        temp_list = clist;
+        clist = nlist;
+        nlist = temp_list;
     }
-    free(idx_list);
-    free(clist);
-    free(nlist);
+    RE_STATS_DO(re_stats_add(&machine->stats, RE_ENGINE_NFA, &e.stats));
+    if (retval && match && mode != MATCH_ANY)
+        *match = best;
     return retval;
 }
+
+/*
+ * Runs the machine against the first len bytes of string. Returns 1 if there
+ * is a match as defined by mode, 0 otherwise. If match is not NULL, the offsets
+ * of the match are stored in it (except for MATCH_ANY, which does not report
+ * a position). The scan stops as soon as the answer is known, for MATCH_PREFIX
+ * and MATCH_ANY that is the first time the accepting state becomes reachable.
+ * Inputs the analysis of the pattern can answer for are not scanned at all.
+ * The scratch space is only allocated for an input which has to be scanned.
+ */
+int
+nfa_match_scratch(nfa_machine_t *machine, nfa_scratch_t *scratch, const char *string, size_t len,
+    match_mode_t mode, match_t *match)
+{
+    const re_analysis_t *a = &machine->analysis;
+    int ret = match_precheck(a, string, len, mode, match);
+    if (ret != -1) {
+        RE_STATS_DO(re_stats_add_prefiltered(&machine->stats, RE_ENGINE_NFA, len));
+        return ret;
+    }
+    ret = nfa_run(machine, scratch, string, len, core_mode(a, mode), match);
+    return extend_match(a, ret, len, mode, match);
+}
+
+/*
+ * nfa_match_scratch with scratch space of its own.
+ */
+int
+nfa_match(nfa_machine_t *machine, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    nfa_scratch_t scratch = {0};
+    int ret = nfa_match_scratch(machine, &scratch, string, len, mode, match);
+    nfa_scratch_free(&scratch);
+    return ret;
+}
+
+void
+nfa_scratch_free(nfa_scratch_t *scratch)
+{
+    re_free(scratch->mem);
+    scratch->mem = NULL;
+    scratch->nstates = 0;
+}
+
+int
+nfa_execute(nfa_machine_t *machine, const char *string)
+{
+    return nfa_match(machine, string, strlen(string), MATCH_PREFIX, NULL);
+}
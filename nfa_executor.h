@@ -30,7 +30,85 @@
 #ifndef NFA_EXECUTOR_H
 #define NFA_EXECUTOR_H
 
+#include <stddef.h>
+#include <string.h>
+
 #include "nfa_compiler.h"
+#include "re_analysis.h"
+
+typedef enum match_mode_t {
+    MATCH_FULL, // the whole string has to match
+    MATCH_PREFIX, // some prefix of the string has to match, this is what nfa_execute does
+    MATCH_SEARCH, // leftmost-longest match anywhere in the string
+    MATCH_ANY // is there a match anywhere in the string, stops at the first one found
+} match_mode_t;
+
+typedef struct match_t {
+    size_t start;
+    size_t end;
+} match_t;
+
+/*
+ * Space for the thread lists and closure stack of the NFA, which a caller
+ * can keep across its matches against any machine, one at a time. Zeroed
+ * before first use.
+ */
+typedef struct nfa_scratch_t {
+    void *mem;
+    size_t nstates; // the size of the NFAs there is room for
+    size_t gen; // the generation of the marks the next match starts after
+} nfa_scratch_t;
+
+/*
+ * Answers a match from the analysis of the pattern alone where it can. An
+ * input too short or, for MATCH_FULL, too long is rejected, as is one
+ * without the required string or, for the anchored modes, not starting
+ * or ending with the prefix and suffix of every match. A pattern which
+ * matches the empty string anywhere matches at once in the modes where
+ * the empty match at the start is the answer. Returns the result, or -1 if
+ * an engine has to run.
+ */
+static inline int
+match_precheck(const re_analysis_t *a, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    int anchored = mode == MATCH_FULL || mode == MATCH_PREFIX;
+    if (len < a->min_len || (mode == MATCH_FULL && len > a->max_len))
+        return 0;
+    if (a->nullable && (mode == MATCH_PREFIX || mode == MATCH_ANY || len == 0)) {
+        if (match) {
+            match->start = 0;
+            match->end = 0;
+        }
+        return 1;
+    }
+    if (anchored && a->prefix.len && memcmp(string, a->prefix.bytes, a->prefix.len) != 0)
+        return 0;
+    if (mode == MATCH_FULL && a->suffix.len && memcmp(string + len - a->suffix.len, a->suffix.bytes, a->suffix.len) != 0)
+        return 0;
+    if (a->required.len && find_literal(string, len, &a->required) == NULL)
+        return 0;
+    return -1;
+}
+
+/*
+ * Without its trailing `.*` a machine matches the whole input if it
+ * matches a prefix of it, and a match of the pattern runs on to the end
+ * of the input. These translate the mode for the machine and its match
+ * back for the pattern.
+ */
+#define core_mode(a, mode) ((a)->trailing_any && (mode) == MATCH_FULL? MATCH_PREFIX: (mode))
+
+static inline int
+extend_match(const re_analysis_t *a, int ret, size_t len, match_mode_t mode, match_t *match)
+{
+    if (ret && match && a->trailing_any && (mode == MATCH_FULL || mode == MATCH_SEARCH))
+        match->end = len;
+    return ret;
+}
 
 int nfa_execute(nfa_machine_t *, const char *);
+size_t nfa_scratch_size(nfa_machine_t *);
+int nfa_match(nfa_machine_t *, const char *, size_t, match_mode_t, match_t *);
+int nfa_match_scratch(nfa_machine_t *, nfa_scratch_t *, const char *, size_t, match_mode_t, match_t *);
+void nfa_scratch_free(nfa_scratch_t *);
 #endif
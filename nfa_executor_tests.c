@@ -27,11 +27,14 @@
  * SUCH DAMAGE.
  */
 
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "nfa_compiler.h"
 #include "nfa_executor.h"
 #include "parser.h"
+#include "re_utils.h"
 #include "test_utils.h"
 
 #define ANSI_COLOR_RED     "\x1b[31m"
@@ -77,6 +80,9 @@ test_matches(void)
         {"a?a?a?aaa", "aaab", 1},
         {"a?a?a?aaa", "a", 0},
         {"a?a?a?a?a?a?a?aaaaaaa", "aaaaaaa", 1},
+        {"a?b", "ab", 1},
+        {"a?b", "b", 1},
+        {"(a*)*b", "aab", 1},
         {"(ab|c)+", "ab", 1},
         {"((ab|cd)+)12", "ab12", 1},
         {"((ab|cd)+)12", "cd12", 1},
@@ -143,8 +149,651 @@ test_matches(void)
     }
 }
 
+static void
+test_match_modes(void)
+{
+    typedef struct test_input {
+        const char *regex;
+        const char *s;
+        match_mode_t mode;
+        int expected;
+        size_t start;
+        size_t end;
+    } test_input;
+
+    static const char *mode_names[] = {"full", "prefix", "search", "any"};
+
+    test_input tests[] = {
+        {"a+", "aaa", MATCH_FULL, 1, 0, 3},
+        {"a+", "aab", MATCH_FULL, 0, 0, 0},
+        {"a+", "", MATCH_FULL, 0, 0, 0},
+        {"a*", "", MATCH_FULL, 1, 0, 0},
+        {"ab|cd", "cd", MATCH_FULL, 1, 0, 2},
+        {"ab|cd", "abcd", MATCH_FULL, 0, 0, 0},
+        {"a+", "aab", MATCH_PREFIX, 1, 0, 1},
+        {"a+", "ba", MATCH_PREFIX, 0, 0, 0},
+        {"a*", "b", MATCH_PREFIX, 1, 0, 0},
+        {"a+", "ba", MATCH_SEARCH, 1, 1, 2},
+        {"a+", "bcaaad", MATCH_SEARCH, 1, 2, 5},
+        {"a+", "bcd", MATCH_SEARCH, 0, 0, 0},
+        {"ab|b", "xab", MATCH_SEARCH, 1, 1, 3},
+        {"b|abc", "abc", MATCH_SEARCH, 1, 0, 3},
+        {"[0-9]+", "id=1234;", MATCH_SEARCH, 1, 3, 7},
+        {"a*", "bbb", MATCH_SEARCH, 1, 0, 0},
+        {"a+", "ba", MATCH_ANY, 1, 0, 0},
+        {"a+b+c+de", "123aabcde", MATCH_ANY, 1, 0, 0},
+        {"a+b+c+de", "123aabcd", MATCH_ANY, 0, 0, 0},
+    };
+
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        test_input t = tests[i];
+        match_t m = {0, 0};
+        printf("Testing regex %s with string %s in %s mode---", t.regex, t.s, mode_names[t.mode]);
+        nfa_machine_t *machine = compile_regex(t.regex);
+        int match = nfa_match(machine, t.s, strlen(t.s), t.mode, &m);
+        free_nfa(machine);
+        test(match == t.expected, ANSI_COLOR_RED "failed for input %s: %s\n" ANSI_COLOR_RESET, t.regex, t.s);
+        if (match && t.mode != MATCH_ANY)
+            test(m.start == t.start && m.end == t.end,
+                ANSI_COLOR_RED "expected match at [%zu, %zu), got [%zu, %zu)\n" ANSI_COLOR_RESET,
+                t.start, t.end, m.start, m.end);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+}
+
+static void
+test_assertions(void)
+{
+    typedef struct test_input {
+        const char *regex;
+        const char *s;
+        match_mode_t mode;
+        int expected;
+        size_t start;
+        size_t end;
+    } test_input;
+
+    static const char *mode_names[] = {"full", "prefix", "search", "any"};
+
+    test_input tests[] = {
+        {"^ab", "abab", MATCH_SEARCH, 1, 0, 2},
+        {"^ab", "xab", MATCH_SEARCH, 0, 0, 0},
+        {"ab$", "abab", MATCH_SEARCH, 1, 2, 4},
+        {"ab$", "abx", MATCH_ANY, 0, 0, 0},
+        {"^$", "", MATCH_FULL, 1, 0, 0},
+        {"^$", "a", MATCH_SEARCH, 0, 0, 0},
+        {"a^b", "ab", MATCH_SEARCH, 0, 0, 0},
+        {"x$|y", "yx", MATCH_SEARCH, 1, 0, 1},
+        {"(^|,)b", "a,b", MATCH_SEARCH, 1, 1, 3},
+        {"\\bfoo\\b", "a foo.", MATCH_SEARCH, 1, 2, 5},
+        {"\\bfoo\\b", "foobar", MATCH_SEARCH, 0, 0, 0},
+        {"\\bfoo\\b", "foo", MATCH_FULL, 1, 0, 3},
+        {"o\\B", "foo bo", MATCH_SEARCH, 1, 1, 2},
+        {"\\B", "ab", MATCH_SEARCH, 1, 1, 1},
+        {"\\b", "", MATCH_ANY, 0, 0, 0},
+        {"a+\\b", "aa b", MATCH_PREFIX, 1, 0, 2},
+        {"[a-z]+$", "one two", MATCH_SEARCH, 1, 4, 7},
+    };
+
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        test_input t = tests[i];
+        match_t m = {0, 0};
+        printf("Testing regex %s with string %s in %s mode---", t.regex, t.s, mode_names[t.mode]);
+        nfa_machine_t *machine = compile_regex(t.regex);
+        int match = nfa_match(machine, t.s, strlen(t.s), t.mode, &m);
+        free_nfa(machine);
+        test(match == t.expected, ANSI_COLOR_RED "failed for input %s: %s\n" ANSI_COLOR_RESET, t.regex, t.s);
+        if (match && t.mode != MATCH_ANY)
+            test(m.start == t.start && m.end == t.end,
+                ANSI_COLOR_RED "expected match at [%zu, %zu), got [%zu, %zu)\n" ANSI_COLOR_RESET,
+                t.start, t.end, m.start, m.end);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+
+    typedef struct anchor_input {
+        const char *regex;
+        int anchored_start;
+        int reverse;
+    } anchor_input;
+
+    anchor_input anchors[] = {
+        {"^ab", 1, 0},
+        {"^a|^b", 1, 0},
+        {"^a|b", 0, 0},
+        {"ab$", 0, 1},
+        {"a$|b$", 0, 1},
+        {"a$|b", 0, 0},
+        {"^ab$", 1, 0},
+        {"\\bab", 0, 0},
+    };
+
+    for (size_t i = 0; i < sizeof(anchors)/sizeof(anchors[0]); i++) {
+        anchor_input t = anchors[i];
+        printf("Testing anchors of %s---", t.regex);
+        nfa_machine_t *machine = compile_regex(t.regex);
+        test(machine->anchored_start == t.anchored_start,
+            ANSI_COLOR_RED "expected anchored_start %d\n" ANSI_COLOR_RESET, t.anchored_start);
+        test((machine->reverse != NULL) == t.reverse,
+            ANSI_COLOR_RED "expected %s reverse machine\n" ANSI_COLOR_RESET, t.reverse? "a": "no");
+        free_nfa(machine);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+}
+
+static void
+test_escapes_and_classes(void)
+{
+    typedef struct test_input {
+        const char *regex;
+        int flags;
+        const char *s;
+        int expected;
+    } test_input;
+
+    test_input tests[] = {
+        {"\\d+", 0, "2024", 1},
+        {"\\d+", 0, "20a4", 0},
+        {"\\D+", 0, "ab-\xff", 1},
+        {"\\D", 0, "7", 0},
+        {"\\w+", 0, "foo_Bar9", 1},
+        {"\\W", 0, "_", 0},
+        {"\\W", 0, "\xfe", 1},
+        {"\\s\\S", 0, "\tx", 1},
+        {"\\s", 0, "\v", 1},
+        {"a\\.b", 0, "a.b", 1},
+        {"a\\.b", 0, "axb", 0},
+        {"\\(\\*\\)", 0, "(*)", 1},
+        {"\\\\", 0, "\\", 1},
+        {"a\\n\\t", 0, "a\n\t", 1},
+        {"\\x41\\x7e", 0, "A~", 1},
+        {"\\xff+", 0, "\xff\xff", 1},
+        {"\\x00", 0, "", 0},
+        {"[^a-c]", 0, "d", 1},
+        {"[^a-c]", 0, "b", 0},
+        {"[^a]", 0, "\xff", 1},
+        {"[^]a]", 0, "]", 0},
+        {"[^]a]", 0, "b", 1},
+        {"[\\^a]", 0, "^", 1},
+        {"[a^]", 0, "^", 1},
+        {"[.+*?()|$]+", 0, ".+*?()|$", 1},
+        {"[.]", 0, "x", 0},
+        {"[a\\-z]", 0, "b", 0},
+        {"[a\\-z]", 0, "-", 1},
+        {"[\\d-z]+", 0, "1-z", 1},
+        {"[\\x00-\\x1f]", 0, "\x1f", 1},
+        {"[\\d\\s]+", 0, "1 2", 1},
+        {"[^\\d\\s]", 0, " ", 0},
+        {"[\\W]", 0, "a", 0},
+        {"[[:alpha:]_][[:alnum:]_]*", 0, "_id9", 1},
+        {"[[:alpha:]]", 0, "9", 0},
+        {"[^[:space:][:punct:]]+", 0, "ab9", 1},
+        {"[^[:space:][:punct:]]+", 0, "a,b", 0},
+        {"[[:xdigit:]]+", 0, "00fF", 1},
+        {"[[:upper:]]+", RE_ICASE, "aBc", 1},
+        {"[^a]", RE_ICASE, "A", 0},
+        {"\\W", RE_ICASE, "K", 0},
+        {"\\w", RE_UTF8, "é", 0},
+        {"\\W", RE_UTF8, "é", 1},
+        {"\\D+", RE_UTF8, "a€😀", 1},
+        {"[^a]", RE_UTF8, "€", 1},
+        {"[^a]", RE_UTF8, "\xff", 0},
+        {"[^α-ω]", RE_UTF8, "λ", 0},
+        {"[^α-ω]", RE_UTF8, "λλ", 0},
+        {"[^α-ω]", RE_UTF8, "Λ", 1},
+        {"[^α-ω]", RE_UTF8 | RE_ICASE, "Λ", 0},
+        {"\\é\\.", RE_UTF8, "é.", 1},
+        {"\\xe9", RE_UTF8, "é", 1},
+        {"\\.", RE_UTF8, "x", 0},
+    };
+
+    print_test_separator_line();
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        test_input t = tests[i];
+        re_compile_options_t options = {.flags = t.flags};
+        printf("Testing regex %s with flags %d and string %s---", t.regex, t.flags, t.s);
+        nfa_machine_t *machine = compile_regex_with_options(t.regex, &options, NULL);
+        test(machine != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET, t.regex);
+        int match = nfa_match(machine, t.s, strlen(t.s), MATCH_FULL, NULL);
+        free_nfa(machine);
+        test(match == t.expected, ANSI_COLOR_RED "failed for input %s: %s\n" ANSI_COLOR_RESET, t.regex, t.s);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+
+    // a class of any kind is one char set state
+    const char *single_state[] = {
+        "\\d", "\\D", "\\w", "\\W", "\\s", "\\S", "\\.", "\\x00", "[^a-z]", "[[:punct:]]", "[^\\d[:alpha:]]", "[\\W_]"
+    };
+    for (size_t i = 0; i < sizeof(single_state)/sizeof(single_state[0]); i++) {
+        printf("Testing states of %s---", single_state[i]);
+        nfa_machine_t *machine = compile_regex(single_state[i]);
+        test(machine != NULL && machine->nstates == 1,
+            ANSI_COLOR_RED "expected a single state for %s\n" ANSI_COLOR_RESET, single_state[i]);
+        free_nfa(machine);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+
+    const char *invalid[] = {"a\\", "\\q", "\\1", "\\x4", "\\xg0", "[[:alpha]", "[[:foo:]]", "[\\b]", "[a-\\x00]"};
+    for (size_t i = 0; i < sizeof(invalid)/sizeof(invalid[0]); i++) {
+        printf("Testing invalid escape %s---", invalid[i]);
+        nfa_machine_t *machine = compile_regex(invalid[i]);
+        test(machine == NULL, ANSI_COLOR_RED "%s should not compile\n" ANSI_COLOR_RESET, invalid[i]);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+}
+
+static void
+test_required_literal(void)
+{
+    typedef struct test_input {
+        const char *regex;
+        int flags;
+        const char *required;
+    } test_input;
+
+    test_input tests[] = {
+        {"abc", 0, "abc"},
+        {"[a-z]+@corp\\.example\\.com", 0, "@corp.example.com"},
+        {".*session_id=[0-9]+", 0, "session_id="},
+        {"ab*cde", 0, "cde"},
+        {"a+bc", 0, "bc"},
+        {"(ab)+", 0, "ab"},
+        {"x(foobar|foobaz)y", 0, "xfooba"},
+        {"(foo|bar)baz", 0, "baz"},
+        {"(abc|abc)d", 0, "abcd"},
+        {"\\bfoo\\b", 0, "foo"},
+        {"^ab$", 0, "ab"},
+        {"a?bc", 0, "bc"},
+        {"[x]y[.]", 0, "xy."},
+        {"é+", RE_UTF8, "é"},
+        {"ab", RE_ICASE, ""},
+        {"a-1", RE_ICASE, "-1"},
+        {"a*", 0, ""},
+        {"a|b", 0, ""},
+        {"a.b", 0, "a"},
+        {"[ab]c", 0, "c"},
+    };
+
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        test_input t = tests[i];
+        re_compile_options_t options = {.flags = t.flags};
+        printf("Testing the required string of %s---", t.regex);
+        nfa_machine_t *machine = compile_regex_with_options(t.regex, &options, NULL);
+        const re_literal_t *required = &machine->analysis.required;
+        test(required->len == strlen(t.required) &&
+            (required->len == 0 || memcmp(required->bytes, t.required, required->len) == 0),
+            ANSI_COLOR_RED "expected %s, got %.*s\n" ANSI_COLOR_RESET, t.required, (int) required->len,
+            required->len? (const char *) required->bytes: "");
+        free_nfa(machine);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+}
+
+static void
+test_pattern_analysis(void)
+{
+    typedef struct test_input {
+        const char *regex;
+        int flags;
+        size_t min_len;
+        size_t max_len;
+        int nullable;
+        const char *prefix;
+        const char *suffix;
+        int leading_any;
+        int trailing_any;
+    } test_input;
+
+    test_input tests[] = {
+        {"a+b+c+de", 0, 5, RE_UNBOUNDED, 0, "a", "de", 0, 0},
+        {"abc", 0, 3, 3, 0, "abc", "abc", 0, 0},
+        {"a*", 0, 0, RE_UNBOUNDED, 1, "", "", 0, 0},
+        {"(ab)?c", 0, 1, 3, 0, "", "c", 0, 0},
+        {"ab|abcd", 0, 2, 4, 0, "ab", "", 0, 0},
+        {"x?", 0, 0, 1, 1, "", "", 0, 0},
+        {"^$", 0, 0, 0, 0, "", "", 0, 0},
+        {"\\b|a*", 0, 0, RE_UNBOUNDED, 1, "", "", 0, 0},
+        {"(ab)*c?", 0, 0, RE_UNBOUNDED, 1, "", "", 0, 0},
+        {".", RE_UTF8, 1, 4, 0, "", "", 0, 0},
+        {"[α-ω]", RE_UTF8, 2, 2, 0, "", "", 0, 0},
+        {"é", RE_UTF8, 2, 2, 0, "é", "é", 0, 0},
+        {".*ab", 0, 2, RE_UNBOUNDED, 0, "", "ab", 1, 0},
+        {"ab.*", 0, 2, RE_UNBOUNDED, 0, "ab", "", 0, 1},
+        {".*a(b|c).*", 0, 2, RE_UNBOUNDED, 0, "", "", 1, 1},
+        {"(.*)ab", 0, 2, RE_UNBOUNDED, 0, "", "ab", 1, 0},
+        {".*", 0, 0, RE_UNBOUNDED, 1, "", "", 0, 0},
+        {".*.*", 0, 0, RE_UNBOUNDED, 1, "", "", 0, 1},
+        {".*a|b", 0, 1, RE_UNBOUNDED, 0, "", "", 0, 0},
+        {".*ab", RE_UTF8, 2, RE_UNBOUNDED, 0, "", "ab", 0, 0},
+        {"^.*ab", 0, 2, RE_UNBOUNDED, 0, "", "ab", 0, 0},
+    };
+
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        test_input t = tests[i];
+        re_compile_options_t options = {.flags = t.flags};
+        printf("Testing the analysis of %s---", t.regex);
+        nfa_machine_t *machine = compile_regex_with_options(t.regex, &options, NULL);
+        test(machine != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET, t.regex);
+        const re_analysis_t *a = &machine->analysis;
+        test(a->min_len == t.min_len && a->max_len == t.max_len && a->nullable == t.nullable,
+            ANSI_COLOR_RED "expected lengths [%zu, %zu] and nullable %d, got [%zu, %zu] and %d\n" ANSI_COLOR_RESET,
+            t.min_len, t.max_len, t.nullable, a->min_len, a->max_len, a->nullable);
+        test(a->prefix.len == strlen(t.prefix) && (a->prefix.len == 0 ||
+            memcmp(a->prefix.bytes, t.prefix, a->prefix.len) == 0),
+            ANSI_COLOR_RED "expected prefix %s\n" ANSI_COLOR_RESET, t.prefix);
+        test(a->suffix.len == strlen(t.suffix) && (a->suffix.len == 0 ||
+            memcmp(a->suffix.bytes, t.suffix, a->suffix.len) == 0),
+            ANSI_COLOR_RED "expected suffix %s\n" ANSI_COLOR_RESET, t.suffix);
+        test(a->leading_any == t.leading_any && a->trailing_any == t.trailing_any,
+            ANSI_COLOR_RED "expected leading and trailing .* %d %d, got %d %d\n" ANSI_COLOR_RESET,
+            t.leading_any, t.trailing_any, a->leading_any, a->trailing_any);
+        free_nfa(machine);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+
+    typedef struct match_input {
+        const char *regex;
+        const char *s;
+        match_mode_t mode;
+        int expected;
+        size_t start;
+        size_t end;
+    } match_input;
+
+    match_input matches[] = {
+        {"a*", "bbb", MATCH_PREFIX, 1, 0, 0},
+        {"a*", "aab", MATCH_SEARCH, 1, 0, 2},
+        {"a*", "", MATCH_FULL, 1, 0, 0},
+        {"a*", "ab", MATCH_FULL, 0, 0, 0},
+        {"a+b+c+de", "abcd", MATCH_SEARCH, 0, 0, 0},
+        {"abc", "abcd", MATCH_FULL, 0, 0, 0},
+        {"ab[0-9]+yz", "ab1yz", MATCH_FULL, 1, 0, 5},
+        {"ab[0-9]+yz", "ab1yy", MATCH_FULL, 0, 0, 0},
+        {".*ab", "xabyab", MATCH_SEARCH, 1, 0, 6},
+        {".*ab", "xabyab", MATCH_PREFIX, 1, 0, 3},
+        {".*ab", "xaby", MATCH_FULL, 0, 0, 0},
+        {".*ab", "xaby", MATCH_SEARCH, 1, 0, 3},
+        {"ab.*", "xaby", MATCH_SEARCH, 1, 1, 4},
+        {"ab.*", "abxy", MATCH_FULL, 1, 0, 4},
+        {"ab.*", "abxy", MATCH_PREFIX, 1, 0, 2},
+        {".*a(b|c).*", "xxacx", MATCH_FULL, 1, 0, 5},
+        {".*a(b|c).*", "xxacx", MATCH_PREFIX, 1, 0, 4},
+        {".*a(b|c).*", "xxadx", MATCH_SEARCH, 0, 0, 0},
+        {".*\\bfoo", "afoo foo", MATCH_SEARCH, 1, 0, 8},
+        {".*\\bfoo", "afoo", MATCH_ANY, 0, 0, 0},
+    };
+
+    for (size_t i = 0; i < sizeof(matches)/sizeof(matches[0]); i++) {
+        match_input t = matches[i];
+        match_t m = {0, 0};
+        printf("Testing regex %s with string %s in mode %d---", t.regex, t.s, t.mode);
+        nfa_machine_t *machine = compile_regex(t.regex);
+        int match = nfa_match(machine, t.s, strlen(t.s), t.mode, &m);
+        free_nfa(machine);
+        test(match == t.expected, ANSI_COLOR_RED "failed for input %s: %s\n" ANSI_COLOR_RESET, t.regex, t.s);
+        if (match && t.mode != MATCH_ANY)
+            test(m.start == t.start && m.end == t.end,
+                ANSI_COLOR_RED "expected match at [%zu, %zu), got [%zu, %zu)\n" ANSI_COLOR_RESET,
+                t.start, t.end, m.start, m.end);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+
+    // the `.*` left out of the machine
+    const char *stripped[][2] = {{".*ab", "ab"}, {"ab.*", "ab"}, {".*a(b|c).*", "a(b|c)"}};
+    for (size_t i = 0; i < sizeof(stripped)/sizeof(stripped[0]); i++) {
+        printf("Testing the states of %s---", stripped[i][0]);
+        nfa_machine_t *machine = compile_regex(stripped[i][0]);
+        nfa_machine_t *core = compile_regex(stripped[i][1]);
+        test(machine->nstates == core->nstates,
+            ANSI_COLOR_RED "expected %zu states, got %zu\n" ANSI_COLOR_RESET, core->nstates, machine->nstates);
+        free_nfa(core);
+        free_nfa(machine);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+}
+
+static void
+test_utf8(void)
+{
+    typedef struct test_input {
+        const char *regex;
+        const char *s;
+        match_mode_t mode;
+        int expected;
+        size_t start;
+        size_t end;
+    } test_input;
+
+    static const char *mode_names[] = {"full", "prefix", "search", "any"};
+
+    test_input tests[] = {
+        {".", "é", MATCH_FULL, 1, 0, 2},
+        {".", "€", MATCH_FULL, 1, 0, 3},
+        {".", "😀", MATCH_FULL, 1, 0, 4},
+        {"..", "é", MATCH_FULL, 0, 0, 0},
+        {".", "\xff", MATCH_FULL, 0, 0, 0},
+        {".", "\xc3", MATCH_FULL, 0, 0, 0},
+        {".", "\xc0\xaf", MATCH_FULL, 0, 0, 0}, // overlong
+        {".", "\xed\xa0\x80", MATCH_FULL, 0, 0, 0}, // surrogate
+        {".", "\xf4\x90\x80\x80", MATCH_FULL, 0, 0, 0}, // above U+10FFFF
+        {"é+", "ééé", MATCH_FULL, 1, 0, 6},
+        {"é+", "é\xa9", MATCH_FULL, 0, 0, 0},
+        {"aé?b", "ab", MATCH_FULL, 1, 0, 2},
+        {"aé?b", "aéb", MATCH_FULL, 1, 0, 4},
+        {"[α-ω]+", "λόγος", MATCH_FULL, 0, 0, 0},
+        {"[α-ωά-ώ]+", "λόγος", MATCH_FULL, 1, 0, 10},
+        {"[α-ω]+", "abγδe", MATCH_SEARCH, 1, 2, 6},
+        {"[a-zα-ω]+", "aγb", MATCH_FULL, 1, 0, 4},
+        {"[a-zα-ω]+", "γaB", MATCH_PREFIX, 1, 0, 2},
+        {"[😀-🙏]", "🙂", MATCH_FULL, 1, 0, 4},
+        {"[😀-🙏]", "🚀", MATCH_FULL, 0, 0, 0},
+        {"[é]", "e", MATCH_FULL, 0, 0, 0},
+        {"x.*y", "x€😀ey", MATCH_FULL, 1, 0, 10},
+        {"x.*y", "x\x80y", MATCH_FULL, 0, 0, 0},
+        {"€|£", "a£", MATCH_SEARCH, 1, 1, 3},
+    };
+
+    print_test_separator_line();
+    re_compile_options_t options = {.flags = RE_UTF8};
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        test_input t = tests[i];
+        match_t m = {0, 0};
+        printf("Testing UTF-8 regex %s with string %s in %s mode---", t.regex, t.s, mode_names[t.mode]);
+        nfa_machine_t *machine = compile_regex_with_options(t.regex, &options, NULL);
+        test(machine != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET, t.regex);
+        int match = nfa_match(machine, t.s, strlen(t.s), t.mode, &m);
+        free_nfa(machine);
+        test(match == t.expected, ANSI_COLOR_RED "failed for input %s: %s\n" ANSI_COLOR_RESET, t.regex, t.s);
+        if (match && t.mode != MATCH_ANY)
+            test(m.start == t.start && m.end == t.end,
+                ANSI_COLOR_RED "expected match at [%zu, %zu), got [%zu, %zu)\n" ANSI_COLOR_RESET,
+                t.start, t.end, m.start, m.end);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+
+    // without the flag the same patterns work on bytes
+    nfa_machine_t *machine = compile_regex(".");
+    test(nfa_match(machine, "é", strlen("é"), MATCH_FULL, NULL) == 0,
+        ANSI_COLOR_RED "`.` matched two bytes\n" ANSI_COLOR_RESET);
+    free_nfa(machine);
+}
+
+static void
+test_icase(void)
+{
+    typedef struct test_input {
+        const char *regex;
+        const char *s;
+        int flags;
+        int expected;
+    } test_input;
+
+    test_input tests[] = {
+        {"select", "SeLeCt", RE_ICASE, 1},
+        {"select", "SeLeCt", 0, 0},
+        {"GET|POST", "post", RE_ICASE, 1},
+        {"[a-f0-9]+", "DEADbeef42", RE_ICASE, 1},
+        {"[A-Z_]+", "snake_case", RE_ICASE, 1},
+        {"a|b", "B", RE_ICASE, 1},
+        {"a1", "A1", RE_ICASE, 1},
+        {"a1", "A!", RE_ICASE, 0},
+        {"[@-Z]", "`", RE_ICASE, 0},
+        {"é", "É", RE_ICASE, 0},
+        {"é", "É", RE_ICASE | RE_UTF8, 1},
+        {"straße", "STRAẞE", RE_ICASE | RE_UTF8, 1},
+        {"σ+", "Σςσ", RE_ICASE | RE_UTF8, 1},
+        {"k", "\xe2\x84\xaa", RE_ICASE | RE_UTF8, 1}, // Kelvin sign
+        {"k", "\xe2\x84\xaa", RE_ICASE, 0},
+        {"[à-þ]+", "ÀÉÎ", RE_ICASE | RE_UTF8, 1},
+        {"[à-þ]+", "ÀÉÎ", RE_UTF8, 0},
+        {"i", "ı", RE_ICASE | RE_UTF8, 0},
+    };
+
+    print_test_separator_line();
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        test_input t = tests[i];
+        re_compile_options_t options = {.flags = t.flags};
+        printf("Testing regex %s with string %s and flags %d---", t.regex, t.s, t.flags);
+        nfa_machine_t *machine = compile_regex_with_options(t.regex, &options, NULL);
+        int match = nfa_match(machine, t.s, strlen(t.s), MATCH_FULL, NULL);
+        test(match == t.expected, ANSI_COLOR_RED "failed for input %s: %s\n" ANSI_COLOR_RESET, t.regex, t.s);
+        if (!(t.flags & RE_UTF8)) {
+            // folding happens in the char sets, the automaton keeps its size
+            nfa_machine_t *plain = compile_regex(t.regex);
+            test(plain->nstates == machine->nstates, ANSI_COLOR_RED "%zu states instead of %zu\n"
+                ANSI_COLOR_RESET, machine->nstates, plain->nstates);
+            free_nfa(plain);
+        }
+        free_nfa(machine);
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+}
+
+static void
+test_compile_errors(void)
+{
+    typedef struct test_input {
+        const char *regex;
+        re_compile_options_t options;
+        re_error_code_t expected;
+    } test_input;
+
+    char long_literal[1001];
+    memset(long_literal, 'a', 1000);
+    long_literal[1000] = 0;
+    test_input tests[] = {
+        {"(ab", {0}, RE_ERROR_SYNTAX},
+        {"ab)", {0}, RE_ERROR_SYNTAX},
+        {"a(b))c", {0}, RE_ERROR_SYNTAX},
+        {"[a-", {0}, RE_ERROR_SYNTAX},
+        {"[z-a]", {0}, RE_ERROR_SYNTAX},
+        {"a|", {0}, RE_ERROR_SYNTAX},
+        {"*a", {0}, RE_ERROR_SYNTAX},
+        {"()", {0}, RE_ERROR_SYNTAX},
+        {"", {0}, RE_ERROR_SYNTAX},
+        {"((((a))))", {.max_depth = 3}, RE_ERROR_TOO_DEEP},
+        {"((((a))))", {.max_depth = 4}, RE_OK},
+        {"a****", {.max_depth = 3}, RE_ERROR_TOO_DEEP},
+        {"(a|b)*c", {.max_depth = 3}, RE_OK},
+        {long_literal, {.max_depth = 3}, RE_OK},
+        {"((((((a+)+)+)+)+)+)+", {.max_repetition = 100}, RE_ERROR_REPETITION},
+        {"(ab)+c+", {.max_repetition = 100}, RE_OK},
+        {"(ab|cd)*e", {.max_states = 6}, RE_ERROR_TOO_MANY_STATES},
+        {"(ab|cd)*e", {.max_states = 7}, RE_OK},
+        {"a?b+[0-9]", {.max_states = 5}, RE_ERROR_TOO_MANY_STATES},
+        {"a?b+[0-9]", {.max_states = 6}, RE_OK},
+        {"a|b|c", {.max_states = 2}, RE_ERROR_TOO_MANY_STATES},
+        {"a|b|c", {.max_states = 3}, RE_OK},
+        {"a\xff", {.flags = RE_UTF8}, RE_ERROR_SYNTAX},
+        {"\xce", {.flags = RE_UTF8}, RE_ERROR_SYNTAX},
+        {"[\xce\xb1-\xe2]", {.flags = RE_UTF8}, RE_ERROR_SYNTAX},
+        {"[ω-α]", {.flags = RE_UTF8}, RE_ERROR_SYNTAX},
+        {"é+", {.max_states = 4, .flags = RE_UTF8}, RE_ERROR_TOO_MANY_STATES},
+        {"é+", {.max_states = 5, .flags = RE_UTF8}, RE_OK},
+        {".", {.max_states = 21, .flags = RE_UTF8}, RE_ERROR_TOO_MANY_STATES},
+        {".", {.max_states = 22, .flags = RE_UTF8}, RE_OK},
+        {"[a-zα-ω]*", {.max_states = 8, .flags = RE_UTF8}, RE_OK},
+    };
+    re_allocator_t allocator;
+    re_alloc_counter_t counter;
+
+    print_test_separator_line();
+    re_counting_allocator(&allocator, &counter);
+    re_set_allocator(&allocator);
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        test_input t = tests[i];
+        re_compile_error_t error;
+        printf("Testing compile errors for %.40s\n", t.regex);
+        nfa_machine_t *machine = compile_regex_with_options(t.regex, &t.options, &error);
+        test(error.code == t.expected, ANSI_COLOR_RED "expected error %d, got %d: %s\n" ANSI_COLOR_RESET,
+            t.expected, error.code, error.message);
+        test((machine == NULL) == (t.expected != RE_OK), ANSI_COLOR_RED "wrong result\n" ANSI_COLOR_RESET);
+        if (machine) {
+            if (t.options.max_states)
+                test(machine->nstates == t.options.max_states, ANSI_COLOR_RED "expected %zu states, got %zu\n"
+                    ANSI_COLOR_RESET, t.options.max_states, machine->nstates);
+            free_nfa(machine);
+        } else
+            test(error.message[0] != 0, ANSI_COLOR_RED "no error message\n" ANSI_COLOR_RESET);
+        test(atomic_load(&counter.bytes) == 0, ANSI_COLOR_RED "%zu bytes leaked\n" ANSI_COLOR_RESET,
+            atomic_load(&counter.bytes));
+        printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+    }
+    re_set_allocator(NULL);
+    test(compile_regex("(ab") == NULL, ANSI_COLOR_RED "compile_regex accepted a bad pattern\n" ANSI_COLOR_RESET);
+}
+
+static void
+test_scratch(void)
+{
+    const char *regexes[] = {"b", "(a|b)*c", "\\bfoo\\b|bar$", "x[0-9]+y|(ab|cd|ef)+g"};
+    const char *inputs[] = {"", "c", "abc", "a foo bar", "foobar", "x12y abefg", "cdcdg"};
+    re_allocator_t allocator;
+    re_alloc_counter_t counter = {0};
+    nfa_scratch_t scratch = {0};
+
+    print_test_separator_line();
+    printf("Testing matches sharing scratch space---");
+    re_counting_allocator(&allocator, &counter);
+    re_set_allocator(&allocator);
+    for (size_t i = 0; i < sizeof(regexes)/sizeof(regexes[0]); i++) {
+        nfa_machine_t *machine = compile_regex(regexes[i]);
+        size_t nallocs = 0;
+        for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+            for (size_t j = 0; j < sizeof(inputs)/sizeof(inputs[0]); j++) {
+                match_t m = {0, 0}, expected_m = {0, 0};
+                size_t len = strlen(inputs[j]);
+                int expected = nfa_match(machine, inputs[j], len, mode, &expected_m);
+                size_t before = atomic_load(&counter.nallocs);
+                int match = nfa_match_scratch(machine, &scratch, inputs[j], len, mode, &m);
+                test(match == expected && (!match || mode == MATCH_ANY ||
+                    (m.start == expected_m.start && m.end == expected_m.end)),
+                    ANSI_COLOR_RED "%s on %s in mode %d differs from nfa_match\n" ANSI_COLOR_RESET,
+                    regexes[i], inputs[j], mode);
+                nallocs += atomic_load(&counter.nallocs) - before;
+            }
+        }
+        // only the first match against a bigger machine allocates
+        test(nallocs <= 1, ANSI_COLOR_RED "%zu allocations for %s\n" ANSI_COLOR_RESET, nallocs, regexes[i]);
+        free_nfa(machine);
+    }
+    nfa_scratch_free(&scratch);
+    re_set_allocator(NULL);
+    test(atomic_load(&counter.bytes) == 0, ANSI_COLOR_RED "%zu bytes leaked\n" ANSI_COLOR_RESET,
+        atomic_load(&counter.bytes));
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
 int
 main(int argc, char **argv)
 {
     test_matches();
+    test_match_modes();
+    test_assertions();
+    test_escapes_and_classes();
+    test_required_literal();
+    test_pattern_analysis();
+    test_utf8();
+    test_icase();
+    test_compile_errors();
+    test_scratch();
 }
\ No newline at end of file
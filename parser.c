@@ -36,6 +36,7 @@
 #include "lexer.h"
 #include "parser.h"
 #include "token.h"
+#include "utf8.h"
 
 static char *expression_to_string(expression_node_t *);
 static char * to_string(expression_node_t *);
@@ -44,15 +45,10 @@ static expression_node_t * parse_postfix_expression(parser_t *, expression_node_
 static expression_node_t * parse_char_node(parser_t *);
 static expression_node_t * parse_re_group(parser_t *);
 static expression_node_t * parse_char_class(parser_t *);
+static expression_node_t * parse_assertion(parser_t *);
+static expression_node_t * parse_class_escape(parser_t *);
 static void print_exp(expression_node_t *, size_t);
-
-/** Stack used during freeing up the AST nodes
- * setting stack size to 64 - it is reasonably big to collect all the nodes
- * of the AST. Tested with expression a?^na^n for n=40000. An expression bigger
- * than this can cause the program to crash before leaking memory. 
-*/
-static expression_node_t *stack[32];
-
+static size_t count_nodes(expression_node_t *);
 
 static prefix_parse_fn prefix_fns[] = {
     parse_char_node, // char
@@ -65,6 +61,12 @@ static prefix_parse_fn prefix_fns[] = {
     NULL, // star
     parse_char_class, // lbracket
     NULL, // rbracket
+    parse_assertion, // caret
+    parse_assertion, // dollar
+    parse_assertion, // word boundary
+    parse_assertion, // not word boundary
+    parse_char_node, // escaped char
+    parse_class_escape, // class escape
     NULL, // illegal
     NULL, // EOF
 };
@@ -80,6 +82,12 @@ static postfix_parse_fn postfix_fns[] = {
     parse_postfix_expression, // star
     NULL, // lbracket
     NULL, // rbracket
+    NULL, // caret
+    NULL, // dollar
+    NULL, // word boundary
+    NULL, // not word boundary
+    NULL, // escaped char
+    NULL, // class escape
     NULL, // illegal
     NULL // EOF
 };
@@ -95,6 +103,12 @@ static infix_parse_fn infix_fns[] = {
     NULL, // star
     parse_infix_expression, // lbracket
     NULL, // rbracket
+    parse_infix_expression, // caret
+    parse_infix_expression, // dollar
+    parse_infix_expression, // word boundary
+    parse_infix_expression, // not word boundary
+    parse_infix_expression, // escaped char
+    parse_infix_expression, // class escape
     NULL, // illegal
     NULL // EOF
 };
@@ -110,26 +124,46 @@ static operator_precedence_t precedences[] = {
     PRE_ASTERISK, // star
     LOWEST, // lbracket
     LOWEST, // rbracket
+    LOWEST, // caret
+    LOWEST, // dollar
+    LOWEST, // word boundary
+    LOWEST, // not word boundary
+    LOWEST, // escaped char
+    LOWEST, // class escape
     LOWEST, // illegal
     LOWEST // EOF
 };
 
 #define get_precedence(toktype) precedences[toktype]
-#define peek_precedence(parser) (parser->peek_tok->type == CHAR || parser->peek_tok->type == LPAREN \
-    || parser->peek_tok->type == LBRACKET? precedences[CAT]: precedences[parser->peek_tok->type])
+#define is_assertion_token(toktype) ((toktype) >= CARET && (toktype) <= NOT_WORD_BOUNDARY)
+// the tokens which start an operand, and so an implicit concatenation
+#define starts_operand(toktype) ((toktype) == CHAR || (toktype) == LPAREN || (toktype) == LBRACKET || \
+    is_assertion_token(toktype) || (toktype) == ESCAPED_CHAR || (toktype) == CLASS_ESCAPE)
+// operators and anchors have no special meaning inside a class
+#define is_class_char(toktype) ((toktype) != RBRACKET && (toktype) != CLASS_ESCAPE && \
+    (toktype) != WORD_BOUNDARY && (toktype) != NOT_WORD_BOUNDARY && (toktype) != ILLEGAL && \
+    (toktype) != END_OF_FILE)
+#define peek_precedence(parser) (starts_operand(parser->peek_tok->type)? precedences[CAT]: \
+    precedences[parser->peek_tok->type])
 
 
 parser_t *
 parser_init(lexer_t *lexer)
 {
     parser_t *parser;
-    parser = malloc(sizeof(*parser));
+    parser = re_malloc(sizeof(*parser));
     if (parser == NULL)
         err(EXIT_FAILURE, "malloc failed");
     parser->lexer = lexer;
     parser->cur_tok = NULL;
     parser->peek_tok = NULL;
     parser->error = NULL;
+    parser->error_code = RE_OK;
+    parser->max_depth = 0;
+    parser->max_repetition = 0;
+    parser->icase = 0;
+    parser->depth = 0;
+    parser->expanded = 0;
     parser_next_token(parser);
     parser_next_token(parser);
     return parser;
@@ -139,7 +173,7 @@ regex_t *
 regex_init(void)
 {
     regex_t *regex;
-    regex = malloc(sizeof(*regex));
+    regex = re_malloc(sizeof(*regex));
     if (regex == NULL)
         err(EXIT_FAILURE, "malloc failed");
     regex->root = NULL;
@@ -183,14 +217,16 @@ parse_expression(parser_t *parser, operator_precedence_t precedence, token_type
     /* Expect the first token to be a char literal */
     if (prefix_fn == NULL) {
         char *error = NULL;
-        asprintf(&error, "Unexpected character found %s", parser->cur_tok->literal);
+        re_asprintf(&error, "Unexpected character found %s", parser->cur_tok->literal);
         parser->error = error;
         return NULL;
     }
     left = prefix_fn(parser);
-    if (parser->error)
+    if (parser->error) {
+        free_expression(left);
         return NULL;
-    
+    }
+
     while (parser->peek_tok->type != terminator_tok) {
         if (precedence >= peek_precedence(parser))
             break;
@@ -198,8 +234,11 @@ parse_expression(parser_t *parser, operator_precedence_t precedence, token_type
         if (infix_fn) {
             parser_next_token(parser);
             expression_node_t *right = infix_fn(parser, left);
-            if (parser->error)
+            // the new node owns left, both are dropped on error
+            if (parser->error) {
+                free_expression(right);
                 return NULL;
+            }
             left = right;
             continue;
         }
@@ -207,8 +246,10 @@ parse_expression(parser_t *parser, operator_precedence_t precedence, token_type
         if (postfix_fn) {
             parser_next_token(parser);
             expression_node_t *right = postfix_fn(parser, left);
-            if (parser->error)
+            if (parser->error) {
+                free_expression(right);
                 return NULL;
+            }
             left = right;
             continue;
         }
@@ -221,7 +262,7 @@ postfix_expression_t *
 create_postfix_exp(void)
 {
     postfix_expression_t *postfix_exp;
-    postfix_exp = malloc(sizeof(*postfix_exp));
+    postfix_exp = re_malloc(sizeof(*postfix_exp));
     if (postfix_exp == NULL)
         err(EXIT_FAILURE, "malloc failed");
     postfix_exp->expression.type = POSTFIX_EXPRESSION;
@@ -243,6 +284,13 @@ parse_postfix_expression(parser_t *parser, expression_node_t *left)
         return (expression_node_t *) infix_exp;
     }
     if (op == ONE_OR_MORE) {
+        // nested `+` doubles the size of the tree with every level
+        parser->expanded += count_nodes(left);
+        if (parser->max_repetition && parser->expanded > parser->max_repetition) {
+            parser->error_code = RE_ERROR_REPETITION;
+            re_asprintf(&parser->error, "Repetition expands to more than %zu nodes", parser->max_repetition);
+            return left;
+        }
         infix_expression_t *infix_exp = create_infix_exp();
         infix_exp->op = CONCAT;
         infix_exp->left = left;
@@ -262,7 +310,7 @@ infix_expression_t *
 create_infix_exp(void)
 {
     infix_expression_t *infix_exp;
-    infix_exp = malloc(sizeof(*infix_exp));
+    infix_exp = re_malloc(sizeof(*infix_exp));
     if (infix_exp == NULL)
         err(EXIT_FAILURE, "malloc failed");
     infix_exp->expression.type = INFIX_EXPRESSION;
@@ -277,7 +325,7 @@ parse_infix_expression(parser_t *parser, expression_node_t *left)
     infix_expression_t *infix_exp = create_infix_exp();
     infix_exp->left = left;
     token_type terminating_tok = parser->cur_tok->type == LPAREN? RPAREN: END_OF_FILE;
-    if (parser->cur_tok->type == CHAR_LITERAL || parser->cur_tok->type == LPAREN || parser->cur_tok->type == LBRACKET) {
+    if (starts_operand(parser->cur_tok->type)) {
         infix_exp->op = CONCAT;
         precedence = get_precedence(CAT);
     } else {
@@ -289,70 +337,385 @@ parse_infix_expression(parser_t *parser, expression_node_t *left)
     return (expression_node_t *) infix_exp;
 }
 
+/*
+ * The value of a character in a pattern: its code point in UTF-8 mode
+ * (the lexer has checked the encoding), its byte otherwise.
+ */
+static uint32_t
+char_value(parser_t *parser, const char *literal)
+{
+    uint32_t cp;
+    if (parser->lexer->utf8 && utf8_decode((const uint8_t *) literal, UTF8_MAX_BYTES, &cp))
+        return cp;
+    return (uint8_t) literal[0];
+}
+
+/*
+ * Adds [lo, hi] to a class being parsed. In UTF-8 mode the non-ASCII part
+ * of the range goes to a code point class, created on first use.
+ */
+static void
+add_class_range(parser_t *parser, char_class_t *char_class, utf8_class_t **utf8_class, uint32_t lo, uint32_t hi)
+{
+    uint32_t byte_limit = parser->lexer->utf8? 0x7F: 0xFF;
+    for (uint32_t c = lo; c <= hi && c <= byte_limit; c++)
+        char_class->allowed_values[c] = 1;
+    if (hi <= byte_limit)
+        return;
+    if (*utf8_class == NULL)
+        *utf8_class = create_utf8_class();
+    utf8_class_add_range(*utf8_class, lo > byte_limit? lo: byte_limit + 1, hi);
+}
+
+/*
+ * Replaces the members of a class being parsed with all the characters
+ * which are not members. In UTF-8 mode the code point ranges are
+ * complemented up to UTF8_MAX_CODEPOINT.
+ */
+static void
+negate_class(parser_t *parser, char_class_t *char_class, utf8_class_t **utf8_class)
+{
+    uint32_t byte_limit = parser->lexer->utf8? 0x7F: 0xFF;
+    for (uint32_t c = 0; c <= byte_limit; c++)
+        char_class->allowed_values[c] = !char_class->allowed_values[c];
+    if (!parser->lexer->utf8)
+        return;
+    utf8_class_t *negated = create_utf8_class();
+    uint32_t next = 0x80;
+    if (*utf8_class) {
+        utf8_class_t *members = *utf8_class;
+        utf8_class_normalize(members);
+        for (size_t i = 0; i < members->nranges; i++) {
+            if (members->ranges[2 * i] > next)
+                utf8_class_add_range(negated, next, members->ranges[2 * i] - 1);
+            next = members->ranges[2 * i + 1] + 1;
+        }
+        free_expression((expression_node_t *) members);
+    }
+    if (next <= UTF8_MAX_CODEPOINT)
+        utf8_class_add_range(negated, next, UTF8_MAX_CODEPOINT);
+    if (negated->nranges == 0) {
+        free_expression((expression_node_t *) negated);
+        negated = NULL;
+    }
+    *utf8_class = negated;
+}
+
+/*
+ * Folds the case of a parsed class if asked to, negates it, and picks its
+ * node: a byte set if all the members are single bytes, a code point class
+ * otherwise.
+ */
+static expression_node_t *
+finish_class(parser_t *parser, char_class_t *char_class, utf8_class_t *utf8_class, int negated)
+{
+    uint8_t *allowed = char_class->allowed_values;
+    if (parser->icase && !parser->lexer->utf8) {
+        for (int c = 'a'; c <= 'z'; c++) {
+            if (allowed[c] || allowed[c - 'a' + 'A'])
+                allowed[c] = allowed[c - 'a' + 'A'] = 1;
+        }
+    } else if (parser->icase) {
+        // ASCII letters have variants outside ASCII, such as the Kelvin sign
+        if (utf8_class == NULL)
+            utf8_class = create_utf8_class();
+        for (uint32_t c = 0; c < 0x80; c++) {
+            if (allowed[c])
+                utf8_class_add_range(utf8_class, c, c);
+        }
+        utf8_class_fold(utf8_class);
+        memset(allowed, 0, 0x80);
+        size_t n = 0;
+        uint32_t *ranges = utf8_class->ranges;
+        for (size_t i = 0; i < utf8_class->nranges; i++) {
+            for (uint32_t c = ranges[2 * i]; c <= ranges[2 * i + 1] && c < 0x80; c++)
+                allowed[c] = 1;
+            if (ranges[2 * i + 1] < 0x80)
+                continue;
+            ranges[2 * n] = ranges[2 * i] < 0x80? 0x80: ranges[2 * i];
+            ranges[2 * n + 1] = ranges[2 * i + 1];
+            n++;
+        }
+        utf8_class->nranges = n;
+        if (n == 0) {
+            free_expression((expression_node_t *) utf8_class);
+            utf8_class = NULL;
+        }
+    }
+    if (negated)
+        negate_class(parser, char_class, &utf8_class);
+    if (utf8_class == NULL)
+        return (expression_node_t *) char_class;
+
+    // ASCII-only classes stay byte sets, the others get one node
+    for (uint32_t c = 0; c < 0x80; c++) {
+        if (allowed[c])
+            utf8_class_add_range(utf8_class, c, c);
+    }
+    re_free(char_class);
+    utf8_class_normalize(utf8_class);
+    return (expression_node_t *) utf8_class;
+}
+
+static void
+note_fold(uint32_t lo, uint32_t hi, void *arg)
+{
+    (void) lo;
+    (void) hi;
+    *(int *) arg = 1;
+}
+
+/*
+ * Whether the character has other case variants. Without UTF-8 mode only
+ * the ASCII letters do.
+ */
+static int
+has_case_variants(parser_t *parser, uint32_t value)
+{
+    int found = 0;
+    if (!parser->lexer->utf8)
+        return (value >= 'a' && value <= 'z') || (value >= 'A' && value <= 'Z');
+    utf8_fold_range(value, value, note_fold, &found);
+    return found;
+}
+
+/*
+ * The ASCII ranges of the POSIX bracket classes, the class escapes are
+ * made of them as well.
+ */
+typedef struct named_class {
+    const char *name;
+    size_t nranges;
+    uint8_t ranges[8];
+} named_class;
+
+static const named_class named_classes[] = {
+    {"alnum", 3, {'0', '9', 'A', 'Z', 'a', 'z'}},
+    {"alpha", 2, {'A', 'Z', 'a', 'z'}},
+    {"blank", 2, {'\t', '\t', ' ', ' '}},
+    {"cntrl", 2, {0, 0x1f, 0x7f, 0x7f}},
+    {"digit", 1, {'0', '9'}},
+    {"graph", 1, {'!', '~'}},
+    {"lower", 1, {'a', 'z'}},
+    {"print", 1, {' ', '~'}},
+    {"punct", 4, {'!', '/', ':', '@', '[', '`', '{', '~'}},
+    {"space", 2, {'\t', '\r', ' ', ' '}},
+    {"upper", 1, {'A', 'Z'}},
+    {"word", 4, {'0', '9', 'A', 'Z', '_', '_', 'a', 'z'}},
+    {"xdigit", 3, {'0', '9', 'A', 'F', 'a', 'f'}},
+};
+
+static const named_class *
+find_named_class(const char *name)
+{
+    for (size_t i = 0; i < sizeof(named_classes)/sizeof(named_classes[0]); i++) {
+        if (strcmp(named_classes[i].name, name) == 0)
+            return &named_classes[i];
+    }
+    return NULL;
+}
+
+/* The class of \d, \w or \s, given the letter of either case */
+static const named_class *
+escape_class(char letter)
+{
+    switch (letter) {
+    case 'd':
+    case 'D':
+        return find_named_class("digit");
+    case 'w':
+    case 'W':
+        return find_named_class("word");
+    default:
+        return find_named_class("space");
+    }
+}
+
+/*
+ * Adds the members of a named class to a class being parsed, or if negated
+ * all the characters which are not members.
+ */
+static void
+add_named_class(parser_t *parser, char_class_t *char_class, utf8_class_t **utf8_class,
+    const named_class *named, int negated)
+{
+    uint32_t next = 0;
+    for (size_t i = 0; i < named->nranges; i++) {
+        uint32_t lo = named->ranges[2 * i];
+        uint32_t hi = named->ranges[2 * i + 1];
+        if (!negated)
+            add_class_range(parser, char_class, utf8_class, lo, hi);
+        else if (lo > next)
+            add_class_range(parser, char_class, utf8_class, next, lo - 1);
+        next = hi + 1;
+    }
+    if (negated)
+        add_class_range(parser, char_class, utf8_class, next, parser->lexer->utf8? UTF8_MAX_CODEPOINT: 0xFF);
+}
+
+#define is_class_escape_negated(literal) ((literal)[1] >= 'A' && (literal)[1] <= 'Z')
+
+/*
+ * \d, \w, \s and their negations outside of a class. The negations are
+ * complemented after the case folding, so that `\W` never matches a
+ * letter.
+ */
+static expression_node_t *
+parse_class_escape(parser_t *parser)
+{
+    const char *literal = parser->cur_tok->literal;
+    char_class_t *char_class = create_char_class();
+    utf8_class_t *utf8_class = NULL;
+    add_named_class(parser, char_class, &utf8_class, escape_class(literal[1]), 0);
+    return finish_class(parser, char_class, utf8_class, is_class_escape_negated(literal));
+}
+
+static expression_node_t *
+class_error(parser_t *parser, char_class_t *char_class, utf8_class_t *utf8_class, char *error)
+{
+    if (parser->error == NULL)
+        parser->error = error;
+    else
+        re_free(error);
+    re_free(char_class);
+    free_expression((expression_node_t *) utf8_class);
+    return NULL;
+}
+
+/*
+ * Parses a POSIX bracket class such as `[:alpha:]`, the current token is
+ * its `[` and is left on its `]`. Returns NULL and sets the error if the
+ * name is not known.
+ */
+static const named_class *
+parse_posix_class(parser_t *parser)
+{
+    char name[16];
+    size_t len = 0;
+    parser_next_token(parser);
+    parser_next_token(parser);
+    while (parser->cur_tok->type == CHAR && parser->cur_tok->literal[0] != ':') {
+        if (len < sizeof(name) - 1)
+            name[len++] = parser->cur_tok->literal[0];
+        parser_next_token(parser);
+    }
+    name[len] = 0;
+    if (parser->cur_tok->type != CHAR || parser->peek_tok->type != RBRACKET) {
+        re_asprintf(&parser->error, "Missing :] after [:%s", name);
+        return NULL;
+    }
+    parser_next_token(parser);
+    const named_class *named = find_named_class(name);
+    if (named == NULL)
+        re_asprintf(&parser->error, "Unknown class [:%s:]", name);
+    return named;
+}
+
+/*
+ * Parses a bracketed class. A `^` first negates it and a `]` first (after
+ * the `^`) is a member. Operators stand for themselves, `-` is a member
+ * where it can't make a range, and class escapes and POSIX classes add all
+ * their members.
+ */
 static expression_node_t *
 parse_char_class(parser_t *parser)
 {
     char_class_t *char_class_node = create_char_class();
+    utf8_class_t *utf8_class_node = NULL;
+    int negated = 0;
     parser_next_token(parser);
-    char prev_char_value = 0;
+    if (parser->cur_tok->type == CARET) {
+        negated = 1;
+        parser_next_token(parser);
+    }
+    uint32_t prev_char_value = 0;
+    int has_prev = 0; // prev_char_value can start a range
     if (parser->cur_tok->type == RBRACKET) {
         char_class_node->allowed_values[']'] = 1;
         prev_char_value = ']';
+        has_prev = 1;
         parser_next_token(parser);
     }
 
     while (parser->cur_tok->type != RBRACKET && parser->cur_tok->type != END_OF_FILE) {
-        if (parser->cur_tok->type != CHAR_LITERAL) {
+        token_type type = parser->cur_tok->type;
+        if (type == CLASS_ESCAPE) {
+            const char *literal = parser->cur_tok->literal;
+            add_named_class(parser, char_class_node, &utf8_class_node, escape_class(literal[1]),
+                is_class_escape_negated(literal));
+            has_prev = 0;
+            parser_next_token(parser);
+            continue;
+        }
+        if (type == LBRACKET && parser->peek_tok->type == CHAR && parser->peek_tok->literal[0] == ':') {
+            const named_class *named = parse_posix_class(parser);
+            if (named == NULL)
+                return class_error(parser, char_class_node, utf8_class_node, NULL);
+            add_named_class(parser, char_class_node, &utf8_class_node, named, 0);
+            has_prev = 0;
+            parser_next_token(parser);
+            continue;
+        }
+        if (!is_class_char(type)) {
             char *error = NULL;
-            asprintf(&error, "Unexpected token type %s inside a character class", get_token_name(parser->cur_tok->type));
-            parser->error = error;
-            return NULL;
+            re_asprintf(&error, "Unexpected token type %s inside a character class", get_token_name(type));
+            return class_error(parser, char_class_node, utf8_class_node, error);
         }
-        uint8_t value = (uint8_t) parser->cur_tok->literal[0];
-        if (value == '-' && prev_char_value) {
-            if (parser->peek_tok->type == CHAR_LITERAL) {
-                parser_next_token(parser);
-                uint8_t range_end = parser->cur_tok->literal[0];
-                if (value >= range_end) {
-                    char *error = NULL;
-                    asprintf(&error, "Bad range");
-                    parser->error = error;
-                    return NULL;
-                }
-                for (uint8_t c = prev_char_value + 1; c <= range_end; c++)
-                    char_class_node->allowed_values[c] = 1;
-                prev_char_value = 0; //reset, so that we can parse more ranges
-            } else if (parser->peek_tok->type == RBRACKET) {
-                char_class_node->allowed_values['-'] = 1;
+        uint32_t value = char_value(parser, parser->cur_tok->literal);
+        if (value == '-' && type == CHAR && has_prev && is_class_char(parser->peek_tok->type) &&
+            parser->peek_tok->type != LBRACKET) {
+            parser_next_token(parser);
+            uint32_t range_end = char_value(parser, parser->cur_tok->literal);
+            if (prev_char_value > range_end) {
+                char *error = NULL;
+                re_asprintf(&error, "Bad range");
+                return class_error(parser, char_class_node, utf8_class_node, error);
             }
+            if (prev_char_value < range_end)
+                add_class_range(parser, char_class_node, &utf8_class_node, prev_char_value + 1, range_end);
+            has_prev = 0; //reset, so that we can parse more ranges
         } else {
-            char_class_node->allowed_values[value] = 1;
+            add_class_range(parser, char_class_node, &utf8_class_node, value, value);
             prev_char_value = value;
+            has_prev = 1;
         }
         parser_next_token(parser);
     }
     if (parser->cur_tok->type != RBRACKET) {
         char *error = NULL;
-        asprintf(&error, "Missing matching ]");
-        parser->error = error;
-        return NULL;
+        re_asprintf(&error, "Missing matching ]");
+        return class_error(parser, char_class_node, utf8_class_node, error);
     }
-    return (expression_node_t *) char_class_node;
+    return finish_class(parser, char_class_node, utf8_class_node, negated);
 }
 
 static expression_node_t *
 parse_re_group(parser_t *parser)
 {
+    if (parser->max_depth && parser->depth >= parser->max_depth) {
+        parser->error_code = RE_ERROR_TOO_DEEP;
+        re_asprintf(&parser->error, "Groups nested deeper than %zu", parser->max_depth);
+        return NULL;
+    }
+    parser->depth++;
     parser_next_token(parser);
     expression_node_t *exp = parse_expression(parser, LOWEST, RPAREN);
+    parser->depth--;
     if (exp == NULL) {
-        char *error = NULL;
-        asprintf(&error, "Invalid expression, missing matching `('");
-        parser->error = error;
+        // a limit hit inside the group is reported as it is
+        if (parser->error_code == RE_OK) {
+            char *error = NULL;
+            re_asprintf(&error, "Invalid expression, missing matching `('");
+            re_free(parser->error);
+            parser->error = error;
+        }
+        return NULL;
+    }
+    if (parser->peek_tok->type != RPAREN) {
+        re_asprintf(&parser->error, "Missing a matching )");
+        free_expression(exp);
         return NULL;
     }
-    if (parser->peek_tok->type != RPAREN)
-        errx(EXIT_FAILURE, "Missing a matching )");
     parser_next_token(parser);
     return exp;
 }
@@ -361,7 +724,7 @@ char_class_t *
 create_char_class(void)
 {
     char_class_t *char_class;
-    char_class = calloc(1, sizeof(*char_class));
+    char_class = re_calloc(1, sizeof(*char_class));
     if (char_class == NULL)
         err(EXIT_FAILURE, "malloc failed");
     char_class->expression.type = CHAR_CLASS;
@@ -369,11 +732,120 @@ create_char_class(void)
     return char_class;
 }
 
+utf8_class_t *
+create_utf8_class(void)
+{
+    utf8_class_t *utf8_class;
+    utf8_class = re_calloc(1, sizeof(*utf8_class));
+    if (utf8_class == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    utf8_class->expression.type = UTF8_CLASS;
+    utf8_class->expression.string = to_string;
+    return utf8_class;
+}
+
+void
+utf8_class_add_range(utf8_class_t *utf8_class, uint32_t lo, uint32_t hi)
+{
+    uint32_t *ranges = re_reallocarray(utf8_class->ranges, 2 * (utf8_class->nranges + 1), sizeof(*ranges));
+    if (ranges == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    ranges[2 * utf8_class->nranges] = lo;
+    ranges[2 * utf8_class->nranges + 1] = hi;
+    utf8_class->ranges = ranges;
+    utf8_class->nranges++;
+}
+
+static int
+compare_ranges(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return x < y? -1: x > y;
+}
+
+/*
+ * Sorts the ranges and merges the ones which overlap or touch.
+ */
+void
+utf8_class_normalize(utf8_class_t *utf8_class)
+{
+    uint32_t *ranges = utf8_class->ranges;
+    size_t n = 0;
+    if (utf8_class->nranges == 0)
+        return;
+    qsort(ranges, utf8_class->nranges, 2 * sizeof(*ranges), compare_ranges);
+    for (size_t i = 1; i < utf8_class->nranges; i++) {
+        if (ranges[2 * i] <= ranges[2 * n + 1] + 1) {
+            if (ranges[2 * i + 1] > ranges[2 * n + 1])
+                ranges[2 * n + 1] = ranges[2 * i + 1];
+        } else {
+            n++;
+            ranges[2 * n] = ranges[2 * i];
+            ranges[2 * n + 1] = ranges[2 * i + 1];
+        }
+    }
+    utf8_class->nranges = n + 1;
+}
+
+static void
+add_folded(uint32_t lo, uint32_t hi, void *arg)
+{
+    utf8_class_add_range(arg, lo, hi);
+}
+
+/*
+ * Adds the case variants of all the members. Every pass adds the next
+ * variant of each member, which closes the class after one pass less
+ * than the most variants a code point has.
+ */
+void
+utf8_class_fold(utf8_class_t *utf8_class)
+{
+    for (int pass = 1; pass < UTF8_MAX_FOLDS; pass++) {
+        size_t n = utf8_class->nranges;
+        for (size_t i = 0; i < n; i++) {
+            uint32_t lo = utf8_class->ranges[2 * i];
+            uint32_t hi = utf8_class->ranges[2 * i + 1];
+            utf8_fold_range(lo, hi, add_folded, utf8_class);
+        }
+        utf8_class_normalize(utf8_class);
+    }
+}
+
+assertion_t *
+create_assertion(assertion_kind_t kind)
+{
+    assertion_t *assertion;
+    assertion = re_malloc(sizeof(*assertion));
+    if (assertion == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    assertion->expression.type = ASSERTION;
+    assertion->expression.string = to_string;
+    assertion->kind = kind;
+    return assertion;
+}
+
+static expression_node_t *
+parse_assertion(parser_t *parser)
+{
+    switch (parser->cur_tok->type) {
+    case CARET:
+        return (expression_node_t *) create_assertion(ASSERT_TEXT_START);
+    case DOLLAR:
+        return (expression_node_t *) create_assertion(ASSERT_TEXT_END);
+    case WORD_BOUNDARY:
+        return (expression_node_t *) create_assertion(ASSERT_WORD_BOUNDARY);
+    default:
+        return (expression_node_t *) create_assertion(ASSERT_NOT_WORD_BOUNDARY);
+    }
+}
+
 char_literal_t *
 create_char_literal(void)
 {
     char_literal_t *char_node;
-    char_node = malloc(sizeof(*char_node));
+    char_node = re_malloc(sizeof(*char_node));
     if (char_node == NULL)
         err(EXIT_FAILURE, "malloc failed");
     char_node->expression.type = CHAR_LITERAL;
@@ -384,9 +856,42 @@ create_char_literal(void)
 static expression_node_t *
 parse_char_node(parser_t *parser)
 {
+    const char *literal = parser->cur_tok->literal;
+    int escaped = parser->cur_tok->type == ESCAPED_CHAR;
+    if (parser->lexer->utf8 && !escaped && literal[0] == '.') {
+        // any code point, the encoder leaves out the surrogates
+        utf8_class_t *any = create_utf8_class();
+        utf8_class_add_range(any, 0, UTF8_MAX_CODEPOINT);
+        return (expression_node_t *) any;
+    }
+    if (parser->icase && has_case_variants(parser, char_value(parser, literal))) {
+        // a set of the variants, a single state just like the literal
+        char_class_t *char_class = create_char_class();
+        utf8_class_t *utf8_class = NULL;
+        uint32_t value = char_value(parser, literal);
+        add_class_range(parser, char_class, &utf8_class, value, value);
+        return finish_class(parser, char_class, utf8_class, 0);
+    }
+    // a literal `.` would match any byte and one of NULL_STATE would be null
+    if (literal[0] && literal[1] == 0 && ((escaped && literal[0] == '.') || (uint8_t) literal[0] == NULL_STATE)) {
+        char_class_t *char_class = create_char_class();
+        char_class->allowed_values[(uint8_t) literal[0]] = 1;
+        return (expression_node_t *) char_class;
+    }
     char_literal_t *char_node = create_char_literal();
-    char_node->value = parser->cur_tok->literal[0];
-    return (expression_node_t *) char_node;
+    char_node->value = literal[0];
+    // a multibyte character is the concatenation of its bytes
+    expression_node_t *node = (expression_node_t *) char_node;
+    for (size_t i = 1; literal[0] && literal[i]; i++) {
+        infix_expression_t *cat = create_infix_exp();
+        cat->op = CONCAT;
+        cat->left = node;
+        char_literal_t *byte_node = create_char_literal();
+        byte_node->value = literal[i];
+        cat->right = (expression_node_t *) byte_node;
+        node = (expression_node_t *) cat;
+    }
+    return node;
 }
 
 
@@ -395,6 +900,11 @@ parse_regex(parser_t *parser)
 {
     regex_t * regex = regex_init();
     expression_node_t *node = parse_expression(parser, LOWEST, END_OF_FILE);
+    if (node && parser->peek_tok->type != END_OF_FILE) {
+        re_asprintf(&parser->error, "Unexpected %s", parser->peek_tok->literal);
+        free_expression(node);
+        node = NULL;
+    }
     regex->root = node;
     return regex;
 }
@@ -405,7 +915,8 @@ parser_free(parser_t *parser)
     token_free(parser->cur_tok);
     token_free(parser->peek_tok);
     lexer_free(parser->lexer);
-    free(parser);
+    re_free(parser->error);
+    re_free(parser);
 }
 
 
@@ -414,41 +925,102 @@ void
 regex_free(regex_t *regex)
 {
     free_expression((expression_node_t *) regex->root);
-    free(regex);
+    re_free(regex);
+}
+
+/*
+ * Returns the number of nodes in the tree.
+ */
+static size_t
+count_nodes(expression_node_t *exp)
+{
+    size_t n = 0;
+    cm_stack *stack = cm_stack_init(32);
+    cm_stack_push(stack, exp);
+    while (stack->length > 0) {
+        expression_node_t *e = cm_stack_pop(stack);
+        n++;
+        if (e->type == INFIX_EXPRESSION) {
+            cm_stack_push(stack, ((infix_expression_t *) e)->left);
+            cm_stack_push(stack, ((infix_expression_t *) e)->right);
+        } else if (e->type == POSTFIX_EXPRESSION)
+            cm_stack_push(stack, ((postfix_expression_t *) e)->left);
+    }
+    cm_stack_free(stack);
+    return n;
+}
+
+/*
+ * Returns the bytes allocated for the tree.
+ */
+size_t
+regex_size(regex_t *regex)
+{
+    size_t size = sizeof(*regex);
+    cm_stack *stack = cm_stack_init(32);
+    cm_stack_push(stack, regex->root);
+    while (stack->length > 0) {
+        expression_node_t *e = cm_stack_pop(stack);
+        switch (e->type) {
+        case CHAR_LITERAL:
+            size += sizeof(char_literal_t);
+            break;
+        case CHAR_CLASS:
+            size += sizeof(char_class_t);
+            break;
+        case UTF8_CLASS:
+            size += sizeof(utf8_class_t) + 2 * ((utf8_class_t *) e)->nranges * sizeof(uint32_t);
+            break;
+        case ASSERTION:
+            size += sizeof(assertion_t);
+            break;
+        case INFIX_EXPRESSION:
+            size += sizeof(infix_expression_t);
+            cm_stack_push(stack, ((infix_expression_t *) e)->left);
+            cm_stack_push(stack, ((infix_expression_t *) e)->right);
+            break;
+        case POSTFIX_EXPRESSION:
+            size += sizeof(postfix_expression_t);
+            cm_stack_push(stack, ((postfix_expression_t *) e)->left);
+            break;
+        default:
+            break;
+        }
+    }
+    cm_stack_free(stack);
+    return size;
 }
 
 void
 free_expression(expression_node_t *exp)
 {
-    size_t top = 0;
-    stack[top++] = exp;
-    while (top > 0) {
-        expression_node_t *e = stack[--top];
-        if (e->type == CHAR_LITERAL || e->type == CHAR_LITERAL) {
-            free(e);
-            continue;
-        }
+    // the stack is local so that patterns can be compiled from several threads
+    if (exp == NULL)
+        return;
+    cm_stack *stack = cm_stack_init(32);
+    cm_stack_push(stack, exp);
+    while (stack->length > 0) {
+        expression_node_t *e = cm_stack_pop(stack);
+        if (e == NULL)
+            continue; // the right side of an infix expression which failed to parse
         if (e->type == INFIX_EXPRESSION) {
             infix_expression_t *infix = (infix_expression_t *) e;
-            stack[top++] = infix->left;
-            stack[top++] = infix->right;
-            free(e);
-            continue;
-        }
-        if (e->type == POSTFIX_EXPRESSION) {
+            cm_stack_push(stack, infix->left);
+            cm_stack_push(stack, infix->right);
+        } else if (e->type == POSTFIX_EXPRESSION) {
             postfix_expression_t *postfix = (postfix_expression_t *) e;
-            stack[top++] = postfix->left;
-            free(e);
-            continue;
-        }
-        free(e);
+            cm_stack_push(stack, postfix->left);
+        } else if (e->type == UTF8_CLASS)
+            re_free(((utf8_class_t *) e)->ranges);
+        re_free(e);
     }
+    cm_stack_free(stack);
 }
 
 static char *
 char_to_string(char_literal_t *node)
 {
-    char *s = malloc(sizeof(char) * 2);
+    char *s = re_malloc(sizeof(char) * 2);
     if (s == NULL)
         err(EXIT_FAILURE, "malloc failed");
     s[0] = node->value;
@@ -465,7 +1037,7 @@ char_class_to_string(char_class_t *node)
         if (node->allowed_values[i])
             len++;
     }
-    s = malloc(len + 1);
+    s = re_malloc(len + 1);
     if (s == NULL)
         err(EXIT_FAILURE, "malloc failed");
     for (size_t i = 0, j = 0; i < 256; i++) {
@@ -476,13 +1048,42 @@ char_class_to_string(char_class_t *node)
     return s;
 }
 
+static char *
+utf8_class_to_string(utf8_class_t *node)
+{
+    // a range is at most two characters and a dash
+    char *s = re_malloc(node->nranges * (2 * UTF8_MAX_BYTES + 1) + 1);
+    size_t len = 0;
+    if (s == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    for (size_t i = 0; i < node->nranges; i++) {
+        len += utf8_encode(node->ranges[2 * i], (uint8_t *) s + len);
+        if (node->ranges[2 * i + 1] != node->ranges[2 * i]) {
+            s[len++] = '-';
+            len += utf8_encode(node->ranges[2 * i + 1], (uint8_t *) s + len);
+        }
+    }
+    s[len] = 0;
+    return s;
+}
+
+static char *
+assertion_to_string(assertion_t *node)
+{
+    static const char *strings[] = {"", "^", "$", "\\b", "\\B"};
+    char *s = re_strdup(strings[node->kind]);
+    if (s == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    return s;
+}
+
 static char *
 infix_to_string(infix_expression_t *node)
 {
     char *left = expression_to_string(node->left);
     char *right = expression_to_string(node->right);
     char *s = NULL;
-    asprintf(&s, "%s %s %s", left, operator_to_string(node->op), right);
+    re_asprintf(&s, "%s %s %s", left, operator_to_string(node->op), right);
     return s;
 }
 
@@ -491,7 +1092,7 @@ postfix_to_string(postfix_expression_t *node)
 {
     char *left = expression_to_string(node->left);
     char *s = NULL;
-    asprintf(&s, "%s %s", left, operator_to_string(node->op));
+    re_asprintf(&s, "%s %s", left, operator_to_string(node->op));
     return s;
 }
 
@@ -507,6 +1108,10 @@ expression_to_string(expression_node_t *node)
         return char_to_string((char_literal_t *) node);
     case CHAR_CLASS:
         return char_class_to_string((char_class_t *) node);
+    case UTF8_CLASS:
+        return utf8_class_to_string((utf8_class_t *) node);
+    case ASSERTION:
+        return assertion_to_string((assertion_t *) node);
     default:
         return NULL;
     }
@@ -613,6 +1218,20 @@ copy_char_class(char_class_t *exp)
     return (expression_node_t *) node;
 }
 
+expression_node_t *
+copy_utf8_class(utf8_class_t *exp)
+{
+    utf8_class_t *node = create_utf8_class();
+    node->ranges = re_reallocarray(NULL, 2 * exp->nranges, sizeof(*node->ranges));
+    if (exp->nranges && node->ranges == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    if (exp->nranges)
+        memcpy(node->ranges, exp->ranges, 2 * exp->nranges * sizeof(*node->ranges));
+    node->nranges = exp->nranges;
+    node->reversed = exp->reversed;
+    return (expression_node_t *) node;
+}
+
 expression_node_t *
 copy_postfix_expression(postfix_expression_t *exp)
 {
@@ -640,6 +1259,10 @@ copy_expression(expression_node_t *exp)
         return copy_char_literal((char_literal_t *) exp);
     case CHAR_CLASS:
         return copy_char_class((char_class_t *) exp);
+    case UTF8_CLASS:
+        return copy_utf8_class((utf8_class_t *) exp);
+    case ASSERTION:
+        return (expression_node_t *) create_assertion(((assertion_t *) exp)->kind);
     case POSTFIX_EXPRESSION:
         return copy_postfix_expression((postfix_expression_t *) exp);
     case INFIX_EXPRESSION:
@@ -648,3 +1271,41 @@ copy_expression(expression_node_t *exp)
         errx(EXIT_FAILURE, "Unsupported expression type");
     }
 }
+
+/*
+ * Returns a copy of the expression matching the reversed strings: the
+ * operands of concatenations swap places, the text anchors swap meaning
+ * and code point classes match their encodings backwards.
+ */
+expression_node_t *
+reverse_expression(expression_node_t *exp)
+{
+    expression_node_t *copy = copy_expression(exp);
+    cm_stack *stack = cm_stack_init(32);
+    cm_stack_push(stack, copy);
+    while (stack->length > 0) {
+        expression_node_t *e = cm_stack_pop(stack);
+        if (e->type == INFIX_EXPRESSION) {
+            infix_expression_t *infix = (infix_expression_t *) e;
+            if (infix->op == CONCAT) {
+                expression_node_t *temp = infix->left;
+                infix->left = infix->right;
+                infix->right = temp;
+            }
+            cm_stack_push(stack, infix->left);
+            cm_stack_push(stack, infix->right);
+        } else if (e->type == POSTFIX_EXPRESSION) {
+            cm_stack_push(stack, ((postfix_expression_t *) e)->left);
+        } else if (e->type == UTF8_CLASS) {
+            ((utf8_class_t *) e)->reversed = !((utf8_class_t *) e)->reversed;
+        } else if (e->type == ASSERTION) {
+            assertion_t *assertion = (assertion_t *) e;
+            if (assertion->kind == ASSERT_TEXT_START)
+                assertion->kind = ASSERT_TEXT_END;
+            else if (assertion->kind == ASSERT_TEXT_END)
+                assertion->kind = ASSERT_TEXT_START;
+        }
+    }
+    cm_stack_free(stack);
+    return copy;
+}
@@ -35,11 +35,25 @@
 #include "token.h"
 #include "re_utils.h"
 
+typedef enum re_error_code_t {
+    RE_OK,
+    RE_ERROR_SYNTAX,
+    RE_ERROR_TOO_DEEP,
+    RE_ERROR_REPETITION,
+    RE_ERROR_TOO_MANY_STATES
+} re_error_code_t;
+
 typedef struct parser_t {
     lexer_t *lexer;
     token_t *cur_tok;
     token_t *peek_tok;
     char *error;
+    re_error_code_t error_code; // RE_OK with error set means a syntax error
+    size_t max_depth; // limit on the nesting of groups, 0 for none
+    size_t max_repetition; // limit on the nodes copied to expand `x+`, 0 for none
+    int icase; // fold case of literals and classes
+    size_t depth;
+    size_t expanded;
 } parser_t;
 
 
@@ -61,11 +75,18 @@ regex_t *regex_init(void);
 void print_ast(regex_t *);
 void parser_free(parser_t *);
 void regex_free(regex_t *);
+size_t regex_size(regex_t *);
 postfix_expression_t *create_postfix_exp(void);
 infix_expression_t *create_infix_exp(void);
 char_literal_t *create_char_literal(void);
 char_class_t *create_char_class(void);
+utf8_class_t *create_utf8_class(void);
+void utf8_class_add_range(utf8_class_t *, uint32_t, uint32_t);
+void utf8_class_normalize(utf8_class_t *);
+void utf8_class_fold(utf8_class_t *);
 void free_expression(expression_node_t *);
+assertion_t *create_assertion(assertion_kind_t);
 expression_node_t *copy_expression(expression_node_t *);
+expression_node_t *reverse_expression(expression_node_t *);
 
 #endif
\ No newline at end of file
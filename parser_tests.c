@@ -63,6 +63,22 @@ char_node(char c)
     return (expression_node_t *) char_exp;
 }
 
+/*
+ * The parser turns `x+` into `xx*` and `x?` into the alternation of a null
+ * literal and x.
+ */
+static expression_node_t *
+plus_node(expression_node_t *left)
+{
+    return infix_node(left, postfix_node(copy_expression(left), ZERO_OR_MORE), CONCAT);
+}
+
+static expression_node_t *
+optional_node(expression_node_t *left)
+{
+    return infix_node(char_node(NULL_STATE), left, OR);
+}
+
 static expression_node_t *
 char_class_node(size_t n, ...)
 {
@@ -70,7 +86,8 @@ char_class_node(size_t n, ...)
     va_list arglist;
     va_start(arglist, n);
     for (size_t i = 0; i < n; i++)
-        char_class->allowed_values[(uint8_t) va_arg(arglist, uint8_t)] = 1;
+        char_class->allowed_values[(uint8_t) va_arg(arglist, int)] = 1;
+    va_end(arglist);
     return (expression_node_t *) char_class;
 }
 
@@ -207,36 +224,36 @@ test_simple_repitition(void)
         },
         {
             "ab+",
-            infix_node(char_node('a'), postfix_node(char_node('b'), ONE_OR_MORE), CONCAT)
+            infix_node(char_node('a'), plus_node(char_node('b')), CONCAT)
         },
         {
             "a+b",
-            infix_node(postfix_node(char_node('a'), ONE_OR_MORE), char_node('b'), CONCAT)
+            infix_node(plus_node(char_node('a')), char_node('b'), CONCAT)
         },
         {
             "a(bc+)",
-            infix_node(char_node('a'), infix_node(char_node('b'), postfix_node(char_node('c'), ONE_OR_MORE), CONCAT), CONCAT)
+            infix_node(char_node('a'), infix_node(char_node('b'), plus_node(char_node('c')), CONCAT), CONCAT)
         },
         {
             "a|(bc+)|d",
-            infix_node(infix_node(char_node('a'), infix_node(char_node('b'), postfix_node(char_node('c'), ONE_OR_MORE), CONCAT) ,OR), char_node('d'), OR)
+            infix_node(infix_node(char_node('a'), infix_node(char_node('b'), plus_node(char_node('c')), CONCAT) ,OR), char_node('d'), OR)
         },
         {
             "(ab)?c",
-            infix_node(postfix_node(infix_node(char_node('a'), char_node('b'), CONCAT), ZERO_OR_ONE), char_node('c'), CONCAT)
+            infix_node(optional_node(infix_node(char_node('a'), char_node('b'), CONCAT)), char_node('c'), CONCAT)
         },
         {
             "((ab)|(ac))?d",
-            infix_node(postfix_node(infix_node(infix_node(char_node('a'), char_node('b'), CONCAT), infix_node(char_node('a'), char_node('c'), CONCAT) , OR), ZERO_OR_ONE), char_node('d'), CONCAT)
+            infix_node(optional_node(infix_node(infix_node(char_node('a'), char_node('b'), CONCAT), infix_node(char_node('a'), char_node('c'), CONCAT) , OR)), char_node('d'), CONCAT)
         },
         {
             "a?aa",
-            infix_node(infix_node(postfix_node(char_node('a'), ZERO_OR_ONE), char_node('a'), CONCAT), char_node('a'), CONCAT)
+            infix_node(infix_node(optional_node(char_node('a')), char_node('a'), CONCAT), char_node('a'), CONCAT)
 
         },
         {
             "a?a?a",
-            infix_node(infix_node(postfix_node(char_node('a'), ZERO_OR_ONE), postfix_node(char_node('a'), ZERO_OR_ONE), CONCAT), char_node('a'), CONCAT)
+            infix_node(infix_node(optional_node(char_node('a')), optional_node(char_node('a')), CONCAT), char_node('a'), CONCAT)
         },
         {
             "[a-z]",
@@ -244,11 +261,11 @@ test_simple_repitition(void)
         },
         {
             "a[0-9a-d]+b",
-            infix_node(infix_node(char_node('a'), postfix_node(char_class_node(14, '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd'), ONE_OR_MORE), CONCAT), char_node('b'), CONCAT)
+            infix_node(infix_node(char_node('a'), plus_node(char_class_node(14, '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd')), CONCAT), char_node('b'), CONCAT)
         },
         {
             "f+[afg12]",
-            infix_node(postfix_node(char_node('f'), ONE_OR_MORE), char_class_node(5, 'a', 'f', 'g', '1', '2') , CONCAT)
+            infix_node(plus_node(char_node('f')), char_class_node(5, 'a', 'f', 'g', '1', '2') , CONCAT)
         },
         {
             "[-a-d]*",
@@ -0,0 +1,250 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Times the phases of compiling a pattern separately: lexing, parsing,
+ * building the NFA and freeing the NFA and the AST. The patterns are
+ * generated with 10 up to 100k tokens, and for each size the median time
+ * of every phase is reported in ns/token along with the number of
+ * allocations per token.
+ *
+ * Allocations are counted with the counting allocator in an untimed run,
+ * so that its bookkeeping does not show up in the times.
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lexer.h"
+#include "nfa_compiler.h"
+#include "parser.h"
+#include "re_utils.h"
+#include "token.h"
+
+#define MIN_TRIALS 5
+#define TOKENS_PER_SIZE 2000000
+
+typedef enum phase_t {
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_COMPILE,
+    PHASE_FREE_NFA,
+    PHASE_FREE_AST,
+    NPHASES
+} phase_t;
+
+static const char *phase_names[] = {"lex", "parse", "compile", "free_nfa", "free_ast"};
+
+static re_alloc_counter_t counter;
+
+#define nallocs atomic_load_explicit(&counter.nallocs, memory_order_relaxed)
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y? -1: x > y;
+}
+
+/*
+ * Generates a pattern of at least ntokens tokens by concatenating a mix
+ * of literals, classes, alternations and repetitions.
+ */
+static char *
+generate_pattern(size_t ntokens)
+{
+    static const char *units[] = {"ab", "[a-z]", "(cd|e)*", "x+", "y?", "[0-9]+", "(f|gh|i)"};
+    static const size_t unit_tokens[] = {2, 5, 7, 2, 2, 6, 8};
+    size_t nunits = sizeof(units) / sizeof(units[0]);
+    size_t size = 64, len = 0, count = 0;
+    char *pattern = malloc(size);
+    if (pattern == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    for (size_t i = 0; count < ntokens; i++) {
+        const char *unit = units[i % nunits];
+        size_t n = strlen(unit);
+        if (len + n + 1 > size) {
+            size *= 2;
+            pattern = realloc(pattern, size);
+            if (pattern == NULL)
+                err(EXIT_FAILURE, "malloc failed");
+        }
+        memcpy(pattern + len, unit, n);
+        len += n;
+        count += unit_tokens[i % nunits];
+    }
+    pattern[len] = 0;
+    return pattern;
+}
+
+static size_t
+lex_pattern(const char *pattern)
+{
+    size_t ntokens = 0;
+    lexer_t *lexer = lexer_init(pattern);
+    for (;;) {
+        token_t *t = next_token(lexer);
+        ntokens++;
+        int done = t->type == END_OF_FILE;
+        token_free(t);
+        if (done)
+            break;
+    }
+    lexer_free(lexer);
+    return ntokens;
+}
+
+/*
+ * Runs all the phases once for the pattern, storing the time and the
+ * allocation count of each.
+ */
+static void
+run_phases(const char *pattern, uint64_t *times, size_t *allocs)
+{
+    uint64_t start;
+    size_t before;
+
+#define TIME_PHASE(phase, code) do { \
+        before = nallocs; \
+        start = now_ns(); \
+        code; \
+        times[phase] = now_ns() - start; \
+        allocs[phase] = nallocs - before; \
+    } while (0)
+
+    TIME_PHASE(PHASE_LEX, lex_pattern(pattern));
+
+    regex_t *regex;
+    TIME_PHASE(PHASE_PARSE, {
+        parser_t *parser = parser_init(lexer_init(pattern));
+        regex = parse_regex(parser);
+        if (parser->error)
+            errx(EXIT_FAILURE, "%s", parser->error);
+        parser_free(parser);
+    });
+
+    nfa_machine_t *machine;
+    TIME_PHASE(PHASE_COMPILE, machine = compile_regex_ast(regex));
+    TIME_PHASE(PHASE_FREE_NFA, free_nfa(machine));
+    TIME_PHASE(PHASE_FREE_AST, regex_free(regex));
+#undef TIME_PHASE
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: phase_benchmark [-j]\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t sizes[] = {10, 100, 1000, 10000, 100000};
+    re_allocator_t allocator;
+    int json = 0, first = 1, ch;
+
+    while ((ch = getopt(argc, argv, "j")) != -1) {
+        switch (ch) {
+        case 'j':
+            json = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    re_counting_allocator(&allocator, &counter);
+    if (json)
+        printf("[\n");
+    else
+        printf("tokens,phase,median_ns,ns_per_token,allocs_per_token\n");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char *pattern = generate_pattern(sizes[i]);
+        size_t ntokens = lex_pattern(pattern);
+        size_t trials = TOKENS_PER_SIZE / ntokens;
+        if (trials < MIN_TRIALS)
+            trials = MIN_TRIALS;
+        uint64_t *samples[NPHASES];
+        size_t allocs[NPHASES];
+        for (int p = 0; p < NPHASES; p++) {
+            samples[p] = malloc(trials * sizeof(uint64_t));
+            if (samples[p] == NULL)
+                err(EXIT_FAILURE, "malloc failed");
+        }
+
+        // the warmup run counts the allocations, the timed runs use the plain allocator
+        uint64_t times[NPHASES];
+        size_t unused[NPHASES];
+        re_set_allocator(&allocator);
+        run_phases(pattern, times, allocs);
+        re_set_allocator(NULL);
+        for (size_t t = 0; t < trials; t++) {
+            run_phases(pattern, times, unused);
+            for (int p = 0; p < NPHASES; p++)
+                samples[p][t] = times[p];
+        }
+
+        for (int p = 0; p < NPHASES; p++) {
+            qsort(samples[p], trials, sizeof(uint64_t), compare_u64);
+            uint64_t median = samples[p][trials / 2];
+            double ns_per_token = (double) median / ntokens;
+            double allocs_per_token = (double) allocs[p] / ntokens;
+            if (json)
+                printf("%s  {\"tokens\": %zu, \"phase\": \"%s\", \"median_ns\": %" PRIu64 ", "
+                    "\"ns_per_token\": %.2f, \"allocs_per_token\": %.2f}",
+                    first? "": ",\n", ntokens, phase_names[p], median, ns_per_token, allocs_per_token);
+            else
+                printf("%zu,%s,%" PRIu64 ",%.2f,%.2f\n", ntokens, phase_names[p], median,
+                    ns_per_token, allocs_per_token);
+            first = 0;
+            free(samples[p]);
+        }
+        fflush(stdout);
+        free(pattern);
+    }
+    if (json)
+        printf("\n]\n");
+    return 0;
+}
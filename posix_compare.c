@@ -0,0 +1,481 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dense_dfa.h"
+#include "dfa.h"
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "posix_regex.h"
+#include "re_meta.h"
+
+#define CORPUS_SIZE (1024 * 1024)
+#define LONG_CORPUS_SIZE (4 * 1024 * 1024)
+#define DEFAULT_TRIALS 5
+#define DEFAULT_WARMUP 1
+#define FUZZ_PATTERN_SIZE 256
+#define FUZZ_INPUTS 8
+#define FUZZ_MAX_REPORTS 20
+
+static const char *mode_names[] = {"full", "prefix", "search", "any"};
+
+/*
+ * A pattern in the syntax both engines share: literals, `.`, bracket
+ * classes, groups, `|`, `*`, `+`, `?` and `^` and `$` around the whole
+ * pattern.
+ */
+typedef struct workload {
+    const char *type; // pathological, literal, class, alternation or long_input
+    char *name;
+    char *pattern;
+    char *input;
+    size_t len;
+    match_mode_t mode;
+} workload;
+
+typedef struct pattern_gen {
+    char buf[FUZZ_PATTERN_SIZE];
+    size_t len;
+    unsigned int seed;
+} pattern_gen;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y? -1: x > y;
+}
+
+static uint64_t
+median(uint64_t *samples, size_t n)
+{
+    qsort(samples, n, sizeof(uint64_t), compare_u64);
+    return samples[n / 2];
+}
+
+/*
+ * What regexec's leftmost-longest match says about a match in the mode: a
+ * prefix match starts at 0, a full match also ends at len.
+ */
+static int
+posix_match(posix_regex_t *re, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    size_t start, end;
+    if (!posix_regex_search(re, string, len, &start, &end))
+        return 0;
+    if ((mode == MATCH_PREFIX || mode == MATCH_FULL) && start != 0)
+        return 0;
+    if (mode == MATCH_FULL && end != len)
+        return 0;
+    match->start = start;
+    match->end = end;
+    return 1;
+}
+
+static char *
+random_text(size_t len, const char *alphabet, unsigned int seed)
+{
+    size_t n = strlen(alphabet);
+    char *text = malloc(len + 1);
+    if (text == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    for (size_t i = 0; i < len; i++)
+        text[i] = alphabet[rand_r(&seed) % n];
+    text[len] = 0;
+    return text;
+}
+
+static char *
+xstrdup(const char *s)
+{
+    char *copy = strdup(s);
+    if (copy == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    return copy;
+}
+
+static void
+add_workload(workload **workloads, size_t *n, const char *type, const char *name, const char *pattern,
+    char *input, size_t len, match_mode_t mode)
+{
+    *workloads = reallocarray(*workloads, *n + 1, sizeof(workload));
+    if (*workloads == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    workload *w = &(*workloads)[(*n)++];
+    w->type = type;
+    w->name = xstrdup(name);
+    w->pattern = xstrdup(pattern);
+    w->input = input;
+    w->len = len;
+    w->mode = mode;
+}
+
+/* The corpora never contain a match unless noted */
+static workload *
+create_workloads(size_t *n)
+{
+    workload *workloads = NULL;
+    *n = 0;
+
+    char *as = malloc(10001);
+    if (as == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    memset(as, 'a', 10000);
+    as[10000] = 0;
+    add_workload(&workloads, n, "pathological", "a?^25a^25", "a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?"
+        "aaaaaaaaaaaaaaaaaaaaaaaaa", xstrdup("aaaaaaaaaaaaaaaaaaaaaaaaa"), 25, MATCH_FULL);
+    add_workload(&workloads, n, "pathological", "(a|aa)*b", "(a|aa)*b", as, 10000, MATCH_ANY);
+
+    char *text = random_text(CORPUS_SIZE, "abcdefghijklmnopqrstuvwxyz      \n", 1);
+    char *alnum = random_text(CORPUS_SIZE, "abcdefghijklmnopqrstuvwxyz0123456789 .,;=", 2);
+    add_workload(&workloads, n, "literal", "literal", "needle", text, CORPUS_SIZE, MATCH_ANY);
+    add_workload(&workloads, n, "literal", "long_literal", "session_identifier_token", text, CORPUS_SIZE, MATCH_ANY);
+    add_workload(&workloads, n, "class", "email", "[a-z0-9]+@[a-z]+[.][a-z][a-z]+", alnum, CORPUS_SIZE, MATCH_ANY);
+    add_workload(&workloads, n, "class", "key_value", "[a-z]+=[0-9][0-9][0-9][0-9][0-9]+;", alnum, CORPUS_SIZE,
+        MATCH_ANY);
+    add_workload(&workloads, n, "alternation", "words", "(alpha|bravo|charlie|delta|echo|foxtrot|golf|hotel)[0-9]",
+        text, CORPUS_SIZE, MATCH_ANY);
+    add_workload(&workloads, n, "alternation", "methods", "(GET|HEAD|POST|PUT|DELETE|OPTIONS|PATCH) /",
+        text, CORPUS_SIZE, MATCH_ANY);
+
+    char *long_text = random_text(LONG_CORPUS_SIZE, "abcdefghijklmnopqrstuvwxyz      \n", 3);
+    add_workload(&workloads, n, "long_input", "full_match", "[a-z \n]*", long_text, LONG_CORPUS_SIZE, MATCH_FULL);
+    add_workload(&workloads, n, "long_input", "suffix", "x[0-9]+$", long_text, LONG_CORPUS_SIZE, MATCH_ANY);
+    char *field = random_text(LONG_CORPUS_SIZE, "abcdefghijklmnopqrstuvwxyz      \n", 4);
+    field[0] = field[LONG_CORPUS_SIZE - 1] = '"';
+    add_workload(&workloads, n, "long_input", "quoted_field", "\"[^\"]*\"", field, LONG_CORPUS_SIZE, MATCH_PREFIX);
+    return workloads;
+}
+
+static void
+free_workloads(workload *workloads, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        free(workloads[i].name);
+        free(workloads[i].pattern);
+        // the corpora are shared between workloads
+        int shared = 0;
+        for (size_t j = i + 1; j < n; j++)
+            shared |= workloads[j].input == workloads[i].input;
+        if (!shared)
+            free(workloads[i].input);
+    }
+    free(workloads);
+}
+
+/*
+ * Times the matches of both engines and prints a line for the workload.
+ * Returns the speedup, or 0 if the engines disagree.
+ */
+static double
+run_workload(workload *w, size_t trials, size_t warmup)
+{
+    uint64_t *samples = malloc(trials * sizeof(uint64_t));
+    if (samples == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    nfa_machine_t *machine = compile_regex(w->pattern);
+    posix_regex_t *posix = posix_regex_compile(w->pattern, 0);
+    if (machine == NULL || posix == NULL)
+        errx(EXIT_FAILURE, "%s: can't compile %s", w->name, w->pattern);
+    re_meta_t *re = re_meta_init(machine);
+
+    int result = 0, posix_result = 0;
+    match_t m;
+    for (size_t i = 0; i < warmup + trials; i++) {
+        uint64_t start = now_ns();
+        result = re_meta_match(re, w->input, w->len, w->mode, &m);
+        uint64_t end = now_ns();
+        if (i >= warmup)
+            samples[i - warmup] = end - start;
+    }
+    uint64_t re_ns = median(samples, trials);
+    for (size_t i = 0; i < warmup + trials; i++) {
+        uint64_t start = now_ns();
+        posix_result = posix_match(posix, w->input, w->len, w->mode, &m);
+        uint64_t end = now_ns();
+        if (i >= warmup)
+            samples[i - warmup] = end - start;
+    }
+    uint64_t posix_ns = median(samples, trials);
+    double speedup = (double) posix_ns / (re_ns? re_ns: 1);
+    printf("%s,%s,%zu,%" PRIu64 ",%" PRIu64 ",%.2f,%d,%s\n", w->name, w->type, w->len, re_ns, posix_ns, speedup,
+        result, result == posix_result? "yes": "NO");
+
+    re_meta_free(re);
+    free_nfa(machine);
+    posix_regex_free(posix);
+    free(samples);
+    return result == posix_result? speedup: 0;
+}
+
+static void
+emit(pattern_gen *g, const char *s)
+{
+    size_t n = strlen(s);
+    if (g->len + n < FUZZ_PATTERN_SIZE) {
+        memcpy(g->buf + g->len, s, n);
+        g->len += n;
+        g->buf[g->len] = 0;
+    }
+}
+
+static void gen_alternation(pattern_gen *, int);
+
+static void
+gen_atom(pattern_gen *g, int depth)
+{
+    static const char *atoms[] = {"a", "b", "c", "a", "b", ".", "[ab]", "[^a]", "[b-d]", "B"};
+    if (depth > 0 && rand_r(&g->seed) % 4 == 0) {
+        emit(g, "(");
+        gen_alternation(g, depth - 1);
+        emit(g, ")");
+    } else {
+        emit(g, atoms[rand_r(&g->seed) % (sizeof(atoms)/sizeof(atoms[0]))]);
+    }
+}
+
+static void
+gen_alternation(pattern_gen *g, int depth)
+{
+    size_t nbranches = rand_r(&g->seed) % 4 == 0? 2 + rand_r(&g->seed) % 2: 1;
+    for (size_t b = 0; b < nbranches; b++) {
+        if (b)
+            emit(g, "|");
+        size_t npieces = 1 + rand_r(&g->seed) % 3;
+        for (size_t p = 0; p < npieces; p++) {
+            gen_atom(g, depth);
+            unsigned int r = rand_r(&g->seed) % 8;
+            emit(g, r == 0? "*": r == 1? "+": r == 2? "?": "");
+        }
+    }
+}
+
+static void
+gen_pattern(pattern_gen *g)
+{
+    g->len = 0;
+    g->buf[0] = 0;
+    if (rand_r(&g->seed) % 5 == 0)
+        emit(g, "^");
+    gen_alternation(g, 3);
+    if (rand_r(&g->seed) % 5 == 0)
+        emit(g, "$");
+}
+
+/* Prints the input with its newlines escaped */
+static void
+print_input(const char *input, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (input[i] == '\n')
+            printf("\\n");
+        else
+            putchar(input[i]);
+    }
+}
+
+static int
+report(const char *engine, const char *pattern, int icase, const char *input, size_t len, match_mode_t mode,
+    int result, match_t *m, int expected, match_t *e)
+{
+    printf("%s disagrees on %s%s in %s mode: %d [%zu, %zu], regexec says %d [%zu, %zu], input \"", engine,
+        pattern, icase? " (icase)": "", mode_names[mode], result, result? m->start: 0, result? m->end: 0,
+        expected, expected? e->start: 0, expected? e->end: 0);
+    print_input(input, len);
+    printf("\"\n");
+    return 1;
+}
+
+/*
+ * Runs random patterns against random inputs on every engine and checks
+ * the results against regexec, and the offsets of MATCH_SEARCH, the only
+ * mode which also asks for the leftmost-longest match. Returns the number
+ * of disagreements.
+ */
+static size_t
+fuzz(size_t iterations, unsigned int seed)
+{
+    pattern_gen g = {{0}, 0, seed};
+    re_compile_options_t options = {0};
+    re_compile_error_t error;
+    char input[256];
+    size_t failures = 0;
+
+    for (size_t iter = 0; iter < iterations && failures < FUZZ_MAX_REPORTS; iter++) {
+        gen_pattern(&g);
+        int icase = rand_r(&g.seed) % 4 == 0;
+        options.flags = icase? RE_ICASE: 0;
+        nfa_machine_t *machine = compile_regex_with_options(g.buf, &options, &error);
+        posix_regex_t *posix = posix_regex_compile(g.buf, icase);
+        if (machine == NULL || posix == NULL) {
+            printf("%s is rejected by %s\n", g.buf, machine == NULL? "compile_regex": "regcomp");
+            failures++;
+            if (machine)
+                free_nfa(machine);
+            if (posix)
+                posix_regex_free(posix);
+            continue;
+        }
+        dfa_t *dfa = dfa_init(machine, 0);
+        dfa_t *full = dfa_init(machine, 0);
+        dense_dfa_t *dense = dfa_minimize(full);
+        re_meta_t *re = re_meta_init(machine);
+
+        for (size_t k = 0; k < FUZZ_INPUTS; k++) {
+            // mostly short inputs, some long enough for the planned DFA
+            size_t len = k == FUZZ_INPUTS - 1? 64 + rand_r(&g.seed) % 128: rand_r(&g.seed) % 12;
+            for (size_t i = 0; i < len; i++)
+                input[i] = "abcdaB\n"[rand_r(&g.seed) % 7];
+            for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+                match_t e = {0}, m;
+                int expected = posix_match(posix, input, len, mode, &e);
+                int result;
+#define CHECK(engine, call) \
+                do { \
+                    memset(&m, 0, sizeof(m)); \
+                    result = call; \
+                    if (result != expected || (result && mode == MATCH_SEARCH && (m.start != e.start || m.end != e.end))) \
+                        failures += report(engine, g.buf, icase, input, len, mode, result, &m, expected, &e); \
+                } while (0)
+                CHECK("nfa", nfa_match(machine, input, len, mode, &m));
+                CHECK("dfa", dfa_match(dfa, input, len, mode, &m));
+                if (dense)
+                    CHECK("dense_dfa", dense_dfa_match(dense, input, len, mode, &m));
+                CHECK("meta", re_meta_match(re, input, len, mode, &m));
+#undef CHECK
+            }
+        }
+        re_meta_free(re);
+        if (dense)
+            dense_dfa_free(dense);
+        dfa_free(full);
+        dfa_free(dfa);
+        free_nfa(machine);
+        posix_regex_free(posix);
+    }
+    return failures;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: posix_compare [-n trials] [-w warmup] [-t type] [-f iterations] [-s seed]\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t trials = DEFAULT_TRIALS;
+    size_t warmup = DEFAULT_WARMUP;
+    size_t iterations = 0;
+    unsigned int seed = 1;
+    const char *type = NULL;
+    size_t nworkloads;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "f:n:s:t:w:")) != -1) {
+        switch (ch) {
+        case 'f':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            trials = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            type = optarg;
+            break;
+        case 'w':
+            warmup = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (trials == 0)
+        usage();
+
+    if (iterations) {
+        size_t failures = fuzz(iterations, seed);
+        printf("%zu disagreements in %zu random patterns\n", failures, iterations);
+        return failures != 0;
+    }
+
+    // the geometric mean of the speedups of every type of workload
+    const char *types[] = {"pathological", "literal", "class", "alternation", "long_input"};
+    double log_sum[sizeof(types)/sizeof(types[0])] = {0};
+    size_t count[sizeof(types)/sizeof(types[0])] = {0};
+    int disagreements = 0;
+    workload *workloads = create_workloads(&nworkloads);
+    printf("workload,type,input_bytes,re_median_ns,posix_median_ns,speedup,matched,agree\n");
+    for (size_t i = 0; i < nworkloads; i++) {
+        if (type && strcmp(type, workloads[i].type) != 0)
+            continue;
+        double speedup = run_workload(&workloads[i], trials, warmup);
+        fflush(stdout);
+        if (speedup == 0) {
+            disagreements = 1;
+            continue;
+        }
+        for (size_t t = 0; t < sizeof(types)/sizeof(types[0]); t++) {
+            if (strcmp(types[t], workloads[i].type) == 0) {
+                log_sum[t] += log(speedup);
+                count[t]++;
+            }
+        }
+    }
+    printf("\ntype,workloads,speedup\n");
+    for (size_t t = 0; t < sizeof(types)/sizeof(types[0]); t++) {
+        if (count[t])
+            printf("%s,%zu,%.2f\n", types[t], count[t], exp(log_sum[t] / count[t]));
+    }
+    free_workloads(workloads, nworkloads);
+    return disagreements;
+}
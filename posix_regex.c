@@ -0,0 +1,77 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <regex.h>
+#include <stdlib.h>
+
+#include "posix_regex.h"
+
+struct posix_regex_t {
+    regex_t regex;
+};
+
+/* Returns NULL if regcomp rejects the pattern */
+posix_regex_t *
+posix_regex_compile(const char *pattern, int icase)
+{
+    posix_regex_t *re = malloc(sizeof(*re));
+    if (re == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    if (regcomp(&re->regex, pattern, REG_EXTENDED | (icase? REG_ICASE: 0)) != 0) {
+        free(re);
+        return NULL;
+    }
+    return re;
+}
+
+/*
+ * The leftmost-longest match in the first len bytes of string, which
+ * don't have to be NUL terminated. Returns 1 and the offsets of the match,
+ * or 0.
+ */
+int
+posix_regex_search(posix_regex_t *re, const char *string, size_t len, size_t *start, size_t *end)
+{
+    regmatch_t m;
+    m.rm_so = 0;
+    m.rm_eo = len;
+    if (regexec(&re->regex, string, 1, &m, REG_STARTEND) != 0)
+        return 0;
+    *start = m.rm_so;
+    *end = m.rm_eo;
+    return 1;
+}
+
+void
+posix_regex_free(posix_regex_t *re)
+{
+    regfree(&re->regex);
+    free(re);
+}
@@ -0,0 +1,522 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast.h"
+#include "parser.h"
+#include "re_analysis.h"
+#include "re_utils.h"
+
+/*
+ * What all the matches of a subexpression have in common: their length is
+ * in [min_len, max_len], they start with prefix, end with suffix and
+ * contain required. If exact is set the subexpression only matches that
+ * one string, which is then the prefix, the suffix and required at once.
+ * Zero width assertions count as matching the empty string exactly, but
+ * not as nullable since they don't match it everywhere.
+ */
+typedef struct node_info {
+    size_t min_len;
+    size_t max_len;
+    int nullable;
+    int exact;
+    re_literal_t prefix;
+    re_literal_t suffix;
+    re_literal_t required;
+} node_info;
+
+#define add_len(a, b) ((a) == RE_UNBOUNDED || (b) == RE_UNBOUNDED? RE_UNBOUNDED: (a) + (b))
+#define utf8_length(cp) ((cp) < 0x80? 1: (cp) < 0x800? 2: (cp) < 0x10000? 3: 4)
+
+static re_literal_t
+literal_concat(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen)
+{
+    re_literal_t l = {NULL, alen + blen};
+    if (l.len == 0)
+        return l;
+    l.bytes = re_malloc(l.len);
+    if (l.bytes == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    if (alen)
+        memcpy(l.bytes, a, alen);
+    if (blen)
+        memcpy(l.bytes + alen, b, blen);
+    return l;
+}
+
+#define literal_copy(bytes, len) literal_concat(bytes, len, NULL, 0)
+
+static void
+literal_free(re_literal_t *l)
+{
+    re_free(l->bytes);
+    l->bytes = NULL;
+    l->len = 0;
+}
+
+/* Keeps the longer of the two, the first one on a tie */
+static re_literal_t
+literal_longest(re_literal_t a, re_literal_t b)
+{
+    if (b.len > a.len) {
+        literal_free(&a);
+        return b;
+    }
+    literal_free(&b);
+    return a;
+}
+
+static void
+info_free(node_info *info)
+{
+    literal_free(&info->prefix);
+    literal_free(&info->suffix);
+    literal_free(&info->required);
+}
+
+static void
+set_exact(node_info *info, const uint8_t *bytes, size_t len)
+{
+    info->min_len = info->max_len = len;
+    info->exact = 1;
+    info->prefix = literal_copy(bytes, len);
+    info->suffix = literal_copy(bytes, len);
+    info->required = literal_copy(bytes, len);
+}
+
+static void analyze_node(expression_node_t *, node_info *);
+
+static void
+analyze_concat(infix_expression_t *node, node_info *info)
+{
+    node_info left = {0}, right = {0};
+    analyze_node(node->left, &left);
+    analyze_node(node->right, &right);
+    info->min_len = left.min_len + right.min_len;
+    info->max_len = add_len(left.max_len, right.max_len);
+    info->nullable = left.nullable && right.nullable;
+    info->exact = left.exact && right.exact;
+    if (left.exact)
+        info->prefix = literal_concat(left.prefix.bytes, left.prefix.len, right.prefix.bytes, right.prefix.len);
+    else
+        info->prefix = literal_copy(left.prefix.bytes, left.prefix.len);
+    if (right.exact)
+        info->suffix = literal_concat(left.suffix.bytes, left.suffix.len, right.suffix.bytes, right.suffix.len);
+    else
+        info->suffix = literal_copy(right.suffix.bytes, right.suffix.len);
+    // the end of the left side runs straight into the start of the right one
+    re_literal_t joined = literal_concat(left.suffix.bytes, left.suffix.len, right.prefix.bytes, right.prefix.len);
+    info->required = literal_longest(literal_longest(left.required, right.required), joined);
+    left.required.bytes = right.required.bytes = NULL;
+    info_free(&left);
+    info_free(&right);
+}
+
+static void
+analyze_or(infix_expression_t *node, node_info *info)
+{
+    node_info left = {0}, right = {0};
+    analyze_node(node->left, &left);
+    analyze_node(node->right, &right);
+    size_t p = 0, s = 0;
+    while (p < left.prefix.len && p < right.prefix.len && left.prefix.bytes[p] == right.prefix.bytes[p])
+        p++;
+    while (s < left.suffix.len && s < right.suffix.len &&
+        left.suffix.bytes[left.suffix.len - s - 1] == right.suffix.bytes[right.suffix.len - s - 1])
+        s++;
+    if (left.exact && right.exact && left.prefix.len == right.prefix.len && p == left.prefix.len) {
+        set_exact(info, left.prefix.bytes, p);
+    } else {
+        info->min_len = left.min_len < right.min_len? left.min_len: right.min_len;
+        info->max_len = left.max_len > right.max_len? left.max_len: right.max_len;
+        info->prefix = literal_copy(left.prefix.bytes, p);
+        info->suffix = literal_copy(s? left.suffix.bytes + left.suffix.len - s: NULL, s);
+        info->required = literal_longest(literal_copy(info->prefix.bytes, p), literal_copy(info->suffix.bytes, s));
+    }
+    info->nullable = left.nullable || right.nullable;
+    info_free(&left);
+    info_free(&right);
+}
+
+static void
+analyze_utf8_class(utf8_class_t *node, node_info *info)
+{
+    if (node->nranges == 0) {
+        info->min_len = info->max_len = 1;
+        return;
+    }
+    // the encoding gets longer with the code point
+    info->min_len = utf8_length(node->ranges[0]);
+    info->max_len = utf8_length(node->ranges[2 * node->nranges - 1]);
+}
+
+static void
+analyze_node(expression_node_t *node, node_info *info)
+{
+    switch (node->type) {
+    case CHAR_LITERAL: {
+        uint8_t c = ((char_literal_t *) node)->value;
+        if (c == NULL_STATE) {
+            set_exact(info, NULL, 0);
+            info->nullable = 1;
+        } else if (c == '.') {
+            info->min_len = info->max_len = 1;
+        } else {
+            set_exact(info, &c, 1);
+        }
+        break;
+    }
+    case CHAR_CLASS: {
+        char_class_t *cc = (char_class_t *) node;
+        size_t n = 0;
+        uint8_t c = 0;
+        for (size_t i = 0; i < 256; i++) {
+            if (cc->allowed_values[i]) {
+                c = i;
+                n++;
+            }
+        }
+        info->min_len = info->max_len = 1;
+        if (n == 1)
+            set_exact(info, &c, 1);
+        break;
+    }
+    case UTF8_CLASS:
+        analyze_utf8_class((utf8_class_t *) node, info);
+        break;
+    case ASSERTION:
+        set_exact(info, NULL, 0);
+        break;
+    case POSTFIX_EXPRESSION: {
+        // only `*` is left after parsing, `x+` is x followed by `x*`
+        node_info left = {0};
+        analyze_node(((postfix_expression_t *) node)->left, &left);
+        info->max_len = left.max_len == 0? 0: RE_UNBOUNDED;
+        info->nullable = 1;
+        info_free(&left);
+        break;
+    }
+    case INFIX_EXPRESSION: {
+        infix_expression_t *infix = (infix_expression_t *) node;
+        if (infix->op == CONCAT)
+            analyze_concat(infix, info);
+        else
+            analyze_or(infix, info);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* `.*` in byte mode, which matches anything */
+static int
+is_any_star(expression_node_t *node)
+{
+    if (node->type != POSTFIX_EXPRESSION)
+        return 0;
+    expression_node_t *left = ((postfix_expression_t *) node)->left;
+    return left->type == CHAR_LITERAL && ((char_literal_t *) left)->value == '.';
+}
+
+/* Copies the concatenation node without the `.*` at the start of its left spine */
+static expression_node_t *
+strip_leading_any(expression_node_t *node)
+{
+    infix_expression_t *infix = (infix_expression_t *) node;
+    if (is_any_star(infix->left))
+        return copy_expression(infix->right);
+    infix_expression_t *copy = create_infix_exp();
+    copy->op = CONCAT;
+    copy->left = strip_leading_any(infix->left);
+    copy->right = copy_expression(infix->right);
+    return (expression_node_t *) copy;
+}
+
+/*
+ * Works out what every match of the pattern has in common: its length
+ * bounds, whether the empty string matches anywhere, the strings every
+ * match starts and ends with and the longest string every match contains.
+ * The required string comes from the literal runs of concatenations and
+ * what all the branches of an alternation start or end with. Matching can
+ * reject an input which is too short or lacks one of the strings without
+ * running an automaton over it.
+ */
+void
+analyze_pattern(expression_node_t *root, re_analysis_t *analysis)
+{
+    node_info info = {0};
+    analyze_node(root, &info);
+    analysis->min_len = info.min_len;
+    analysis->max_len = info.max_len;
+    analysis->nullable = info.nullable;
+    analysis->leading_any = analysis->trailing_any = 0;
+    analysis->prefix = info.prefix;
+    analysis->suffix = info.suffix;
+    analysis->required = info.required;
+}
+
+/*
+ * A `.*` at the start of a pattern in byte mode only turns an anchored
+ * match into a search, and one at the end extends a match to the end of
+ * the input, so both can be left out of the machine and handled by the
+ * executors instead. Returns a copy of the pattern without them, recording
+ * which ones were removed in analysis, or NULL if there are none. A
+ * pattern which is nothing but `.*` is kept.
+ */
+expression_node_t *
+strip_any_wrappers(expression_node_t *root, re_analysis_t *analysis)
+{
+    expression_node_t *core = root;
+    infix_expression_t *infix = (infix_expression_t *) root;
+    if (root->type == INFIX_EXPRESSION && infix->op == CONCAT && is_any_star(infix->right)) {
+        analysis->trailing_any = 1;
+        core = infix->left;
+    }
+    for (expression_node_t *n = core; n->type == INFIX_EXPRESSION; n = ((infix_expression_t *) n)->left) {
+        infix = (infix_expression_t *) n;
+        if (infix->op != CONCAT)
+            break;
+        if (is_any_star(infix->left)) {
+            analysis->leading_any = 1;
+            break;
+        }
+    }
+    if (analysis->leading_any)
+        return strip_leading_any(core);
+    if (analysis->trailing_any)
+        return copy_expression(core);
+    return NULL;
+}
+
+/* A concatenation of single bytes */
+static int
+is_literal(expression_node_t *node)
+{
+    switch (node->type) {
+    case CHAR_LITERAL: {
+        uint8_t c = ((char_literal_t *) node)->value;
+        return c != NULL_STATE && c != '.';
+    }
+    case CHAR_CLASS: {
+        size_t n = 0;
+        for (size_t i = 0; i < 256; i++)
+            n += ((char_class_t *) node)->allowed_values[i] != 0;
+        return n == 1;
+    }
+    case INFIX_EXPRESSION: {
+        infix_expression_t *infix = (infix_expression_t *) node;
+        return infix->op == CONCAT && is_literal(infix->left) && is_literal(infix->right);
+    }
+    default:
+        return 0;
+    }
+}
+
+static int
+is_literal_set(expression_node_t *node)
+{
+    infix_expression_t *infix = (infix_expression_t *) node;
+    if (node->type == INFIX_EXPRESSION && infix->op == OR)
+        return is_literal_set(infix->left) && is_literal_set(infix->right);
+    return is_literal(node);
+}
+
+/* The byte of a single byte node of a literal */
+static uint8_t
+literal_byte(expression_node_t *node)
+{
+    if (node->type == CHAR_LITERAL)
+        return ((char_literal_t *) node)->value;
+    size_t c = 0;
+    while (!((char_class_t *) node)->allowed_values[c])
+        c++;
+    return c;
+}
+
+static size_t
+literal_length(expression_node_t *node)
+{
+    infix_expression_t *infix = (infix_expression_t *) node;
+    if (node->type == INFIX_EXPRESSION)
+        return literal_length(infix->left) + literal_length(infix->right);
+    return 1;
+}
+
+static void
+append_literal(expression_node_t *node, re_literal_t *l)
+{
+    infix_expression_t *infix = (infix_expression_t *) node;
+    if (node->type == INFIX_EXPRESSION) {
+        append_literal(infix->left, l);
+        append_literal(infix->right, l);
+    } else {
+        l->bytes[l->len++] = literal_byte(node);
+    }
+}
+
+/* The number of strings of a literal set */
+static size_t
+count_alternatives(expression_node_t *node)
+{
+    infix_expression_t *infix = (infix_expression_t *) node;
+    if (node->type == INFIX_EXPRESSION && infix->op == OR)
+        return count_alternatives(infix->left) + count_alternatives(infix->right);
+    return 1;
+}
+
+static void
+collect_literals(expression_node_t *node, re_plan_t *plan)
+{
+    infix_expression_t *infix = (infix_expression_t *) node;
+    if (node->type == INFIX_EXPRESSION && infix->op == OR) {
+        collect_literals(infix->left, plan);
+        collect_literals(infix->right, plan);
+        return;
+    }
+    re_literal_t *l = &plan->literals[plan->nliterals++];
+    l->bytes = re_malloc(literal_length(node));
+    if (l->bytes == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    l->len = 0;
+    append_literal(node, l);
+}
+
+/*
+ * Fills in the strings of a literal set and the bytes they start with,
+ * unless they start with more different bytes than one memchr looks for,
+ * which leaves the set to the DFA.
+ */
+static void
+plan_literals(expression_node_t *root, re_plan_t *plan)
+{
+    plan->literals = re_malloc(RE_PLAN_MAX_LITERALS * sizeof(re_literal_t));
+    if (plan->literals == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    collect_literals(root, plan);
+    for (size_t i = 0; i < plan->nliterals; i++) {
+        uint8_t c = plan->literals[i].bytes[0];
+        if (memchr(plan->first_bytes, c, plan->nfirst_bytes))
+            continue;
+        if (plan->nfirst_bytes == RE_PLAN_MAX_FIRST_BYTES) {
+            free_plan(plan);
+            return;
+        }
+        plan->first_bytes[plan->nfirst_bytes++] = c;
+    }
+}
+
+static void
+count_positions(expression_node_t *node, re_plan_t *plan)
+{
+    switch (node->type) {
+    case CHAR_LITERAL:
+        plan->npositions += ((char_literal_t *) node)->value != NULL_STATE;
+        break;
+    case CHAR_CLASS:
+        plan->npositions++;
+        break;
+    case UTF8_CLASS:
+        plan->npositions += ((utf8_class_t *) node)->nranges;
+        break;
+    case ASSERTION:
+        plan->has_assertions = 1;
+        break;
+    case POSTFIX_EXPRESSION:
+        count_positions(((postfix_expression_t *) node)->left, plan);
+        break;
+    case INFIX_EXPRESSION:
+        count_positions(((infix_expression_t *) node)->left, plan);
+        count_positions(((infix_expression_t *) node)->right, plan);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Picks the engine for a pattern from its shape. A single string, or an
+ * alternation of a few, is found with a string search for the strings of
+ * the plan, a memmem for one and a memchr for the bytes they start with
+ * for more. A pattern with few positions has a DFA of a manageable size,
+ * which is then built in full, anything bigger only gets the states the
+ * inputs run into.
+ */
+void
+plan_pattern(expression_node_t *root, re_plan_t *plan)
+{
+    memset(plan, 0, sizeof(*plan));
+    count_positions(root, plan);
+    if (is_literal(root))
+        plan->shape = RE_SHAPE_LITERAL;
+    else if (is_literal_set(root))
+        plan->shape = RE_SHAPE_LITERAL_SET;
+    else
+        plan->shape = RE_SHAPE_GENERAL;
+    if (plan->shape != RE_SHAPE_GENERAL && count_alternatives(root) <= RE_PLAN_MAX_LITERALS)
+        plan_literals(root, plan);
+    if (plan->literals)
+        plan->engine = RE_ENGINE_LITERAL;
+    else if (plan->npositions <= RE_PLAN_DENSE_POSITIONS)
+        plan->engine = RE_ENGINE_DENSE_DFA;
+    else
+        plan->engine = RE_ENGINE_DFA;
+    plan->short_input = RE_PLAN_SHORT_INPUT;
+}
+
+void
+free_plan(re_plan_t *plan)
+{
+    for (size_t i = 0; i < plan->nliterals; i++)
+        literal_free(&plan->literals[i]);
+    re_free(plan->literals);
+    plan->literals = NULL;
+    plan->nliterals = 0;
+    plan->nfirst_bytes = 0;
+}
+
+void
+copy_analysis(re_analysis_t *dst, const re_analysis_t *src)
+{
+    *dst = *src;
+    dst->prefix = literal_copy(src->prefix.bytes, src->prefix.len);
+    dst->suffix = literal_copy(src->suffix.bytes, src->suffix.len);
+    dst->required = literal_copy(src->required.bytes, src->required.len);
+}
+
+void
+free_analysis(re_analysis_t *analysis)
+{
+    literal_free(&analysis->prefix);
+    literal_free(&analysis->suffix);
+    literal_free(&analysis->required);
+}
@@ -0,0 +1,122 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef RE_ANALYSIS_H
+#define RE_ANALYSIS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ast.h"
+#include "re_stats.h"
+
+/* A byte string, with bytes NULL if len is 0 */
+typedef struct re_literal_t {
+    uint8_t *bytes;
+    size_t len;
+} re_literal_t;
+
+#define RE_UNBOUNDED SIZE_MAX
+
+/* What is known about every match of a pattern before running it */
+typedef struct re_analysis_t {
+    size_t min_len;
+    size_t max_len; // RE_UNBOUNDED if there is no limit
+    int nullable; // the empty string matches at any position
+    int leading_any; // the machine was built without a leading `.*`
+    int trailing_any; // and without a trailing one
+    re_literal_t prefix; // every match starts with it
+    re_literal_t suffix; // every match ends with it
+    re_literal_t required; // every match contains it
+} re_analysis_t;
+
+/* Inputs shorter than this run on the NFA until a DFA has been built */
+#define RE_PLAN_SHORT_INPUT 64
+/* Patterns with up to this many positions get a fully built DFA */
+#define RE_PLAN_DENSE_POSITIONS 64
+/*
+ * Alternations of up to this many strings, starting with up to this many
+ * different bytes, are matched with a string search
+ */
+#define RE_PLAN_MAX_LITERALS 8
+#define RE_PLAN_MAX_FIRST_BYTES 3
+
+typedef enum re_shape_t {
+    RE_SHAPE_LITERAL, // matches one string and nothing else
+    RE_SHAPE_LITERAL_SET, // an alternation of strings
+    RE_SHAPE_GENERAL
+} re_shape_t;
+
+static const char *re_shape_strings[] = {
+    "LITERAL",
+    "LITERAL_SET",
+    "GENERAL"
+};
+
+#define re_shape_to_string(shape) re_shape_strings[shape]
+
+/*
+ * How a pattern is best matched. engine is the one for inputs of at least
+ * short_input bytes, shorter ones don't make up for building a DFA. The
+ * strings of the pattern are only filled in for RE_ENGINE_LITERAL.
+ */
+typedef struct re_plan_t {
+    re_shape_t shape;
+    size_t npositions; // the bytes and classes of the pattern
+    int has_assertions;
+    re_engine_t engine;
+    size_t short_input;
+    re_literal_t *literals; // in the order of the alternation
+    size_t nliterals;
+    uint8_t first_bytes[RE_PLAN_MAX_FIRST_BYTES]; // the different bytes the literals start with
+    size_t nfirst_bytes;
+} re_plan_t;
+
+void analyze_pattern(expression_node_t *, re_analysis_t *);
+expression_node_t *strip_any_wrappers(expression_node_t *, re_analysis_t *);
+void plan_pattern(expression_node_t *, re_plan_t *);
+void free_plan(re_plan_t *);
+void copy_analysis(re_analysis_t *, const re_analysis_t *);
+void free_analysis(re_analysis_t *);
+
+/*
+ * Returns the first occurrence of the literal in the first len bytes of
+ * string, or NULL. A single byte is looked for with memchr, anything longer
+ * with memmem, which in glibc is a Two-Way search with a vectorized scan
+ * for the rare bytes of short needles.
+ */
+static inline const char *
+find_literal(const char *string, size_t len, const re_literal_t *literal)
+{
+    if (literal->len == 1)
+        return memchr(string, literal->bytes[0], len);
+    return memmem(string, len, literal->bytes, literal->len);
+}
+#endif
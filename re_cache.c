@@ -0,0 +1,289 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nfa_compiler.h"
+#include "re_cache.h"
+#include "re_memory.h"
+#include "re_utils.h"
+
+static re_cache_t *default_cache;
+static pthread_once_t default_cache_once = PTHREAD_ONCE_INIT;
+
+re_cache_t *
+re_cache_init(size_t max_size)
+{
+    re_cache_t *cache;
+    cache = re_malloc(sizeof(*cache));
+    if (cache == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    for (size_t i = 0; i < RE_CACHE_NSHARDS; i++) {
+        re_cache_shard *shard = &cache->shards[i];
+        if (pthread_mutex_init(&shard->lock, NULL))
+            errx(EXIT_FAILURE, "pthread_mutex_init failed");
+        // the entries own the pattern strings and are freed by the cache
+        shard->table = cm_hash_table_init(string_hash_function, string_equals, NULL, NULL);
+        shard->lru_head = NULL;
+        shard->lru_tail = NULL;
+        shard->size = 0;
+    }
+    cache->max_size = max_size? max_size: RE_CACHE_DEFAULT_SIZE;
+    atomic_init(&cache->size, 0);
+    atomic_init(&cache->clock, 0);
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+    atomic_init(&cache->evictions, 0);
+    atomic_init(&cache->uncached, 0);
+    return cache;
+}
+
+static void
+free_entry(re_cache_entry *entry)
+{
+    free_nfa(entry->machine);
+    re_free(entry->pattern);
+    re_free(entry);
+}
+
+static void
+lru_unlink(re_cache_shard *shard, re_cache_entry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        shard->lru_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        shard->lru_tail = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void
+lru_push_front(re_cache_shard *shard, re_cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->lru_head;
+    if (shard->lru_head)
+        shard->lru_head->prev = entry;
+    shard->lru_head = entry;
+    if (shard->lru_tail == NULL)
+        shard->lru_tail = entry;
+}
+
+/*
+ * Drops the cache's reference of the least recently used entries until the
+ * cache is within its budget. The tails of the shards are compared to find
+ * the oldest entry, only one shard is locked at a time, so it has to be
+ * called with none locked.
+ */
+static void
+evict_entries(re_cache_t *cache)
+{
+    while (atomic_load_explicit(&cache->size, memory_order_relaxed) > cache->max_size) {
+        re_cache_shard *oldest = NULL;
+        size_t oldest_use = 0;
+        for (size_t i = 0; i < RE_CACHE_NSHARDS; i++) {
+            re_cache_shard *shard = &cache->shards[i];
+            pthread_mutex_lock(&shard->lock);
+            if (shard->lru_tail && (oldest == NULL || shard->lru_tail->last_use < oldest_use)) {
+                oldest = shard;
+                oldest_use = shard->lru_tail->last_use;
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+        if (oldest == NULL)
+            return;
+
+        // the tail may have been used since, another thread evicting at
+        // the same time makes it no worse than a per shard LRU
+        pthread_mutex_lock(&oldest->lock);
+        re_cache_entry *victim = oldest->lru_tail;
+        if (victim && atomic_load_explicit(&cache->size, memory_order_relaxed) > cache->max_size) {
+            lru_unlink(oldest, victim);
+            cm_hash_table_remove(oldest->table, victim->pattern);
+            oldest->size -= victim->size;
+            atomic_fetch_sub_explicit(&cache->size, victim->size, memory_order_relaxed);
+            atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+        } else {
+            victim = NULL;
+        }
+        pthread_mutex_unlock(&oldest->lock);
+        if (victim)
+            re_cache_release(victim);
+    }
+}
+
+/*
+ * Returns the compiled machine for the pattern, compiling it if it is not
+ * cached. The lock of the shard is not held while compiling, if two threads
+ * race to compile the same pattern the loser throws its machine away.
+ * Patterns bigger than the whole budget are compiled but not cached, they
+ * are counted as uncached in the stats.
+ * The returned entry has to be given back with re_cache_release. Returns
+ * NULL if the pattern does not compile, failures are not cached.
+ */
+re_cache_entry *
+re_cache_get(re_cache_t *cache, const char *pattern)
+{
+    re_cache_shard *shard = &cache->shards[string_hash_function((void *) pattern) % RE_CACHE_NSHARDS];
+    re_cache_entry *entry;
+
+    pthread_mutex_lock(&shard->lock);
+    entry = cm_hash_table_get(shard->table, (void *) pattern);
+    if (entry) {
+        atomic_fetch_add_explicit(&entry->refcount, 1, memory_order_relaxed);
+        entry->last_use = atomic_fetch_add_explicit(&cache->clock, 1, memory_order_relaxed);
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+        pthread_mutex_unlock(&shard->lock);
+        atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+        return entry;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+
+    entry = re_malloc(sizeof(*entry));
+    if (entry == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    entry->pattern = re_strdup(pattern);
+    if (entry->pattern == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    entry->machine = compile_regex(pattern);
+    if (entry->machine == NULL) {
+        re_free(entry->pattern);
+        re_free(entry);
+        return NULL;
+    }
+    re_memory_usage_t usage;
+    re_memory_usage(entry->machine, NULL, &usage);
+    entry->size = usage.total + strlen(pattern) + 1 + sizeof(*entry);
+    entry->prev = NULL;
+    entry->next = NULL;
+    atomic_init(&entry->refcount, 1);
+    if (entry->size > cache->max_size) {
+        atomic_fetch_add_explicit(&cache->uncached, 1, memory_order_relaxed);
+        return entry;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    re_cache_entry *existing = cm_hash_table_get(shard->table, (void *) pattern);
+    if (existing) {
+        atomic_fetch_add_explicit(&existing->refcount, 1, memory_order_relaxed);
+        existing->last_use = atomic_fetch_add_explicit(&cache->clock, 1, memory_order_relaxed);
+        lru_unlink(shard, existing);
+        lru_push_front(shard, existing);
+        pthread_mutex_unlock(&shard->lock);
+        free_entry(entry);
+        return existing;
+    }
+    atomic_fetch_add_explicit(&entry->refcount, 1, memory_order_relaxed);
+    entry->last_use = atomic_fetch_add_explicit(&cache->clock, 1, memory_order_relaxed);
+    cm_hash_table_put(shard->table, entry->pattern, entry);
+    lru_push_front(shard, entry);
+    shard->size += entry->size;
+    atomic_fetch_add_explicit(&cache->size, entry->size, memory_order_relaxed);
+    pthread_mutex_unlock(&shard->lock);
+    evict_entries(cache);
+    return entry;
+}
+
+void
+re_cache_release(re_cache_entry *entry)
+{
+    if (atomic_fetch_sub_explicit(&entry->refcount, 1, memory_order_acq_rel) == 1)
+        free_entry(entry);
+}
+
+void
+re_cache_get_stats(re_cache_t *cache, re_cache_stats_t *stats)
+{
+    stats->hits = atomic_load_explicit(&cache->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&cache->misses, memory_order_relaxed);
+    stats->evictions = atomic_load_explicit(&cache->evictions, memory_order_relaxed);
+    stats->uncached = atomic_load_explicit(&cache->uncached, memory_order_relaxed);
+    stats->entries = 0;
+    stats->size = 0;
+    for (size_t i = 0; i < RE_CACHE_NSHARDS; i++) {
+        re_cache_shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->entries += shard->table->nkeys;
+        stats->size += shard->size;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/*
+ * Drops the cache's references, entries still held by callers stay alive
+ * until they are released.
+ */
+void
+re_cache_free(re_cache_t *cache)
+{
+    for (size_t i = 0; i < RE_CACHE_NSHARDS; i++) {
+        re_cache_shard *shard = &cache->shards[i];
+        re_cache_entry *entry = shard->lru_head;
+        while (entry) {
+            re_cache_entry *next = entry->next;
+            re_cache_release(entry);
+            entry = next;
+        }
+        cm_hash_table_free(shard->table);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    re_free(cache);
+}
+
+static void
+init_default_cache(void)
+{
+    default_cache = re_cache_init(RE_CACHE_DEFAULT_SIZE);
+}
+
+/*
+ * The process wide cache used by compile_regex_cached.
+ */
+re_cache_t *
+re_default_cache(void)
+{
+    pthread_once(&default_cache_once, init_default_cache);
+    return default_cache;
+}
+
+re_cache_entry *
+compile_regex_cached(const char *pattern)
+{
+    return re_cache_get(re_default_cache(), pattern);
+}
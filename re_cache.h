@@ -0,0 +1,100 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef RE_CACHE_H
+#define RE_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "nfa_compiler.h"
+#include "re_utils.h"
+
+#define RE_CACHE_NSHARDS 16
+#define RE_CACHE_DEFAULT_SIZE (64 * 1024 * 1024)
+
+/*
+ * A compiled pattern handed out by the cache. The cache holds one reference
+ * for as long as the entry is cached, every re_cache_get holds another one
+ * until it is given back with re_cache_release. The machine is freed when
+ * the last reference goes away.
+ */
+typedef struct re_cache_entry {
+    char *pattern;
+    nfa_machine_t *machine;
+    size_t size;
+    atomic_size_t refcount;
+    size_t last_use; // the cache's clock when it was last handed out
+    struct re_cache_entry *prev; // LRU list of the shard, most recently used first
+    struct re_cache_entry *next;
+} re_cache_entry;
+
+/*
+ * Patterns are spread over shards by their hash, each shard has its own
+ * lock, table and LRU list, so lookups of different patterns rarely contend.
+ * The budget is shared by all the shards, an eviction takes the least
+ * recently used entry of the whole cache.
+ */
+typedef struct re_cache_shard {
+    pthread_mutex_t lock;
+    cm_hash_table *table;
+    re_cache_entry *lru_head;
+    re_cache_entry *lru_tail;
+    size_t size;
+} re_cache_shard;
+
+typedef struct re_cache_stats_t {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t uncached; // compiled patterns bigger than the whole budget
+    size_t entries;
+    size_t size;
+} re_cache_stats_t;
+
+typedef struct re_cache_t {
+    re_cache_shard shards[RE_CACHE_NSHARDS];
+    size_t max_size;
+    atomic_size_t size;
+    atomic_size_t clock;
+    atomic_size_t hits;
+    atomic_size_t misses;
+    atomic_size_t evictions;
+    atomic_size_t uncached;
+} re_cache_t;
+
+re_cache_t *re_cache_init(size_t);
+re_cache_entry *re_cache_get(re_cache_t *, const char *);
+void re_cache_release(re_cache_entry *);
+void re_cache_get_stats(re_cache_t *, re_cache_stats_t *);
+void re_cache_free(re_cache_t *);
+re_cache_t *re_default_cache(void);
+re_cache_entry *compile_regex_cached(const char *);
+#endif
@@ -0,0 +1,190 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "re_cache.h"
+#include "re_memory.h"
+#include "test_utils.h"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+#define NTHREADS 8
+#define NPATTERNS 64
+#define NLOOKUPS 20000
+
+static void
+test_hits_and_misses(void)
+{
+    re_cache_stats_t stats;
+    printf("Testing cache hits and misses---");
+    re_cache_t *cache = re_cache_init(0);
+    re_cache_entry *e1 = re_cache_get(cache, "a+b");
+    re_cache_entry *e2 = re_cache_get(cache, "a+b");
+    re_cache_entry *e3 = re_cache_get(cache, "a+c");
+    test(e1 == e2, ANSI_COLOR_RED "expected the same entry for the same pattern\n" ANSI_COLOR_RESET);
+    test(e1 != e3, ANSI_COLOR_RED "expected different entries for different patterns\n" ANSI_COLOR_RESET);
+    test(nfa_execute(e1->machine, "aab") == 1, ANSI_COLOR_RED "cached machine does not match\n" ANSI_COLOR_RESET);
+    re_cache_get_stats(cache, &stats);
+    test(stats.hits == 1 && stats.misses == 2 && stats.entries == 2,
+        ANSI_COLOR_RED "unexpected stats: %zu hits, %zu misses, %zu entries\n" ANSI_COLOR_RESET,
+        stats.hits, stats.misses, stats.entries);
+    re_cache_release(e1);
+    re_cache_release(e2);
+    re_cache_release(e3);
+    re_cache_free(cache);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+static void
+test_eviction(void)
+{
+    re_cache_stats_t stats;
+    re_memory_usage_t usage;
+    char pattern[32];
+    printf("Testing cache eviction---");
+    // room for a few small machines per shard
+    nfa_machine_t *sample = compile_regex("x100y*");
+    re_memory_usage(sample, NULL, &usage);
+    free_nfa(sample);
+    re_cache_t *cache = re_cache_init(RE_CACHE_NSHARDS * 4 * usage.total);
+    re_cache_entry *held = re_cache_get(cache, "held(a|b)+");
+    for (size_t i = 0; i < 1000; i++) {
+        snprintf(pattern, sizeof(pattern), "x%zuy*", i);
+        re_cache_release(re_cache_get(cache, pattern));
+    }
+    re_cache_get_stats(cache, &stats);
+    test(stats.evictions > 0, ANSI_COLOR_RED "expected evictions\n" ANSI_COLOR_RESET);
+    test(stats.size <= cache->max_size,
+        ANSI_COLOR_RED "cache size %zu over budget\n" ANSI_COLOR_RESET, stats.size);
+    // an evicted entry stays usable while it is held
+    test(nfa_execute(held->machine, "heldab") == 1, ANSI_COLOR_RED "held machine does not match\n" ANSI_COLOR_RESET);
+    re_cache_release(held);
+    re_cache_free(cache);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+/*
+ * The budget is shared by the shards, so an entry bigger than a shard's
+ * share of it is still cached and the least recently used entry of the
+ * whole cache is the one evicted.
+ */
+static void
+test_global_budget(void)
+{
+    re_cache_stats_t stats;
+    re_memory_usage_t usage;
+    char pattern[32];
+    printf("Testing the cache budget---");
+    nfa_machine_t *sample = compile_regex("x100y*");
+    re_memory_usage(sample, NULL, &usage);
+    free_nfa(sample);
+
+    re_cache_t *cache = re_cache_init(2 * usage.total);
+    re_cache_release(re_cache_get(cache, "x1y*"));
+    re_cache_release(re_cache_get(cache, "x1y*"));
+    re_cache_get_stats(cache, &stats);
+    test(stats.hits == 1 && stats.entries == 1 && stats.uncached == 0,
+        ANSI_COLOR_RED "entry over a shard's share not cached\n" ANSI_COLOR_RESET);
+    re_cache_free(cache);
+
+    cache = re_cache_init(usage.total / 2);
+    re_cache_release(re_cache_get(cache, "x1y*"));
+    re_cache_get_stats(cache, &stats);
+    test(stats.uncached == 1 && stats.entries == 0,
+        ANSI_COLOR_RED "entry over the budget not reported\n" ANSI_COLOR_RESET);
+    re_cache_free(cache);
+
+    // kept in use, it outlives the entries of the other shards
+    cache = re_cache_init(16 * usage.total);
+    for (size_t i = 0; i < 200; i++) {
+        re_cache_release(re_cache_get(cache, "keep(a|b)+"));
+        snprintf(pattern, sizeof(pattern), "x%zuy*", i);
+        re_cache_release(re_cache_get(cache, pattern));
+    }
+    re_cache_get_stats(cache, &stats);
+    test(stats.evictions > 0 && stats.hits == 199 && stats.size <= cache->max_size,
+        ANSI_COLOR_RED "recently used entry evicted: %zu hits, %zu evictions\n" ANSI_COLOR_RESET,
+        stats.hits, stats.evictions);
+    re_cache_free(cache);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+static void *
+lookup_worker(void *arg)
+{
+    re_cache_t *cache = (re_cache_t *) arg;
+    char pattern[32], input[32];
+    unsigned int seed = (unsigned int) (size_t) pthread_self();
+    for (size_t i = 0; i < NLOOKUPS; i++) {
+        int n = rand_r(&seed) % NPATTERNS;
+        snprintf(pattern, sizeof(pattern), "p%d(a|b)+", n);
+        snprintf(input, sizeof(input), "p%dab", n);
+        re_cache_entry *entry = re_cache_get(cache, pattern);
+        if (nfa_execute(entry->machine, input) != 1)
+            abort();
+        re_cache_release(entry);
+    }
+    return NULL;
+}
+
+static void
+test_concurrent_lookups(size_t cache_size)
+{
+    pthread_t threads[NTHREADS];
+    re_cache_stats_t stats;
+    printf("Testing concurrent lookups with cache size %zu---", cache_size);
+    re_cache_t *cache = re_cache_init(cache_size);
+    for (size_t i = 0; i < NTHREADS; i++)
+        pthread_create(&threads[i], NULL, lookup_worker, cache);
+    for (size_t i = 0; i < NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+    re_cache_get_stats(cache, &stats);
+    test(stats.hits + stats.misses == NTHREADS * NLOOKUPS,
+        ANSI_COLOR_RED "expected %d lookups, got %zu\n" ANSI_COLOR_RESET, NTHREADS * NLOOKUPS, stats.hits + stats.misses);
+    re_cache_free(cache);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    test_hits_and_misses();
+    test_eviction();
+    test_global_budget();
+    test_concurrent_lookups(0);
+    test_concurrent_lookups(RE_CACHE_NSHARDS * 2048);
+}
@@ -0,0 +1,128 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "dense_dfa.h"
+#include "dfa.h"
+#include "dfa_jit.h"
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "re_memory.h"
+#include "re_meta.h"
+#include "re_utils.h"
+#include "shared_dfa.h"
+
+static void
+add_usage(nfa_machine_t *machine, dfa_t *dfa, re_memory_usage_t *usage)
+{
+    size_t char_sets = machine->nstates * sizeof(((nfa_state_t *) 0)->c);
+    usage->machine += sizeof(*machine) + machine->analysis.prefix.len + machine->analysis.suffix.len +
+        machine->analysis.required.len;
+    if (machine->plan.literals)
+        usage->machine += RE_PLAN_MAX_LITERALS * sizeof(re_literal_t);
+    for (size_t i = 0; i < machine->plan.nliterals; i++)
+        usage->machine += machine->plan.literals[i].len;
+    usage->char_sets += char_sets;
+    usage->states += machine->nstates * sizeof(nfa_state_t) - char_sets;
+    usage->match_scratch += nfa_scratch_size(machine);
+    usage->parse += machine->parse_size;
+
+    if (dfa) {
+        usage->dfa_cache += dfa_states_size(dfa);
+        usage->dfa_scratch += dfa_scratch_size(dfa);
+    }
+    if (machine->reverse)
+        add_usage(machine->reverse, dfa? dfa->reverse: NULL, usage);
+}
+
+static void
+sum_total(re_memory_usage_t *usage)
+{
+    usage->total = usage->machine + usage->states + usage->char_sets + usage->dfa_cache + usage->dfa_scratch +
+        usage->dense_dfa + usage->jit + usage->jit_code + usage->shared_dfa + usage->meta;
+}
+
+/*
+ * Fills in usage for the machine and the DFA, which may be NULL. The
+ * numbers are the sizes requested from the allocator, so they match what
+ * a counting allocator sees but not the allocator's own overhead. The
+ * reversed machine of a pattern anchored at the end and its DFA are
+ * included.
+ */
+void
+re_memory_usage(nfa_machine_t *machine, dfa_t *dfa, re_memory_usage_t *usage)
+{
+    memset(usage, 0, sizeof(*usage));
+    add_usage(machine, dfa, usage);
+    sum_total(usage);
+}
+
+/* These add an engine built from the machine to its usage */
+void
+re_memory_add_dense_dfa(re_memory_usage_t *usage, dense_dfa_t *dfa)
+{
+    usage->dense_dfa += dense_dfa_size(dfa);
+    sum_total(usage);
+}
+
+/*
+ * Only the code and the dfa_jit_t, the dense DFA it runs is added on its
+ * own.
+ */
+void
+re_memory_add_jit(re_memory_usage_t *usage, dfa_jit_t *jit)
+{
+    usage->jit += sizeof(*jit);
+    usage->jit_code += jit->code? jit->code_size: 0;
+    sum_total(usage);
+}
+
+void
+re_memory_add_shared_dfa(re_memory_usage_t *usage, shared_dfa_t *dfa)
+{
+    usage->shared_dfa += shared_dfa_size(dfa);
+    sum_total(usage);
+}
+
+/*
+ * The re_meta_t and whichever DFA it has built.
+ */
+void
+re_memory_add_meta(re_memory_usage_t *usage, re_meta_t *re)
+{
+    usage->meta += sizeof(*re);
+    if (atomic_load_explicit(&re->built, memory_order_acquire)) {
+        if (re->dense)
+            usage->dense_dfa += dense_dfa_size(re->dense);
+        if (re->lazy)
+            usage->shared_dfa += shared_dfa_size(re->lazy);
+    }
+    sum_total(usage);
+}
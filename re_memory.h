@@ -0,0 +1,70 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef RE_MEMORY_H
+#define RE_MEMORY_H
+
+#include <stddef.h>
+
+#include "dense_dfa.h"
+#include "dfa.h"
+#include "dfa_jit.h"
+#include "nfa_compiler.h"
+#include "re_meta.h"
+#include "shared_dfa.h"
+
+/*
+ * Bytes held by a compiled machine and, optionally, the engines built from
+ * it. The lexer, parser and parse tree are all freed by compile_regex, parse
+ * is what they took while compiling. match_scratch is what every nfa_match
+ * call allocates for the duration of the match. Neither is included in
+ * total. jit_code is mapped with mmap, a counting allocator doesn't see it.
+ */
+typedef struct re_memory_usage_t {
+    size_t machine; // the machine, the analysis of its pattern and its plan
+    size_t states; // the NFA states, without their char sets
+    size_t char_sets;
+    size_t dfa_cache; // the DFA states, their transitions and the state table
+    size_t dfa_scratch; // the DFA itself, its subset construction and search buffers
+    size_t dense_dfa; // full DFAs and the tables they own
+    size_t jit; // the dfa_jit_t
+    size_t jit_code;
+    size_t shared_dfa; // shared lazy DFAs with their current and retired caches
+    size_t meta; // the re_meta_t, the DFA it built is counted with its engine
+    size_t match_scratch;
+    size_t parse;
+    size_t total;
+} re_memory_usage_t;
+
+void re_memory_usage(nfa_machine_t *, dfa_t *, re_memory_usage_t *);
+void re_memory_add_dense_dfa(re_memory_usage_t *, dense_dfa_t *);
+void re_memory_add_jit(re_memory_usage_t *, dfa_jit_t *);
+void re_memory_add_shared_dfa(re_memory_usage_t *, shared_dfa_t *);
+void re_memory_add_meta(re_memory_usage_t *, re_meta_t *);
+#endif
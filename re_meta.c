@@ -0,0 +1,205 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "re_meta.h"
+#include "re_utils.h"
+
+/*
+ * The machine is not owned and has to outlive the re_meta_t. Nothing is
+ * built until the first match which needs it.
+ */
+re_meta_t *
+re_meta_init(nfa_machine_t *machine)
+{
+    re_meta_t *re = re_calloc(1, sizeof(*re));
+    if (re == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    re->machine = machine;
+    atomic_init(&re->engine, machine->plan.engine);
+    atomic_init(&re->built, 0);
+    pthread_mutex_init(&re->lock, NULL);
+    return re;
+}
+
+/*
+ * The engine a match of len bytes in the mode runs on. Until the DFA is
+ * built, short inputs run on the NFA. A match anchored at the start of
+ * the input never looks further than the longest match of the pattern.
+ */
+re_engine_t
+re_meta_engine(re_meta_t *re, size_t len, match_mode_t mode)
+{
+    re_engine_t engine = atomic_load_explicit(&re->engine, memory_order_relaxed);
+    if (engine == RE_ENGINE_LITERAL || atomic_load_explicit(&re->built, memory_order_acquire))
+        return engine;
+    const re_analysis_t *a = &re->machine->analysis;
+    if ((re->machine->anchored_start || mode == MATCH_PREFIX) && len > a->max_len)
+        len = a->max_len;
+    return len < re->machine->plan.short_input? RE_ENGINE_NFA: engine;
+}
+
+static void
+build(re_meta_t *re)
+{
+    pthread_mutex_lock(&re->lock);
+    if (!atomic_load_explicit(&re->built, memory_order_relaxed)) {
+        if (atomic_load_explicit(&re->engine, memory_order_relaxed) == RE_ENGINE_DENSE_DFA) {
+            dfa_t *dfa = dfa_init(re->machine, 0);
+            re->dense = dfa_minimize(dfa);
+            dfa_free(dfa);
+            if (re->dense == NULL)
+                atomic_store_explicit(&re->engine, RE_ENGINE_DFA, memory_order_relaxed);
+        }
+        if (re->dense == NULL)
+            re->lazy = shared_dfa_init(re->machine, 0);
+        atomic_store_explicit(&re->built, 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&re->lock);
+}
+
+static const char *
+find_first_byte(const char *string, size_t len, const re_plan_t *plan)
+{
+    const uint8_t *bytes = plan->first_bytes;
+    if (plan->nfirst_bytes == 1)
+        return memchr(string, bytes[0], len);
+    if (plan->nfirst_bytes == 2)
+        return re_memchr2(string, bytes[0], bytes[1], len);
+    return re_memchr3(string, bytes[0], bytes[1], bytes[2], len);
+}
+
+/* The longest of the strings of the plan at the start of string, or NULL */
+static const re_literal_t *
+longest_at(const re_plan_t *plan, const char *string, size_t len)
+{
+    const re_literal_t *longest = NULL;
+    for (size_t i = 0; i < plan->nliterals; i++) {
+        const re_literal_t *l = &plan->literals[i];
+        if (l->len <= len && memcmp(string, l->bytes, l->len) == 0 && (longest == NULL || l->len > longest->len))
+            longest = l;
+    }
+    return longest;
+}
+
+/*
+ * Returns the leftmost occurrence of any of the strings of the plan, the
+ * longest one at that offset, and sets found_len to its length. A single
+ * string is looked for with find_literal, more are tried at every offset
+ * holding one of the bytes they start with.
+ */
+static const char *
+find_literals(const re_plan_t *plan, const char *string, size_t len, size_t *found_len)
+{
+    if (plan->nliterals == 1) {
+        *found_len = plan->literals[0].len;
+        return find_literal(string, len, &plan->literals[0]);
+    }
+    const char *end = string + len;
+    for (const char *p = string; (p = find_first_byte(p, end - p, plan)) != NULL; p++) {
+        const re_literal_t *l = longest_at(plan, p, end - p);
+        if (l) {
+            *found_len = l->len;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The pattern is one of the strings of its plan. Like the automata a
+ * prefix match ends at the first string it reaches, the shortest one.
+ */
+static int
+literal_match(nfa_machine_t *machine, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    const re_plan_t *plan = &machine->plan;
+    const char *found = NULL;
+    size_t found_len = 0;
+    if (mode == MATCH_FULL || mode == MATCH_PREFIX) {
+        for (size_t i = 0; i < plan->nliterals; i++) {
+            const re_literal_t *l = &plan->literals[i];
+            if ((mode == MATCH_FULL? len == l->len: len >= l->len) && memcmp(string, l->bytes, l->len) == 0 &&
+                (found == NULL || l->len < found_len)) {
+                found = string;
+                found_len = l->len;
+            }
+        }
+    } else {
+        found = find_literals(plan, string, len, &found_len);
+    }
+#ifdef RE_STATS
+    re_match_stats_t m = {0};
+    m.bytes_scanned = found? (size_t) (found - string) + found_len: len;
+    re_stats_add(&machine->stats, RE_ENGINE_LITERAL, &m);
+#endif
+    if (found == NULL)
+        return 0;
+    if (match) {
+        match->start = found - string;
+        match->end = match->start + found_len;
+    }
+    return 1;
+}
+
+int
+re_meta_match(re_meta_t *re, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    switch (re_meta_engine(re, len, mode)) {
+    case RE_ENGINE_LITERAL:
+        return literal_match(re->machine, string, len, mode, match);
+    case RE_ENGINE_NFA:
+        return nfa_match(re->machine, string, len, mode, match);
+    default:
+        break;
+    }
+    if (!atomic_load_explicit(&re->built, memory_order_acquire))
+        build(re);
+    if (re->dense)
+        return dense_dfa_match(re->dense, string, len, mode, match);
+    return shared_dfa_match(re->lazy, string, len, mode, match);
+}
+
+/*
+ * No thread may be matching against it any more. The machine is left to
+ * the caller.
+ */
+void
+re_meta_free(re_meta_t *re)
+{
+    if (re->dense)
+        dense_dfa_free(re->dense);
+    if (re->lazy)
+        shared_dfa_free(re->lazy);
+    pthread_mutex_destroy(&re->lock);
+    re_free(re);
+}
@@ -0,0 +1,62 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef RE_META_H
+#define RE_META_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "dense_dfa.h"
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "shared_dfa.h"
+
+/*
+ * Matches a machine on the engine its plan picks, building the DFA the
+ * first time an input is long enough to be worth it. engine starts out as
+ * the one of the plan and falls back to the lazy DFA if the full DFA
+ * doesn't fit in the machine's DFA memory. Any number of threads can
+ * match against it at once.
+ */
+typedef struct re_meta_t {
+    nfa_machine_t *machine;
+    _Atomic re_engine_t engine;
+    atomic_int built; // the DFA of engine is ready
+    dense_dfa_t *dense;
+    shared_dfa_t *lazy;
+    pthread_mutex_t lock; // held while building the DFA
+} re_meta_t;
+
+re_meta_t *re_meta_init(nfa_machine_t *);
+re_engine_t re_meta_engine(re_meta_t *, size_t, match_mode_t);
+int re_meta_match(re_meta_t *, const char *, size_t, match_mode_t, match_t *);
+void re_meta_free(re_meta_t *);
+#endif
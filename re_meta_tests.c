@@ -0,0 +1,278 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "re_meta.h"
+#include "test_utils.h"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+#define NINPUTS 200
+#define NTHREADS 4
+
+static const char *long_pattern =
+    "(abc|bca|cab)x(abc|bca|cab)x(abc|bca|cab)x(abc|bca|cab)x(abc|bca|cab)x(abc|bca|cab)x(abc|bca|cab)x[abc]+";
+
+static void
+test_plan(void)
+{
+    struct {
+        const char *pattern;
+        re_shape_t shape;
+        re_engine_t engine;
+    } tests[] = {
+        {"hello", RE_SHAPE_LITERAL, RE_ENGINE_LITERAL},
+        {"a[b]c", RE_SHAPE_LITERAL, RE_ENGINE_LITERAL},
+        {"foo|bar|bazz", RE_SHAPE_LITERAL_SET, RE_ENGINE_LITERAL},
+        {"ab|b|abc|a", RE_SHAPE_LITERAL_SET, RE_ENGINE_LITERAL},
+        {"a|b|c|d", RE_SHAPE_LITERAL_SET, RE_ENGINE_DENSE_DFA},
+        {"a|a|a|a|a|a|a|a|aa", RE_SHAPE_LITERAL_SET, RE_ENGINE_DENSE_DFA},
+        {"\\bfoo\\b", RE_SHAPE_GENERAL, RE_ENGINE_DENSE_DFA},
+        {"^foo", RE_SHAPE_GENERAL, RE_ENGINE_DENSE_DFA},
+        {".*foo", RE_SHAPE_GENERAL, RE_ENGINE_DENSE_DFA},
+        {"(a|b)*abb", RE_SHAPE_GENERAL, RE_ENGINE_DENSE_DFA},
+        {long_pattern, RE_SHAPE_GENERAL, RE_ENGINE_DFA},
+    };
+
+    printf("Testing engine plans---");
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        nfa_machine_t *machine = compile_regex(tests[i].pattern);
+        test(machine != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET, tests[i].pattern);
+        test(machine->plan.shape == tests[i].shape && machine->plan.engine == tests[i].engine,
+            ANSI_COLOR_RED "%s: planned %s on %s\n" ANSI_COLOR_RESET, tests[i].pattern,
+            re_shape_to_string(machine->plan.shape), re_engine_to_string(machine->plan.engine));
+        free_nfa(machine);
+    }
+
+    nfa_machine_t *machine = compile_regex("(a|b)*abb");
+    re_meta_t *re = re_meta_init(machine);
+    test(re_meta_engine(re, 10, MATCH_SEARCH) == RE_ENGINE_NFA && re_meta_engine(re, 1000, MATCH_SEARCH) ==
+        RE_ENGINE_DENSE_DFA, ANSI_COLOR_RED "short inputs should run on the NFA\n" ANSI_COLOR_RESET);
+    re_meta_free(re);
+    free_nfa(machine);
+
+    // an anchored pattern only ever looks at the first few bytes
+    machine = compile_regex("^ab(c|d)");
+    re = re_meta_init(machine);
+    test(re_meta_engine(re, 100000, MATCH_SEARCH) == RE_ENGINE_NFA, ANSI_COLOR_RED
+        "anchored matches should run on the NFA\n" ANSI_COLOR_RESET);
+    re_meta_free(re);
+    free_nfa(machine);
+
+    // the full DFA doesn't fit and the lazy one takes over
+    re_compile_options_t options = {0};
+    options.max_dfa_memory = 4096;
+    machine = compile_regex_with_options("(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)", &options, NULL);
+    re = re_meta_init(machine);
+    char input[1000];
+    for (size_t i = 0; i < sizeof(input); i++)
+        input[i] = "ab"[i % 3 == 0];
+    test(re_meta_match(re, input, sizeof(input), MATCH_FULL, NULL) ==
+        nfa_match(machine, input, sizeof(input), MATCH_FULL, NULL) &&
+        re_meta_engine(re, 10, MATCH_FULL) == RE_ENGINE_DFA, ANSI_COLOR_RED
+        "expected a fallback to the lazy DFA\n" ANSI_COLOR_RESET);
+    re_meta_free(re);
+    free_nfa(machine);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+typedef struct worker_arg {
+    re_meta_t *re;
+    char **inputs;
+    size_t *lens;
+    int failed;
+} worker_arg;
+
+/* Checks every mode on every input against the NFA */
+static void *
+check_inputs(void *arg)
+{
+    worker_arg *w = (worker_arg *) arg;
+    for (size_t i = 0; i < NINPUTS; i++) {
+        for (match_mode_t mode = MATCH_FULL; mode <= MATCH_ANY; mode++) {
+            match_t m1 = {0}, m2 = {0};
+            int r1 = re_meta_match(w->re, w->inputs[i], w->lens[i], mode, &m1);
+            int r2 = nfa_match(w->re->machine, w->inputs[i], w->lens[i], mode, &m2);
+            if (r1 != r2 || (r1 && mode != MATCH_ANY && (m1.start != m2.start || m1.end != m2.end)))
+                w->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+static void
+test_match(void)
+{
+    const char *patterns[] = {"abc", "abc|bca|x", "c|cab|xc|bx|ca", "ab|a|abc|b", "b c|xa|ca|ab x|xab",
+        "\\babc\\b", "^ab", "c$", "(a|b)*abb", ".*cab", "x.*", long_pattern};
+    char *inputs[NINPUTS];
+    size_t lens[NINPUTS];
+    unsigned int seed = 11;
+    for (size_t i = 0; i < NINPUTS; i++) {
+        lens[i] = i % 4 == 0? 100 + rand_r(&seed) % 2000: rand_r(&seed) % 40;
+        inputs[i] = malloc(lens[i] + 1);
+        test(inputs[i] != NULL, ANSI_COLOR_RED "malloc failed\n" ANSI_COLOR_RESET);
+        for (size_t j = 0; j < lens[i]; j++)
+            inputs[i][j] = "abcx "[rand_r(&seed) % 5];
+        inputs[i][lens[i]] = 0;
+    }
+
+    printf("Testing matches on the planned engines---");
+    for (size_t p = 0; p < sizeof(patterns)/sizeof(patterns[0]); p++) {
+        nfa_machine_t *machine = compile_regex(patterns[p]);
+        test(machine != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET, patterns[p]);
+        re_meta_t *re = re_meta_init(machine);
+        pthread_t threads[NTHREADS];
+        worker_arg args[NTHREADS];
+        for (size_t t = 0; t < NTHREADS; t++) {
+            args[t] = (worker_arg) {re, inputs, lens, 0};
+            pthread_create(&threads[t], NULL, check_inputs, &args[t]);
+        }
+        for (size_t t = 0; t < NTHREADS; t++) {
+            pthread_join(threads[t], NULL);
+            test(!args[t].failed, ANSI_COLOR_RED "wrong match for %s\n" ANSI_COLOR_RESET, patterns[p]);
+        }
+        re_meta_free(re);
+        free_nfa(machine);
+    }
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+
+    for (size_t i = 0; i < NINPUTS; i++)
+        free(inputs[i]);
+}
+
+/*
+ * A search whose leftmost match only starts at the end of a long input
+ * runs on the full DFA in one pass, not one per start offset.
+ */
+static void
+test_long_search(void)
+{
+    size_t n = 100000;
+    char *input = malloc(n + 1);
+    test(input != NULL, ANSI_COLOR_RED "malloc failed\n" ANSI_COLOR_RESET);
+    memset(input, 'a', n);
+    input[n] = 'X';
+
+    printf("Testing a search of a long input on the planned engine---");
+    nfa_machine_t *machine = compile_regex("a*c|X");
+    re_meta_t *re = re_meta_init(machine);
+    test(re_meta_engine(re, n + 1, MATCH_SEARCH) == RE_ENGINE_DENSE_DFA,
+        ANSI_COLOR_RED "expected the full DFA\n" ANSI_COLOR_RESET);
+    clock_t begin = clock();
+    match_t m = {0};
+    test(re_meta_match(re, input, n + 1, MATCH_SEARCH, &m) == 1 && m.start == n && m.end == n + 1,
+        ANSI_COLOR_RED "wrong match %zu-%zu\n" ANSI_COLOR_RESET, m.start, m.end);
+    double seconds = (double) (clock() - begin) / CLOCKS_PER_SEC;
+    test(seconds < 10, ANSI_COLOR_RED "the search took %.2fs\n" ANSI_COLOR_RESET, seconds);
+    re_meta_free(re);
+    free_nfa(machine);
+    free(input);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+/* The best of three runs of a search, in seconds */
+static double
+time_search(re_meta_t *re, nfa_machine_t *machine, const char *input, size_t len, match_t *m)
+{
+    double best = 0;
+    for (int run = 0; run < 3; run++) {
+        clock_t begin = clock();
+        if (re)
+            re_meta_match(re, input, len, MATCH_SEARCH, m);
+        else
+            nfa_match(machine, input, len, MATCH_SEARCH, m);
+        double seconds = (double) (clock() - begin) / CLOCKS_PER_SEC;
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+/*
+ * The engine planned for a pattern has to search a long input faster than
+ * the NFA, or the NFA would have been the better plan.
+ */
+static void
+test_plan_speed(void)
+{
+    struct {
+        const char *pattern;
+        re_engine_t engine;
+    } tests[] = {
+        {"(alpha|bravo|charlie|delta|echo|foxtrot|golf|hotel|india|juliet|kilo|lima|mike|november|oscar|"
+            "papa|quebec|romeo|sierra|tango|uniform|victor|whiskey|xray|yankee) [0-9]+", RE_ENGINE_DFA},
+        {"[a-z]+ing [0-9]+", RE_ENGINE_DENSE_DFA},
+    };
+    size_t n = 1 << 20;
+    char *input = malloc(n);
+    test(input != NULL, ANSI_COLOR_RED "malloc failed\n" ANSI_COLOR_RESET);
+    unsigned int seed = 1;
+    for (size_t i = 0; i < n; i++)
+        input[i] = "abcdefghijklmnopqrstuvwxyz  "[rand_r(&seed) % 28];
+    memcpy(input + n - 20, " testing 42 yankee 1", 20);
+
+    printf("Testing that the planned engines search faster than the NFA---");
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        nfa_machine_t *machine = compile_regex(tests[i].pattern);
+        re_meta_t *re = re_meta_init(machine);
+        match_t m = {0}, expected_m = {0};
+        test(re_meta_engine(re, n, MATCH_SEARCH) == tests[i].engine, ANSI_COLOR_RED "%s: planned %s\n"
+            ANSI_COLOR_RESET, tests[i].pattern, re_engine_to_string(re_meta_engine(re, n, MATCH_SEARCH)));
+        double planned = time_search(re, NULL, input, n, &m);
+        double nfa = time_search(NULL, machine, input, n, &expected_m);
+        test(m.start == expected_m.start && m.end == expected_m.end, ANSI_COLOR_RED
+            "%s found %zu-%zu, the NFA %zu-%zu\n" ANSI_COLOR_RESET, tests[i].pattern, m.start, m.end,
+            expected_m.start, expected_m.end);
+        test(planned < nfa, ANSI_COLOR_RED "%s took %.3fs, the NFA %.3fs\n" ANSI_COLOR_RESET, tests[i].pattern,
+            planned, nfa);
+        re_meta_free(re);
+        free_nfa(machine);
+    }
+    free(input);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    test_plan();
+    test_match();
+    test_long_search();
+    test_plan_speed();
+}
@@ -0,0 +1,276 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "re_pool.h"
+#include "re_utils.h"
+#include "shared_dfa.h"
+
+#define NO_RANGE 0 // ranges are never empty, so this is not one
+#define MAX_BATCH UINT32_MAX
+#define pack_range(start, end) ((uint64_t) (start) << 32 | (end))
+#define range_start(range) ((size_t) ((range) >> 32))
+#define range_end(range) ((size_t) ((range) & UINT32_MAX))
+
+/*
+ * The deque operations follow "Correct and Efficient Work-Stealing for
+ * Weak Memory Models" by Lê et al. A worker never has more ranges in its
+ * deque than the number of times its biggest range can be halved, so the
+ * array does not need to grow.
+ */
+static void
+deque_push(re_pool_deque *d, uint64_t range)
+{
+    int_least64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    atomic_store_explicit(&d->ranges[b % RE_POOL_DEQUE_SIZE], range, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+static uint64_t
+deque_take(re_pool_deque *d)
+{
+    int_least64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int_least64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    uint64_t range = NO_RANGE;
+    if (t <= b) {
+        range = atomic_load_explicit(&d->ranges[b % RE_POOL_DEQUE_SIZE], memory_order_relaxed);
+        if (t != b)
+            return range;
+        // the last range, which a thief may be taking as well
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst,
+            memory_order_relaxed))
+            range = NO_RANGE;
+    }
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return range;
+}
+
+static uint64_t
+deque_steal(re_pool_deque *d)
+{
+    int_least64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int_least64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return NO_RANGE;
+    uint64_t range = atomic_load_explicit(&d->ranges[t % RE_POOL_DEQUE_SIZE], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst,
+        memory_order_relaxed))
+        return NO_RANGE;
+    return range;
+}
+
+/*
+ * Tries the deques of the other workers once each, starting at a random one.
+ */
+static uint64_t
+steal_range(re_pool_worker *w)
+{
+    re_pool_t *pool = w->pool;
+    size_t first = rand_r(&w->seed) % pool->nworkers;
+    for (size_t i = 0; i < pool->nworkers; i++) {
+        re_pool_worker *victim = &pool->workers[(first + i) % pool->nworkers];
+        if (victim == w)
+            continue;
+        uint64_t range = deque_steal(&victim->deque);
+        if (range != NO_RANGE)
+            return range;
+    }
+    return NO_RANGE;
+}
+
+static size_t
+range_bytes(re_job_t *jobs, size_t start, size_t end)
+{
+    size_t bytes = 0;
+    for (size_t i = start; i < end; i++)
+        bytes += jobs[i].len;
+    return bytes;
+}
+
+/*
+ * Pushes the upper half of the range for thieves until what is left is
+ * small enough, then runs it.
+ */
+static void
+run_range(re_pool_worker *w, uint64_t range)
+{
+    re_pool_t *pool = w->pool;
+    re_job_t *jobs = pool->jobs;
+    size_t start = range_start(range), end = range_end(range);
+    while (end - start > 1 &&
+        (end - start > RE_POOL_GRAIN || range_bytes(jobs, start, end) > RE_POOL_GRAIN_BYTES)) {
+        size_t mid = start + (end - start) / 2;
+        deque_push(&w->deque, pack_range(mid, end));
+        end = mid;
+    }
+    for (size_t i = start; i < end; i++) {
+        re_job_t *job = &jobs[i];
+        job->match.start = job->match.end = 0;
+        job->result = shared_dfa_match_scratch(job->dfa, &w->scratch, job->input, job->len, job->mode,
+            &job->match);
+        if (pool->callback)
+            pool->callback(job, pool->arg);
+    }
+    atomic_fetch_sub_explicit(&pool->remaining, end - start, memory_order_relaxed);
+}
+
+static void
+run_batch(re_pool_worker *w)
+{
+    while (atomic_load_explicit(&w->pool->remaining, memory_order_relaxed)) {
+        uint64_t range = deque_take(&w->deque);
+        if (range == NO_RANGE)
+            range = steal_range(w);
+        if (range == NO_RANGE)
+            sched_yield();
+        else
+            run_range(w, range);
+    }
+}
+
+static void *
+worker_main(void *arg)
+{
+    re_pool_worker *w = (re_pool_worker *) arg;
+    re_pool_t *pool = w->pool;
+    uint64_t batch = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->batch == batch && !pool->shutdown)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->shutdown)
+            break;
+        batch = pool->batch;
+        pthread_mutex_unlock(&pool->lock);
+        run_batch(w);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->nfinished == pool->nworkers)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * Starts nworkers threads, or one per online CPU if nworkers is 0.
+ */
+re_pool_t *
+re_pool_init(size_t nworkers)
+{
+    if (nworkers == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpus > 0? ncpus: 1;
+    }
+    re_pool_t *pool = re_calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    pool->workers = re_calloc(nworkers, sizeof(*pool->workers));
+    if (pool->workers == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    pool->nworkers = nworkers;
+    if (pthread_mutex_init(&pool->lock, NULL) || pthread_cond_init(&pool->start, NULL) ||
+        pthread_cond_init(&pool->done, NULL))
+        errx(EXIT_FAILURE, "pthread init failed");
+    atomic_init(&pool->remaining, 0);
+    for (size_t i = 0; i < nworkers; i++) {
+        re_pool_worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->id = i;
+        w->seed = i + 1;
+        atomic_init(&w->deque.top, 0);
+        atomic_init(&w->deque.bottom, 0);
+        if (pthread_create(&w->thread, NULL, worker_main, w))
+            errx(EXIT_FAILURE, "pthread_create failed");
+    }
+    return pool;
+}
+
+/*
+ * Runs the jobs on the workers and returns once they are all done. The
+ * callback, if not NULL, is called for every job on the worker which ran
+ * it. Only one batch runs at a time.
+ */
+void
+re_pool_run(re_pool_t *pool, re_job_t *jobs, size_t njobs, re_job_done_fn callback, void *arg)
+{
+    // the offsets in a range are 32 bits
+    for (; njobs > MAX_BATCH; jobs += MAX_BATCH, njobs -= MAX_BATCH)
+        re_pool_run(pool, jobs, MAX_BATCH, callback, arg);
+    if (njobs == 0)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs = jobs;
+    pool->callback = callback;
+    pool->arg = arg;
+    atomic_store_explicit(&pool->remaining, njobs, memory_order_relaxed);
+    // the workers are all waiting, so their deques can be set up from here
+    for (size_t i = 0; i < pool->nworkers; i++) {
+        re_pool_deque *d = &pool->workers[i].deque;
+        size_t start = njobs * i / pool->nworkers;
+        size_t end = njobs * (i + 1) / pool->nworkers;
+        atomic_store_explicit(&d->top, 0, memory_order_relaxed);
+        atomic_store_explicit(&d->bottom, 0, memory_order_relaxed);
+        if (start < end)
+            deque_push(d, pack_range(start, end));
+    }
+    pool->nfinished = 0;
+    pool->batch++;
+    pthread_cond_broadcast(&pool->start);
+    while (pool->nfinished < pool->nworkers)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+re_pool_free(re_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->nworkers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        shared_dfa_scratch_free(&pool->workers[i].scratch);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    re_free(pool->workers);
+    re_free(pool);
+}
@@ -0,0 +1,112 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef RE_POOL_H
+#define RE_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nfa_executor.h"
+#include "shared_dfa.h"
+
+// holds the ranges split off by a worker, which halve every time
+#define RE_POOL_DEQUE_SIZE 128
+// a range of jobs is not split further once it is this small
+#define RE_POOL_GRAIN 8
+#define RE_POOL_GRAIN_BYTES (64 * 1024)
+
+/*
+ * One match to run: the pattern as a DFA shared by all the workers, the
+ * input and the mode. result and match are filled in by the pool.
+ */
+typedef struct re_job_t {
+    shared_dfa_t *dfa;
+    const char *input;
+    size_t len;
+    match_mode_t mode;
+    int result;
+    match_t match;
+} re_job_t;
+
+/* Called by the worker which ran the job, as soon as it is done */
+typedef void (*re_job_done_fn) (re_job_t *, void *);
+
+/*
+ * A Chase-Lev work-stealing deque of ranges of job indices, packed into a
+ * uint64_t as start << 32 | end. The owner pushes and takes at the bottom,
+ * the other workers steal from the top.
+ */
+typedef struct re_pool_deque {
+    atomic_int_least64_t top;
+    char pad1[64 - sizeof(atomic_int_least64_t)]; // top and bottom are a cache line apart
+    atomic_int_least64_t bottom;
+    char pad2[64 - sizeof(atomic_int_least64_t)];
+    atomic_uint_least64_t ranges[RE_POOL_DEQUE_SIZE];
+} re_pool_deque;
+
+typedef struct re_pool_worker {
+    struct re_pool_t *pool;
+    pthread_t thread;
+    size_t id;
+    re_pool_deque deque;
+    shared_dfa_scratch_t scratch; // kept across jobs and batches
+    unsigned int seed; // for picking victims
+} re_pool_worker;
+
+/*
+ * A fixed set of worker threads running batches of jobs. Every worker
+ * starts out with an equal share of a batch and splits the range of jobs
+ * it takes in halves, keeping one and pushing the other, so a worker which
+ * runs out of jobs steals half of what is left of another one's range.
+ * A few huge inputs among many small ones thus end up on their own workers
+ * while the others share out the rest.
+ */
+typedef struct re_pool_t {
+    re_pool_worker *workers;
+    size_t nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t start; // a new batch, or shutdown
+    pthread_cond_t done; // a worker finished the batch
+    uint64_t batch; // the number of batches started
+    size_t nfinished; // workers done with the current batch
+    int shutdown;
+    // the current batch
+    re_job_t *jobs;
+    re_job_done_fn callback;
+    void *arg;
+    atomic_size_t remaining; // jobs not yet done
+} re_pool_t;
+
+re_pool_t *re_pool_init(size_t);
+void re_pool_run(re_pool_t *, re_job_t *, size_t, re_job_done_fn, void *);
+void re_pool_free(re_pool_t *);
+#endif
@@ -0,0 +1,160 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "re_pool.h"
+#include "shared_dfa.h"
+#include "test_utils.h"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+#define NJOBS 20000
+#define NHUGE 4
+#define HUGE_SIZE (1024 * 1024)
+
+static const char *patterns[] = {"(a|b)*abb", "[a-c]+x?1", "\\bab\\b", ".*x1", "c(a|b)*c$"};
+#define NPATTERNS (sizeof(patterns)/sizeof(patterns[0]))
+
+typedef struct batch {
+    re_job_t *jobs;
+    char **inputs;
+    size_t njobs;
+    atomic_size_t *calls; // the number of callbacks for every job
+} batch;
+
+static void
+count_job(re_job_t *job, void *arg)
+{
+    batch *b = (batch *) arg;
+    atomic_fetch_add_explicit(&b->calls[job - b->jobs], 1, memory_order_relaxed);
+}
+
+/*
+ * Many small inputs with a few huge ones among them, at the start, in the
+ * middle and at the end of the batch.
+ */
+static void
+make_batch(batch *b, shared_dfa_t **dfas, size_t njobs, unsigned int seed)
+{
+    const char *alphabet = "abcx1 _";
+    b->njobs = njobs;
+    b->jobs = malloc(njobs * sizeof(re_job_t));
+    b->inputs = malloc(njobs * sizeof(char *));
+    b->calls = calloc(njobs, sizeof(atomic_size_t));
+    test(b->jobs != NULL && b->inputs != NULL && b->calls != NULL, ANSI_COLOR_RED "malloc failed\n" ANSI_COLOR_RESET);
+    for (size_t i = 0; i < njobs; i++) {
+        int huge = i == 0 || i == njobs - 1 || i % (njobs / NHUGE) == njobs / NHUGE / 2;
+        size_t len = huge? HUGE_SIZE: (size_t) rand_r(&seed) % 32;
+        char *input = malloc(len + 1);
+        test(input != NULL, ANSI_COLOR_RED "malloc failed\n" ANSI_COLOR_RESET);
+        for (size_t k = 0; k < len; k++)
+            input[k] = alphabet[rand_r(&seed) % strlen(alphabet)];
+        input[len] = 0;
+        b->inputs[i] = input;
+        size_t p = rand_r(&seed) % NPATTERNS;
+        b->jobs[i] = (re_job_t) {dfas[p], input, len, (match_mode_t) (rand_r(&seed) % 4)};
+    }
+}
+
+static void
+free_batch(batch *b)
+{
+    for (size_t i = 0; i < b->njobs; i++)
+        free(b->inputs[i]);
+    free(b->inputs);
+    free(b->jobs);
+    free(b->calls);
+}
+
+static void
+check_batch(batch *b)
+{
+    for (size_t i = 0; i < b->njobs; i++) {
+        re_job_t *job = &b->jobs[i];
+        match_t m = {0, 0};
+        int expected = nfa_match(job->dfa->machine, job->input, job->len, job->mode, &m);
+        test(job->result == expected && (!expected || job->mode == MATCH_ANY ||
+            (job->match.start == m.start && job->match.end == m.end)),
+            ANSI_COLOR_RED "job %zu failed in mode %d\n" ANSI_COLOR_RESET, i, job->mode);
+    }
+}
+
+static void
+test_pool(size_t nworkers)
+{
+    nfa_machine_t *machines[NPATTERNS];
+    shared_dfa_t *dfas[NPATTERNS];
+    batch b;
+
+    if (nworkers)
+        printf("Testing a pool of %zu workers---", nworkers);
+    else
+        printf("Testing a pool of a worker per CPU---");
+    for (size_t i = 0; i < NPATTERNS; i++) {
+        machines[i] = compile_regex(patterns[i]);
+        test(machines[i] != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET, patterns[i]);
+        dfas[i] = shared_dfa_init(machines[i], 0);
+    }
+    re_pool_t *pool = re_pool_init(nworkers);
+    test(pool->nworkers == nworkers || nworkers == 0,
+        ANSI_COLOR_RED "expected %zu workers, got %zu\n" ANSI_COLOR_RESET, nworkers, pool->nworkers);
+
+    re_pool_run(pool, NULL, 0, NULL, NULL);
+    for (unsigned int round = 0; round < 3; round++) {
+        make_batch(&b, dfas, NJOBS >> round, round);
+        re_pool_run(pool, b.jobs, b.njobs, count_job, &b);
+        for (size_t i = 0; i < b.njobs; i++)
+            test(atomic_load(&b.calls[i]) == 1, ANSI_COLOR_RED "job %zu was run %zu times\n" ANSI_COLOR_RESET,
+                i, (size_t) atomic_load(&b.calls[i]));
+        check_batch(&b);
+        free_batch(&b);
+    }
+    re_pool_free(pool);
+    for (size_t i = 0; i < NPATTERNS; i++) {
+        shared_dfa_free(dfas[i]);
+        free_nfa(machines[i]);
+    }
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    test_pool(1);
+    test_pool(4);
+    test_pool(0);
+}
@@ -0,0 +1,307 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dfa.h"
+#include "nfa_compiler.h"
+#include "re_scan.h"
+#include "re_utils.h"
+
+/*
+ * A buffer of the ring. It holds the piece of the input with sequence
+ * number seq until every matcher still scanning has released it.
+ */
+typedef struct scan_buffer {
+    char *data;
+    size_t len;
+    size_t refs;
+} scan_buffer;
+
+typedef struct scan_t scan_t;
+
+typedef struct scan_matcher {
+    scan_t *scan;
+    pthread_t thread;
+    dfa_t **dfas;
+    dfa_stream_t *streams;
+    size_t nstreams;
+    size_t next; // the sequence number of the next buffer to scan
+    int done; // all its streams are done
+} scan_matcher;
+
+struct scan_t {
+    int fd;
+    int wake[2]; // a pipe written to once no matcher is left, -1 if fd can't block
+    int drop_cache;
+    void *memory; // the buffers, before aligning them
+    scan_buffer *buffers;
+    size_t nbuffers;
+    size_t buffer_size;
+    scan_matcher *matchers;
+    size_t nmatchers;
+    pthread_mutex_t lock;
+    pthread_cond_t filled; // a buffer was filled, or the input ended
+    pthread_cond_t released; // a buffer was released, or a matcher is done
+    size_t nfilled; // buffers filled since the start
+    size_t nactive; // matchers not done
+    int eof;
+    int error; // errno of a failed read
+};
+
+/*
+ * Reads once into the buffer, a short read is handed to the matchers as it
+ * is rather than waiting for more of a slow pipe. On an input which can
+ * block, the read waits in poll, which also returns once every matcher is
+ * done, and 0 is returned as if the input had ended. With
+ * RE_SCAN_DROP_CACHE the page cache is told to drop what has been read, so
+ * that a file bigger than RAM does not push everything else out of memory.
+ * It fails harmlessly on pipes.
+ */
+static ssize_t
+fill_buffer(scan_t *scan, char *data, off_t offset)
+{
+    struct pollfd fds[2] = {{scan->fd, POLLIN, 0}, {scan->wake[0], POLLIN, 0}};
+    for (;;) {
+        if (scan->wake[0] != -1) {
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (fds[1].revents)
+                return 0;
+        }
+        ssize_t n = read(scan->fd, data, scan->buffer_size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n > 0 && scan->drop_cache)
+            posix_fadvise(scan->fd, offset, n, POSIX_FADV_DONTNEED);
+        return n;
+    }
+}
+
+static void *
+reader_main(void *arg)
+{
+    scan_t *scan = (scan_t *) arg;
+    off_t offset = 0;
+    posix_fadvise(scan->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    pthread_mutex_lock(&scan->lock);
+    for (;;) {
+        scan_buffer *buffer = &scan->buffers[scan->nfilled % scan->nbuffers];
+        while (buffer->refs && scan->nactive)
+            pthread_cond_wait(&scan->released, &scan->lock);
+        if (scan->nactive == 0)
+            break;
+        pthread_mutex_unlock(&scan->lock);
+        ssize_t len = fill_buffer(scan, buffer->data, offset);
+        int saved_errno = errno;
+        pthread_mutex_lock(&scan->lock);
+        if (len <= 0) {
+            if (len == -1)
+                scan->error = saved_errno;
+            break;
+        }
+        offset += len;
+        buffer->len = len;
+        buffer->refs = scan->nactive;
+        scan->nfilled++;
+        pthread_cond_broadcast(&scan->filled);
+    }
+    scan->eof = 1;
+    pthread_cond_broadcast(&scan->filled);
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+/*
+ * Gives back the buffers filled for the matcher which it will not scan
+ * now that it is done. Has to be called with the lock held.
+ */
+static void
+matcher_done(scan_matcher *m)
+{
+    scan_t *scan = m->scan;
+    for (; m->next < scan->nfilled; m->next++)
+        scan->buffers[m->next % scan->nbuffers].refs--;
+    m->done = 1;
+    if (--scan->nactive == 0 && scan->wake[1] != -1) {
+        if (write(scan->wake[1], "", 1) == -1)
+            err(EXIT_FAILURE, "write failed");
+    }
+    pthread_cond_broadcast(&scan->released);
+}
+
+static void *
+matcher_main(void *arg)
+{
+    scan_matcher *m = (scan_matcher *) arg;
+    scan_t *scan = m->scan;
+    size_t ndone = 0;
+    pthread_mutex_lock(&scan->lock);
+    for (;;) {
+        while (m->next == scan->nfilled && !scan->eof)
+            pthread_cond_wait(&scan->filled, &scan->lock);
+        if (m->next == scan->nfilled)
+            break;
+        scan_buffer *buffer = &scan->buffers[m->next % scan->nbuffers];
+        pthread_mutex_unlock(&scan->lock);
+        for (size_t i = 0; i < m->nstreams; i++) {
+            if (!m->streams[i].done) {
+                dfa_stream_feed(&m->streams[i], buffer->data, buffer->len);
+                ndone += m->streams[i].done;
+            }
+        }
+        pthread_mutex_lock(&scan->lock);
+        m->next++;
+        if (--buffer->refs == 0)
+            pthread_cond_broadcast(&scan->released);
+        if (ndone == m->nstreams) {
+            matcher_done(m);
+            break;
+        }
+    }
+    if (!m->done)
+        matcher_done(m);
+    pthread_mutex_unlock(&scan->lock);
+    for (size_t i = 0; i < m->nstreams; i++)
+        dfa_stream_end(&m->streams[i]);
+    return NULL;
+}
+
+/*
+ * Scans the input read from fd for each of the machines, filling in
+ * results. A reader thread fills a ring of buffers while the matcher
+ * threads run a lazy DFA per machine over them, carrying its state from one
+ * buffer to the next, so reading and matching overlap and the memory used
+ * is bounded by the ring. Reading stops once every pattern has matched or
+ * can't match any more, even if a pipe has nothing more to read yet.
+ * Returns 0, or -1 with errno set if a read failed, after scanning what was
+ * read before it.
+ */
+int
+re_scan_fd(int fd, nfa_machine_t **machines, size_t nmachines, const re_scan_options_t *options,
+    re_scan_result_t *results)
+{
+    scan_t scan = {0};
+    scan.fd = fd;
+    scan.buffer_size = options && options->buffer_size? options->buffer_size: RE_SCAN_DEFAULT_BUFFER_SIZE;
+    scan.nbuffers = options && options->nbuffers? options->nbuffers: RE_SCAN_DEFAULT_NBUFFERS;
+    scan.nmatchers = options && options->nmatchers? options->nmatchers: 1;
+    scan.drop_cache = options && (options->flags & RE_SCAN_DROP_CACHE);
+    if (scan.nmatchers > nmachines)
+        scan.nmatchers = nmachines;
+    if (nmachines == 0)
+        return 0;
+
+    // one allocation for all the buffers, each starting on an RE_SCAN_ALIGN boundary
+    size_t stride = (scan.buffer_size + RE_SCAN_ALIGN - 1) & ~(size_t) (RE_SCAN_ALIGN - 1);
+    scan.memory = re_malloc(stride * scan.nbuffers + RE_SCAN_ALIGN);
+    scan.buffers = re_calloc(scan.nbuffers, sizeof(*scan.buffers));
+    scan.matchers = re_calloc(scan.nmatchers, sizeof(*scan.matchers));
+    if (scan.memory == NULL || scan.buffers == NULL || scan.matchers == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    char *base = (char *) (((uintptr_t) scan.memory + RE_SCAN_ALIGN - 1) & ~(uintptr_t) (RE_SCAN_ALIGN - 1));
+    for (size_t i = 0; i < scan.nbuffers; i++)
+        scan.buffers[i].data = base + i * stride;
+
+    // machine i goes to matcher i % nmatchers
+    for (size_t i = 0; i < scan.nmatchers; i++) {
+        scan_matcher *m = &scan.matchers[i];
+        m->scan = &scan;
+        m->nstreams = (nmachines - i + scan.nmatchers - 1) / scan.nmatchers;
+        m->dfas = re_calloc(m->nstreams, sizeof(*m->dfas));
+        m->streams = re_calloc(m->nstreams, sizeof(*m->streams));
+        if (m->dfas == NULL || m->streams == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+        for (size_t k = 0; k < m->nstreams; k++) {
+            m->dfas[k] = dfa_init(machines[i + k * scan.nmatchers], 0);
+            dfa_stream_init(&m->streams[k], m->dfas[k]);
+        }
+    }
+    scan.nactive = scan.nmatchers;
+
+    // reads of a regular file never block, there is nothing to wake up
+    struct stat sb;
+    scan.wake[0] = scan.wake[1] = -1;
+    if (fstat(fd, &sb) == 0 && !S_ISREG(sb.st_mode) && !S_ISBLK(sb.st_mode) && pipe(scan.wake) == -1)
+        err(EXIT_FAILURE, "pipe failed");
+    if (pthread_mutex_init(&scan.lock, NULL) || pthread_cond_init(&scan.filled, NULL) ||
+        pthread_cond_init(&scan.released, NULL))
+        errx(EXIT_FAILURE, "pthread init failed");
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, reader_main, &scan))
+        errx(EXIT_FAILURE, "pthread_create failed");
+    for (size_t i = 0; i < scan.nmatchers; i++) {
+        if (pthread_create(&scan.matchers[i].thread, NULL, matcher_main, &scan.matchers[i]))
+            errx(EXIT_FAILURE, "pthread_create failed");
+    }
+    pthread_join(reader, NULL);
+    for (size_t i = 0; i < scan.nmatchers; i++)
+        pthread_join(scan.matchers[i].thread, NULL);
+
+    for (size_t i = 0; i < scan.nmatchers; i++) {
+        scan_matcher *m = &scan.matchers[i];
+        for (size_t k = 0; k < m->nstreams; k++) {
+            re_scan_result_t *r = &results[i + k * scan.nmatchers];
+            r->matched = m->streams[k].matched;
+            r->end = m->streams[k].end;
+            dfa_free(m->dfas[k]);
+        }
+        re_free(m->dfas);
+        re_free(m->streams);
+    }
+    pthread_mutex_destroy(&scan.lock);
+    pthread_cond_destroy(&scan.filled);
+    pthread_cond_destroy(&scan.released);
+    if (scan.wake[0] != -1) {
+        close(scan.wake[0]);
+        close(scan.wake[1]);
+    }
+    re_free(scan.matchers);
+    re_free(scan.buffers);
+    re_free(scan.memory);
+    if (scan.error) {
+        errno = scan.error;
+        return -1;
+    }
+    return 0;
+}
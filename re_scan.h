@@ -0,0 +1,62 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef RE_SCAN_H
+#define RE_SCAN_H
+
+#include <stddef.h>
+
+#include "nfa_compiler.h"
+
+#define RE_SCAN_DEFAULT_BUFFER_SIZE (1024 * 1024)
+#define RE_SCAN_DEFAULT_NBUFFERS 8
+#define RE_SCAN_ALIGN 4096
+
+/* re_scan_options_t.flags */
+#define RE_SCAN_DROP_CACHE 0x1 // drop what has been read from the page cache
+
+/*
+ * A zero field takes the default. Every matcher thread scans for its share
+ * of the patterns, so more matchers than patterns are not used.
+ */
+typedef struct re_scan_options_t {
+    size_t buffer_size;
+    size_t nbuffers;
+    size_t nmatchers;
+    int flags;
+} re_scan_options_t;
+
+/* The MATCH_ANY outcome of a scan for one pattern */
+typedef struct re_scan_result_t {
+    int matched;
+    size_t end; // the offset where the first match ends
+} re_scan_result_t;
+
+int re_scan_fd(int, nfa_machine_t **, size_t, const re_scan_options_t *, re_scan_result_t *);
+#endif
@@ -0,0 +1,246 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dfa.h"
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "re_scan.h"
+#include "test_utils.h"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+typedef struct pipe_writer {
+    int fd;
+    const char *data;
+    size_t len;
+} pipe_writer;
+
+static void *
+write_pipe(void *arg)
+{
+    pipe_writer *w = (pipe_writer *) arg;
+    size_t off = 0;
+    while (off < w->len) {
+        // small writes, so that reads come back short
+        size_t n = w->len - off < 5? w->len - off: 5;
+        ssize_t written = write(w->fd, w->data + off, n);
+        if (written <= 0)
+            break;
+        off += written;
+    }
+    close(w->fd);
+    return NULL;
+}
+
+static void
+scan_pipe(const char *input, nfa_machine_t **machines, size_t n, re_scan_options_t *options,
+    re_scan_result_t *results)
+{
+    int fds[2];
+    pthread_t writer;
+    test(pipe(fds) == 0, ANSI_COLOR_RED "pipe failed\n" ANSI_COLOR_RESET);
+    pipe_writer w = {fds[1], input, strlen(input)};
+    pthread_create(&writer, NULL, write_pipe, &w);
+    test(re_scan_fd(fds[0], machines, n, options, results) == 0, ANSI_COLOR_RED "scan failed\n" ANSI_COLOR_RESET);
+    // the scan may stop reading early, so drain the pipe for the writer
+    char buf[64];
+    while (read(fds[0], buf, sizeof(buf)) > 0)
+        ;
+    pthread_join(writer, NULL);
+    close(fds[0]);
+}
+
+static void
+test_stream(void)
+{
+    struct {
+        const char *pattern;
+        const char *input;
+        int matched;
+        size_t end;
+    } tests[] = {
+        {"needle", "haystack with a needle in it", 1, 22},
+        {"\\bfoo\\b", "foobar barfoo foo bar", 1, 17},
+        {"\\bfoo\\b", "foobar barfoo foo", 1, 17},
+        {"abc$", "abcabcabc", 1, 9},
+        {"abc$", "abcabcab", 0, 0},
+        {"^ab", "xab", 0, 0},
+        {"x*", "abc", 1, 0},
+        {".*c1", "aaaaaaac1", 1, 9},
+        {"(a|b)*abb", "bababbab", 1, 6},
+    };
+
+    printf("Testing streaming DFA scans---");
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        nfa_machine_t *machine = compile_regex(tests[i].pattern);
+        test(machine != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET, tests[i].pattern);
+        size_t len = strlen(tests[i].input);
+        test(nfa_match(machine, tests[i].input, len, MATCH_ANY, NULL) == tests[i].matched,
+            ANSI_COLOR_RED "wrong expectation for %s\n" ANSI_COLOR_RESET, tests[i].pattern);
+        dfa_t *dfa = dfa_init(machine, 0);
+        // every way of cutting the input in two
+        for (size_t cut = 0; cut <= len; cut++) {
+            dfa_stream_t stream;
+            dfa_stream_init(&stream, dfa);
+            dfa_stream_feed(&stream, tests[i].input, cut);
+            dfa_stream_feed(&stream, tests[i].input + cut, len - cut);
+            int matched = dfa_stream_end(&stream);
+            test(matched == tests[i].matched && (!matched || stream.end == tests[i].end),
+                ANSI_COLOR_RED "%s on %s cut at %zu: %d at %zu\n" ANSI_COLOR_RESET,
+                tests[i].pattern, tests[i].input, cut, matched, stream.end);
+        }
+        dfa_free(dfa);
+        free_nfa(machine);
+    }
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+static void
+test_scan(void)
+{
+    const char *patterns[] = {"needle", "\\bfoo\\b", "k[0-9]+=v", "end$", "never", "^start"};
+    size_t npatterns = sizeof(patterns)/sizeof(patterns[0]);
+    nfa_machine_t *machines[sizeof(patterns)/sizeof(patterns[0])];
+    re_scan_result_t results[sizeof(patterns)/sizeof(patterns[0])];
+    re_scan_result_t expected[sizeof(patterns)/sizeof(patterns[0])];
+    char path[] = "/tmp/re_scan_testXXXXXX";
+    size_t len = 20000;
+    char *input = malloc(len + 1);
+    test(input != NULL, ANSI_COLOR_RED "malloc failed\n" ANSI_COLOR_RESET);
+    unsigned int seed = 7;
+    for (size_t i = 0; i < len; i++)
+        input[i] = "abcdefghij \n"[rand_r(&seed) % 12];
+    memcpy(input + 9000, "needle", 6);
+    memcpy(input + 13000, " foo ", 5);
+    memcpy(input + 15000, "k123=v", 6);
+    memcpy(input + len - 3, "end", 3);
+    input[len] = 0;
+
+    for (size_t i = 0; i < npatterns; i++) {
+        machines[i] = compile_regex(patterns[i]);
+        test(machines[i] != NULL, ANSI_COLOR_RED "failed to compile %s\n" ANSI_COLOR_RESET, patterns[i]);
+        dfa_t *dfa = dfa_init(machines[i], 0);
+        dfa_stream_t stream;
+        dfa_stream_init(&stream, dfa);
+        dfa_stream_feed(&stream, input, len);
+        expected[i].matched = dfa_stream_end(&stream);
+        expected[i].end = stream.end;
+        dfa_free(dfa);
+    }
+    test(expected[0].matched && expected[0].end == 9006 && !expected[4].matched && !expected[5].matched &&
+        expected[3].matched && expected[3].end == len, ANSI_COLOR_RED "wrong expectations\n" ANSI_COLOR_RESET);
+
+    int fd = mkstemp(path);
+    test(fd != -1 && write(fd, input, len) == (ssize_t) len, ANSI_COLOR_RED "failed to write %s\n" ANSI_COLOR_RESET, path);
+    close(fd);
+
+    printf("Testing pipelined scans of files and pipes---");
+    size_t buffer_sizes[] = {0, 1, 7, 4096, 5000};
+    for (size_t b = 0; b < sizeof(buffer_sizes)/sizeof(buffer_sizes[0]); b++) {
+        for (size_t nbuffers = 1; nbuffers <= 4; nbuffers += 3) {
+            for (size_t nmatchers = 1; nmatchers <= 3; nmatchers++) {
+                re_scan_options_t options = {buffer_sizes[b], nbuffers, nmatchers, nmatchers == 2? RE_SCAN_DROP_CACHE: 0};
+                for (int use_pipe = 0; use_pipe < 2; use_pipe++) {
+                    memset(results, 0, sizeof(results));
+                    if (use_pipe)
+                        scan_pipe(input, machines, npatterns, &options, results);
+                    else {
+                        fd = open(path, O_RDONLY);
+                        test(fd != -1, ANSI_COLOR_RED "failed to open %s\n" ANSI_COLOR_RESET, path);
+                        test(re_scan_fd(fd, machines, npatterns, &options, results) == 0,
+                            ANSI_COLOR_RED "scan failed\n" ANSI_COLOR_RESET);
+                        close(fd);
+                    }
+                    for (size_t i = 0; i < npatterns; i++)
+                        test(results[i].matched == expected[i].matched &&
+                            (!results[i].matched || results[i].end == expected[i].end),
+                            ANSI_COLOR_RED "%s with buffers of %zu: %d at %zu\n" ANSI_COLOR_RESET,
+                            patterns[i], buffer_sizes[b], results[i].matched, results[i].end);
+                }
+            }
+        }
+    }
+    test(re_scan_fd(-1, machines, npatterns, NULL, results) == -1,
+        ANSI_COLOR_RED "expected a read error\n" ANSI_COLOR_RESET);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+
+    unlink(path);
+    for (size_t i = 0; i < npatterns; i++)
+        free_nfa(machines[i]);
+    free(input);
+}
+
+/*
+ * A pipe whose writer stays open. What has been written so far has to be
+ * scanned without waiting for the buffer to fill, and the scan has to
+ * return once every pattern has matched, with the pipe still open.
+ */
+static void
+test_open_pipe(void)
+{
+    const char *patterns[] = {"needle", "k[0-9]+=v"};
+    nfa_machine_t *machines[2];
+    re_scan_result_t results[2];
+    int fds[2];
+
+    printf("Testing scans of a pipe left open---");
+    for (size_t i = 0; i < 2; i++)
+        machines[i] = compile_regex(patterns[i]);
+    for (size_t nmatchers = 1; nmatchers <= 2; nmatchers++) {
+        re_scan_options_t options = {0, 0, nmatchers, 0};
+        test(pipe(fds) == 0, ANSI_COLOR_RED "pipe failed\n" ANSI_COLOR_RESET);
+        test(write(fds[1], "a needle, k12=v ", 16) == 16, ANSI_COLOR_RED "write failed\n" ANSI_COLOR_RESET);
+        test(re_scan_fd(fds[0], machines, 2, &options, results) == 0, ANSI_COLOR_RED "scan failed\n" ANSI_COLOR_RESET);
+        test(results[0].matched && results[0].end == 8 && results[1].matched && results[1].end == 15,
+            ANSI_COLOR_RED "%zu matchers: %d at %zu, %d at %zu\n" ANSI_COLOR_RESET, nmatchers,
+            results[0].matched, results[0].end, results[1].matched, results[1].end);
+        close(fds[0]);
+        close(fds[1]);
+    }
+    for (size_t i = 0; i < 2; i++)
+        free_nfa(machines[i]);
+    printf(ANSI_COLOR_GREEN "-Passed!" ANSI_COLOR_RESET "\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    test_stream();
+    test_scan();
+    test_open_pipe();
+}
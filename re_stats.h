@@ -0,0 +1,177 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef RE_STATS_H
+#define RE_STATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * Execution statistics. They are only collected when the library is built
+ * with RE_STATS defined (make RE_STATS=1), otherwise RE_STATS_DO() expands
+ * to nothing and the executors do no extra work at all. Every object has
+ * to be built with the same setting, since it changes the layout of
+ * nfa_machine_t and dense_dfa_t.
+ */
+#ifdef RE_STATS
+#define RE_STATS_DO(...) do { __VA_ARGS__; } while (0)
+#else
+#define RE_STATS_DO(...) do {} while (0)
+#endif
+
+typedef enum re_engine_t {
+    RE_ENGINE_NFA,
+    RE_ENGINE_DFA,
+    RE_ENGINE_DENSE_DFA,
+    RE_ENGINE_JIT,
+    RE_ENGINE_LITERAL, // a string search, for patterns which are one string or a few
+    RE_NENGINES
+} re_engine_t;
+
+static const char *re_engine_strings[] = {
+    "NFA",
+    "DFA",
+    "DENSE_DFA",
+    "JIT",
+    "LITERAL"
+};
+
+#define re_engine_to_string(engine) re_engine_strings[engine]
+
+/*
+ * Counters for one match. A step is one NFA thread advanced over a byte or
+ * one DFA transition. peak_threads is the largest clist/nlist of the NFA.
+ */
+typedef struct re_match_stats_t {
+    size_t bytes_scanned;
+    size_t steps;
+    size_t peak_threads;
+    size_t epsilon_edges;
+    size_t prefilter_skips; // bytes skipped by a prefilter
+    size_t prefilter_candidates;
+    size_t dfa_cache_hits;
+    size_t dfa_cache_misses;
+    size_t dfa_cache_flushes;
+} re_match_stats_t;
+
+/*
+ * The counters of all the matches run against a machine, updated with
+ * relaxed atomics so that matches on several threads can add to them.
+ * peak_threads is the maximum over the matches, everything else a sum.
+ */
+typedef struct re_stats_t {
+    atomic_size_t matches[RE_NENGINES];
+    atomic_int last_engine;
+    atomic_size_t bytes_scanned;
+    atomic_size_t steps;
+    atomic_size_t peak_threads;
+    atomic_size_t epsilon_edges;
+    atomic_size_t prefilter_skips;
+    atomic_size_t prefilter_candidates;
+    atomic_size_t dfa_cache_hits;
+    atomic_size_t dfa_cache_misses;
+    atomic_size_t dfa_cache_flushes;
+} re_stats_t;
+
+/* A plain copy of a re_stats_t */
+typedef struct re_stats_summary_t {
+    size_t matches[RE_NENGINES];
+    re_engine_t last_engine;
+    re_match_stats_t totals;
+} re_stats_summary_t;
+
+#define re_stats_add_field(stats, m, field) \
+    atomic_fetch_add_explicit(&(stats)->field, (m)->field, memory_order_relaxed)
+
+static inline void
+re_stats_add(re_stats_t *stats, re_engine_t engine, const re_match_stats_t *m)
+{
+    atomic_fetch_add_explicit(&stats->matches[engine], 1, memory_order_relaxed);
+    atomic_store_explicit(&stats->last_engine, engine, memory_order_relaxed);
+    re_stats_add_field(stats, m, bytes_scanned);
+    re_stats_add_field(stats, m, steps);
+    re_stats_add_field(stats, m, epsilon_edges);
+    re_stats_add_field(stats, m, prefilter_skips);
+    re_stats_add_field(stats, m, prefilter_candidates);
+    re_stats_add_field(stats, m, dfa_cache_hits);
+    re_stats_add_field(stats, m, dfa_cache_misses);
+    re_stats_add_field(stats, m, dfa_cache_flushes);
+    size_t peak = atomic_load_explicit(&stats->peak_threads, memory_order_relaxed);
+    while (m->peak_threads > peak && !atomic_compare_exchange_weak_explicit(&stats->peak_threads,
+        &peak, m->peak_threads, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+#define re_stats_load_field(stats, s, field) \
+    ((s)->totals.field = atomic_load_explicit(&(stats)->field, memory_order_relaxed))
+
+/* Adds a match which a prefilter answered without running the engine */
+static inline void
+re_stats_add_prefiltered(re_stats_t *stats, re_engine_t engine, size_t len)
+{
+    re_match_stats_t m = {0};
+    m.prefilter_skips = len;
+    re_stats_add(stats, engine, &m);
+}
+
+static inline void
+re_stats_read(re_stats_t *stats, re_stats_summary_t *s)
+{
+    for (int i = 0; i < RE_NENGINES; i++)
+        s->matches[i] = atomic_load_explicit(&stats->matches[i], memory_order_relaxed);
+    s->last_engine = atomic_load_explicit(&stats->last_engine, memory_order_relaxed);
+    re_stats_load_field(stats, s, bytes_scanned);
+    re_stats_load_field(stats, s, steps);
+    re_stats_load_field(stats, s, peak_threads);
+    re_stats_load_field(stats, s, epsilon_edges);
+    re_stats_load_field(stats, s, prefilter_skips);
+    re_stats_load_field(stats, s, prefilter_candidates);
+    re_stats_load_field(stats, s, dfa_cache_hits);
+    re_stats_load_field(stats, s, dfa_cache_misses);
+    re_stats_load_field(stats, s, dfa_cache_flushes);
+}
+
+static inline void
+re_stats_reset(re_stats_t *stats)
+{
+    for (int i = 0; i < RE_NENGINES; i++)
+        atomic_store_explicit(&stats->matches[i], 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->bytes_scanned, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->steps, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->peak_threads, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->epsilon_edges, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->prefilter_skips, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->prefilter_candidates, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->dfa_cache_hits, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->dfa_cache_misses, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->dfa_cache_flushes, 0, memory_order_relaxed);
+}
+
+#endif
@@ -28,18 +28,199 @@
  */
 
 #include <err.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "re_utils.h"
 
+static void *
+libc_malloc(size_t size, void *ctx)
+{
+    return malloc(size);
+}
+
+static void *
+libc_realloc(void *p, size_t size, void *ctx)
+{
+    return realloc(p, size);
+}
+
+static void
+libc_free(void *p, void *ctx)
+{
+    free(p);
+}
+
+static re_allocator_t allocator = {libc_malloc, libc_realloc, libc_free, NULL};
+
+/*
+ * Replaces the allocation hooks, NULL restores the libc ones. Not thread
+ * safe, and only to be called while the library holds no memory.
+ */
+void
+re_set_allocator(const re_allocator_t *a)
+{
+    if (a == NULL) {
+        allocator.malloc = libc_malloc;
+        allocator.realloc = libc_realloc;
+        allocator.free = libc_free;
+        allocator.ctx = NULL;
+    } else
+        allocator = *a;
+}
+
+void *
+re_malloc(size_t size)
+{
+    return allocator.malloc(size, allocator.ctx);
+}
+
+void *
+re_calloc(size_t n, size_t size)
+{
+    if (size && n > SIZE_MAX / size)
+        return NULL;
+    void *p = allocator.malloc(n * size, allocator.ctx);
+    if (p)
+        memset(p, 0, n * size);
+    return p;
+}
+
+void *
+re_realloc(void *p, size_t size)
+{
+    return allocator.realloc(p, size, allocator.ctx);
+}
+
+void *
+re_reallocarray(void *p, size_t n, size_t size)
+{
+    if (size && n > SIZE_MAX / size)
+        return NULL;
+    return allocator.realloc(p, n * size, allocator.ctx);
+}
+
+char *
+re_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = allocator.malloc(len, allocator.ctx);
+    if (copy)
+        memcpy(copy, s, len);
+    return copy;
+}
+
+int
+re_asprintf(char **s, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0 || (*s = allocator.malloc(len + 1, allocator.ctx)) == NULL)
+        return -1;
+    va_start(ap, fmt);
+    vsnprintf(*s, len + 1, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+void
+re_free(void *p)
+{
+    if (p)
+        allocator.free(p, allocator.ctx);
+}
+
+/*
+ * The counting allocator keeps the size of every block in a header in
+ * front of it.
+ */
+#define COUNT_HEADER sizeof(max_align_t)
+
+static void
+count_alloc(re_alloc_counter_t *counter, size_t size)
+{
+    atomic_fetch_add_explicit(&counter->nallocs, 1, memory_order_relaxed);
+    size_t bytes = atomic_fetch_add_explicit(&counter->bytes, size, memory_order_relaxed) + size;
+    size_t peak = atomic_load_explicit(&counter->peak, memory_order_relaxed);
+    while (bytes > peak && !atomic_compare_exchange_weak_explicit(&counter->peak, &peak, bytes,
+        memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static void *
+counting_malloc(size_t size, void *ctx)
+{
+    if (size > SIZE_MAX - COUNT_HEADER)
+        return NULL;
+    char *p = malloc(size + COUNT_HEADER);
+    if (p == NULL)
+        return NULL;
+    *(size_t *) p = size;
+    count_alloc(ctx, size);
+    return p + COUNT_HEADER;
+}
+
+static void
+counting_free(void *p, void *ctx)
+{
+    re_alloc_counter_t *counter = ctx;
+    char *block = (char *) p - COUNT_HEADER;
+    atomic_fetch_add_explicit(&counter->nfrees, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&counter->bytes, *(size_t *) block, memory_order_relaxed);
+    free(block);
+}
+
+static void *
+counting_realloc(void *p, size_t size, void *ctx)
+{
+    if (p == NULL)
+        return counting_malloc(size, ctx);
+    if (size > SIZE_MAX - COUNT_HEADER)
+        return NULL;
+    re_alloc_counter_t *counter = ctx;
+    char *block = (char *) p - COUNT_HEADER;
+    size_t old_size = *(size_t *) block;
+    block = realloc(block, size + COUNT_HEADER);
+    if (block == NULL)
+        return NULL;
+    *(size_t *) block = size;
+    atomic_fetch_sub_explicit(&counter->bytes, old_size, memory_order_relaxed);
+    count_alloc(counter, size);
+    return block + COUNT_HEADER;
+}
+
+/*
+ * Fills in a with hooks which allocate from libc and keep counts in
+ * counter, for enforcing memory budgets.
+ */
+void
+re_counting_allocator(re_allocator_t *a, re_alloc_counter_t *counter)
+{
+    atomic_init(&counter->nallocs, 0);
+    atomic_init(&counter->nfrees, 0);
+    atomic_init(&counter->bytes, 0);
+    atomic_init(&counter->peak, 0);
+    a->malloc = counting_malloc;
+    a->realloc = counting_realloc;
+    a->free = counting_free;
+    a->ctx = counter;
+}
+
 cm_list *
 cm_list_init(void)
 {
     cm_list *list;
-    list = malloc(sizeof(*list));
+    list = re_malloc(sizeof(*list));
     if (list == NULL)
         errx(EXIT_FAILURE, "malloc failed");
     list->head = NULL;
@@ -51,7 +232,7 @@ cm_list_init(void)
 int
 cm_list_add(cm_list *list, void *data)
 {
-    cm_list_node *node = malloc(sizeof(*node));
+    cm_list_node *node = re_malloc(sizeof(*node));
     if (node == NULL)
         return 0;
     node->data = data;
@@ -79,12 +260,12 @@ cm_list_free(cm_list *list, void (*free_data) (void *))
         if (free_data)
             free_data(list_node->data);
         // else
-            // free(list_node->data);
+            // re_free(list_node->data);
         temp_node = list_node->next;
-        free(list_node);
+        re_free(list_node);
         list_node = temp_node;
     }
-    free(list);
+    re_free(list);
 }
 
 void *
@@ -115,12 +296,62 @@ size_t calculate_string_size(long l)
     return size + 1;
 }
 
+/*
+ * memchr for any of two or three bytes. With SSE2 the input is compared 16
+ * bytes at a time, the rest one byte at a time.
+ */
+void *
+re_memchr2(const void *s, int c1, int c2, size_t n)
+{
+    const uint8_t *p = s;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i v1 = _mm_set1_epi8((char) c1);
+    __m128i v2 = _mm_set1_epi8((char) c2);
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, v1), _mm_cmpeq_epi8(chunk, v2)));
+        if (mask)
+            return (void *) (p + i + __builtin_ctz(mask));
+    }
+#endif
+    for (; i < n; i++) {
+        if (p[i] == (uint8_t) c1 || p[i] == (uint8_t) c2)
+            return (void *) (p + i);
+    }
+    return NULL;
+}
+
+void *
+re_memchr3(const void *s, int c1, int c2, int c3, size_t n)
+{
+    const uint8_t *p = s;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i v1 = _mm_set1_epi8((char) c1);
+    __m128i v2 = _mm_set1_epi8((char) c2);
+    __m128i v3 = _mm_set1_epi8((char) c3);
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (p + i));
+        __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(chunk, v1), _mm_cmpeq_epi8(chunk, v2));
+        int mask = _mm_movemask_epi8(_mm_or_si128(eq, _mm_cmpeq_epi8(chunk, v3)));
+        if (mask)
+            return (void *) (p + i + __builtin_ctz(mask));
+    }
+#endif
+    for (; i < n; i++) {
+        if (p[i] == (uint8_t) c1 || p[i] == (uint8_t) c2 || p[i] == (uint8_t) c3)
+            return (void *) (p + i);
+    }
+    return NULL;
+}
+
 char *
 long_to_string(long l)
 {
     long rem;
     size_t str_size = calculate_string_size(l) + 1;
-    char *str = malloc(str_size + 1);
+    char *str = re_malloc(str_size + 1);
     size_t index = str_size;
     _Bool is_negative = l < 0;
     if (is_negative)
@@ -152,7 +383,7 @@ cm_hash_table_init(size_t (*hash_func)(void *),
     void (*free_value) (void *))
 {
     cm_hash_table *table;
-    table = malloc(sizeof(*table));
+    table = re_malloc(sizeof(*table));
     if (table == NULL)
         errx(EXIT_FAILURE, "malloc failed");
     table->hash_func = hash_func;
@@ -160,8 +391,8 @@ cm_hash_table_init(size_t (*hash_func)(void *),
     table->free_key = free_key;
     table->free_value = free_value;
     table->table_size = INITIAL_HASHTABLE_SIZE;
-    table->table = calloc(table->table_size, sizeof(*table->table));
-    table->used_slots = cm_array_list_init(table->table_size, free);
+    table->table = re_calloc(table->table_size, sizeof(*table->table));
+    table->used_slots = cm_array_list_init(table->table_size, re_free);
     if (table->table == NULL)
         errx(EXIT_FAILURE, "malloc failed");
     table->nkeys = 0;
@@ -182,6 +413,40 @@ find_entry(cm_list *list, cm_hash_entry *other_entry, _Bool (*keyequals) (void *
 }
 
 
+static void
+cm_hash_table_resize(cm_hash_table *hash_table, size_t new_size)
+{
+    cm_list **new_table = re_calloc(new_size, sizeof(*new_table));
+    if (new_table == NULL)
+        errx(EXIT_FAILURE, "malloc failed");
+    cm_array_list *new_used_slots = cm_array_list_init(new_size, re_free);
+    for (size_t i = 0; i < hash_table->used_slots->length; i++) {
+        size_t *old_index = (size_t *) hash_table->used_slots->array[i];
+        cm_list *entry_list = hash_table->table[*old_index];
+        cm_list_node *node = entry_list->head;
+        while (node) {
+            cm_hash_entry *entry = (cm_hash_entry *) node->data;
+            size_t index = hash_table->hash_func(entry->key) % new_size;
+            if (new_table[index] == NULL) {
+                new_table[index] = cm_list_init();
+                size_t *used_slot = re_malloc(sizeof(*used_slot));
+                if (used_slot == NULL)
+                    errx(EXIT_FAILURE, "malloc failed");
+                *used_slot = index;
+                cm_array_list_add(new_used_slots, used_slot);
+            }
+            cm_list_add(new_table[index], entry);
+            node = node->next;
+        }
+        cm_list_free(entry_list, NULL);
+    }
+    re_free(hash_table->table);
+    cm_array_list_free(hash_table->used_slots);
+    hash_table->table = new_table;
+    hash_table->used_slots = new_used_slots;
+    hash_table->table_size = new_size;
+}
+
 void
 cm_hash_table_put(cm_hash_table *hash_table, void *key, void *value)
 {
@@ -191,25 +456,26 @@ cm_hash_table_put(cm_hash_table *hash_table, void *key, void *value)
     if (entry_list == NULL) {
         entry_list = cm_list_init();
         hash_table->table[index] = entry_list;
-        size_t *used_slot = malloc(sizeof(*used_slot));
+        size_t *used_slot = re_malloc(sizeof(*used_slot));
         if (used_slot == NULL)
             errx(EXIT_FAILURE, "malloc failed");
         *used_slot = index;
         cm_array_list_add(hash_table->used_slots, used_slot);
-        //TODO: resize when nentries == table size
     } else {
         cm_hash_entry temp_entry = {key, NULL};
         entry = find_entry(entry_list, &temp_entry, hash_table->keyequals);
     }
 
     if (entry == NULL) {
-        entry = malloc(sizeof*entry);
+        entry = re_malloc(sizeof*entry);
         if (entry == NULL)
             errx(EXIT_FAILURE, "malloc failed");
         entry->key = key;
         entry->value = value;
         hash_table->nkeys++;
         cm_list_add(entry_list, entry);
+        if (hash_table->nkeys > hash_table->table_size)
+            cm_hash_table_resize(hash_table, hash_table->table_size * 2);
     } else {
         if (hash_table->free_value)
             hash_table->free_value(entry->value);
@@ -220,6 +486,19 @@ cm_hash_table_put(cm_hash_table *hash_table, void *key, void *value)
     }
 }
 
+/*
+ * Bytes allocated for the table itself, not counting the keys and values.
+ */
+size_t
+cm_hash_table_memory(cm_hash_table *hash_table)
+{
+    cm_array_list *slots = hash_table->used_slots;
+    return sizeof(*hash_table) + hash_table->table_size * sizeof(cm_list *) +
+        sizeof(*slots) + slots->array_size * sizeof(void *) +
+        slots->length * (sizeof(size_t) + sizeof(cm_list)) +
+        hash_table->nkeys * (sizeof(cm_list_node) + sizeof(cm_hash_entry));
+}
+
 void *
 cm_hash_table_get(cm_hash_table *hash_table, void *key)
 {
@@ -238,6 +517,44 @@ cm_hash_table_get(cm_hash_table *hash_table, void *key)
     return NULL;
 }
 
+/*
+ * Removes the entry for key from the table, freeing its key and value
+ * with the table's free functions. Returns 1 if an entry was removed.
+ */
+int
+cm_hash_table_remove(cm_hash_table *hash_table, void *key)
+{
+    size_t index = hash_table->hash_func(key) % hash_table->table_size;
+    cm_list *entry_list = hash_table->table[index];
+    if (entry_list == NULL)
+        return 0;
+    cm_list_node *prev = NULL;
+    cm_list_node *node = entry_list->head;
+    while (node) {
+        cm_hash_entry *entry = (cm_hash_entry *) node->data;
+        if (hash_table->keyequals(entry->key, key)) {
+            if (prev)
+                prev->next = node->next;
+            else
+                entry_list->head = node->next;
+            if (entry_list->tail == node)
+                entry_list->tail = prev;
+            entry_list->length--;
+            hash_table->nkeys--;
+            if (hash_table->free_key)
+                hash_table->free_key(entry->key);
+            if (hash_table->free_value)
+                hash_table->free_value(entry->value);
+            re_free(entry);
+            re_free(node);
+            return 1;
+        }
+        prev = node;
+        node = node->next;
+    }
+    return 0;
+}
+
 cm_hash_table *
 cm_hash_table_copy(cm_hash_table *src, void * (*key_copy) (void *), void * (*value_copy) (void *))
 {
@@ -290,12 +607,12 @@ free_entry_list(cm_hash_table *table, cm_list *entry_list)
         if (table->free_value != NULL) {
             table->free_value(entry->value);
         }
-        free(entry);
+        re_free(entry);
         temp = node->next;
-        free(node);
+        re_free(node);
         node = temp;
     }
-    free(entry_list);
+    re_free(entry_list);
 }
 
 void
@@ -307,19 +624,19 @@ cm_hash_table_free(cm_hash_table *table)
             free_entry_list(table, entry_list);
         }
     }
-    free(table->table);
+    re_free(table->table);
     cm_array_list_free(table->used_slots);
-    free(table);
+    re_free(table);
 }
 
 cm_array_list *
 cm_array_list_init(size_t init_size, void (*free_func) (void *))
 {
     cm_array_list *list;
-    list = malloc(sizeof(*list));
+    list = re_malloc(sizeof(*list));
     if (list == NULL)
         errx(EXIT_FAILURE, "malloc failed");
-    list->array = calloc(init_size, sizeof(*list->array));
+    list->array = re_calloc(init_size, sizeof(*list->array));
     if (list->array == NULL)
         errx(EXIT_FAILURE, "malloc failed");
     list->array_size = init_size;
@@ -333,7 +650,7 @@ cm_array_list_add(cm_array_list *list, void *value)
 {
     if (list->length == list->array_size) {
         list->array_size *= 3;
-        list->array = reallocarray(list->array, list->array_size, sizeof(*list->array));
+        list->array = re_reallocarray(list->array, list->array_size, sizeof(*list->array));
         if (list->array == NULL)
             errx(EXIT_FAILURE, "malloc failed");
     }
@@ -384,11 +701,11 @@ cm_array_list_remove(cm_array_list *list, size_t index)
         cm_array_list_add(copy, list->array[i]);
     }
 
-    free(list->array);
+    re_free(list->array);
     list->array = copy->array;
     list->length = copy->length;
     list->array_size = copy->array_size;
-    free(copy);
+    re_free(copy);
 }
 
 void
@@ -399,8 +716,8 @@ cm_array_list_free(cm_array_list *list)
             list->free_func(list->array[i]);
         }
     }
-    free(list->array);
-    free(list);
+    re_free(list->array);
+    re_free(list);
 }
 
 char *
@@ -414,14 +731,14 @@ cm_array_string_list_join(cm_array_list *list, const char *delim)
 
     for (size_t i = 0; i < list->length; i++) {
         if (string == NULL) {
-            ret = asprintf(&temp, "%s", (char *) list->array[i]);
+            ret = re_asprintf(&temp, "%s", (char *) list->array[i]);
             if (ret == -1)
                 errx(EXIT_FAILURE, "malloc failed");
         } else {
-            ret = asprintf(&temp, "%s%s%s", string, delim, (char *) list->array[i]);
+            ret = re_asprintf(&temp, "%s%s%s", string, delim, (char *) list->array[i]);
             if (ret == -1)
                 errx(EXIT_FAILURE, "malloc failed");
-            free(string);
+            re_free(string);
         }
         string = temp;
         temp = NULL;
@@ -30,11 +30,36 @@
 #ifndef CMONKEY_UTILS_H
 #define CMONKEY_UTILS_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
 #define INITIAL_HASHTABLE_SIZE 64
 
+/*
+ * All the memory of the library is allocated through these hooks, which
+ * default to the libc allocator. They can be replaced with re_set_allocator
+ * before anything is compiled, after which memory handed out by the library
+ * has to be released with re_free.
+ */
+typedef struct re_allocator_t {
+    void *(*malloc) (size_t, void *);
+    void *(*realloc) (void *, size_t, void *);
+    void (*free) (void *, void *);
+    void *ctx; // passed to every hook
+} re_allocator_t;
+
+/*
+ * Counts for re_counting_allocator. bytes is the memory currently
+ * allocated, peak its high water mark.
+ */
+typedef struct re_alloc_counter_t {
+    atomic_size_t nallocs;
+    atomic_size_t nfrees;
+    atomic_size_t bytes;
+    atomic_size_t peak;
+} re_alloc_counter_t;
+
 typedef struct cm_list_node {
     void *data;
     struct cm_list_node *next;
@@ -92,6 +117,18 @@ void cm_stack_free(cm_stack *);
 char *cm_array_string_list_join(cm_array_list *, const char *);
 cm_array_list *cm_array_list_copy(cm_array_list *, void * (*copy_func) (void *));
 
+void re_set_allocator(const re_allocator_t *);
+void re_counting_allocator(re_allocator_t *, re_alloc_counter_t *);
+void *re_malloc(size_t);
+void *re_calloc(size_t, size_t);
+void *re_realloc(void *, size_t);
+void *re_reallocarray(void *, size_t, size_t);
+char *re_strdup(const char *);
+int re_asprintf(char **, const char *, ...);
+void re_free(void *);
+void *re_memchr2(const void *, int, int, size_t);
+void *re_memchr3(const void *, int, int, int, size_t);
+
 char *long_to_string(long);
 const char *bool_to_string(_Bool);
 
@@ -102,7 +139,9 @@ cm_hash_table *cm_hash_table_init(
     void (*free_value) (void *));
 void cm_hash_table_put(cm_hash_table *, void *, void *);
 void *cm_hash_table_get(cm_hash_table *, void *);
+int cm_hash_table_remove(cm_hash_table *, void *);
 void cm_hash_table_free(cm_hash_table *);
+size_t cm_hash_table_memory(cm_hash_table *);
 cm_hash_table *cm_hash_table_copy(cm_hash_table *, void * (*key_copy) (void *), void * (*value_copy) (void *));
 size_t string_hash_function(void *);
 _Bool string_equals(void *, void *);
@@ -0,0 +1,259 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Ahead of time compiler for fixed patterns. Compiles the pattern to a
+ * minimized DFA and prints a self contained C function implementing it as
+ * a goto state machine, with the byte class table as a static const array:
+ *
+ *     int name(const char *string, size_t len);
+ *
+ * returns 1 if string matches the pattern in the chosen mode (full, prefix
+ * or any, with the same meaning as in nfa_match) and 0 otherwise. States
+ * accepting depending on the byte after them (from `$`, `\b` or `\B`) look
+ * at it through a second table of the word bytes.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dense_dfa.h"
+#include "dfa.h"
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: recodegen [-iu] [-m full|prefix|any] [-n function_name] pattern\n");
+    exit(EXIT_FAILURE);
+}
+
+static void
+print_escaped(FILE *out, const char *s)
+{
+    for (; *s; s++) {
+        if (*s == '*' && s[1] == '/')
+            fprintf(out, "*\\");
+        else
+            fputc(*s, out);
+    }
+}
+
+/*
+ * Marks the states reachable from start, only those get any code.
+ */
+static uint8_t *
+reachable_states(dense_dfa_t *dfa, uint32_t start)
+{
+    uint8_t *seen = calloc(dfa->nstates, 1);
+    uint32_t *queue = malloc(dfa->nstates * sizeof(uint32_t));
+    if (seen == NULL || queue == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    size_t head = 0, tail = 0;
+    seen[start] = 1;
+    queue[tail++] = start;
+    while (head < tail) {
+        uint32_t s = queue[head++];
+        for (size_t c = 0; c < dfa->nclasses; c++) {
+            uint32_t t = dfa->trans[(size_t) s * dfa->nclasses + c];
+            if (!seen[t]) {
+                seen[t] = 1;
+                queue[tail++] = t;
+            }
+        }
+    }
+    free(queue);
+    return seen;
+}
+
+static void
+print_state(FILE *out, dense_dfa_t *dfa, uint32_t state, match_mode_t mode)
+{
+    const uint32_t *row = dfa->trans + (size_t) state * dfa->nclasses;
+    uint8_t flags = dfa->flags[state];
+    int accepting = flags & DFA_ACCEPTING;
+    uint32_t common = row[0];
+    size_t best = 0;
+
+    fprintf(out, "s%u:\n", state);
+    if (state == DFA_DEAD_STATE) {
+        fprintf(out, "    return 0;\n");
+        return;
+    }
+    if (mode != MATCH_FULL && accepting) {
+        fprintf(out, "    return 1;\n");
+        return;
+    }
+    fprintf(out, "    if (p == end)\n        return %d;\n", accepting || (flags & DFA_ACCEPT_AT_END)? 1: 0);
+    if (mode != MATCH_FULL) {
+        if ((flags & DFA_ACCEPT_BEFORE_WORD) && (flags & DFA_ACCEPT_BEFORE_NONWORD)) {
+            fprintf(out, "    return 1;\n");
+            return;
+        }
+        if (flags & DFA_ACCEPT_BEFORE_WORD)
+            fprintf(out, "    if (word[*p])\n        return 1;\n");
+        else if (flags & DFA_ACCEPT_BEFORE_NONWORD)
+            fprintf(out, "    if (!word[*p])\n        return 1;\n");
+    }
+
+    // the target most classes go to becomes the default case
+    for (size_t c = 0; c < dfa->nclasses; c++) {
+        size_t count = 0;
+        for (size_t d = 0; d < dfa->nclasses; d++)
+            count += row[d] == row[c];
+        if (count > best) {
+            best = count;
+            common = row[c];
+        }
+    }
+    if (best == dfa->nclasses) {
+        fprintf(out, "    p++;\n    goto s%u;\n", common);
+        return;
+    }
+    fprintf(out, "    switch (classes[*p++]) {\n");
+    for (size_t c = 0; c < dfa->nclasses; c++) {
+        if (row[c] == common)
+            continue;
+        int first = 1;
+        // print all the classes going to the same state together
+        for (size_t d = 0; d < c; d++) {
+            if (row[d] == row[c]) {
+                first = 0;
+                break;
+            }
+        }
+        if (!first)
+            continue;
+        for (size_t d = c; d < dfa->nclasses; d++) {
+            if (row[d] == row[c])
+                fprintf(out, "    case %zu:\n", d);
+        }
+        fprintf(out, "        goto s%u;\n", row[c]);
+    }
+    fprintf(out, "    default:\n        goto s%u;\n    }\n", common);
+}
+
+static void
+print_function(FILE *out, dense_dfa_t *dfa, const char *pattern, const char *name, match_mode_t mode)
+{
+    static const char *mode_names[] = {"full", "prefix", "search", "any"};
+    // without its trailing `.*` the DFA matches all of the input if it matches a prefix
+    match_mode_t run = core_mode(&dfa->analysis, mode);
+    uint32_t start = dfa->start[run == MATCH_ANY? 1: 0];
+    uint8_t *reachable = reachable_states(dfa, start);
+    int lookahead = 0;
+    for (uint32_t s = 0; s < dfa->nstates; s++) {
+        if (reachable[s] && (dfa->flags[s] & (DFA_ACCEPT_BEFORE_WORD | DFA_ACCEPT_BEFORE_NONWORD)))
+            lookahead = 1;
+    }
+
+    fprintf(out, "/* Generated by recodegen, do not edit.\n * pattern: ");
+    print_escaped(out, pattern);
+    fprintf(out, "\n * mode: %s\n */\n\n", mode_names[mode]);
+    fprintf(out, "#include <stddef.h>\n\n");
+    fprintf(out, "int %s(const char *, size_t);\n\n", name);
+    fprintf(out, "int\n%s(const char *string, size_t len)\n{\n", name);
+    fprintf(out, "    static const unsigned char classes[256] = {");
+    for (size_t c = 0; c < 256; c++)
+        fprintf(out, "%s%u,", c % 16? " ": "\n        ", dfa->byte_classes[c]);
+    fprintf(out, "\n    };\n");
+    if (lookahead && run != MATCH_FULL) {
+        fprintf(out, "    static const unsigned char word[256] = {");
+        for (size_t c = 0; c < 256; c++)
+            fprintf(out, "%s%d,", c % 16? " ": "\n        ", is_word_byte(c)? 1: 0);
+        fprintf(out, "\n    };\n");
+    }
+    fprintf(out, "    const unsigned char *p = (const unsigned char *) string;\n");
+    fprintf(out, "    const unsigned char *end = p + len;\n\n");
+    fprintf(out, "    (void) classes;\n");
+    fprintf(out, "    goto s%u;\n", start);
+    for (uint32_t s = 0; s < dfa->nstates; s++) {
+        if (reachable[s])
+            print_state(out, dfa, s, run);
+    }
+    fprintf(out, "}\n");
+    free(reachable);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *name = "re_match";
+    match_mode_t mode = MATCH_FULL;
+    re_compile_options_t options = {0};
+    int ch;
+
+    while ((ch = getopt(argc, argv, "im:n:u")) != -1) {
+        switch (ch) {
+        case 'i':
+            options.flags |= RE_ICASE;
+            break;
+        case 'm':
+            if (strcmp(optarg, "full") == 0)
+                mode = MATCH_FULL;
+            else if (strcmp(optarg, "prefix") == 0)
+                mode = MATCH_PREFIX;
+            else if (strcmp(optarg, "any") == 0)
+                mode = MATCH_ANY;
+            else
+                usage();
+            break;
+        case 'n':
+            name = optarg;
+            break;
+        case 'u':
+            options.flags |= RE_UTF8;
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 1)
+        usage();
+
+    re_compile_error_t error;
+    nfa_machine_t *machine = compile_regex_with_options(argv[0], &options, &error);
+    if (machine == NULL)
+        errx(EXIT_FAILURE, "%s: %s", argv[0], error.message);
+    dfa_t *dfa = dfa_init(machine, SIZE_MAX);
+    dense_dfa_t *dense = dfa_minimize(dfa);
+    if (dense == NULL)
+        errx(EXIT_FAILURE, "the DFA for %s is too big", argv[0]);
+    print_function(stdout, dense, argv[0], name, mode);
+    dense_dfa_free(dense);
+    dfa_free(dfa);
+    free_nfa(machine);
+    return 0;
+}
@@ -0,0 +1,218 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measures how the throughput of a batch of match jobs run on a re_pool_t
+ * scales with the number of workers. The batch is skewed on purpose: a
+ * few multi-megabyte documents among many small ones, matched against a
+ * handful of patterns each compiled once into a shared DFA. The DFAs are
+ * warmed up before timing, so the numbers are for matching alone. For
+ * every worker count the median time of the batch over a number of trials
+ * is reported, with the throughput and the speedup over one worker.
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+#include "re_pool.h"
+#include "shared_dfa.h"
+
+#define NSMALL 200000
+#define SMALL_MAX 256
+#define NHUGE 8
+#define HUGE_SIZE (4 * 1024 * 1024)
+#define DEFAULT_TRIALS 5
+
+static const char *patterns[] = {
+    "[a-z0-9]+@[a-z]+[.][a-z][a-z]+",
+    "[a-z]+=[0-9][0-9][0-9][0-9][0-9]+;",
+    "(alpha|bravo|charlie|delta|echo|foxtrot|golf|hotel)[0-9]",
+    "\"[^\"]*\"",
+};
+#define NPATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y? -1: x > y;
+}
+
+static char *
+random_text(size_t len, const char *alphabet, unsigned int *seed)
+{
+    size_t n = strlen(alphabet);
+    char *text = malloc(len + 1);
+    if (text == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    for (size_t i = 0; i < len; i++) {
+        *seed = *seed * 1103515245 + 12345;
+        text[i] = alphabet[(*seed >> 16) % n];
+    }
+    text[len] = 0;
+    return text;
+}
+
+/*
+ * The huge documents are spread evenly over the batch, each job matches a
+ * pattern chosen round robin.
+ */
+static re_job_t *
+create_jobs(shared_dfa_t **dfas, size_t *njobs, size_t *nbytes)
+{
+    const char *alphabet = "abcdefghijklmnopqrstuvwxyz0123456789 .,;=@\"";
+    unsigned int seed = 1;
+    size_t n = NSMALL + NHUGE;
+    re_job_t *jobs = malloc(n * sizeof(*jobs));
+    if (jobs == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    *nbytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        int huge = i % (n / NHUGE) == 0;
+        seed = seed * 1103515245 + 12345;
+        size_t len = huge? HUGE_SIZE: 1 + (seed >> 16) % SMALL_MAX;
+        jobs[i].dfa = dfas[i % NPATTERNS];
+        jobs[i].input = random_text(len, alphabet, &seed);
+        jobs[i].len = len;
+        jobs[i].mode = MATCH_ANY;
+        *nbytes += len;
+    }
+    *njobs = n;
+    return jobs;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: scaling_benchmark [-j] [-n trials] [-w max_workers]\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t trials = DEFAULT_TRIALS, max_workers = 0, njobs, nbytes;
+    nfa_machine_t *machines[NPATTERNS];
+    shared_dfa_t *dfas[NPATTERNS];
+    double base = 0;
+    int json = 0, first = 1, ch;
+
+    while ((ch = getopt(argc, argv, "jn:w:")) != -1) {
+        switch (ch) {
+        case 'j':
+            json = 1;
+            break;
+        case 'n':
+            trials = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            max_workers = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (trials == 0)
+        usage();
+    if (max_workers == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_workers = ncpus > 0? ncpus: 1;
+    }
+
+    for (size_t i = 0; i < NPATTERNS; i++) {
+        machines[i] = compile_regex(patterns[i]);
+        if (machines[i] == NULL)
+            errx(EXIT_FAILURE, "failed to compile %s", patterns[i]);
+        dfas[i] = shared_dfa_init(machines[i], 0);
+    }
+    re_job_t *jobs = create_jobs(dfas, &njobs, &nbytes);
+    uint64_t *samples = malloc(trials * sizeof(uint64_t));
+    if (samples == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+
+    if (json)
+        printf("[\n");
+    else
+        printf("workers,jobs,input_bytes,median_ns,mb_per_s,speedup\n");
+    // powers of two up to max_workers, and max_workers itself
+    for (size_t nworkers = 1; ; nworkers = nworkers * 2 < max_workers? nworkers * 2: max_workers) {
+        re_pool_t *pool = re_pool_init(nworkers);
+        re_pool_run(pool, jobs, njobs, NULL, NULL);
+        for (size_t t = 0; t < trials; t++) {
+            uint64_t start = now_ns();
+            re_pool_run(pool, jobs, njobs, NULL, NULL);
+            samples[t] = now_ns() - start;
+        }
+        re_pool_free(pool);
+        qsort(samples, trials, sizeof(uint64_t), compare_u64);
+        uint64_t median = samples[trials / 2];
+        double mb_per_s = median? (double) nbytes / (1024 * 1024) / ((double) median / 1e9): 0;
+        if (nworkers == 1)
+            base = mb_per_s;
+        double speedup = base? mb_per_s / base: 0;
+        if (json)
+            printf("%s  {\"workers\": %zu, \"jobs\": %zu, \"input_bytes\": %zu, \"median_ns\": %" PRIu64 ", "
+                "\"mb_per_s\": %.2f, \"speedup\": %.2f}", first? "": ",\n", nworkers, njobs, nbytes, median,
+                mb_per_s, speedup);
+        else
+            printf("%zu,%zu,%zu,%" PRIu64 ",%.2f,%.2f\n", nworkers, njobs, nbytes, median, mb_per_s, speedup);
+        fflush(stdout);
+        first = 0;
+        if (nworkers == max_workers)
+            break;
+    }
+    if (json)
+        printf("\n]\n");
+
+    for (size_t i = 0; i < njobs; i++)
+        free((char *) jobs[i].input);
+    free(jobs);
+    free(samples);
+    for (size_t i = 0; i < NPATTERNS; i++) {
+        shared_dfa_free(dfas[i]);
+        free_nfa(machines[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,671 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfa.h"
+#include "nfa_executor.h"
+#include "re_utils.h"
+#include "shared_dfa.h"
+
+#define state_size(dfa, nset) (sizeof(shared_dfa_state_t) + \
+    (dfa)->nclasses * sizeof(shared_dfa_state_t *) + (nset) * sizeof(size_t))
+
+/*
+ * What a thread needs while matching: the cache it is working in and a
+ * builder, which is only set up once a transition has to be computed.
+ */
+typedef struct matcher {
+    shared_dfa_t *dfa;
+    shared_dfa_cache_t *cache;
+    shared_dfa_scratch_t *scratch;
+    dfa_builder_t *builder; // NULL until set up
+#ifdef RE_STATS
+    size_t ncomputed;
+    size_t nflushes;
+#endif
+} matcher;
+
+static _Thread_local size_t slot_hint;
+
+static size_t
+state_hash(const size_t *set, size_t nset, uint8_t flags)
+{
+    size_t hash = 14695981039346656037UL ^ flags;
+    for (size_t i = 0; i < nset; i++) {
+        hash ^= set[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static shared_dfa_state_t *
+new_state(shared_dfa_t *dfa, const size_t *set, size_t nset, uint8_t flags, size_t hash)
+{
+    shared_dfa_state_t *state = re_malloc(state_size(dfa, nset));
+    if (state == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    state->chain = NULL;
+    state->hash = hash;
+    state->set = (size_t *) (state->next + dfa->nclasses);
+    if (nset)
+        memcpy(state->set, set, nset * sizeof(size_t));
+    state->nset = nset;
+    state->flags = flags;
+    for (size_t i = 0; i < dfa->nclasses; i++)
+        atomic_init(&state->next[i], NULL);
+    return state;
+}
+
+static shared_dfa_cache_t *
+new_cache(shared_dfa_t *dfa)
+{
+    shared_dfa_cache_t *cache = re_malloc(sizeof(*cache));
+    if (cache == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    // about one bucket for every state the cache can hold
+    cache->nbuckets = 16;
+    while (cache->nbuckets * state_size(dfa, 0) < dfa->cache_size)
+        cache->nbuckets *= 2;
+    cache->buckets = re_malloc(cache->nbuckets * sizeof(*cache->buckets));
+    if (cache->buckets == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    for (size_t i = 0; i < cache->nbuckets; i++)
+        atomic_init(&cache->buckets[i], NULL);
+    for (size_t i = 0; i < 4; i++)
+        atomic_init(&cache->start[i], NULL);
+    cache->dead = new_state(dfa, NULL, 0, SHARED_DFA_DEAD, 0);
+    for (size_t i = 0; i < dfa->nclasses; i++)
+        atomic_init(&cache->dead->next[i], cache->dead);
+    atomic_init(&cache->mem_used, state_size(dfa, 0));
+    cache->retire_epoch = 0;
+    cache->next_retired = NULL;
+    return cache;
+}
+
+static void
+free_cache(shared_dfa_cache_t *cache)
+{
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        shared_dfa_state_t *state = atomic_load_explicit(&cache->buckets[i], memory_order_relaxed);
+        while (state) {
+            shared_dfa_state_t *chain = state->chain;
+            re_free(state);
+            state = chain;
+        }
+    }
+    re_free(cache->dead);
+    re_free(cache->buckets);
+    re_free(cache);
+}
+
+static void
+init_slots(shared_dfa_slots_t *block)
+{
+    for (size_t i = 0; i < SHARED_DFA_SLOTS; i++)
+        atomic_init(&block->slots[i].epoch, 0);
+    atomic_init(&block->next, NULL);
+}
+
+/*
+ * A matching thread announces the epoch it started at in a free slot before
+ * it looks at the current cache. A cache retired at epoch e can't be in use
+ * by a thread which announced e or later, as it only got to see the caches
+ * installed by then.
+ */
+static shared_dfa_slot_t *
+enter(shared_dfa_t *dfa)
+{
+    for (shared_dfa_slots_t *block = &dfa->slots; ; ) {
+        for (size_t n = 0; n < SHARED_DFA_SLOTS; n++) {
+            size_t i = (slot_hint + n) % SHARED_DFA_SLOTS;
+            uint_least64_t free_slot = 0;
+            uint_least64_t epoch = atomic_load(&dfa->epoch);
+            if (atomic_compare_exchange_strong(&block->slots[i].epoch, &free_slot, epoch)) {
+                slot_hint = i;
+                return &block->slots[i];
+            }
+        }
+        shared_dfa_slots_t *next = atomic_load(&block->next);
+        if (next == NULL) {
+            // every slot is taken
+            shared_dfa_slots_t *fresh = re_malloc(sizeof(*fresh));
+            if (fresh == NULL)
+                err(EXIT_FAILURE, "malloc failed");
+            init_slots(fresh);
+            if (atomic_compare_exchange_strong(&block->next, &next, fresh))
+                next = fresh;
+            else
+                re_free(fresh);
+        }
+        block = next;
+    }
+}
+
+/*
+ * Frees the retired caches no thread can be using any more. Has to be
+ * called with retired_lock held.
+ */
+static void
+reclaim(shared_dfa_t *dfa)
+{
+    uint_least64_t oldest = UINT_LEAST64_MAX;
+    for (shared_dfa_slots_t *block = &dfa->slots; block; block = atomic_load(&block->next)) {
+        for (size_t i = 0; i < SHARED_DFA_SLOTS; i++) {
+            uint_least64_t epoch = atomic_load(&block->slots[i].epoch);
+            if (epoch && epoch < oldest)
+                oldest = epoch;
+        }
+    }
+    shared_dfa_cache_t *cache = atomic_load_explicit(&dfa->retired, memory_order_relaxed);
+    shared_dfa_cache_t *keep = NULL;
+    while (cache) {
+        shared_dfa_cache_t *next = cache->next_retired;
+        if (cache->retire_epoch <= oldest)
+            free_cache(cache);
+        else {
+            cache->next_retired = keep;
+            keep = cache;
+        }
+        cache = next;
+    }
+    atomic_store_explicit(&dfa->retired, keep, memory_order_relaxed);
+}
+
+static void
+leave(shared_dfa_t *dfa, shared_dfa_slot_t *slot)
+{
+    atomic_store(&slot->epoch, 0);
+    if (atomic_load_explicit(&dfa->retired, memory_order_relaxed) &&
+        pthread_mutex_trylock(&dfa->retired_lock) == 0) {
+        reclaim(dfa);
+        pthread_mutex_unlock(&dfa->retired_lock);
+    }
+}
+
+/*
+ * Replaces cache with an empty one, unless another thread already did.
+ */
+static void
+flush(matcher *m, shared_dfa_cache_t *cache)
+{
+    shared_dfa_t *dfa = m->dfa;
+    shared_dfa_cache_t *fresh = new_cache(dfa);
+    if (!atomic_compare_exchange_strong(&dfa->cache, &cache, fresh)) {
+        free_cache(fresh);
+        return;
+    }
+    atomic_fetch_add_explicit(&dfa->nflushes, 1, memory_order_relaxed);
+    RE_STATS_DO(m->nflushes++);
+    pthread_mutex_lock(&dfa->retired_lock);
+    // the epoch only moves on after the new cache is in place
+    cache->retire_epoch = atomic_fetch_add(&dfa->epoch, 1) + 1;
+    cache->next_retired = atomic_load_explicit(&dfa->retired, memory_order_relaxed);
+    atomic_store_explicit(&dfa->retired, cache, memory_order_relaxed);
+    reclaim(dfa);
+    pthread_mutex_unlock(&dfa->retired_lock);
+}
+
+/*
+ * Looks for the state in the bucket list from state up to, but not
+ * including, end.
+ */
+static shared_dfa_state_t *
+find_state(shared_dfa_state_t *state, shared_dfa_state_t *end, const size_t *set, size_t nset,
+    uint8_t flags, size_t hash)
+{
+    for (; state != end; state = state->chain) {
+        if (state->hash == hash && state->flags == flags && state->nset == nset &&
+            (nset == 0 || memcmp(state->set, set, nset * sizeof(size_t)) == 0))
+            return state;
+    }
+    return NULL;
+}
+
+/*
+ * Returns the state in the set of the builder from the current cache,
+ * adding it if no thread has yet. m->cache becomes the current cache. If
+ * the cache is full it is flushed first, unless the state alone does not
+ * fit.
+ */
+static shared_dfa_state_t *
+add_state(matcher *m, uint8_t flags)
+{
+    shared_dfa_t *dfa = m->dfa;
+    const size_t *set = m->builder->set;
+    size_t nset = m->builder->nset;
+    size_t hash = state_hash(set, nset, flags);
+    size_t size = state_size(dfa, nset);
+    for (;;) {
+        shared_dfa_cache_t *cache = m->cache = atomic_load(&dfa->cache);
+        if (nset == 0 && flags == 0)
+            return cache->dead;
+        _Atomic(shared_dfa_state_t *) *bucket = &cache->buckets[hash & (cache->nbuckets - 1)];
+        shared_dfa_state_t *head = atomic_load_explicit(bucket, memory_order_acquire);
+        shared_dfa_state_t *state = find_state(head, NULL, set, nset, flags, hash);
+        if (state)
+            return state;
+        size_t used = atomic_fetch_add_explicit(&cache->mem_used, size, memory_order_relaxed);
+        if (used + size > dfa->cache_size && used > state_size(dfa, 0)) {
+            flush(m, cache);
+            continue;
+        }
+        shared_dfa_state_t *new = new_state(dfa, set, nset, flags, hash);
+        new->chain = head;
+        while (!atomic_compare_exchange_weak_explicit(bucket, &new->chain, new,
+            memory_order_release, memory_order_acquire)) {
+            // another thread may have just added the same state
+            state = find_state(new->chain, head, set, nset, flags, hash);
+            if (state) {
+                atomic_fetch_sub_explicit(&cache->mem_used, size, memory_order_relaxed);
+                re_free(new);
+                return state;
+            }
+            head = new->chain;
+        }
+        return new;
+    }
+}
+
+/*
+ * Points the builder of the scratch space at the NFA of the DFA, making
+ * room for its states if they are more than the scratch space has seen.
+ */
+static void
+setup_builder(matcher *m)
+{
+    shared_dfa_scratch_t *scratch = m->scratch;
+    nfa_machine_t *machine = m->dfa->machine;
+    if (m->builder)
+        return;
+    if (scratch->nstates < machine->nstates) {
+        if (scratch->nstates)
+            dfa_builder_free(&scratch->builder);
+        dfa_builder_init(&scratch->builder, machine, m->dfa->class_bytes);
+        scratch->nstates = machine->nstates;
+    } else {
+        // the marks left behind by other NFAs are all older than the next gen
+        scratch->builder.machine = machine;
+        scratch->builder.class_bytes = m->dfa->class_bytes;
+    }
+    m->builder = &scratch->builder;
+}
+
+/*
+ * Returns start state which of the cache, numbered as in dfa_t.
+ */
+static shared_dfa_state_t *
+start_state(matcher *m, int which)
+{
+    // a search for a pattern anchored at the start has nothing to retry
+    if (which == 1 && m->dfa->machine->anchored_start)
+        which = 0;
+    shared_dfa_state_t *state = atomic_load_explicit(&m->cache->start[which], memory_order_acquire);
+    if (state)
+        return state;
+    setup_builder(m);
+    state = add_state(m, dfa_builder_start(m->builder, which));
+    atomic_store_explicit(&m->cache->start[which], state, memory_order_release);
+    return state;
+}
+
+/*
+ * Computes the transition of from over the bytes of the given class. It is
+ * only published if from is in the cache the new state went into, a state
+ * of a retired cache is not worth updating.
+ */
+static shared_dfa_state_t *
+compute_transition(matcher *m, shared_dfa_state_t *from, uint8_t class)
+{
+    shared_dfa_cache_t *cache = m->cache;
+    setup_builder(m);
+    uint8_t flags = dfa_builder_step(m->builder, from->set, from->nset, from->flags, class);
+    shared_dfa_state_t *to = add_state(m, flags);
+    RE_STATS_DO(m->ncomputed++);
+    if (m->cache == cache)
+        atomic_store_explicit(&from->next[class], to, memory_order_release);
+    return to;
+}
+
+static inline shared_dfa_state_t *
+next_state(matcher *m, shared_dfa_state_t *state, uint8_t c)
+{
+    uint8_t class = m->dfa->byte_classes[c];
+    shared_dfa_state_t *next = atomic_load_explicit(&state->next[class], memory_order_acquire);
+    return next? next: compute_transition(m, state, class);
+}
+
+#ifdef RE_STATS
+static int
+record_match(matcher *m, size_t steps, int ret)
+{
+    re_match_stats_t s = {0};
+    s.bytes_scanned = steps;
+    s.steps = steps;
+    s.dfa_cache_misses = m->ncomputed;
+    s.dfa_cache_hits = steps > m->ncomputed? steps - m->ncomputed: 0;
+    s.dfa_cache_flushes = m->nflushes;
+    s.prefilter_candidates = m->dfa->machine->analysis.required.len != 0;
+    re_stats_add(&m->dfa->machine->stats, RE_ENGINE_DFA, &s);
+    return ret;
+}
+#define match_return(ret) return record_match(m, i, ret)
+#else
+#define match_return(ret) return ret
+#endif
+
+/*
+ * Makes room for twice the attempts in each list. The hash table starts
+ * out empty, so it only knows about the attempts of list l afterwards.
+ */
+static void
+grow_search(shared_dfa_scratch_t *s, size_t l, size_t gen)
+{
+    size_t size = s->size? 2 * s->size: 16;
+    for (size_t i = 0; i < 2; i++) {
+        s->states[i] = re_reallocarray(s->states[i], size, sizeof(shared_dfa_state_t *));
+        s->starts[i] = re_reallocarray(s->starts[i], size, sizeof(size_t));
+        if (s->states[i] == NULL || s->starts[i] == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+    }
+    re_free(s->marks);
+    s->marks = re_calloc(2 * size, sizeof(shared_dfa_mark_t));
+    if (s->marks == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    s->size = size;
+    for (size_t t = 0; t < s->n[l]; t++) {
+        shared_dfa_state_t *state = s->states[l][t];
+        size_t h = state->hash & (2 * size - 1);
+        while (s->marks[h].gen == gen)
+            h = (h + 1) & (2 * size - 1);
+        s->marks[h].state = state;
+        s->marks[h].gen = gen;
+    }
+}
+
+static void
+add_attempt(shared_dfa_scratch_t *s, size_t l, size_t gen, shared_dfa_state_t *state, size_t start)
+{
+    if (state->flags & SHARED_DFA_DEAD)
+        return;
+    if (s->n[l] == s->size)
+        grow_search(s, l, gen);
+    size_t h = state->hash & (2 * s->size - 1);
+    for (; s->marks[h].gen == gen; h = (h + 1) & (2 * s->size - 1)) {
+        if (s->marks[h].state == state)
+            return;
+    }
+    s->marks[h].state = state;
+    s->marks[h].gen = gen;
+    s->states[l][s->n[l]] = state;
+    s->starts[l][s->n[l]++] = start;
+}
+
+/*
+ * Like skip_dead_starts in dfa.c, on the transitions of the current cache.
+ */
+static size_t
+skip_dead_starts(matcher *m, const char *string, size_t len, size_t i, size_t end)
+{
+    shared_dfa_state_t *starts[2];
+    for (size_t w = 0; w < 2; w++) {
+        starts[w] = atomic_load_explicit(&m->cache->start[2 + w], memory_order_acquire);
+        if (starts[w] == NULL)
+            return i;
+    }
+    for (; i < end; i++) {
+        shared_dfa_state_t *state = starts[is_word_byte((uint8_t) string[i - 1])];
+        if (dfa_accepts(state->flags, string, i, len))
+            break;
+        shared_dfa_state_t *next = atomic_load_explicit(&state->next[m->dfa->byte_classes[(uint8_t) string[i]]],
+            memory_order_acquire);
+        if (next == NULL || !(next->flags & SHARED_DFA_DEAD))
+            break;
+    }
+    return i;
+}
+
+/*
+ * Finds the leftmost longest match like leftmost_longest in dfa.c. The
+ * states stay valid while the match goes on even if the cache they are
+ * in gets flushed, so the attempts always run to the end.
+ */
+static void
+leftmost_longest(matcher *m, const char *string, size_t len, size_t end, match_t *match)
+{
+    shared_dfa_scratch_t *s = m->scratch;
+    size_t base = s->gen;
+    size_t cur = 0, next = 1;
+    int once = m->dfa->machine->analysis.leading_any || m->dfa->machine->anchored_start;
+    size_t max_len = m->dfa->machine->analysis.max_len;
+    int found = 0;
+
+    s->n[cur] = 0;
+    s->n[next] = 0;
+    for (size_t i = max_len != RE_UNBOUNDED && end > max_len? end - max_len: 0; ; i++) {
+        if (i > 0 && !found && !once && s->n[cur] == 0)
+            i = skip_dead_starts(m, string, len, i, end);
+        size_t gen = base + i + 1;
+        s->gen = gen + 1;
+        if (!found && i <= end && (i == 0 || !once))
+            add_attempt(s, cur, gen, start_state(m, i == 0? 0: is_word_byte((uint8_t) string[i - 1])? 3: 2), i);
+        for (size_t t = 0; t < s->n[cur]; t++) {
+            shared_dfa_state_t *state = s->states[cur][t];
+            if (dfa_accepts(state->flags, string, i, len)) {
+                found = 1;
+                match->start = s->starts[cur][t];
+                match->end = i;
+                s->n[cur] = t + 1;
+            }
+            if (i < len)
+                add_attempt(s, next, gen + 1, next_state(m, state, string[i]), s->starts[cur][t]);
+        }
+        if (i == len || (s->n[next] == 0 && (found || i >= end)))
+            return;
+        cur ^= 1;
+        next ^= 1;
+        s->n[next] = 0;
+    }
+}
+
+/*
+ * Like dfa_run, without the reverse DFA.
+ */
+static int
+shared_dfa_run(matcher *m, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    int anchored = mode == MATCH_FULL || mode == MATCH_PREFIX;
+    shared_dfa_state_t *state = start_state(m, anchored? 0: 1);
+    size_t i;
+
+    if (mode == MATCH_FULL) {
+        for (i = 0; i < len && !(state->flags & SHARED_DFA_DEAD); i++)
+            state = next_state(m, state, string[i]);
+        if (!dfa_accepts_next(state->flags, 1, 0))
+            match_return(0);
+        if (match) {
+            match->start = 0;
+            match->end = len;
+        }
+        match_return(1);
+    }
+
+    for (i = 0; !dfa_accepts(state->flags, string, i, len); i++) {
+        if (i == len || (state->flags & SHARED_DFA_DEAD))
+            match_return(0);
+        state = next_state(m, state, string[i]);
+    }
+    if (mode == MATCH_SEARCH && match)
+        leftmost_longest(m, string, len, i, match);
+    if (mode == MATCH_PREFIX && match) {
+        match->start = 0;
+        match->end = i;
+    }
+    match_return(1);
+}
+
+/*
+ * A cache_size of 0 takes the max_dfa_memory the machine was compiled
+ * with, or DFA_DEFAULT_CACHE_SIZE if it has none. The cache_size is shared
+ * by all the threads.
+ */
+shared_dfa_t *
+shared_dfa_init(nfa_machine_t *machine, size_t cache_size)
+{
+    shared_dfa_t *dfa = re_malloc(sizeof(*dfa));
+    if (dfa == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    dfa->machine = machine;
+    memcpy(dfa->byte_classes, machine->byte_classes, 256);
+    dfa->nclasses = machine->nclasses;
+    for (int c = 255; c >= 0; c--)
+        dfa->class_bytes[dfa->byte_classes[c]] = c;
+    if (cache_size == 0)
+        cache_size = machine->max_dfa_memory? machine->max_dfa_memory: DFA_DEFAULT_CACHE_SIZE;
+    dfa->cache_size = cache_size;
+    atomic_init(&dfa->cache, new_cache(dfa));
+    atomic_init(&dfa->epoch, 1);
+    init_slots(&dfa->slots);
+    if (pthread_mutex_init(&dfa->retired_lock, NULL))
+        errx(EXIT_FAILURE, "pthread_mutex_init failed");
+    atomic_init(&dfa->retired, NULL);
+    atomic_init(&dfa->nflushes, 0);
+    return dfa;
+}
+
+/*
+ * Same semantics as dfa_match, and safe to call from any number of threads
+ * at once, each with its own scratch space.
+ */
+int
+shared_dfa_match_scratch(shared_dfa_t *dfa, shared_dfa_scratch_t *scratch, const char *string, size_t len,
+    match_mode_t mode, match_t *match)
+{
+    const re_analysis_t *a = &dfa->machine->analysis;
+    int ret = match_precheck(a, string, len, mode, match);
+    if (ret != -1) {
+        RE_STATS_DO(re_stats_add_prefiltered(&dfa->machine->stats, RE_ENGINE_DFA, len));
+        return ret;
+    }
+    matcher m = {0};
+    m.dfa = dfa;
+    m.scratch = scratch;
+    shared_dfa_slot_t *slot = enter(dfa);
+    m.cache = atomic_load(&dfa->cache);
+    ret = shared_dfa_run(&m, string, len, core_mode(a, mode), match);
+    leave(dfa, slot);
+    return extend_match(a, ret, len, mode, match);
+}
+
+/*
+ * shared_dfa_match_scratch with scratch space of its own, which is only
+ * allocated if the match runs into a transition not computed yet or has
+ * the offsets of a search to find.
+ */
+int
+shared_dfa_match(shared_dfa_t *dfa, const char *string, size_t len, match_mode_t mode, match_t *match)
+{
+    shared_dfa_scratch_t scratch = {0};
+    int ret = shared_dfa_match_scratch(dfa, &scratch, string, len, mode, match);
+    shared_dfa_scratch_free(&scratch);
+    return ret;
+}
+
+void
+shared_dfa_scratch_free(shared_dfa_scratch_t *scratch)
+{
+    if (scratch->nstates)
+        dfa_builder_free(&scratch->builder);
+    scratch->nstates = 0;
+    for (size_t i = 0; i < 2; i++) {
+        re_free(scratch->states[i]);
+        re_free(scratch->starts[i]);
+        scratch->states[i] = NULL;
+        scratch->starts[i] = NULL;
+    }
+    re_free(scratch->marks);
+    scratch->marks = NULL;
+    scratch->size = 0;
+}
+
+static size_t
+cache_bytes(shared_dfa_t *dfa, shared_dfa_cache_t *cache)
+{
+    size_t size = sizeof(*cache) + cache->nbuckets * sizeof(*cache->buckets) + state_size(dfa, 0);
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        shared_dfa_state_t *state = atomic_load_explicit(&cache->buckets[i], memory_order_acquire);
+        for (; state; state = state->chain)
+            size += state_size(dfa, state->nset);
+    }
+    return size;
+}
+
+/*
+ * The bytes of the DFA, its current cache, the retired caches not freed
+ * yet and the blocks of slots. No thread may be matching against the DFA,
+ * a flush could free the cache being counted.
+ */
+size_t
+shared_dfa_size(shared_dfa_t *dfa)
+{
+    size_t size = sizeof(*dfa) + cache_bytes(dfa, atomic_load(&dfa->cache));
+    pthread_mutex_lock(&dfa->retired_lock);
+    shared_dfa_cache_t *cache = atomic_load_explicit(&dfa->retired, memory_order_relaxed);
+    for (; cache; cache = cache->next_retired)
+        size += cache_bytes(dfa, cache);
+    pthread_mutex_unlock(&dfa->retired_lock);
+    for (shared_dfa_slots_t *block = atomic_load(&dfa->slots.next); block; block = atomic_load(&block->next))
+        size += sizeof(*block);
+    return size;
+}
+
+/*
+ * No thread may be matching against the DFA any more.
+ */
+void
+shared_dfa_free(shared_dfa_t *dfa)
+{
+    shared_dfa_cache_t *cache = atomic_load(&dfa->retired);
+    while (cache) {
+        shared_dfa_cache_t *next = cache->next_retired;
+        free_cache(cache);
+        cache = next;
+    }
+    free_cache(atomic_load(&dfa->cache));
+    shared_dfa_slots_t *block = atomic_load(&dfa->slots.next);
+    while (block) {
+        shared_dfa_slots_t *next = atomic_load(&block->next);
+        re_free(block);
+        block = next;
+    }
+    pthread_mutex_destroy(&dfa->retired_lock);
+    re_free(dfa);
+}
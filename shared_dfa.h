@@ -0,0 +1,144 @@
+/*-
+ * Copyright (c) 2020 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SHARED_DFA_H
+#define SHARED_DFA_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfa.h"
+#include "nfa_compiler.h"
+#include "nfa_executor.h"
+
+#define SHARED_DFA_SLOTS 64 // slots in a block, more are added as threads need them
+#define SHARED_DFA_DEAD 0x80 // only set on the dead state of a cache
+
+/*
+ * A DFA state. Its transitions start out NULL and are set once, when first
+ * computed, to a state of the same cache.
+ */
+typedef struct shared_dfa_state_t {
+    struct shared_dfa_state_t *chain; // the next state in the same bucket
+    size_t hash;
+    size_t *set; // as in dfa_state_t
+    size_t nset;
+    uint8_t flags;
+    _Atomic(struct shared_dfa_state_t *) next[]; // one per byte class
+} shared_dfa_state_t;
+
+/*
+ * The states built since the last flush, in a hash table whose buckets are
+ * lists only ever added to at their head.
+ */
+typedef struct shared_dfa_cache_t {
+    _Atomic(shared_dfa_state_t *) *buckets;
+    size_t nbuckets;
+    _Atomic(shared_dfa_state_t *) start[4]; // as in dfa_t
+    shared_dfa_state_t *dead;
+    atomic_size_t mem_used;
+    uint64_t retire_epoch;
+    struct shared_dfa_cache_t *next_retired;
+} shared_dfa_cache_t;
+
+/*
+ * The epoch a thread entered a match at, 0 if the slot is free. Slots are
+ * a cache line apart.
+ */
+typedef struct shared_dfa_slot_t {
+    atomic_uint_least64_t epoch;
+    char pad[64 - sizeof(atomic_uint_least64_t)];
+} shared_dfa_slot_t;
+
+/*
+ * A block of slots. A thread finding every slot taken adds a block after
+ * the last one, blocks are only freed with the DFA.
+ */
+typedef struct shared_dfa_slots_t {
+    shared_dfa_slot_t slots[SHARED_DFA_SLOTS];
+    _Atomic(struct shared_dfa_slots_t *) next;
+} shared_dfa_slots_t;
+
+/*
+ * A lazy DFA whose states are shared by all the threads matching against
+ * it. Following a transition is a single atomic load, and a missing one is
+ * computed by the thread running into it and published with a
+ * compare-and-swap into the hash table of the cache, so matching never
+ * takes a lock. When the cache fills up it is replaced by an empty one and
+ * retired at the current epoch, and freed once every thread which could
+ * still be using it has left its match.
+ */
+typedef struct shared_dfa_t {
+    nfa_machine_t *machine;
+    uint8_t byte_classes[256];
+    uint8_t class_bytes[256]; // a representative byte for every class
+    size_t nclasses;
+    size_t cache_size;
+    _Atomic(shared_dfa_cache_t *) cache;
+    atomic_uint_least64_t epoch;
+    shared_dfa_slots_t slots; // the first block
+    pthread_mutex_t retired_lock;
+    _Atomic(shared_dfa_cache_t *) retired; // changed only with retired_lock held
+    atomic_size_t nflushes;
+} shared_dfa_t;
+
+/*
+ * An entry of the hash table telling which states a list of attempts of a
+ * search has, it is only in the table for the generation it was set in.
+ */
+typedef struct shared_dfa_mark_t {
+    shared_dfa_state_t *state;
+    size_t gen;
+} shared_dfa_mark_t;
+
+/*
+ * Scratch space for computing states and for the attempts of a search, as
+ * in dfa_search_t, which a thread can keep across its matches against any
+ * shared DFA. Zeroed before first use.
+ */
+typedef struct shared_dfa_scratch_t {
+    dfa_builder_t builder;
+    size_t nstates; // the size of the NFAs the builder has room for
+    shared_dfa_state_t **states[2];
+    size_t *starts[2];
+    size_t n[2];
+    size_t size; // the attempts a list has room for
+    shared_dfa_mark_t *marks; // 2 * size entries
+    size_t gen;
+} shared_dfa_scratch_t;
+
+shared_dfa_t *shared_dfa_init(nfa_machine_t *, size_t);
+int shared_dfa_match(shared_dfa_t *, const char *, size_t, match_mode_t, match_t *);
+int shared_dfa_match_scratch(shared_dfa_t *, shared_dfa_scratch_t *, const char *, size_t, match_mode_t, match_t *);
+void shared_dfa_scratch_free(shared_dfa_scratch_t *);
+size_t shared_dfa_size(shared_dfa_t *);
+void shared_dfa_free(shared_dfa_t *);
+#endif
@@ -31,6 +31,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include "token.h"
+#include "re_utils.h"
 
 token_t *
 token_copy(token_t *tok)
@@ -38,12 +39,12 @@ token_copy(token_t *tok)
     token_t *new_token;
     if (tok == NULL)
         return NULL;
-    new_token = malloc(sizeof(*new_token));
+    new_token = re_malloc(sizeof(*new_token));
     if (new_token == NULL)
         err(EXIT_FAILURE, "malloc failed");
     new_token->type = tok->type;
-    if (tok->type == CHAR) {
-        char *literal = strdup(tok->literal);
+    if (token_owns_literal(tok->type)) {
+        char *literal = re_strdup(tok->literal);
         if (literal == NULL)
             err(EXIT_FAILURE, "malloc failed");
         new_token->literal = literal;
@@ -55,7 +56,7 @@ token_copy(token_t *tok)
 void
 token_free(token_t *tok)
 {
-    if (tok->type == CHAR)
-        free(tok->literal);
-    free(tok);
+    if (token_owns_literal(tok->type))
+        re_free(tok->literal);
+    re_free(tok);
 }
@@ -41,6 +41,12 @@ typedef enum token_type {
     STAR,
     LBRACKET,
     RBRACKET,
+    CARET,
+    DOLLAR,
+    WORD_BOUNDARY,
+    NOT_WORD_BOUNDARY,
+    ESCAPED_CHAR, // a character after a backslash, never special
+    CLASS_ESCAPE, // \d, \w, \s and their negations
     ILLEGAL,
     END_OF_FILE
 } token_type;
@@ -56,6 +62,12 @@ static const char *token_names[] = {
     "STAR",
     "LBRACKET",
     "RBRACKET",
+    "CARET",
+    "DOLLAR",
+    "WORD_BOUNDARY",
+    "NOT_WORD_BOUNDARY",
+    "ESCAPED_CHAR",
+    "CLASS_ESCAPE",
     "ILLEGAL",
     "EOF"
 };
@@ -66,6 +78,8 @@ typedef struct token_t {
 } token_t;
 
 #define get_token_name(tok_type) token_names[tok_type]
+// the tokens whose literal is allocated
+#define token_owns_literal(tok_type) ((tok_type) == CHAR || (tok_type) == ESCAPED_CHAR)
 token_t *token_copy(token_t *);
 void token_free(token_t *);
 